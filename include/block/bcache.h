@@ -0,0 +1,71 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <block/blkqueue.h>
+
+// Write-back cache behind a request queue. Blocks are BCACHE_BLOCK_SECTORS
+// aligned sectors, tracked per sector so a partial write never has to read
+// the rest of the block first. Reads only hit if every sector they want is
+// here, otherwise they go to the disk and whatever the cache holds is laid
+// over the result. Clean blocks are dropped least recently used first, a
+// dirty one gets written back before its slot is reused.
+
+#define BCACHE_BLOCK_SECTORS 8
+#define BCACHE_BLOCK_SIZE (BCACHE_BLOCK_SECTORS * BLK_SECTOR_SIZE)
+#define BCACHE_ENTRIES 128
+#define BCACHE_HASH_SIZE 64
+
+struct bcache_entry
+{
+    uint64_t lba; // first sector
+    uint8_t *data;
+    uint8_t valid;     // sector bitmasks
+    uint8_t dirty;
+    uint8_t writeback; // sectors with a write in flight
+    bool used;
+    struct blk_io wb_io;
+
+    struct bcache_entry *hash_next;
+    struct bcache_entry *lru_prev; // head is the most recently used
+    struct bcache_entry *lru_next;
+};
+
+struct bcache
+{
+    struct bcache_entry entries[BCACHE_ENTRIES];
+    struct bcache_entry *hash[BCACHE_HASH_SIZE];
+    struct bcache_entry *lru_head;
+    struct bcache_entry *lru_tail;
+
+    // Statistics
+    uint32_t write_hits; // absorbed without touching the disk
+    uint32_t read_hits;
+    uint32_t writebacks;
+    uint32_t evictions;
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // For blkqueue.c. None of them take the queue lock themselves except
+    // bcache_write and bcache_writeback, which do I/O.
+    struct bcache *bcache_create();
+    // Copies into the cache, false if it couldn't take the write
+    bool bcache_write(struct blk_queue *q, struct blk_io *io);
+    // Refreshes sectors the cache already holds, for writes that bypass it
+    void bcache_update(struct bcache *c, struct blk_io *io);
+    // true if every sector was here and got copied
+    bool bcache_read(struct bcache *c, struct blk_io *io);
+    // Lays cached sectors over what came off the disk
+    void bcache_overlay(struct bcache *c, struct blk_io *io);
+    // Writes every dirty sector back as one plugged burst, no flush
+    uint8_t bcache_writeback(struct blk_queue *q);
+    void bcache_report(struct blk_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,80 @@
+#ifndef BIO_H
+#define BIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <block/blkqueue.h>
+#include <drivers/device.h>
+
+// A vectored transfer to a block device: consecutive sectors starting at
+// sector, spread over up to BIO_MAX_VECS buffers. Each vector goes to the
+// device's queue as its own blk_io and the queue merges them back into as
+// few requests as the hardware takes. The caller owns the bio until
+// end_io runs or bio_wait returns.
+
+#define BIO_MAX_VECS 16
+
+#define BIO_BENCH_COROUTINES 32
+#define BIO_BENCH_SECTORS 8 // per read, rounded up to the device block
+
+// Errors of the bio itself, driver errors come through unchanged
+#define BIO_ERR_RANGE 0xF0    // past the end of the device
+#define BIO_ERR_READONLY 0xF1
+#define BIO_ERR_ALIGN 0xF2    // not a multiple of the device's block size
+#define BIO_ERR_NODEV 0xF3
+
+struct bio;
+// Runs with interrupts off once every vector is done, possibly from the
+// irq handler
+typedef void (*bio_end_t)(struct bio *bio);
+
+struct bio
+{
+    block_device_t *bdev;
+    uint8_t direction; // BLK_READ or BLK_WRITE
+    uint8_t flags;     // BLK_PREFLUSH goes before the first vector, BLK_FUA applies to all
+    uint64_t sector;
+    uint32_t sectors; // sum of the vectors
+    struct blk_segment vecs[BIO_MAX_VECS];
+    uint32_t vcnt;
+
+    bio_end_t end_io;
+    void *private;
+
+    // Filled in on the way
+    struct blk_io ios[BIO_MAX_VECS];
+    uint32_t nios;
+    uint32_t remaining; // ios still out, plus one while submitting
+    volatile bool done;
+    uint8_t error; // the first one, 0 if all went fine
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void bio_init(struct bio *bio, block_device_t *bdev, uint8_t direction, uint64_t sector);
+    // Appends sectors of buf, split into vectors the queue can take in one
+    // request. false, with the bio unchanged, if it runs out of vectors.
+    bool bio_add(struct bio *bio, void *buf, uint32_t sectors);
+    // Queues every vector and returns. Without vectors and with
+    // BLK_PREFLUSH it's a cache flush.
+    void bio_submit(struct bio *bio);
+    // Sleeps until the bio is done and returns its error
+    uint8_t bio_wait(struct bio *bio);
+
+    // One buffer, submit and wait
+    uint8_t bdev_rw(block_device_t *bdev, uint8_t direction, uint64_t sector, uint32_t count, void *buf);
+
+    // end_io for bios submitted from a coroutine: set private to the
+    // struct coroutine and CO_WAIT_UNTIL(co, bio->done) after bio_submit.
+    void bio_end_wake(struct bio *bio);
+
+    // count sectors read by BIO_BENCH_COROUTINES coroutines at once, each
+    // resumed from the completion irq
+    void bio_coroutine_benchmark(block_device_t *bdev, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
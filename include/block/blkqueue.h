@@ -0,0 +1,182 @@
+#ifndef BLKQUEUE_H
+#define BLKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <scheduler/waitqueue.h>
+
+// Per device request queue. Callers submit blk_io's, the queue merges the
+// ones that touch neighbouring sectors into a single request and hands the
+// driver one request at a time in elevator order (ascending LBA from the
+// last position, wrapping around). A request that waited past its deadline
+// goes first regardless. While plugged nothing is dispatched, so a burst
+// of submissions can be sorted and merged before the disk sees any of it.
+//
+// With a cache enabled, plain writes land in the write-back cache and
+// complete right away. Nothing reaches the platter until the cache evicts,
+// blk_sync runs, or a write carries BLK_FUA/BLK_PREFLUSH. Those are
+// barriers: everything queued before them is dispatched first.
+//
+// Drivers that can keep several commands on the hardware (NCQ) register
+// with blk_queue_init_async instead. The queue then starts up to depth
+// requests without waiting and the driver completes them from its irq
+// handler with blk_complete. A barrier still goes out alone.
+
+#define BLK_READ 0
+#define BLK_WRITE 1
+
+// blk_io flags
+#define BLK_PREFLUSH 0x01 // drain the drive's write cache before this
+#define BLK_FUA 0x02      // on stable storage when it completes
+#define BLK_NOCACHE 0x04  // straight to the driver, the cache's own writebacks
+
+#define BLK_SECTOR_SIZE 512
+#define BLK_QUEUE_DEPTH 64
+#define BLK_MAX_SEGMENTS 32 // blk_io's per request
+
+#define BLK_READ_DEADLINE_MS 500
+#define BLK_WRITE_DEADLINE_MS 5000
+
+// A run of sectors in memory. The driver walks a request's segments in
+// order as if they were one buffer.
+struct blk_segment
+{
+    uint8_t *buf;
+    uint32_t sectors;
+};
+
+struct blk_io;
+// Runs with interrupts off once io is done, possibly from the irq handler
+typedef void (*blk_end_io_t)(struct blk_io *io);
+
+// One caller's transfer, lives until blk_wait returns (or end_io runs)
+struct blk_io
+{
+    uint8_t direction; // BLK_READ or BLK_WRITE
+    uint8_t flags;
+    uint64_t lba;
+    uint32_t count; // sectors, 0 with BLK_PREFLUSH is a plain flush
+    uint8_t *buf;
+
+    volatile bool done;
+    uint8_t error; // driver's error code, 0 if fine
+    struct blk_io *next; // within its request
+
+    blk_end_io_t end_io; // set by blk_submit_end
+    void *private;
+};
+
+struct blk_request
+{
+    uint8_t direction;
+    uint8_t flags;
+    uint64_t lba;
+    uint32_t count;
+    uint64_t deadline; // ktime ns
+
+    struct blk_io *head; // in LBA order
+    struct blk_io *tail;
+    uint32_t nios;
+
+    struct blk_request *next; // sorted list or free list
+    struct blk_request *fifo_next;
+};
+
+// Runs one request. Sleeps until it's done, returns the driver's error.
+typedef uint8_t (*blk_transfer_t)(void *dev, uint8_t direction, uint8_t flags, uint64_t lba, const struct blk_segment *segs,
+                                  uint32_t nsegs);
+
+// Async drivers: puts rq on the hardware and returns, blk_complete
+// follows once it's done. The segments are only valid during the call.
+// A nonzero return fails rq right away with that error.
+typedef uint8_t (*blk_start_t)(void *dev, struct blk_request *rq, const struct blk_segment *segs, uint32_t nsegs);
+// Looks for finished commands, for waiters that can't sleep on the irq.
+// Called with interrupts off.
+typedef void (*blk_poll_t)(void *dev);
+// Optional, after a run of starts. Drivers that batch their doorbell
+// writes ring it here.
+typedef void (*blk_commit_t)(void *dev);
+
+struct bcache;
+
+struct blk_queue
+{
+    const char *name;
+    blk_transfer_t transfer; // NULL for async drivers
+    blk_start_t start;
+    blk_poll_t poll;
+    blk_commit_t commit;
+    bool polled; // the driver got no interrupt, waiters always poll
+    void *dev;
+    uint32_t max_sectors; // per request
+    uint32_t depth;       // requests the driver takes at once
+    // Nonzero: ios only merge where the buffers meet on this boundary
+    // (mask, e.g. PAGE_SIZE - 1), for hardware that can't take a gap
+    // inside a page mid request
+    uint32_t virt_boundary;
+
+    struct blk_request pool[BLK_QUEUE_DEPTH];
+    struct blk_request *free;
+    struct blk_request *sorted;    // pending, by LBA
+    struct blk_request *fifo_head; // pending, by arrival
+    struct blk_request *fifo_tail;
+    uint64_t head_pos; // sector after the last dispatched request
+
+    uint32_t plugged; // nesting count
+    bool running;     // somebody is dispatching
+    uint32_t inflight; // handed to the driver, not completed
+    bool ordered;      // a barrier is in flight, nothing else goes out
+    struct wait_queue wq; // completions and free requests
+    struct bcache *cache; // NULL is write-through
+
+    // Statistics
+    uint32_t ios;
+    uint32_t requests;
+    uint32_t back_merges;
+    uint32_t front_merges;
+    uint32_t expired;
+    uint32_t barriers;
+    uint32_t peak_inflight;
+    uint64_t sectors;
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void blk_queue_init(struct blk_queue *q, const char *name, blk_transfer_t transfer, void *dev, uint32_t max_sectors);
+    void blk_queue_init_async(struct blk_queue *q, const char *name, blk_start_t start, blk_poll_t poll,
+                              blk_commit_t commit, void *dev, uint32_t max_sectors, uint32_t depth);
+    // Turns on write-back caching, false if there's no memory for it
+    bool blk_queue_enable_cache(struct blk_queue *q);
+
+    // Queues io without waiting for it. Dispatches right away unless the
+    // queue is plugged.
+    void blk_submit(struct blk_queue *q, struct blk_io *io);
+    // Same, and end_io gets called when it's done
+    void blk_submit_end(struct blk_queue *q, struct blk_io *io, blk_end_io_t end_io, void *private);
+    // Sleeps until io is done, dispatching (plugged or not) if nobody else
+    // is. Returns io->error.
+    uint8_t blk_wait(struct blk_queue *q, struct blk_io *io);
+    // Submit and wait
+    uint8_t blk_rw(struct blk_queue *q, uint8_t direction, uint64_t lba, uint32_t count, void *buf);
+
+    // Plugs nest, the last unplug dispatches whatever piled up
+    void blk_plug(struct blk_queue *q);
+    void blk_unplug(struct blk_queue *q);
+
+    // Writes back everything dirty in the cache and flushes the drive.
+    // What was written before the call is on stable storage once it
+    // returns 0.
+    uint8_t blk_sync(struct blk_queue *q);
+
+    // From async drivers, interrupts off. Finishes rq's ios and wakes
+    // their waiters.
+    void blk_complete(struct blk_queue *q, struct blk_request *rq, uint8_t error);
+
+    void blk_queue_report(struct blk_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
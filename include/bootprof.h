@@ -0,0 +1,36 @@
+#ifndef BOOTPROF_H
+#define BOOTPROF_H
+
+#include <stdint.h>
+
+// Boot stage timing with rdtsc. Stages nest, a stage's time includes the
+// ones inside it.
+//
+//   BOOT_STAGE("init_memory", init_memory(high, start));
+
+#define BOOTPROF_MAX_STAGES 32
+
+#define BOOT_STAGE(name, call)             \
+    do                                     \
+    {                                      \
+        int _stage = bootprof_begin(name); \
+        call;                              \
+        bootprof_end(_stage);              \
+    } while (0)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // First thing in kernel_main, everything is relative to this
+    void bootprof_init();
+    int bootprof_begin(const char *name);
+    void bootprof_end(int stage);
+    // Slowest first on the console, plus "bootprof," CSV lines on serial.
+    // Cycles turn into time once ktime has calibrated the TSC.
+    void bootprof_report();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,220 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <drivers/pci.h>
+#include <hrtimer.h>
+#include <block/blkqueue.h>
+
+// PCI class 01 subclass 06, prog if 01. Registers are in the ABAR (BAR5).
+
+// Generic host control, offsets from the ABAR
+#define AHCI_REG_CAP 0x00
+#define AHCI_REG_GHC 0x04
+#define AHCI_REG_IS 0x08 // one bit per port
+#define AHCI_REG_PI 0x0C // ports implemented
+#define AHCI_REG_VS 0x10
+#define AHCI_REG_CAP2 0x24
+#define AHCI_REG_BOHC 0x28 // BIOS/OS handoff
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // command slots
+#define AHCI_CAP_SNCQ (1u << 30)
+#define AHCI_CAP_S64A (1u << 31)
+#define AHCI_CAP2_BOH (1 << 0)
+#define AHCI_BOHC_BOS (1 << 0)
+#define AHCI_BOHC_OOS (1 << 1)
+
+#define AHCI_GHC_HR (1 << 0) // reset
+#define AHCI_GHC_IE (1 << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+// Port registers, offsets from AHCI_PORT(n)
+#define AHCI_PORT(n) (0x100 + (n) * 0x80)
+#define AHCI_PxCLB 0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB 0x08
+#define AHCI_PxFBU 0x0C
+#define AHCI_PxIS 0x10
+#define AHCI_PxIE 0x14
+#define AHCI_PxCMD 0x18
+#define AHCI_PxTFD 0x20
+#define AHCI_PxSIG 0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSCTL 0x2C
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34 // NCQ tags the drive still owes
+#define AHCI_PxCI 0x38   // slots the HBA still owes
+
+#define AHCI_PxCMD_ST (1 << 0)
+#define AHCI_PxCMD_SUD (1 << 1)
+#define AHCI_PxCMD_POD (1 << 2)
+#define AHCI_PxCMD_FRE (1 << 4)
+#define AHCI_PxCMD_FR (1 << 14)
+#define AHCI_PxCMD_CR (1 << 15)
+
+// PxIS and PxIE
+#define AHCI_PxIS_DHRS (1 << 0) // D2H register FIS, non-queued commands
+#define AHCI_PxIS_PSS (1 << 1)
+#define AHCI_PxIS_DSS (1 << 2)
+#define AHCI_PxIS_SDBS (1 << 3) // set device bits FIS, NCQ completions
+#define AHCI_PxIS_DPS (1 << 5)
+#define AHCI_PxIS_PCS (1 << 6)
+#define AHCI_PxIS_IFS (1 << 27)
+#define AHCI_PxIS_HBDS (1 << 28)
+#define AHCI_PxIS_HBFS (1 << 29)
+#define AHCI_PxIS_TFES (1 << 30)
+#define AHCI_PxIS_ERRORS (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_SSTS_DET(s) ((s) & 0xF)
+#define AHCI_SSTS_DET_PRESENT 3
+#define AHCI_SSTS_IPM(s) (((s) >> 8) & 0xF)
+#define AHCI_SSTS_IPM_ACTIVE 1
+
+#define AHCI_SIG_ATA 0x00000101
+#define AHCI_SIG_ATAPI 0xEB140101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+// Host to device register FIS, sits at the start of a command table
+typedef struct
+{
+    uint8_t type; // FIS_TYPE_REG_H2D
+    uint8_t flags; // bit 7 is a command, port multiplier port below
+    uint8_t command;
+    uint8_t feature_low;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t feature_high;
+    uint8_t count_low;
+    uint8_t count_high;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} __attribute__((packed)) ahci_fis_h2d_t;
+
+#define FIS_H2D_COMMAND 0x80
+#define FIS_DEVICE_LBA 0x40
+#define FIS_DEVICE_FUA 0x80 // FPDMA QUEUED writes
+
+// One per slot in a port's command list
+typedef struct
+{
+    uint16_t flags; // FIS length in dwords, AHCI_CMD_* bits
+    uint16_t prdtl; // PRDT entries
+    volatile uint32_t prdbc; // bytes transferred
+    uint32_t ctba;  // command table, 128 byte aligned
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+#define AHCI_CMD_WRITE (1 << 6)
+#define AHCI_CMD_CLEAR_BUSY (1 << 10)
+
+typedef struct
+{
+    uint32_t dba; // even address
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc; // bytes - 1 (even count, up to 4M), bit 31 interrupts
+} __attribute__((packed)) ahci_prd_t;
+
+#define AHCI_PRD_MAX_BYTES (4 * 1024 * 1024)
+
+// Per request limit. A segment can start mid page, so the worst case is a
+// PRD per page plus two per segment.
+#define AHCI_MAX_SECTORS 256
+#define AHCI_PRDT_ENTRIES (AHCI_MAX_SECTORS * 512 / 4096 + 2 * BLK_MAX_SEGMENTS)
+
+typedef struct
+{
+    uint8_t cfis[64];
+    uint8_t acmd[16]; // ATAPI packet
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+#define AHCI_CMD_TABLE_SIZE ((sizeof(ahci_cmd_table_t) + 127) & ~127)
+#define AHCI_SLOTS 32
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_DISKS 4
+#define AHCI_TIMEOUT_MS 5000 // without a single completion
+#define AHCI_BENCH_DEPTH 32
+
+#define AHCI_ERR_DEVICE 1 // the drive reported an error
+#define AHCI_ERR_HOST 2   // the HBA or the link did
+#define AHCI_ERR_ALIGN 3  // a buffer isn't mapped or isn't word aligned
+#define AHCI_ERR_TIMEOUT 5
+
+// What a slot still has to issue for its request, in this order
+#define AHCI_STAGE_PREFLUSH 0x01
+#define AHCI_STAGE_DATA 0x02
+#define AHCI_STAGE_POSTFLUSH 0x04 // FUA without NCQ
+
+struct ahci_slot
+{
+    struct blk_request *rq;
+    uint8_t stages;
+    uint16_t prdtl; // for the data stage
+};
+
+typedef struct ahci_port
+{
+    struct ahci_controller *hba;
+    uint8_t num;
+    volatile uint8_t *regs;
+
+    ahci_cmd_header_t *cmd_list; // 1K, AHCI_SLOTS headers
+    uint8_t *fis;                // 256 bytes the HBA copies received FISes to
+    uint32_t cmd_list_phys;
+    uint8_t *tables; // AHCI_SLOTS command tables
+    uint32_t tables_phys;
+
+    uint64_t sectors;
+    bool ncq;
+    uint32_t depth; // slots in use at once
+    char model[41];
+
+    // Touched with interrupts off. A slot's bit stays set from start to
+    // blk_complete, whichever stage it's on.
+    struct ahci_slot slots[AHCI_SLOTS];
+    uint32_t active;
+    uint64_t progress; // ktime of the last issue from idle or completion
+    struct hrtimer timeout;
+
+    struct blk_queue queue;
+
+    // Statistics
+    uint32_t commands;
+    uint32_t errors;
+} ahci_port_t;
+
+typedef struct ahci_controller
+{
+    pci_device_t *pci;
+    volatile uint8_t *abar;
+    uint32_t cap;
+    uint32_t nslots;
+    int irq;
+    bool msi;
+    ahci_port_t *ports[AHCI_MAX_PORTS];
+} ahci_controller_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Finds the first AHCI controller, brings up every port with a SATA
+    // disk on it and gives each a request queue.
+    void ahci_init();
+    // Queue of the n-th disk found, NULL if there's no such disk
+    struct blk_queue *ahci_queue(uint32_t disk);
+    // Random 4K reads, one at a time and then AHCI_BENCH_DEPTH at once
+    void ahci_benchmark(uint32_t disk, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -25,14 +25,25 @@
 #define ATA_CMD_WRITE_PIO_EXT 0x34
 #define ATA_CMD_WRITE_DMA 0xCA
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT 0xCE
 #define ATA_CMD_CACHE_FLUSH 0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_PACKET 0xA0
 #define ATA_CMD_IDENTIFY_PACKET 0xA1
 #define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60 // NCQ, count in features, tag in count
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
 
-#define ATAPI_CMD_READ 0xA8
-#define ATAPI_CMD_EJECT 0x1B
+#define ATAPI_CMD_READ 0xA8 // READ(12), 32-bit block count
+#define ATAPI_FEAT_DMA 0x01 // PACKET features: data goes over the bus master
+#define ATAPI_CMD_EJECT 0x1B // START STOP UNIT, LoEj set and Start clear opens the tray
+#define ATAPI_SENSE_UNIT_ATTENTION 0x06 // error register bits 7:4, e.g. the medium changed
 
 #define ATA_IDENT_DEVICETYPE 0
 #define ATA_IDENT_CYLINDERS 2
@@ -40,10 +51,14 @@
 #define ATA_IDENT_SECTORS 12
 #define ATA_IDENT_SERIAL 20
 #define ATA_IDENT_MODEL 54
+#define ATA_IDENT_MAX_MULTIPLE 94 // word 47, low byte is sectors per DRQ block
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID 106
 #define ATA_IDENT_MAX_LBA 120
+#define ATA_IDENT_QUEUE_DEPTH 150 // word 75, bits 4:0 are depth - 1
+#define ATA_IDENT_SATA_CAPS 152   // word 76
 #define ATA_IDENT_COMMANDSETS 164
+#define ATA_IDENT_CMDSET_DEFAULT 174 // word 87
 #define ATA_IDENT_MAX_LBA_EXT 200
 
 #define IDE_ATA 0x00
@@ -76,4 +91,23 @@
 
 // Directions:
 #define ATA_READ 0x00
-#define ATA_WRITE 0x01
\ No newline at end of file
+#define ATA_WRITE 0x01
+
+// Bus master IDE registers, offsets from a channel's bmide base
+#define ATA_BMR_COMMAND 0x00
+#define ATA_BMR_STATUS 0x02
+#define ATA_BMR_PRDT 0x04
+
+#define ATA_BMR_CMD_START 0x01
+#define ATA_BMR_CMD_READ 0x08 // device to memory
+
+#define ATA_BMR_SR_ACTIVE 0x01
+#define ATA_BMR_SR_ERR 0x02
+#define ATA_BMR_SR_IRQ 0x04
+
+#define ATA_CAP_DMA 0x100 // IDENTIFY word 49
+#define ATA_CAP_LBA 0x200
+
+#define ATA_CMDSET_LBA48 (1 << 26) // IDENTIFY word 83 bit 10
+#define ATA_SATA_CAP_NCQ (1 << 8)  // IDENTIFY word 76
+#define ATA_CMDSET_FUA (1 << 6)    // word 87, WRITE ... FUA EXT
@@ -1,13 +1,48 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 
-struct block_device;
+#include <stdint.h>
+#include <stdbool.h>
+#include <block/blkqueue.h>
+
+// Every disk, whatever drives it, registers here with its request queue.
+// Filesystems look devices up by name and talk to them through bios
+// (block/bio.h), never to the controller.
+
+#define BLOCK_DEVICE_MAX 16
+#define BLOCK_DEVICE_NAME_LEN 16
+
+typedef enum block_device_type
+{
+    BLOCK_DISK,
+    BLOCK_CDROM,
+} block_device_type_t;
 
 typedef struct block_device
 {
-    char name[32];
-    ide_device_t *ideDevicePtr;
-    block_device_ops_t *ops;
-} block_device_t
+    char name[BLOCK_DEVICE_NAME_LEN];
+    block_device_type_t type;
+    struct blk_queue *queue;
+    uint64_t sectors;    // 512 byte sectors, 0 if unknown
+    uint32_t block_size; // smallest transfer the device does, bios are multiples of it
+    bool readonly;
+} block_device_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Called by drivers once the queue is up. NULL if the table is full or
+    // the name is taken.
+    block_device_t *bdev_register(const char *name, block_device_type_t type, struct blk_queue *queue, uint64_t sectors,
+                                  uint32_t block_size, bool readonly);
+    block_device_t *bdev_find(const char *name);
+    // In registration order, NULL past the end
+    block_device_t *bdev_get(uint32_t index);
+    uint32_t bdev_count();
+    void bdev_list();
 
-#endif
\ No newline at end of file
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <rsdp.h>
+
+// ACPI "HPET" table
+typedef struct
+{
+    ACPISDTHeader_t header;
+    uint8_t hardware_rev_id;
+    uint8_t comparator_count : 5;
+    uint8_t counter_size : 1;
+    uint8_t reserved : 1;
+    uint8_t legacy_replacement : 1;
+    uint16_t pci_vendor_id;
+
+    // generic address structure
+    uint8_t address_space_id; // 0 = memory
+    uint8_t register_bit_width;
+    uint8_t register_bit_offset;
+    uint8_t reserved2;
+    uint64_t address;
+
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} __attribute__((packed)) HPETTable_t;
+
+// Registers, offsets from the MMIO base
+#define HPET_REG_CAPABILITIES 0x000
+#define HPET_REG_CONFIG 0x010
+#define HPET_REG_INT_STATUS 0x020
+#define HPET_REG_COUNTER 0x0F0
+#define HPET_REG_TIMER_CONFIG(n) (0x100 + 0x20 * (n))
+#define HPET_REG_TIMER_COMPARATOR(n) (0x108 + 0x20 * (n))
+
+// HPET_REG_CAPABILITIES
+#define HPET_CAP_COUNT_SIZE (1 << 13) // 64-bit main counter
+#define HPET_CAP_LEGACY (1 << 15)
+
+// HPET_REG_CONFIG
+#define HPET_CONFIG_ENABLE (1 << 0)
+#define HPET_CONFIG_LEGACY (1 << 1) // timer0 -> IRQ0, timer1 -> IRQ8
+
+// HPET_REG_TIMER_CONFIG
+#define HPET_TIMER_LEVEL (1 << 1)
+#define HPET_TIMER_ENABLE (1 << 2)
+#define HPET_TIMER_PERIODIC (1 << 3)
+#define HPET_TIMER_PERIODIC_CAP (1 << 4)
+#define HPET_TIMER_64BIT_CAP (1 << 5)
+#define HPET_TIMER_VAL_SET (1 << 6)
+#define HPET_TIMER_32BIT_MODE (1 << 8)
+#define HPET_TIMER_ROUTE_SHIFT 9
+#define HPET_TIMER_ROUTE_MASK (0x1F << HPET_TIMER_ROUTE_SHIFT)
+
+#define HPET_MAX_TIMERS 32
+// ISA lines the timers never take even while they're still free: the
+// cascade, RTC, and the keyboard, PS/2 mouse and IDE channels whose
+// drivers come up after the HPET
+#define HPET_ISA_RESERVED ((1 << 1) | (1 << 2) | (1 << 8) | (1 << 12) | (1 << 14) | (1 << 15))
+#define HPET_MMIO_SIZE 0x400
+
+typedef void (*hpet_handler_t)(int timer);
+
+// Finds the HPET through ACPI and, if it can take over IRQ0 through legacy
+// replacement, makes timer 0 the system tick instead of the PIT. Also
+// registers the main counter as a clocksource. Needs rsdt_parse and
+// ktime_init first. Returns false if there's no usable HPET.
+bool hpet_init();
+bool hpet_present();
+uint64_t hpet_read_counter();
+uint64_t hpet_frequency();
+
+// Comparators other than the system tick. A timer can only be used if it
+// has an IRQ the PIC can deliver (timer 1 always has IRQ8 in legacy mode).
+// handler runs in irq context.
+int hpet_timer_count();
+bool hpet_timer_usable(int timer);
+bool hpet_timer_oneshot(int timer, uint64_t delay_ns, hpet_handler_t handler);
+bool hpet_timer_periodic(int timer, uint64_t period_ns, hpet_handler_t handler);
+void hpet_timer_stop(int timer);
@@ -3,6 +3,36 @@
 #include <util.h>
 #include <stdio.h>
 #include <drivers/atadefs.h>
+#include <idt.h>
+#include <hrtimer.h>
+#include <scheduler/waitqueue.h>
+#include <block/blkqueue.h>
+
+// Physical region descriptor, the bus master walks a table of these. A
+// region can't cross a 64K boundary, byte_count 0 means 64K.
+typedef struct ide_prd
+{
+   uint32_t phys;
+   uint16_t byte_count;
+   uint16_t flags; // IDE_PRD_EOT on the last entry
+} __attribute__((packed)) ide_prd_t;
+
+#define IDE_PRD_EOT 0x8000
+#define IDE_DMA_MAX_SECTORS 256 // one command, what the bounce buffer holds
+#define IDE_DMA_BUF_SIZE (IDE_DMA_MAX_SECTORS * 512)
+#define IDE_TIMEOUT_MS 5000 // seek plus transfer, anything longer is a dead drive
+
+#define IDE_ERR_READONLY 4 // write protected, e.g. a write to an ATAPI drive
+#define IDE_ERR_TIMEOUT 5
+#define IDE_ERR_ALIGN 6 // ATAPI transfers are whole 2048 byte blocks
+#define IDE_ERR_NODEV 7 // no drive there, or not the kind the call needs
+
+#define ATAPI_SECTOR_SIZE 2048
+#define IDE_ATAPI_MAX_SECTORS 256 // 512 byte ones per request, 64 blocks
+#define IDE_ATAPI_PIO_BYTES 0xF800 // byte count limit per DRQ, 31 blocks
+#define IDE_ATAPI_RA_MIN 8         // blocks read on a random miss
+#define IDE_ATAPI_RA_MAX 64        // blocks, 128K, as much as one request asks for
+#define IDE_ATAPI_RA_TTL_MS 1000   // buffered blocks older than this are read again
 
 typedef struct ide_channel_register
 {
@@ -10,6 +40,26 @@ typedef struct ide_channel_register
    uint16_t ctrl;  // Control Base
    uint16_t bmide; // Bus Master IDE
    uint8_t nIEN;   // nIEN (No Interrupt);
+
+   // Bus master DMA, prdt is NULL if the channel can't do it
+   ide_prd_t *prdt;
+   uint32_t prdt_phys;
+   uint8_t *dma_buf; // bounce buffer, 64K aligned
+   uint32_t dma_phys;
+   volatile uint8_t dma_active;
+   volatile uint8_t bm_status; // what the irq saw
+
+   // The issuing task sleeps on wq until the irq sets irq_pending or the
+   // timeout fires
+   volatile uint8_t irq_pending;
+   volatile uint8_t cmd_pending; // a command went out, cleared with the lock
+   volatile uint8_t timed_out;
+   struct wait_queue wq;
+   struct hrtimer timeout;
+
+   // One command per channel at a time, other tasks sleep on busy_wq
+   bool busy;
+   struct wait_queue busy_wq;
 } ide_channel_register_t;
 
 typedef struct ide_device
@@ -22,9 +72,32 @@ typedef struct ide_device
    uint16_t Capabilities;    // Features.
    unsigned int CommandSets; // Command Sets Supported.
    unsigned int Size;        // Size in Sectors.
+   uint16_t Multiple;        // Sectors per DRQ block for READ/WRITE MULTIPLE, 0 if not set.
+   uint8_t Fua;              // Has the FUA EXT write commands.
    uint8_t Model[41];        // Model in string.
 } ide_device_t;
 
+// Sequential readahead for an ATAPI drive. A miss fills the buffer with
+// at least window blocks, and a miss right behind what the buffer held
+// doubles the window up to IDE_ATAPI_RA_MAX. A failed command or an eject
+// empties it, and so does age: a disc swapped between two reads is only
+// noticed by the next command, so hits never reach further back than
+// IDE_ATAPI_RA_TTL_MS.
+typedef struct ide_atapi_ra
+{
+   uint8_t *buf; // NULL if there was no memory, reads go straight to the caller
+   uint32_t phys;
+   uint32_t lba;   // first block held
+   uint32_t count; // blocks held
+   uint32_t window;
+   uint64_t filled_ns; // ktime of the read that filled it
+
+   // Statistics
+   uint32_t commands;
+   uint32_t blocks; // handed to callers
+   uint32_t hits;   // of those, already in the buffer
+} ide_atapi_ra_t;
+
 void init_ide();
 void idePrintProg(pci_device_t *device);
 void init_controller(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, unsigned int BAR3, unsigned int BAR4);
@@ -33,11 +106,41 @@ void ideWrite(uint8_t channel, uint8_t reg, uint8_t data);
 uint8_t idePrintError(unsigned int drive, uint8_t err);
 void ideReadBuffer(uint8_t channel, uint8_t reg, unsigned int buffer, unsigned int quads);
 uint8_t idePolling(uint8_t channel, unsigned int advanced_check);
-void ideWaitIrq();
-void ideIrq();
-uint8_t ide_ata_rw(uint8_t direction, uint8_t drive, unsigned int lba, uint8_t numsects, uint32_t selector, unsigned int edi);
+// 0 once the channel interrupted, IDE_ERR_TIMEOUT if it didn't in time.
+// Sleeps if there's a task to put to sleep, polls the drive otherwise.
+uint8_t ideWaitIrq(uint8_t channel, uint32_t timeout_ms);
+// Any number of sectors, split into the largest commands the drive and
+// transfer mode allow (256 sectors, 65536 with LBA48). Data may sit in the
+// drive's write cache afterwards, ide_flush drains it.
+uint8_t ide_ata_rw(uint8_t direction, uint8_t drive, uint64_t lba, uint32_t numsects, uint32_t selector, unsigned int edi);
+// Same with the data spread over segments (flat pointers). flags takes
+// BLK_PREFLUSH and BLK_FUA, without FUA commands that's a flush afterwards.
+uint8_t ide_ata_rw_sg(uint8_t direction, uint8_t drive, uint64_t lba, uint8_t flags, const struct blk_segment *segs,
+                      uint32_t nsegs);
+uint8_t ide_flush(uint8_t drive);
+// The drive's request queue, NULL if there's no drive. ATAPI drives get a
+// read-only one in 512 byte sectors. Filesystems go through the block
+// device registry (drivers/device.h) rather than these.
+struct blk_queue *ide_queue(uint8_t drive);
+// Reads 2048 byte blocks. Flat buffers (selector 0x10) go through the
+// readahead buffer, filled with DMA where the channel has it.
 uint8_t ide_atapi_read(uint8_t drive, unsigned int lba, uint8_t numsects, unsigned short selector, unsigned int edi);
-void ide_irq_handle(struct InterruptRegisters *r);
+// Opens the tray and forgets what was read ahead from the disc
+uint8_t ide_atapi_eject(uint8_t drive);
+// Commands and readahead hits of the ATAPI drives
+void ide_atapi_report();
+irqreturn_t ide_irq_handle(int irq, void *dev_id);
+// DMA is used whenever the drive and channel support it, this turns it
+// off for comparisons.
+extern bool ide_use_dma;
+// Sequential reads of the first count sectors with PIO and with DMA
+void ide_benchmark(uint8_t drive, uint32_t count);
+// IDE_BENCH_WRITES single sector rewrites (same data) at scratch_lba with
+// FUA and cached. Never on its own: only a build that names a scratch range
+// (make BENCH=1 IDE_SCRATCH_LBA=n) runs it, a crash halfway loses those
+// sectors.
+#define IDE_BENCH_WRITES 64
+void ide_benchmark_writes(uint8_t drive, uint64_t scratch_lba);
 
 // fill out doxygen
 
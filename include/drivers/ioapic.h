@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <rsdp.h>
+
+// ACPI "APIC" table (MADT)
+typedef struct
+{
+    ACPISDTHeader_t header;
+    uint32_t lapic_address;
+    uint32_t flags; // bit 0: dual 8259s present
+} __attribute__((packed)) MADT_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) MADTEntryHeader_t;
+
+#define MADT_ENTRY_LAPIC 0
+#define MADT_ENTRY_IOAPIC 1
+#define MADT_ENTRY_OVERRIDE 2
+
+typedef struct
+{
+    MADTEntryHeader_t header;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed)) MADTIOApic_t;
+
+// ISA IRQ that isn't wired to the IOAPIC pin of the same number, or not
+// with ISA polarity/trigger.
+typedef struct
+{
+    MADTEntryHeader_t header;
+    uint8_t bus;
+    uint8_t source; // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed)) MADTOverride_t;
+
+#define MADT_POLARITY_MASK 0x3
+#define MADT_POLARITY_LOW 0x3
+#define MADT_TRIGGER_MASK 0xC
+#define MADT_TRIGGER_LEVEL 0xC
+
+// IOAPIC registers, through IOREGSEL/IOWIN
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_REG_ID 0x00
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDIRECT(n) (0x10 + 2 * (n))
+
+// Redirection entry, low dword
+#define IOAPIC_POLARITY_LOW (1 << 13)
+#define IOAPIC_TRIGGER_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define IOAPIC_MAX 4
+#define MSI_ADDRESS_BASE 0xFEE00000
+
+// Reads the MADT, routes every ISA IRQ and IOAPIC input to vector
+// IRQ_VECTOR_BASE + irq on this cpu's local APIC and turns the 8259s off.
+// Needs lapic_init. Returns false (and leaves the PIC in charge) without an
+// IOAPIC.
+bool ioapic_init();
+// GSI an ISA IRQ arrives on, after MADT overrides
+uint32_t ioapic_isa_to_gsi(uint8_t irq);
+// Masks the input IRQ n is routed from
+void ioapic_set_irq_mask(int irq, bool masked);
+// Address/data pair a device programs into its MSI capability to raise irq
+bool ioapic_msi_message(int irq, uint32_t *address, uint32_t *data);
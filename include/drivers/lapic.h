@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IA32_APIC_BASE 0x1B
+#define IA32_TSC_DEADLINE 0x6E0
+#define APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_TIMER_VECTOR 0xEF
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Registers, offsets from the MMIO base
+#define LAPIC_REG_ID 0x020
+#define LAPIC_REG_VERSION 0x030
+#define LAPIC_REG_TPR 0x080
+#define LAPIC_REG_EOI 0x0B0
+#define LAPIC_REG_SVR 0x0F0
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_ONESHOT (0 << 17)
+#define LAPIC_LVT_PERIODIC (1 << 17)
+#define LAPIC_LVT_TSC_DEADLINE (2 << 17)
+#define LAPIC_DIVIDE_16 0x3
+
+typedef enum
+{
+    LAPIC_TIMER_OFF,
+    LAPIC_TIMER_ONESHOT,
+    LAPIC_TIMER_PERIODIC,
+    LAPIC_TIMER_TSC_DEADLINE
+} lapic_timer_mode_t;
+
+// Maps and enables the local APIC and calibrates its timer against the
+// TSC (so after ktime_init). Then moves the system tick over to the APIC
+// timer and masks IRQ0. Returns false and leaves the tick alone if there's
+// no APIC or no calibrated TSC.
+bool lapic_init();
+bool lapic_present();
+void lapic_eoi();
+uint32_t lapic_id();
+
+// Timer bus frequency after the divider, in Hz
+uint32_t lapic_timer_frequency();
+lapic_timer_mode_t lapic_timer_mode();
+bool lapic_tsc_deadline_supported();
+
+// Taking the timer for something else stops the tick. handler runs in irq
+// context, the EOI is already taken care of.
+void lapic_timer_set_handler(void (*handler)());
+void lapic_timer_oneshot(uint64_t delay_ns);
+void lapic_timer_periodic(uint32_t hz);
+bool lapic_timer_deadline(uint64_t tsc);
+void lapic_timer_stop();
+// Back to generating the TIMER_FREQ system tick
+void lapic_timer_start_tick();
@@ -0,0 +1,202 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <drivers/pci.h>
+#include <block/blkqueue.h>
+#include <hrtimer.h>
+
+// PCI class 01 subclass 08, prog if 02. Registers are in BAR0.
+
+// Controller registers
+#define NVME_REG_CAP 0x00 // 64-bit
+#define NVME_REG_VS 0x08
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_INTMC 0x10
+#define NVME_REG_CC 0x14
+#define NVME_REG_CSTS 0x1C
+#define NVME_REG_AQA 0x24
+#define NVME_REG_ASQ 0x28 // 64-bit
+#define NVME_REG_ACQ 0x30 // 64-bit
+#define NVME_REG_DOORBELLS 0x1000
+
+#define NVME_CAP_MQES(cap) ((uint32_t)((cap) & 0xFFFF) + 1) // entries per queue
+#define NVME_CAP_TO(cap) ((uint32_t)((cap) >> 24) & 0xFF)   // 500ms units
+#define NVME_CAP_DSTRD(cap) ((uint32_t)((cap) >> 32) & 0xF) // doorbell stride, 4 << n bytes
+#define NVME_CAP_MPSMIN(cap) ((uint32_t)((cap) >> 48) & 0xF) // 4K << n
+
+#define NVME_CC_EN (1 << 0)
+#define NVME_CC_IOSQES(n) ((n) << 16) // log2 of the entry sizes
+#define NVME_CC_IOCQES(n) ((n) << 20)
+#define NVME_CSTS_RDY (1 << 0)
+#define NVME_CSTS_CFS (1 << 1) // fatal
+
+// Admin opcodes
+#define NVME_ADMIN_DELETE_SQ 0x00
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_DELETE_CQ 0x04
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_CNS_NAMESPACE 0x00
+#define NVME_CNS_CONTROLLER 0x01
+#define NVME_FEAT_NUM_QUEUES 0x07
+
+#define NVME_QUEUE_CONTIGUOUS (1 << 0) // create CQ/SQ cdw11
+#define NVME_CQ_IRQ_ENABLED (1 << 1)
+
+// I/O opcodes
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+#define NVME_RW_FUA (1u << 30) // cdw12
+
+// Identify controller and namespace, byte offsets
+#define NVME_ID_CTRL_MODEL 24 // 40 chars, space padded
+#define NVME_ID_CTRL_MDTS 77  // max transfer, 1 << n minimum pages, 0 unlimited
+#define NVME_ID_CTRL_NN 516   // namespaces
+#define NVME_ID_CTRL_VWC 525  // bit 0, volatile write cache
+#define NVME_ID_NS_NSZE 0     // blocks, 64-bit
+#define NVME_ID_NS_FLBAS 26
+#define NVME_ID_NS_LBAF 128 // 4 bytes each, LBA data size is bits 16-23
+
+typedef struct
+{
+    uint32_t cdw0; // opcode, and the command id in the top half
+    uint32_t nsid;
+    uint32_t reserved[2];
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_sqe_t;
+
+typedef struct
+{
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; // phase in bit 0
+} __attribute__((packed)) nvme_cqe_t;
+
+#define NVME_ADMIN_QUEUE_SIZE 32
+#define NVME_IO_QUEUE_SIZE 128
+#define NVME_IO_SLOTS 64 // commands out per queue pair
+#define NVME_MAX_IO_QUEUES 8
+#define NVME_MAX_DISKS 4
+#define NVME_TIMEOUT_MS 5000    // admin commands
+#define NVME_IO_TIMEOUT_MS 5000 // a queue pair without a single completion
+#define NVME_BENCH_DEPTH 32
+
+// Per request limit. The block queue only merges ios that meet on a page
+// boundary, so a request is a PRP list entry per page plus PRP1's offset.
+#define NVME_MAX_SECTORS 256
+#define NVME_PRP_ENTRIES (NVME_MAX_SECTORS * 512 / 4096 + 1)
+
+#define NVME_ERR_DEVICE 1 // the controller returned an error status
+#define NVME_ERR_ALIGN 3  // a buffer isn't mapped or can't be a PRP
+#define NVME_ERR_BUSY 4   // no free command slot
+#define NVME_ERR_TIMEOUT 5
+#define NVME_ERR_DEAD 6 // the queue pair couldn't be recreated after a timeout
+
+// What a slot still has to issue for its request, in this order. FUA is
+// a bit on the write itself.
+#define NVME_STAGE_PREFLUSH 0x01
+#define NVME_STAGE_DATA 0x02
+
+struct nvme_namespace;
+
+struct nvme_slot
+{
+    struct nvme_namespace *ns;
+    struct blk_request *rq;
+    uint8_t stages;
+    uint64_t prp1; // for the data stage
+    uint64_t prp2;
+};
+
+typedef struct nvme_queue_pair
+{
+    struct nvme_controller *ctrl;
+    uint16_t qid;
+    uint16_t size;
+    int irq; // -1 if polled
+    uint16_t vector;
+
+    nvme_sqe_t *sq;
+    volatile nvme_cqe_t *cq;
+    uint32_t sq_phys;
+    uint32_t cq_phys;
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint16_t sq_tail;
+    uint16_t sq_rung; // tail as of the last doorbell write
+    uint16_t cq_head;
+    uint16_t phase;
+
+    // I/O pairs only, touched with interrupts off
+    struct nvme_slot slots[NVME_IO_SLOTS];
+    uint32_t nslots;
+    uint64_t active;
+    uint64_t *prp_lists; // a page per slot
+    uint32_t prp_lists_phys;
+    uint64_t progress; // ktime of the last issue from idle or completion
+    struct hrtimer timeout;
+    bool dead;
+
+    // Statistics
+    uint32_t commands;
+    uint32_t doorbells;
+    uint32_t interrupts;
+    uint32_t timeouts;
+} nvme_queue_pair_t;
+
+typedef struct nvme_namespace
+{
+    struct nvme_controller *ctrl;
+    uint32_t nsid;
+    uint64_t sectors;
+    struct blk_queue queue;
+    uint32_t errors;
+} nvme_namespace_t;
+
+typedef struct nvme_controller
+{
+    pci_device_t *pci;
+    volatile uint8_t *regs;
+    uint32_t regs_size;
+    uint64_t cap;
+    uint32_t doorbell_stride;
+    char model[41];
+    bool write_cache;
+    uint32_t max_sectors;
+
+    nvme_queue_pair_t admin;
+    nvme_queue_pair_t *io[NVME_MAX_IO_QUEUES]; // one per CPU
+    uint32_t nio;
+    bool msix; // a vector per pair
+    bool msi;  // one vector for all of them
+} nvme_controller_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Brings up the first NVMe controller, an I/O queue pair per CPU and
+    // a request queue for each 512 byte sector namespace (nvme0n1..)
+    void nvme_init();
+    // Queue of the n-th namespace found, NULL if there's no such one
+    struct blk_queue *nvme_queue(uint32_t disk);
+    // Random 4K reads, one at a time and then NVME_BENCH_DEPTH at once
+    void nvme_benchmark(uint32_t disk, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,28 @@
 
 #define MAX_PCI_DEVICES 32
 
+#define PCI_COMMAND 0x04
+#define PCI_COMMAND_IO (1 << 0)
+#define PCI_COMMAND_MEMORY (1 << 1)
+#define PCI_COMMAND_BUS_MASTER (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS 0x06
+#define PCI_STATUS_CAP_LIST (1 << 4)
+#define PCI_BAR0 0x10
+#define PCI_CAP_PTR 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_MSI_64BIT (1 << 7) // message control
+#define PCI_MSI_ENABLE (1 << 0)
+#define PCI_CAP_ID_VENDOR 0x09
+#define PCI_CAP_ID_MSIX 0x11
+#define PCI_MSIX_ENABLE (1 << 15) // message control
+#define PCI_MSIX_MASKALL (1 << 14)
+
+// pciFindDevice matches any vendor
+#define PCI_ANY_VENDOR 0xFFFF
+
 typedef struct pci_device
 {
     uint8_t bus;
@@ -25,11 +47,31 @@ typedef struct pci_device
     uint32_t bar3;
     uint32_t bar4;
     uint32_t bar5;
+
+    uint8_t irq_line; // what the BIOS routed INTx to, 0xFF if nothing
+    uint8_t irq_pin;  // 1-4 for INTA-INTD, 0 if it doesn't use one
 } pci_device_t;
 
 void pci_init(bool dumpPCI);
 uint32_t pciConfigReadDWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 uint16_t pciConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pciConfigWriteDWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+void pciConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value);
+// Lets the device DMA into memory (command register bit 2)
+void pciEnableBusMastering(pci_device_t *device);
+// Base of BAR n with the type bits masked off. I/O BARs give the port, a
+// 64-bit BAR placed above 4G gives 0.
+uint32_t pciBarAddress(pci_device_t *device, uint8_t bar);
+// Config offset of the first capability with this id, 0 if there's none.
+// pciNextCapability continues the search after offset.
+uint8_t pciFindCapability(pci_device_t *device, uint8_t id);
+uint8_t pciNextCapability(pci_device_t *device, uint8_t offset, uint8_t id);
+// Points the device's MSI capability at irq (a line from irq_alloc) and
+// turns INTx off. false if it has no MSI or the line can't take messages.
+bool pciEnableMsi(pci_device_t *device, int irq);
+// Same for MSI-X table entry n, the other entries stay as they are. Needs
+// memory decoding on.
+bool pciEnableMsix(pci_device_t *device, uint16_t entry, int irq);
 uint16_t pciGetVendorID(uint8_t bus, uint8_t device, uint8_t func);
 uint16_t pciGetDeviceID(uint8_t bus, uint8_t device, uint8_t func);
 uint8_t pciGetClass(uint8_t bus, uint8_t device, uint8_t func);
@@ -40,4 +82,6 @@ void checkDevice(uint8_t bus, uint8_t device);
 void checkAllBuses();
 void checkBus(uint8_t bus);
 void checkFunction(uint8_t bus, uint8_t slot, uint8_t func);
-pci_device_t *pciFindDevice(uint16_t vendorId, uint8_t classId, uint8_t subclass);
\ No newline at end of file
+pci_device_t *pciFindDevice(uint16_t vendorId, uint8_t classId, uint8_t subclass);
+// index-th device (from 0) with this vendor and device id
+pci_device_t *pciFindDeviceId(uint16_t vendorId, uint16_t deviceId, int index);
\ No newline at end of file
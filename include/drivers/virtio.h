@@ -0,0 +1,187 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <drivers/pci.h>
+
+// virtio over PCI, both the legacy (0.9.5, I/O BAR0) and the modern (1.0,
+// vendor capabilities pointing into memory BARs) register layout, plus
+// split virtqueues. Device drivers sit on top of this.
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+#define VIRTIO_PCI_LEGACY_BASE 0x1000 // transitional ids, 0x1000 + subsystem id - 1
+#define VIRTIO_PCI_MODERN_BASE 0x1040 // + virtio device id
+#define VIRTIO_ID_BLOCK 2
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED 0x80
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT_DESC (1ull << 28)
+#define VIRTIO_F_EVENT_IDX (1ull << 29)
+#define VIRTIO_F_VERSION_1 (1ull << 32)
+
+// Legacy registers, offsets from the I/O BAR
+#define VIRTIO_LEGACY_DEVICE_FEATURES 0x00
+#define VIRTIO_LEGACY_GUEST_FEATURES 0x04
+#define VIRTIO_LEGACY_QUEUE_PFN 0x08
+#define VIRTIO_LEGACY_QUEUE_SIZE 0x0C
+#define VIRTIO_LEGACY_QUEUE_SELECT 0x0E
+#define VIRTIO_LEGACY_QUEUE_NOTIFY 0x10
+#define VIRTIO_LEGACY_STATUS 0x12
+#define VIRTIO_LEGACY_ISR 0x13
+#define VIRTIO_LEGACY_CONFIG_VECTOR 0x14 // only with MSI-X on
+#define VIRTIO_LEGACY_QUEUE_VECTOR 0x16
+// Device config moves up by the two vector registers once MSI-X is on
+#define VIRTIO_LEGACY_CONFIG(msix) ((msix) ? 0x18 : 0x14)
+#define VIRTIO_LEGACY_ALIGN 4096 // used ring alignment, PFN unit
+
+// Modern: vendor capability cfg_type
+#define VIRTIO_PCI_CAP_COMMON 1
+#define VIRTIO_PCI_CAP_NOTIFY 2
+#define VIRTIO_PCI_CAP_ISR 3
+#define VIRTIO_PCI_CAP_DEVICE 4
+
+// Modern common config, offsets from its capability
+#define VIRTIO_COMMON_DFSELECT 0x00
+#define VIRTIO_COMMON_DF 0x04
+#define VIRTIO_COMMON_GFSELECT 0x08
+#define VIRTIO_COMMON_GF 0x0C
+#define VIRTIO_COMMON_MSIX 0x10
+#define VIRTIO_COMMON_NUMQ 0x12
+#define VIRTIO_COMMON_STATUS 0x14
+#define VIRTIO_COMMON_CFGGEN 0x15
+#define VIRTIO_COMMON_Q_SELECT 0x16
+#define VIRTIO_COMMON_Q_SIZE 0x18
+#define VIRTIO_COMMON_Q_MSIX 0x1A
+#define VIRTIO_COMMON_Q_ENABLE 0x1C
+#define VIRTIO_COMMON_Q_NOFF 0x1E
+#define VIRTIO_COMMON_Q_DESC 0x20
+#define VIRTIO_COMMON_Q_AVAIL 0x28
+#define VIRTIO_COMMON_Q_USED 0x30
+
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+typedef struct
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) vring_desc_t;
+
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2 // device writes, driver reads
+#define VRING_DESC_F_INDIRECT 4
+
+// used_event follows the ring with EVENT_IDX
+typedef struct
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) vring_avail_t;
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+typedef struct
+{
+    uint32_t id; // head of the chain
+    uint32_t len;
+} __attribute__((packed)) vring_used_elem_t;
+
+// avail_event follows the ring with EVENT_IDX
+typedef struct
+{
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem_t ring[];
+} __attribute__((packed)) vring_used_t;
+
+#define VRING_USED_F_NO_NOTIFY 1
+
+#define VIRTQUEUE_MAX_SIZE 256
+
+struct virtio_device;
+
+struct virtqueue
+{
+    struct virtio_device *vdev;
+    uint16_t index;
+    uint16_t size;
+
+    vring_desc_t *desc;
+    volatile vring_avail_t *avail;
+    volatile vring_used_t *used;
+    void *ring;
+    uint32_t ring_phys;
+    uint32_t ring_bytes;
+
+    uint16_t avail_idx;  // ours, published to avail->idx on kick
+    uint16_t kicked_idx; // avail->idx as of the last kick
+    uint16_t last_used;  // next used entry to look at
+    volatile uint16_t *notify; // modern doorbell
+
+    // Statistics
+    uint32_t kicks;
+    uint32_t kicks_suppressed;
+};
+
+struct virtio_device
+{
+    pci_device_t *pci;
+    bool modern;
+    uint16_t iobase; // legacy
+    volatile uint8_t *common; // modern
+    volatile uint8_t *isr;
+    volatile uint8_t *config;
+    volatile uint8_t *notify_base;
+    uint32_t notify_multiplier;
+
+    uint64_t features; // negotiated
+    int irq;           // -1 without one
+    bool msix;         // every queue on entry 0
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Finds the registers, resets the device and says hello. Sets up MSI-X
+    // entry 0 if it can, vdev->irq is the line to request either way.
+    bool virtio_pci_init(struct virtio_device *vdev, pci_device_t *pci);
+    // Accepts what's in wanted that the device offers (plus VERSION_1 on
+    // modern devices). false if the device refuses.
+    bool virtio_negotiate(struct virtio_device *vdev, uint64_t wanted);
+    static inline bool virtio_has(struct virtio_device *vdev, uint64_t feature)
+    {
+        return (vdev->features & feature) != 0;
+    }
+    uint32_t virtio_config_read32(struct virtio_device *vdev, uint32_t offset);
+    uint64_t virtio_config_read64(struct virtio_device *vdev, uint32_t offset);
+    void virtio_driver_ok(struct virtio_device *vdev);
+    void virtio_fail(struct virtio_device *vdev);
+    // Reading it acknowledges the interrupt, only INTx needs that
+    uint8_t virtio_read_isr(struct virtio_device *vdev);
+
+    // Sizes the ring (at most max_size and VIRTQUEUE_MAX_SIZE) and hands it
+    // to the device
+    bool virtqueue_setup(struct virtio_device *vdev, struct virtqueue *vq, uint16_t index, uint16_t max_size);
+    // The rest is called with interrupts off.
+    // Queues a chain by its head, the device doesn't see it before a kick
+    void virtqueue_add(struct virtqueue *vq, uint16_t head);
+    // Publishes everything added since the last kick, and notifies the
+    // device unless it said (through avail_event) it doesn't need it yet
+    void virtqueue_kick(struct virtqueue *vq);
+    // Next completed chain, false if there's none
+    bool virtqueue_next_used(struct virtqueue *vq, uint32_t *head, uint32_t *len);
+    // Asks for an interrupt on the next completion. false if one already
+    // slipped in, go round again.
+    bool virtqueue_arm(struct virtqueue *vq);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <drivers/virtio.h>
+#include <block/blkqueue.h>
+
+// Device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX (1 << 1)
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLK_F_RO (1 << 5)
+#define VIRTIO_BLK_F_FLUSH (1 << 9)
+
+// Device config
+#define VIRTIO_BLK_CFG_CAPACITY 0 // 512 byte sectors, 64-bit
+#define VIRTIO_BLK_CFG_SIZE_MAX 8
+#define VIRTIO_BLK_CFG_SEG_MAX 12
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+// Errors handed to the queue
+#define VIRTIO_BLK_ERR_IO 1
+#define VIRTIO_BLK_ERR_UNSUPPORTED 2
+#define VIRTIO_BLK_ERR_ALIGN 3 // unmapped buffer or too many pieces
+#define VIRTIO_BLK_ERR_READONLY 4
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+// Per request limit. A segment can start mid page, so the worst case is a
+// descriptor per page plus two per segment, and the header and status.
+#define VIRTIO_BLK_MAX_SECTORS 256
+#define VIRTIO_BLK_MAX_DESCS (VIRTIO_BLK_MAX_SECTORS * 512 / 4096 + 2 * BLK_MAX_SEGMENTS + 2)
+#define VIRTIO_BLK_DEPTH 32
+#define VIRTIO_BLK_MAX_DISKS 4
+#define VIRTIO_BLK_BENCH_BATCH 4 // requests of VIRTIO_BLK_BENCH_SECTORS
+#define VIRTIO_BLK_BENCH_SECTORS 128
+
+// What a slot still has to send for its request, in this order. There's
+// no FUA in virtio-blk, a write that needs it is followed by a flush.
+#define VIRTIO_BLK_STAGE_PREFLUSH 0x01
+#define VIRTIO_BLK_STAGE_DATA 0x02
+#define VIRTIO_BLK_STAGE_POSTFLUSH 0x04
+
+// One in flight request's header, status and (with indirect descriptors)
+// its descriptor table, all in DMA memory
+struct virtio_blk_slot
+{
+    vring_desc_t table[VIRTIO_BLK_MAX_DESCS];
+    virtio_blk_req_hdr_t hdr;
+    volatile uint8_t status;
+} __attribute__((aligned(16)));
+
+typedef struct virtio_blk
+{
+    struct virtio_device vdev;
+    struct virtqueue vq;
+    uint64_t sectors;
+    bool readonly;
+    uint32_t seg_max; // data descriptors per request
+
+    // Indirect descriptors put a whole request in one ring entry. Without
+    // them slot n owns ring descriptors [n * ring_descs, (n + 1) * ring_descs).
+    bool indirect;
+    uint32_t ring_descs;
+    uint32_t chain_max; // descriptors one request may use
+    uint32_t depth;
+
+    struct virtio_blk_slot *slots;
+    uint32_t slots_phys;
+    // Touched with interrupts off
+    struct blk_request *requests[VIRTIO_BLK_DEPTH];
+    struct blk_segment data[VIRTIO_BLK_DEPTH][BLK_MAX_SEGMENTS]; // for later stages
+    uint8_t nsegs[VIRTIO_BLK_DEPTH];
+    uint8_t stages[VIRTIO_BLK_DEPTH];
+    uint32_t active;
+
+    struct blk_queue queue;
+
+    // Statistics
+    uint32_t interrupts;
+} virtio_blk_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Every virtio block device on the bus, legacy or modern, gets a
+    // request queue (vd0..vd3)
+    void virtio_blk_init();
+    struct blk_queue *virtio_blk_queue(uint32_t disk);
+    // Sequential reads through the queue, for comparing with ide_benchmark
+    void virtio_blk_benchmark(uint32_t disk, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -17,6 +17,9 @@
 #define E_NO_MEM -4
 #define E_DIR_FULL -5
 
+#define EXT2_SIGNATURE 0xEF53
+#define EXT2_FILE_BIOS 8 // reads ext2_read_file keeps in flight
+
 #define REQ_COMPRESSION 0x0001
 #define REQ_DIR_TYPE_FIELD 0x0002
 #define REQ_JOURNAL_REPLAY 0x0004
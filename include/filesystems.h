@@ -4,6 +4,7 @@
 #include <ext2.h>
 #include <stdbool.h>
 #include <drivers/ide.h>
+#include <block/bio.h>
 #include <liballoc.h>
 #include <stdio.h>
 #include <util.h>
@@ -12,16 +13,18 @@
 // vfs
 
 // ext2
-void ext2_read_drive(uint8_t drive);
+void ext2_read_drive(block_device_t *drive);
+// First disk in the registry with an ext2 superblock, NULL if there's none
+block_device_t *ext2_find_root();
 
 // iso 9660
-iso9660_pvd_t *isoGetPVDStruct(uint8_t driveIndex);
-uint8_t *isoLoadPathTable(uint8_t drive, iso9660_pvd_t *pvd);
+iso9660_pvd_t *isoGetPVDStruct(block_device_t *drive);
+uint8_t *isoLoadPathTable(block_device_t *drive, iso9660_pvd_t *pvd);
 int isoFilenameCompare(const char *isoName, int isoLen, const char *cName);
-iso9660_dir_t *isoResolveEntry(uint8_t drive, uint32_t dirLBA, const char *name);
-void isoPrintDirectoryRecursive(uint8_t drive, uint8_t *path_table_buf, uint32_t table_size, uint16_t parent_index, int depth);
-void isoPrintfileSystemTree(uint8_t drive);
-void isoPrintFilesInDirectory(uint8_t drive, uint32_t dir_lba, int depth);
+iso9660_dir_t *isoResolveEntry(block_device_t *drive, uint32_t dirLBA, const char *name);
+void isoPrintDirectoryRecursive(block_device_t *drive, uint8_t *path_table_buf, uint32_t table_size, uint16_t parent_index, int depth);
+void isoPrintfileSystemTree(block_device_t *drive);
+void isoPrintFilesInDirectory(block_device_t *drive, uint32_t dir_lba, int depth);
 
 typedef enum filesystem_s
 {
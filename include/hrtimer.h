@@ -0,0 +1,47 @@
+#ifndef HRTIMER_H
+#define HRTIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// One-shot callback timers with nanosecond expiry on the ktime clock.
+// Pending timers sit in a binary min-heap, the earliest one programs the
+// event source. Callbacks run in softirq context: interrupts on, can't
+// sleep, may restart their own timer.
+
+#define HRTIMER_MAX 256
+
+struct hrtimer;
+typedef void (*hrtimer_callback_t)(struct hrtimer *timer);
+
+struct hrtimer
+{
+    uint64_t expires; // ktime_get_ns() value
+    hrtimer_callback_t callback;
+    void *data;       // for the owner
+    int32_t index;    // heap slot, -1 when not queued
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Picks the event source, after hpet_init/lapic_init
+    void init_hrtimer();
+    // Required before the first start
+    void hrtimer_init(struct hrtimer *timer, hrtimer_callback_t callback, void *data);
+    // (Re)arms the timer delay_ns from now. false if the heap is full.
+    bool hrtimer_start(struct hrtimer *timer, uint64_t delay_ns, hrtimer_callback_t callback);
+    bool hrtimer_start_abs(struct hrtimer *timer, uint64_t expires_ns);
+    // Returns whether it was still pending. A callback that is already
+    // running isn't waited for.
+    bool hrtimer_cancel(struct hrtimer *timer);
+    bool hrtimer_active(struct hrtimer *timer);
+    // Called from the system tick, catches expiries when there's no
+    // one-shot event source.
+    void hrtimer_tick();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -22,9 +22,71 @@ void init_idt();
 void setIDTGate(uint8_t num, uint32_t base, uint16_t selector, uint8_t flags);
 extern void idt_flush(uint32_t);
 
-void irq_install_handler(int irq, void (*handler)(struct InterruptRegisters *r));
+// IRQ numbers are ISA lines (0-15) and, with the IOAPIC, global system
+// interrupts 16-23 plus MSI lines from irq_alloc. IRQ n is vector 0x20 + n.
+#define NUM_IRQS 32
+#define IRQ_VECTOR_BASE 0x20
+#define NUM_ISA_IRQS 16
+#define IRQ_MSI_FIRST 24
+
+// Handlers on a line are chained, so lines can be shared. Every handler on
+// the line runs and says whether the interrupt was its device's.
+typedef enum
+{
+    IRQ_NONE = 0,   // not mine
+    IRQ_HANDLED = 1
+} irqreturn_t;
+
+typedef irqreturn_t (*irq_handler_t)(int irq, void *dev_id);
+
+#define IRQ_MAX_ACTIONS 64
+
+struct irq_action
+{
+    irq_handler_t handler;
+    void *dev_id; // handed to the handler, identifies it for irq_free
+    const char *name;
+    struct irq_action *next;
+};
+
+// Hard irq handlers run with interrupts off and should only talk to the
+// device, anything longer goes to a tasklet. Returns 0 or -1 if the line
+// is out of range or there are no free actions.
+int irq_request(int irq, irq_handler_t handler, void *dev_id, const char *name);
+void irq_free(int irq, void *dev_id);
+bool irq_line_in_use(int irq);
+// Name of the first handler on the line, NULL if there's none
+const char *irq_name(int irq);
+// Interrupts on the line that every handler said weren't theirs
+uint32_t irq_unhandled_count(int irq);
+void irq_mask(int irq);
+void irq_unmask(int irq);
+void irq_eoi(int irq);
+// Called by ioapic_init once the IOAPIC has taken over from the PIC
+void irq_set_apic_mode();
+bool irq_apic_mode();
+// A free MSI line, -1 if there's none or we're still on the PIC
+int irq_alloc();
 void isr_handler(struct InterruptRegisters *registers);
-void irq_handler(struct InterruptRegisters *registers);
+void irq_handler(uint32_t vector);
+void disable_pic();
+void pic_mask_irq(uint8_t irq);
+void pic_unmask_irq(uint8_t irq);
+
+// IRQs and the vectors below don't get a struct InterruptRegisters, the
+// stubs call vector_table[vector](vector) directly and interrupt_exit after.
+typedef void (*vector_handler_t)(uint32_t vector);
+extern vector_handler_t vector_table[256];
+
+// Handlers for vectors outside the IRQ range. They EOI themselves.
+void vector_install_handler(uint8_t vector, vector_handler_t handler);
+// Softirqs, then a pending task switch, once the handler has EOI'd
+void interrupt_exit();
+
+#define IRQ_BENCH_VECTOR 240
+// Round trip of a null interrupt through the lean stub and through the
+// full frame exception stub, printed in cycles.
+void irq_benchmark(uint32_t iterations);
 
 // isr externs
 extern void isr0();
@@ -81,4 +143,24 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq16();
+extern void irq17();
+extern void irq18();
+extern void irq19();
+extern void irq20();
+extern void irq21();
+extern void irq22();
+extern void irq23();
+extern void irq24();
+extern void irq25();
+extern void irq26();
+extern void irq27();
+extern void irq28();
+extern void irq29();
+extern void irq30();
+extern void irq31();
+
+extern void vector239();
+extern void vector240();
+extern void vector255();
 #endif
\ No newline at end of file
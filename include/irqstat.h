@@ -0,0 +1,54 @@
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per vector interrupt accounting. Cycles are rdtsc deltas over the hard
+// handler (up to and including the EOI), softirqs are counted on their own.
+
+#define IRQSTAT_BUCKETS 32 // bucket n holds handler runs of 2^n..2^(n+1)-1 cycles
+
+struct irq_stat
+{
+    uint32_t count;
+    uint32_t spurious;
+    uint64_t cycles;
+    uint32_t max_cycles;
+    uint32_t hist[IRQSTAT_BUCKETS];
+};
+
+// Page faults by what the error code says. A fault lands in more than one.
+enum
+{
+    PF_STAT_NOT_PRESENT,
+    PF_STAT_PROTECTION,
+    PF_STAT_WRITE,
+    PF_STAT_USER,
+    PF_STAT_IFETCH,
+    PF_STAT_RESERVED,
+    PF_STAT_COW, // resolved by copy-on-write
+    NR_PF_STATS
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Called from the interrupt paths with interrupts off
+    void irqstat_record(uint8_t vector, uint32_t cycles);
+    void irqstat_count(uint8_t vector); // no timing, e.g. syscalls that may block
+    void irqstat_spurious(uint8_t vector);
+    void irqstat_softirq(uint32_t cycles);
+    void irqstat_page_fault(uint32_t error_code, bool cow);
+
+    const struct irq_stat *irqstat_get(uint8_t vector);
+    uint32_t irqstat_page_faults(int type);
+    void irqstat_reset();
+    // Table of every vector that fired, plus page faults, over serial
+    void irqstat_report();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
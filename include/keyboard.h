@@ -3,5 +3,5 @@
 #include <util.h>
 
 void init_keyboard();
-void keyboardHandler(struct InterruptRegisters *reg);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,54 @@
+#ifndef KTIME_H
+#define KTIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+// Something that counts up at a fixed rate. ns = (cycles * mult) >> shift.
+struct clocksource
+{
+    const char *name;
+    uint64_t (*read)();
+    uint64_t mask;   // counters narrower than 64 bits wrap at this
+    uint64_t freq;   // Hz
+    uint32_t mult;
+    uint32_t shift;
+    int rating;      // the best rated clocksource wins
+    struct clocksource *next;
+};
+
+// Clocksource ratings
+#define CLOCKSOURCE_RATING_PIT 100
+#define CLOCKSOURCE_RATING_HPET 250
+#define CLOCKSOURCE_RATING_TSC 300
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Calibrates the tsc against PIT channel 2 and picks a clocksource.
+    // Call once the PIT is ticking, with interrupts still off.
+    void ktime_init();
+    // Called from the timer interrupt, folds elapsed cycles into the base
+    // so deltas stay small.
+    void ktime_tick();
+    void clocksource_register(struct clocksource *cs);
+    const struct clocksource *clocksource_current();
+
+    // Monotonic nanoseconds since ktime_init
+    uint64_t ktime_get_ns();
+    // Raw counter of the current clocksource, cheap, for timing hot paths
+    uint64_t ktime_get_cycles();
+    uint64_t ktime_cycles_to_ns(uint64_t cycles);
+    // 0 if the tsc wasn't calibrated
+    uint32_t ktime_tsc_khz();
+    bool ktime_tsc_invariant();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -14,7 +14,23 @@ extern int mem_num_vpages;
 
 #define PAGE_FLAG_PRESENT (1 << 0)
 #define PAGE_FLAG_WRITE (1 << 1)
+#define PAGE_FLAG_USER (1 << 2)
+#define PAGE_FLAG_WRITE_THROUGH (1 << 3)
+#define PAGE_FLAG_CACHE_DISABLE (1 << 4)
+#define PAGE_FLAG_4MB (1 << 7)
 #define PAGE_FLAG_OWNER (1 << 9)
+#define PAGE_FLAG_COW (1 << 10) // read-only copy of a shared frame, copied on write
+
+// Scratch page for touching frames that aren't mapped anywhere (page tables
+// of other address spaces, COW copies). Lives in the kernel half.
+#define TEMP_MAP_VADDR 0xFF800000
+
+#define USER_STACK_TOP KERNEL_START
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
 
 void invalid(uint32_t virtualAddr);
 void init_memory(uint32_t memHigh, uint32_t physicalAllocStart);
@@ -30,4 +46,39 @@ void pmmFreePageFrame(uint32_t paddr);
 void vmmUnmapPage(uint32_t virtualAddr);
 void vmmUnmapRegion(uint32_t virtualAddr, size_t numPages);
 bool memIsPagePresent(uint32_t virtualAddr);
-void *vmmAlloc(uint32_t phys_addr, size_t num_pages, uint32_t flags);
\ No newline at end of file
+// Frame behind a mapped address in the current directory plus the offset,
+// 0 if it isn't mapped. For handing kernel buffers to DMA engines.
+uint32_t vmmVirtToPhys(uint32_t virtualAddr);
+// Copies len bytes from the current address space's user half. False if
+// any page in the range isn't present and user accessible.
+bool memCopyFromUser(void *dst, uint32_t userAddr, size_t len);
+void *vmmAlloc(uint32_t phys_addr, size_t num_pages, uint32_t flags);
+// Device registers and firmware tables: the frames aren't ours, so these
+// mappings must be dropped with vmmUnmapMmio and never vmmUnmapPage,
+// which also makes the virtual range available again.
+void *vmmMapMmio(uint32_t physAddr, size_t size, uint32_t flags);
+void vmmUnmapMmio(void *virtualAddr, size_t size);
+
+// Physically contiguous frames for device DMA. align is in bytes (a power
+// of two, at least PAGE_SIZE). Returns 0 if there's no such run.
+uint32_t pmmAllocContiguous(size_t numPages, uint32_t align);
+// Contiguous, zeroed and mapped into the kernel heap. *phys gets the bus
+// address. Free with memFreeDma.
+void *memAllocDma(size_t size, uint32_t align, uint32_t *phys);
+void memFreeDma(void *virtualAddr, size_t size);
+
+// address spaces
+uint32_t *memAllocPageDir();
+void memFreePageDir(uint32_t *pd);
+uint32_t *memForkPageDir();
+uint32_t memPageDirPhys(uint32_t *pd);
+bool vmmMapPageInDir(uint32_t *pd, uint32_t virtualAddr, uint32_t physAddr, uint32_t flags);
+bool memHandleCowFault(uint32_t faultAddr);
+void *memTempMap(uint32_t physAddr);
+void memTempUnmap();
+void pmmGetFrame(uint32_t paddr);
+void pmmPutFrame(uint32_t paddr);
+
+#ifdef __cplusplus
+}
+#endif
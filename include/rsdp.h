@@ -39,7 +39,12 @@ typedef struct ACPISDTHeader
     uint32_t CreatorRevision;
 } ACPISDTHeader_t;
 
+#define ACPI_MAX_TABLE_LENGTH 0x10000 // sanity limit
+
 RSDP_t *scan_for_rsdp(uintptr_t start_addr, uintptr_t end_addr);
 RSDP_t *find_rsdp(uint32_t ptr);
 void acpi_init(uint32_t ptr);
 void rsdt_parse();
+// Looks a table up by its 4 character signature, e.g. "HPET" or "APIC".
+// The table stays mapped, NULL if it's missing or fails its checksum.
+ACPISDTHeader_t *acpi_find_table(const char *signature);
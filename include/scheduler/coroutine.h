@@ -0,0 +1,103 @@
+#pragma once
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Stackless coroutines for I/O bound kernel work.
+//
+// A coroutine is a function plus a resume point. Locals that must survive a
+// suspension live in the caller's own struct (embed struct coroutine in it),
+// so an outstanding operation costs sizeof that struct instead of a task
+// stack. A few worker tasks run whatever is ready. Completion handlers wake
+// a coroutine with coroutine_wake(), which is fine from irq context.
+//
+//   struct read_op { struct coroutine co; uint32_t lba; int i; };
+//
+//   static int readBody(struct coroutine *co)
+//   {
+//       struct read_op *op = (struct read_op *)co;
+//       CO_BEGIN(co);
+//       for (op->i = 0; op->i < 4; op->i++)
+//       {
+//           submit(op->lba + op->i, co);   // irq calls coroutine_wake(co)
+//           CO_WAIT(co);
+//       }
+//       CO_END(co);
+//   }
+//
+// The body is a switch, so it can't hold its own switch across a suspension
+// point and plain locals don't survive one.
+
+// What a body returns to its worker
+#define CO_DONE 0    // finished, the done callback runs next
+#define CO_YIELDED 1 // still runnable, back to the end of the ready queue
+#define CO_WAITING 2 // parked until coroutine_wake
+
+#define CO_BEGIN(co)         \
+    switch ((co)->resume_at) \
+    {                        \
+    case 0:
+
+#define CO_SUSPEND(co, how)          \
+    do                               \
+    {                                \
+        (co)->resume_at = __LINE__;  \
+        return (how);                \
+    case __LINE__:;                  \
+    } while (0)
+
+#define CO_YIELD(co) CO_SUSPEND(co, CO_YIELDED)
+#define CO_WAIT(co) CO_SUSPEND(co, CO_WAITING)
+
+// Re-checks cond every time the coroutine is woken
+#define CO_WAIT_UNTIL(co, cond)       \
+    do                                \
+    {                                 \
+        (co)->resume_at = __LINE__;   \
+        __attribute__((fallthrough)); \
+    case __LINE__:                    \
+        if (!(cond))                  \
+            return CO_WAITING;        \
+    } while (0)
+
+#define CO_END(co)          \
+    }                       \
+    (co)->resume_at = 0;    \
+    return CO_DONE
+
+struct coroutine;
+typedef int (*coroutine_fn)(struct coroutine *co);
+typedef void (*coroutine_done_fn)(struct coroutine *co);
+
+struct coroutine
+{
+    coroutine_fn fn;
+    coroutine_done_fn done; // optional, may free the coroutine
+    struct coroutine *next; // ready queue link
+    uint16_t resume_at;     // __LINE__ of the suspension point, 0 = start
+    uint8_t state;
+    uint8_t wake_pending;   // woken while it was still running
+};
+
+#define COROUTINE_WORKERS 2
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Starts the worker tasks, after scheduler_init
+    void coroutine_init();
+    void coroutine_setup(struct coroutine *co, coroutine_fn fn, coroutine_done_fn done);
+    // Queues a set up coroutine to run from the start
+    void coroutine_start(struct coroutine *co);
+    // Makes a CO_WAITING coroutine runnable again. Safe from irq handlers.
+    void coroutine_wake(struct coroutine *co);
+    uint32_t coroutine_count_active();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
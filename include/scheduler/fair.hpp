@@ -0,0 +1,48 @@
+#ifndef FAIR_HPP
+#define FAIR_HPP
+#include <scheduler/task.hpp>
+#include <stdint.h>
+
+// CFS-style fair class. Every runnable task accumulates vruntime, which is
+// the rdtsc cycles it ran scaled by NICE_0_WEIGHT / weight, and the task
+// with the smallest vruntime runs next.
+
+#define NICE_0_WEIGHT 1024
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+// Targeted latency: every runnable task should get the cpu once per period.
+// How long a task keeps the cpu once picked is its quantum, see timer.h,
+// which is also the lower bound on its weighted slice.
+#define SCHED_LATENCY_TICKS 6
+// A waking task must lead the running task by this much to preempt it.
+#define SCHED_WAKEUP_GRANULARITY_TICKS 1
+// Sleepers are placed at most this far behind min_vruntime on wakeup, so a
+// task that slept for a long time can't monopolize the cpu once it wakes.
+#define SCHED_SLEEPER_CREDIT_TICKS (SCHED_LATENCY_TICKS / 2)
+
+uint32_t niceToWeight(int nice);
+
+class FairRunQueue
+{
+private:
+    Task *head; // sorted by vruntime, leftmost task first
+    uint64_t min_vruntime;
+    uint32_t total_weight;
+    int nr_running;
+
+public:
+    FairRunQueue();
+
+    void enqueue(Task *task);
+    void dequeue(Task *task);
+    Task *pickFirst() { return head; }
+
+    void updateMinVruntime(Task *curr);
+    void placeWakingTask(Task *task, uint64_t sleeper_credit);
+    uint64_t idealSlice(Task *task, uint64_t latency, uint64_t min_granularity);
+    uint64_t minVruntime() { return min_vruntime; }
+    int nrRunning() { return nr_running; }
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef RT_HPP
+#define RT_HPP
+#include <scheduler/task.hpp>
+#include <stdint.h>
+
+// Real-time class. Static priorities 1..99, higher runs first, and any
+// runnable RT task runs before every fair task. SCHED_FIFO tasks run until
+// they block or yield, SCHED_RR tasks round robin within their priority.
+
+#define RT_PRIO_MIN 1
+#define RT_PRIO_MAX 99
+#define RT_NUM_PRIOS (RT_PRIO_MAX + 1)
+#define RT_BITMAP_WORDS ((RT_NUM_PRIOS + 31) / 32)
+
+// SCHED_RR slice in ticks.
+#define RT_RR_QUANTUM_TICKS 10
+
+// Throttle: RT tasks may use at most RT_RUNTIME_TICKS of every
+// RT_PERIOD_TICKS, so a runaway FIFO task can't lock up the fair class.
+#define RT_PERIOD_TICKS 1000
+#define RT_RUNTIME_TICKS 950
+
+class RtRunQueue
+{
+private:
+    Task *heads[RT_NUM_PRIOS];
+    Task *tails[RT_NUM_PRIOS];
+    uint32_t bitmap[RT_BITMAP_WORDS]; // bit set = list for that prio is non-empty
+    int nr_running;
+
+public:
+    RtRunQueue();
+
+    void enqueue(Task *task, bool at_head);
+    void dequeue(Task *task);
+    Task *pickFirst();
+    bool hasOtherAt(int prio) { return heads[prio] != nullptr; }
+    int nrRunning() { return nr_running; }
+};
+
+#endif
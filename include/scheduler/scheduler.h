@@ -7,6 +7,11 @@
 #define TASK_STATE_RUNNING 0
 #define TASK_STATE_SLEEPING 1
 
+// Scheduling policies
+#define SCHED_NORMAL 0 // fair class
+#define SCHED_FIFO 1   // real-time, runs until it blocks or yields
+#define SCHED_RR 2     // real-time, round robin within its priority
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -14,11 +19,34 @@ extern "C"
     extern bool schedulerEnabled;
     void scheduler_init();
 
+    struct InterruptRegisters;
+
     void scheduler_create_task(uint32_t entry_point, bool is_kernel_task);
+    // Same as scheduler_create_task but in its own address space, page_dir if
+    // given (from memAllocPageDir) or a fresh one. Returns the new task id or -1.
+    int scheduler_create_process(uint32_t entry_point, bool is_kernel_task, uint32_t *page_dir);
+    // Copy-on-write fork of the running task from its trap frame. Returns the
+    // child's id to the parent, the child sees 0 in eax. -1 on failure.
+    int scheduler_fork(struct InterruptRegisters *regs);
+    void scheduler_set_nice(int nice);
+    // Per-task slice override in ticks, 0 goes back to g_Quantum.
+    void scheduler_set_quantum(uint32_t ticks);
+    // Switch the running task to another policy. rt_priority is 1..99 for
+    // SCHED_FIFO/SCHED_RR and ignored for SCHED_NORMAL. Returns false on bad input.
+    bool scheduler_set_policy(int policy, int rt_priority);
+    void scheduler_dump_trace();
 
     void scheduler_wake_sleeping_tasks(uint64_t current_ticks);
     void task_sleep(uint32_t milliseconds);
+    uint32_t scheduler_current_id();
+    // Marks the running task dead and switches away, never returns.
+    void scheduler_exit();
     void scheduler_tick();
+    void scheduler_yield();
+
+    // Called on the way out of an interrupt, after the EOI has been sent.
+    // Switches tasks if the tick or a wakeup asked for it.
+    void scheduler_irq_exit();
 
 #ifdef __cplusplus
 }
@@ -1,9 +1,12 @@
 #ifndef SCHEDULER_HPP
 #define SCHEDULER_HPP
 #include <scheduler/task.hpp> // Use the .hpp for the C++ Task class
+#include <scheduler/fair.hpp>
+#include <scheduler/rt.hpp>
 #include <stdint.h>
 
 #define MAX_TASKS 16 // <<<<<<< DEFINE IT HERE
+#define TASK_STACK_SIZE 16384
 extern "C" void contextSwitch(Task *from, Task *to);
 
 class Scheduler
@@ -11,14 +14,42 @@ class Scheduler
 private:
     Task *tasks[MAX_TASKS];
     int num_tasks;
-    int current_task_index;
+    Task *current;
+    Task *idle_task;
+    FairRunQueue fair;
+    RtRunQueue rt;
+
+    // RT throttling, in ticks
+    uint32_t rt_period_elapsed;
+    uint32_t rt_time;
+    bool rt_throttled;
+
+    bool need_resched;
+    uint64_t last_tick_tsc;
+    uint64_t cycles_per_tick; // measured, used to turn tick tunables into cycles
+
+    Task *allocateTask(uint32_t id, uint32_t entry_point, bool is_kernel_task);
+    void addTask(Task *task);
+    void updateCurrent();
+    void checkPreemptWakeup(Task *task);
+    void enqueueTask(Task *task, bool at_head);
+    void dequeueTask(Task *task);
+    Task *pickNextTask();
+    void tickRt();
+    void tickFair();
 
 public:
     Scheduler();
     void init();
     void createTask(uint32_t entry_point, bool is_kernel_task);
+    int createProcess(uint32_t entry_point, bool is_kernel_task, uint32_t *dir = nullptr);
+    int fork(const struct InterruptRegisters *regs);
     void schedule();
+    void tick();
+    bool setPolicy(Task *task, int policy, int rt_priority);
+    void wakeUp(Task *task);
+    bool needResched() { return need_resched; }
     Task *getCurrentTask();
     void wakeSleepingTasks(uint64_t current_ticks);
 };
-#endif
\ No newline at end of file
+#endif
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <scheduler/scheduler.h>
 #include <new.h>
+#include <util.h>
 
 enum class TaskState
 {
@@ -27,6 +28,16 @@ extern "C" struct NewTaskKernelStack
     uint32_t eip, cs, eflags, usermode_esp, usermode_ss;
 };
 
+// Kernel stack of a forked child: contextSwitch pops the callee-saved
+// registers and returns into forkReturn, which unwinds a copy of the
+// parent's interrupt frame the same way isr_common_stub does.
+extern "C" struct ForkKernelStack
+{
+    uint32_t ebp, edi, esi, ebx;
+    uint32_t switch_context_return_addr;
+    struct InterruptRegisters regs;
+};
+
 class Task
 {
 public:
@@ -37,14 +48,45 @@ public:
 
     // --- C++ ONLY MEMBERS ---
     TaskState state;
+    uint32_t *page_dir; // virtual address of the task's page directory
+    uint32_t cr3;       // physical address of the same, loaded on switch
     uint64_t wake_at_tick;
 
+    // --- SCHEDULING CLASS ---
+    uint8_t policy;       // SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+    int rt_priority;      // 1..99 for RT tasks, 0 otherwise
+    uint64_t wake_tsc;    // rdtsc at wakeup, for dispatch latency tracing
+    bool yielding;        // requeue at the tail even if the slice isn't over
+
+    // --- FAIR CLASS ---
+    int nice;             // -20 (greedy) .. 19 (nice)
+    uint32_t weight;      // load weight derived from nice
+    uint64_t vruntime;    // weighted rdtsc cycles, NICE_0_WEIGHT scale
+    uint64_t exec_start;  // rdtsc when the task was last put on the cpu
+    uint64_t sum_exec;    // total rdtsc cycles spent on the cpu
+    uint64_t slice_exec;  // cycles used since the task was last picked
+    uint32_t quantum;     // slice length in ticks, 0 means g_Quantum
+    uint32_t slice_left;  // ticks left before the tick preempts this task
+    Task *rq_next;        // fair run queue link, sorted by vruntime
+    bool on_rq;
+    Task *wq_next;        // wait queue link while BLOCKED
+
     Task(uint32_t id, uint32_t entry_point, uint32_t kernel_stack_top, bool is_kernel);
     Task(uint32_t id, bool is_kernel);
+    Task(uint32_t id, uint32_t kernel_stack_top, const struct InterruptRegisters *parent_regs);
 
     // This was missing from the class definition
     void set_tss_stack(uint32_t stack); // <<<<<<< FIX #2: ADD THIS DECLARATION
     void setState(TaskState new_state) { state = new_state; }
     void setWakeTime(uint64_t ticks) { wake_at_tick = ticks; }
+    void setNice(int new_nice);
+    void setAddressSpace(uint32_t *dir);
+    void setUserStack(uint32_t esp);
+    void setQuantum(uint32_t ticks) { quantum = ticks; }
+    void refillSlice();
+    bool isRealtime() { return policy != SCHED_NORMAL; }
+
+private:
+    void initSchedFields();
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,42 @@
+#ifndef SCHED_TRACE_HPP
+#define SCHED_TRACE_HPP
+#include <scheduler/task.hpp>
+#include <stdint.h>
+
+// Scheduler tracing hooks. Wakeups are timestamped with rdtsc and the delay
+// until the task actually gets the cpu is recorded per scheduling class, so
+// the worst case dispatch latency can be read back with scheduler_dump_trace.
+
+#define SCHED_TRACE_EVENTS 64
+#define SCHED_TRACE_HIST_BUCKETS 32
+
+enum class TraceEvent : uint8_t
+{
+    WAKEUP,
+    SWITCH,
+    THROTTLE,
+    UNTHROTTLE
+};
+
+struct SchedTraceEntry
+{
+    uint64_t tsc;
+    TraceEvent event;
+    uint8_t prev_id;
+    uint8_t next_id;
+    uint32_t latency; // cycles from wakeup to switch-in, SWITCH only
+};
+
+struct SchedLatencyStats
+{
+    uint32_t count;
+    uint64_t total;
+    uint64_t max;
+    uint32_t hist[SCHED_TRACE_HIST_BUCKETS]; // log2(cycles)
+};
+
+void traceSchedWakeup(Task *task);
+void traceSchedSwitch(Task *prev, Task *next);
+void traceSchedThrottle(bool throttled);
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// FIFO of blocked tasks. Tasks are linked through the Task itself so
+// sleeping costs no allocation, and waking is safe from irq handlers.
+struct wait_queue
+{
+    void *head; // Task *, opaque to C
+    void *tail;
+};
+
+#define WAIT_QUEUE_INIT {0, 0}
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void wait_queue_init(struct wait_queue *wq);
+    // Blocks the running task until somebody wakes it. Must be called with
+    // interrupts disabled, after the condition was checked, so a wakeup
+    // can't slip in between. Interrupts are disabled again on return.
+    void wait_queue_sleep(struct wait_queue *wq);
+    // Both return whether a task was woken.
+    bool wait_queue_wake_one(struct wait_queue *wq);
+    bool wait_queue_wake_all(struct wait_queue *wq);
+    bool wait_queue_empty(struct wait_queue *wq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sequence lock for data that's read a lot and written rarely, e.g. 64-bit
+// time values that can't be read atomically on i386. The writer bumps the
+// count to odd, updates, bumps it back to even. Readers retry if the count
+// was odd or moved while they read. Writers must not be interrupted by a
+// reader on the same cpu, so write with interrupts off.
+typedef struct
+{
+    volatile uint32_t sequence;
+} seqlock_t;
+
+#define SEQLOCK_INIT {0}
+
+static inline void seqlock_write_begin(seqlock_t *sl)
+{
+    sl->sequence++;
+    asm volatile("" ::: "memory");
+}
+
+static inline void seqlock_write_end(seqlock_t *sl)
+{
+    asm volatile("" ::: "memory");
+    sl->sequence++;
+}
+
+static inline uint32_t seqlock_read_begin(const seqlock_t *sl)
+{
+    uint32_t start;
+    while ((start = sl->sequence) & 1)
+        asm volatile("pause");
+    asm volatile("" ::: "memory");
+    return start;
+}
+
+static inline bool seqlock_read_retry(const seqlock_t *sl, uint32_t start)
+{
+    asm volatile("" ::: "memory");
+    return sl->sequence != start;
+}
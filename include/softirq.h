@@ -0,0 +1,55 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deferred work raised from hard irq handlers and run on the way out of the
+// interrupt, after the EOI, with interrupts enabled.
+enum
+{
+    SOFTIRQ_HRTIMER,
+    SOFTIRQ_TASKLET,
+    NR_SOFTIRQS
+};
+
+typedef void (*softirq_handler_t)();
+
+// Bottom half a driver schedules from its irq handler. Scheduling one that
+// is already pending does nothing, so it runs once for any number of
+// interrupts, and it never runs twice at the same time.
+struct tasklet
+{
+    struct tasklet *next;
+    void (*func)(void *data);
+    void *data;
+    bool scheduled;
+};
+
+#define TASKLET_INIT(f, d) {0, (f), (d), false}
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void softirq_register(int nr, softirq_handler_t handler);
+    // Safe from any context, runs at the next irq exit
+    void softirq_raise(int nr);
+    // Called by the irq stubs' C side after the EOI. Does nothing if a
+    // softirq run is already in progress further down the stack.
+    void softirq_irq_exit();
+    bool softirq_pending();
+    // A softirq run is on the stack. Task switches wait for it to finish,
+    // otherwise every other irq exit would skip softirqs until the
+    // interrupted task got the cpu back.
+    bool in_softirq_context();
+
+    void softirq_init();
+    void tasklet_init(struct tasklet *t, void (*func)(void *data), void *data);
+    // Safe from any context
+    void tasklet_schedule(struct tasklet *t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,46 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <util.h>
+
+// Syscall ABI (both entry paths):
+//   eax = number, ebx/esi/edi/ebp = arguments, result comes back in eax.
+// sysenter additionally takes the user return address in edx and the user
+// stack pointer in ecx, which is why ecx/edx can't carry arguments.
+// int 0x80 is kept as a fallback for cpus without SEP and for code that
+// needs a full trap frame.
+
+#define SYS_NULL 0
+#define SYS_YIELD 1
+#define SYS_SLEEP 2
+#define SYS_GETPID 3
+#define SYS_FORK 4
+#define SYS_WRITE 5
+#define SYS_EXIT 6
+#define SYS_BENCH_REPORT 7
+#define NUM_SYSCALLS 8
+
+#define IA32_SYSENTER_CS 0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
+
+// Register image of a syscall. The sysenter stub pushes exactly this, the
+// int 0x80 path builds one from its struct InterruptRegisters.
+struct syscall_frame
+{
+    uint32_t eax; // number in, result out
+    uint32_t ebx, esi, edi, ebp;
+    uint32_t user_eip, user_esp;     // edx/ecx, handed back to sysexit
+    struct InterruptRegisters *trap; // full frame for int 0x80, NULL for sysenter
+};
+
+typedef int32_t (*syscall_handler_t)(struct syscall_frame *frame);
+
+void syscall_init();
+void syscall_dispatch(struct syscall_frame *frame);
+void syscall_int80_handler(struct InterruptRegisters *regs);
+void syscall_benchmark(uint32_t iterations);
+extern bool sysenterSupported;
+
+#endif
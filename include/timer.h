@@ -5,15 +5,26 @@
 #include <stdbool.h>
 #include <util.h>
 
+// Default slice in ticks (1 tick = 1 ms). Tunable at runtime through
+// g_Quantum, tasks can override it with scheduler_set_quantum().
+#define DEFAULT_QUANTUM_TICKS 10
+#define TIMER_FREQ 1000 // PIT ticks per second
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
     void init_timer();
-    void onIrq0(struct InterruptRegisters *reg);
+    // One system tick, whoever generates it (PIT/HPET on IRQ0 or the local
+    // APIC timer).
+    void timer_tick();
     void sleep(uint32_t millis);
+    // ticks is 64-bit and can't be read atomically, outside of irq context
+    // use timer_get_ticks() or ktime_get_ns().
     extern uint64_t ticks;
+    uint64_t timer_get_ticks();
     extern uint64_t g_Quantum;
+    extern bool schedulerEnabled;
 #ifdef __cplusplus
 }
 #endif
@@ -42,12 +42,65 @@ extern "C"
         __asm__ volatile("sti");
     };
 
+    // save eflags and lock interrupts
+    static inline uint32_t saveInterrupts()
+    {
+        uint32_t flags;
+        __asm__ volatile("pushfl\n\t"
+                         "popl %0\n\t"
+                         "cli"
+                         : "=r"(flags)
+                         :
+                         : "memory");
+        return flags;
+    };
+
+    // unlock interrupts if they were enabled when flags were saved
+    static inline void restoreInterrupts(uint32_t flags)
+    {
+        if (flags & 0x200)
+            __asm__ volatile("sti" ::: "memory");
+    };
+
+    // read the time stamp counter
+    static inline uint64_t rdtsc()
+    {
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+    };
+
+    static inline uint64_t rdmsr(uint32_t msr)
+    {
+        uint32_t lo, hi;
+        __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+        return ((uint64_t)hi << 32) | lo;
+    };
+
+    static inline void wrmsr(uint32_t msr, uint64_t value)
+    {
+        __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+    };
+
+    static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+    {
+        __asm__ volatile("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(0));
+    };
+
     // output port b
     static inline void outb(uint16_t port, uint8_t val)
     {
         __asm__ volatile("outb %b0, %w1" : : "a"(val), "Nd"(port) : "memory");
     };
 
+    // output port w
+    static inline void outw(uint16_t port, uint16_t val)
+    {
+        __asm__ volatile("outw %w0, %w1" : : "a"(val), "Nd"(port) : "memory");
+    };
+
     // output port l
     static inline void outl(uint16_t port, uint32_t val)
     {
@@ -65,6 +118,17 @@ extern "C"
         return ret;
     };
 
+    // input on port w
+    static inline uint16_t inw(uint16_t port)
+    {
+        uint16_t ret;
+        __asm__ volatile("inw %w1, %w0"
+                         : "=a"(ret)
+                         : "Nd"(port)
+                         : "memory");
+        return ret;
+    };
+
     static inline void insl_rep(uint16_t port, void *addr, int count)
     {
         __asm__ volatile(
@@ -0,0 +1,324 @@
+#include <block/bcache.h>
+#include <liballoc.h>
+#include <string.h>
+#include <util.h>
+#include <stdio.h>
+
+// Entries and their data are only touched with interrupts off, except for
+// the sectors a writeback is reading out of, which nobody frees under it.
+
+static inline uint64_t blockOf(uint64_t lba)
+{
+    return lba - lba % BCACHE_BLOCK_SECTORS;
+}
+
+static inline uint32_t hashOf(uint64_t block)
+{
+    return (uint32_t)(block / BCACHE_BLOCK_SECTORS) % BCACHE_HASH_SIZE;
+}
+
+// Which sectors of block the io covers, and where they start in each buffer
+static uint8_t sectorMask(struct blk_io *io, uint64_t block, uint32_t *first, uint32_t *io_offset)
+{
+    uint64_t start = io->lba > block ? io->lba : block;
+    uint64_t end = io->lba + io->count < block + BCACHE_BLOCK_SECTORS ? io->lba + io->count : block + BCACHE_BLOCK_SECTORS;
+    *first = (uint32_t)(start - block);
+    *io_offset = (uint32_t)(start - io->lba);
+    uint32_t last = (uint32_t)(end - block);
+    return (uint8_t)(((1u << last) - 1) & ~((1u << *first) - 1));
+}
+
+static struct bcache_entry *lookup(struct bcache *c, uint64_t block)
+{
+    for (struct bcache_entry *e = c->hash[hashOf(block)]; e != NULL; e = e->hash_next)
+    {
+        if (e->lba == block)
+            return e;
+    }
+    return NULL;
+}
+
+static void unhash(struct bcache *c, struct bcache_entry *e)
+{
+    struct bcache_entry **link = &c->hash[hashOf(e->lba)];
+    while (*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+}
+
+static void lruRemove(struct bcache *c, struct bcache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+}
+
+static void lruTouch(struct bcache *c, struct bcache_entry *e)
+{
+    lruRemove(c, e);
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head)
+        c->lru_head->lru_prev = e;
+    else
+        c->lru_tail = e;
+    c->lru_head = e;
+}
+
+struct bcache *bcache_create()
+{
+    struct bcache *c = kmalloc(sizeof(struct bcache));
+    if (c == NULL)
+        return NULL;
+    uint8_t *data = kmalloc(BCACHE_ENTRIES * BCACHE_BLOCK_SIZE);
+    if (data == NULL)
+    {
+        kfree(c);
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(struct bcache));
+    for (int i = 0; i < BCACHE_ENTRIES; i++)
+    {
+        struct bcache_entry *e = &c->entries[i];
+        e->data = data + i * BCACHE_BLOCK_SIZE;
+        e->lru_prev = i > 0 ? &c->entries[i - 1] : NULL;
+        e->lru_next = i < BCACHE_ENTRIES - 1 ? &c->entries[i + 1] : NULL;
+    }
+    c->lru_head = &c->entries[0];
+    c->lru_tail = &c->entries[BCACHE_ENTRIES - 1];
+    return c;
+}
+
+// Writes back the first span of dirty sectors, skipping any that aren't
+// cached. Returns false if there was nothing to do. Interrupts off.
+static bool startWriteback(struct blk_queue *q, struct bcache_entry *e, uint32_t flags)
+{
+    uint8_t dirty = e->dirty & ~e->writeback;
+    if (dirty == 0 || e->writeback)
+        return false;
+
+    uint32_t first = 0, end;
+    while (!(dirty & (1 << first)))
+        first++;
+    end = first + 1;
+    for (uint32_t i = first + 1; i < BCACHE_BLOCK_SECTORS && (e->valid & (1 << i)); i++)
+    {
+        if (dirty & (1 << i))
+            end = i + 1;
+    }
+
+    e->writeback = (uint8_t)(((1u << end) - 1) & ~((1u << first) - 1));
+    e->dirty &= ~e->writeback;
+    e->wb_io.direction = BLK_WRITE;
+    e->wb_io.flags = BLK_NOCACHE;
+    e->wb_io.lba = e->lba + first;
+    e->wb_io.count = end - first;
+    e->wb_io.buf = e->data + first * BLK_SECTOR_SIZE;
+    q->cache->writebacks++;
+
+    restoreInterrupts(flags);
+    blk_submit(q, &e->wb_io);
+    saveInterrupts();
+    return true;
+}
+
+// Interrupts off. Failed sectors go back to dirty.
+static uint8_t finishWriteback(struct blk_queue *q, struct bcache_entry *e, uint32_t flags)
+{
+    restoreInterrupts(flags);
+    uint8_t err = blk_wait(q, &e->wb_io);
+    saveInterrupts();
+    if (err)
+        e->dirty |= e->writeback;
+    e->writeback = 0;
+    return err;
+}
+
+// A slot for block, writing back the least recently used dirty entry if
+// nothing clean is left. NULL if everything is already being written.
+// Interrupts off.
+static struct bcache_entry *allocEntry(struct blk_queue *q, uint64_t block, uint32_t flags)
+{
+    struct bcache *c = q->cache;
+    for (;;)
+    {
+        struct bcache_entry *victim = NULL;
+        for (struct bcache_entry *e = c->lru_tail; e != NULL; e = e->lru_prev)
+        {
+            if (!e->used || (!e->dirty && !e->writeback))
+            {
+                if (e->used)
+                {
+                    unhash(c, e);
+                    c->evictions++;
+                }
+                e->used = true;
+                e->lba = block;
+                e->valid = e->dirty = e->writeback = 0;
+                e->hash_next = c->hash[hashOf(block)];
+                c->hash[hashOf(block)] = e;
+                return e;
+            }
+            if (victim == NULL && !e->writeback)
+                victim = e;
+        }
+        if (victim == NULL)
+            return NULL;
+
+        while (startWriteback(q, victim, flags))
+            finishWriteback(q, victim, flags);
+
+        // Somebody may have cached the block while we slept
+        struct bcache_entry *e = lookup(c, block);
+        if (e)
+            return e;
+    }
+}
+
+bool bcache_write(struct blk_queue *q, struct blk_io *io)
+{
+    struct bcache *c = q->cache;
+    for (uint64_t block = blockOf(io->lba); block < io->lba + io->count; block += BCACHE_BLOCK_SECTORS)
+    {
+        uint32_t flags = saveInterrupts();
+        struct bcache_entry *e = lookup(c, block);
+        if (e == NULL)
+            e = allocEntry(q, block, flags);
+        if (e == NULL)
+        {
+            restoreInterrupts(flags);
+            return false;
+        }
+
+        uint32_t first, offset;
+        uint8_t mask = sectorMask(io, block, &first, &offset);
+        memcpy(e->data + first * BLK_SECTOR_SIZE, io->buf + offset * BLK_SECTOR_SIZE,
+               __builtin_popcount(mask) * BLK_SECTOR_SIZE);
+        e->valid |= mask;
+        e->dirty |= mask;
+        lruTouch(c, e);
+        restoreInterrupts(flags);
+    }
+    c->write_hits++;
+    return true;
+}
+
+void bcache_update(struct bcache *c, struct blk_io *io)
+{
+    uint32_t flags = saveInterrupts();
+    for (uint64_t block = blockOf(io->lba); block < io->lba + io->count; block += BCACHE_BLOCK_SECTORS)
+    {
+        struct bcache_entry *e = lookup(c, block);
+        if (e == NULL)
+            continue;
+        uint32_t first, offset;
+        uint8_t mask = sectorMask(io, block, &first, &offset);
+        memcpy(e->data + first * BLK_SECTOR_SIZE, io->buf + offset * BLK_SECTOR_SIZE,
+               __builtin_popcount(mask) * BLK_SECTOR_SIZE);
+        e->valid |= mask;
+    }
+    restoreInterrupts(flags);
+}
+
+bool bcache_read(struct bcache *c, struct blk_io *io)
+{
+    uint32_t flags = saveInterrupts();
+    uint32_t first, offset;
+    for (uint64_t block = blockOf(io->lba); block < io->lba + io->count; block += BCACHE_BLOCK_SECTORS)
+    {
+        struct bcache_entry *e = lookup(c, block);
+        uint8_t mask = sectorMask(io, block, &first, &offset);
+        if (e == NULL || (e->valid & mask) != mask)
+        {
+            restoreInterrupts(flags);
+            return false;
+        }
+    }
+
+    for (uint64_t block = blockOf(io->lba); block < io->lba + io->count; block += BCACHE_BLOCK_SECTORS)
+    {
+        struct bcache_entry *e = lookup(c, block);
+        uint8_t mask = sectorMask(io, block, &first, &offset);
+        memcpy(io->buf + offset * BLK_SECTOR_SIZE, e->data + first * BLK_SECTOR_SIZE,
+               __builtin_popcount(mask) * BLK_SECTOR_SIZE);
+        lruTouch(c, e);
+    }
+    c->read_hits++;
+    restoreInterrupts(flags);
+    return true;
+}
+
+void bcache_overlay(struct bcache *c, struct blk_io *io)
+{
+    uint32_t flags = saveInterrupts();
+    for (uint64_t block = blockOf(io->lba); block < io->lba + io->count; block += BCACHE_BLOCK_SECTORS)
+    {
+        struct bcache_entry *e = lookup(c, block);
+        if (e == NULL)
+            continue;
+        uint32_t first, offset;
+        uint8_t mask = sectorMask(io, block, &first, &offset) & e->valid;
+        for (uint32_t i = first; mask >> i; i++, offset++)
+        {
+            if (mask & (1 << i))
+                memcpy(io->buf + offset * BLK_SECTOR_SIZE, e->data + i * BLK_SECTOR_SIZE, BLK_SECTOR_SIZE);
+        }
+    }
+    restoreInterrupts(flags);
+}
+
+uint8_t bcache_writeback(struct blk_queue *q)
+{
+    struct bcache *c = q->cache;
+    bool started[BCACHE_ENTRIES];
+    uint8_t err = 0;
+
+    // An entry with holes between dirty sectors takes one pass per span
+    for (int pass = 0; pass < BCACHE_BLOCK_SECTORS / 2; pass++)
+    {
+        bool any = false;
+        blk_plug(q);
+        uint32_t flags = saveInterrupts();
+        for (int i = 0; i < BCACHE_ENTRIES; i++)
+        {
+            started[i] = c->entries[i].used && startWriteback(q, &c->entries[i], flags);
+            any |= started[i];
+        }
+        restoreInterrupts(flags);
+        blk_unplug(q);
+
+        flags = saveInterrupts();
+        for (int i = 0; i < BCACHE_ENTRIES; i++)
+        {
+            if (started[i])
+            {
+                uint8_t e = finishWriteback(q, &c->entries[i], flags);
+                if (err == 0)
+                    err = e;
+            }
+        }
+        restoreInterrupts(flags);
+        if (!any || err)
+            break;
+    }
+    return err;
+}
+
+void bcache_report(struct blk_queue *q)
+{
+    struct bcache *c = q->cache;
+    uint32_t dirty = 0;
+    for (int i = 0; i < BCACHE_ENTRIES; i++)
+    {
+        if (c->entries[i].used && c->entries[i].dirty)
+            dirty++;
+    }
+    printf("%s cache: %u writes absorbed, %u read hits, %u writebacks, %u evictions, %u dirty\n", q->name,
+           c->write_hits, c->read_hits, c->writebacks, c->evictions, dirty);
+}
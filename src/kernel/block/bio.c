@@ -0,0 +1,254 @@
+#include <block/bio.h>
+#include <scheduler/coroutine.h>
+#include <scheduler/waitqueue.h>
+#include <liballoc.h>
+#include <ktime.h>
+#include <util.h>
+#include <string.h>
+#include <stdio.h>
+
+void bio_init(struct bio *bio, block_device_t *bdev, uint8_t direction, uint64_t sector)
+{
+    memset(bio, 0, sizeof(struct bio));
+    bio->bdev = bdev;
+    bio->direction = direction;
+    bio->sector = sector;
+}
+
+// Largest vector the queue takes in one request, in whole device blocks
+static uint32_t vecMax(block_device_t *bdev)
+{
+    uint32_t per = bdev->block_size / BLK_SECTOR_SIZE;
+    uint32_t max = bdev->queue->max_sectors - bdev->queue->max_sectors % per;
+    return max ? max : per;
+}
+
+bool bio_add(struct bio *bio, void *buf, uint32_t sectors)
+{
+    if (sectors == 0 || bio->bdev == NULL || bio->bdev->queue == NULL)
+        return false;
+    uint32_t max = vecMax(bio->bdev);
+    if (bio->vcnt + (sectors + max - 1) / max > BIO_MAX_VECS)
+        return false;
+
+    uint8_t *p = buf;
+    while (sectors)
+    {
+        uint32_t n = sectors < max ? sectors : max;
+        bio->vecs[bio->vcnt].buf = p;
+        bio->vecs[bio->vcnt].sectors = n;
+        bio->vcnt++;
+        bio->sectors += n;
+        p += n * BLK_SECTOR_SIZE;
+        sectors -= n;
+    }
+    return true;
+}
+
+// Interrupts off
+static void bioPut(struct bio *bio)
+{
+    if (--bio->remaining)
+        return;
+    bio->done = true;
+    if (bio->end_io)
+        bio->end_io(bio);
+}
+
+static void bioEndIo(struct blk_io *io)
+{
+    struct bio *bio = io->private;
+    if (io->error && bio->error == 0)
+        bio->error = io->error;
+    bioPut(bio);
+}
+
+static uint8_t bioCheck(struct bio *bio)
+{
+    block_device_t *bdev = bio->bdev;
+    if (bdev == NULL || bdev->queue == NULL)
+        return BIO_ERR_NODEV;
+    if (bio->direction == BLK_WRITE && bio->sectors && bdev->readonly)
+        return BIO_ERR_READONLY;
+    uint32_t per = bdev->block_size / BLK_SECTOR_SIZE;
+    if (bio->sector % per || bio->sectors % per)
+        return BIO_ERR_ALIGN;
+    if (bdev->sectors && bio->sector + bio->sectors > bdev->sectors)
+        return BIO_ERR_RANGE;
+    return 0;
+}
+
+void bio_submit(struct bio *bio)
+{
+    bio->done = false;
+    bio->error = bioCheck(bio);
+    bio->nios = 0;
+    if (bio->error == 0)
+        bio->nios = bio->vcnt ? bio->vcnt : (bio->flags & BLK_PREFLUSH) ? 1 : 0;
+    // Held until everything is queued, so a fast completion can't finish
+    // the bio halfway through
+    bio->remaining = bio->nios + 1;
+
+    if (bio->nios)
+    {
+        struct blk_queue *q = bio->bdev->queue;
+        uint64_t lba = bio->sector;
+        blk_plug(q);
+        for (uint32_t i = 0; i < bio->nios; i++)
+        {
+            struct blk_io *io = &bio->ios[i];
+            io->direction = bio->direction;
+            io->flags = bio->flags & (BLK_FUA | BLK_NOCACHE);
+            if (i == 0)
+                io->flags |= bio->flags & BLK_PREFLUSH;
+            io->lba = lba;
+            io->count = bio->vcnt ? bio->vecs[i].sectors : 0;
+            io->buf = bio->vcnt ? bio->vecs[i].buf : NULL;
+            lba += io->count;
+            blk_submit_end(q, io, bioEndIo, bio);
+        }
+        blk_unplug(q);
+    }
+
+    uint32_t flags = saveInterrupts();
+    bioPut(bio);
+    restoreInterrupts(flags);
+}
+
+uint8_t bio_wait(struct bio *bio)
+{
+    for (uint32_t i = 0; i < bio->nios; i++)
+        blk_wait(bio->bdev->queue, &bio->ios[i]);
+    return bio->error;
+}
+
+uint8_t bdev_rw(block_device_t *bdev, uint8_t direction, uint64_t sector, uint32_t count, void *buf)
+{
+    if (bdev == NULL || bdev->queue == NULL)
+        return BIO_ERR_NODEV;
+
+    struct bio bio;
+    uint8_t *p = buf;
+    uint32_t max = vecMax(bdev);
+    uint8_t err = 0;
+    while (count && err == 0)
+    {
+        bio_init(&bio, bdev, direction, sector);
+        while (count && bio_add(&bio, p, count < max ? count : max))
+        {
+            uint32_t n = count < max ? count : max;
+            p += n * BLK_SECTOR_SIZE;
+            sector += n;
+            count -= n;
+        }
+        bio_submit(&bio);
+        err = bio_wait(&bio);
+    }
+    return err;
+}
+
+void bio_end_wake(struct bio *bio)
+{
+    coroutine_wake((struct coroutine *)bio->private);
+}
+
+// One reader of the benchmark. It takes every BIO_BENCH_COROUTINES-th chunk,
+// so all of them have a bio out at the same time.
+struct bio_bench_reader
+{
+    struct coroutine co;
+    struct bio bio;
+    block_device_t *bdev;
+    uint8_t *buf;
+    uint64_t sector;
+    uint64_t end;
+    uint32_t chunk; // sectors per read
+    bool failed;
+};
+
+static struct wait_queue bench_wq = WAIT_QUEUE_INIT;
+static volatile uint32_t bench_running;
+
+static int bioBenchRead(struct coroutine *co)
+{
+    struct bio_bench_reader *r = (struct bio_bench_reader *)co;
+    CO_BEGIN(co);
+    for (; r->sector < r->end; r->sector += (uint64_t)r->chunk * BIO_BENCH_COROUTINES)
+    {
+        bio_init(&r->bio, r->bdev, BLK_READ, r->sector);
+        r->bio.flags = BLK_NOCACHE;
+        r->bio.end_io = bio_end_wake;
+        r->bio.private = co;
+        bio_add(&r->bio, r->buf, r->chunk);
+        bio_submit(&r->bio);
+        CO_WAIT_UNTIL(co, r->bio.done);
+        r->failed |= r->bio.error != 0;
+    }
+    CO_END(co);
+}
+
+static void bioBenchDone(struct coroutine *co)
+{
+    (void)co;
+    uint32_t flags = saveInterrupts();
+    if (--bench_running == 0)
+        wait_queue_wake_all(&bench_wq);
+    restoreInterrupts(flags);
+}
+
+void bio_coroutine_benchmark(block_device_t *bdev, uint32_t count)
+{
+    if (bdev == NULL || bdev->queue == NULL)
+        return;
+    uint32_t per = bdev->block_size / BLK_SECTOR_SIZE;
+    uint32_t chunk = (BIO_BENCH_SECTORS + per - 1) / per * per;
+    if (bdev->sectors && count > bdev->sectors)
+        count = (uint32_t)bdev->sectors;
+    count -= count % chunk;
+    if (count == 0)
+        return;
+
+    struct bio_bench_reader *readers = kmalloc(BIO_BENCH_COROUTINES * sizeof(struct bio_bench_reader));
+    uint8_t *buffer = kmalloc(BIO_BENCH_COROUTINES * chunk * BLK_SECTOR_SIZE);
+    if (readers == NULL || buffer == NULL)
+    {
+        if (readers)
+            kfree(readers);
+        if (buffer)
+            kfree(buffer);
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    bench_running = BIO_BENCH_COROUTINES;
+    for (uint32_t i = 0; i < BIO_BENCH_COROUTINES; i++)
+    {
+        struct bio_bench_reader *r = &readers[i];
+        coroutine_setup(&r->co, bioBenchRead, bioBenchDone);
+        r->bdev = bdev;
+        r->buf = buffer + i * chunk * BLK_SECTOR_SIZE;
+        r->sector = (uint64_t)i * chunk;
+        r->end = count;
+        r->chunk = chunk;
+        r->failed = false;
+        coroutine_start(&r->co);
+    }
+
+    uint32_t flags = saveInterrupts();
+    while (bench_running)
+        wait_queue_sleep(&bench_wq);
+    restoreInterrupts(flags);
+    uint64_t cycles = rdtsc() - start;
+
+    bool failed = false;
+    for (uint32_t i = 0; i < BIO_BENCH_COROUTINES; i++)
+        failed |= readers[i].failed;
+    kfree(buffer);
+    kfree(readers);
+
+    uint32_t khz = ktime_tsc_khz();
+    uint64_t kb = (uint64_t)count / 2;
+    uint64_t us = khz ? cycles * 1000 / khz : 0;
+    printf("bio coroutines %s: %u readers, %llu KB in %llu us, %llu KB/s%s\n", bdev->name, BIO_BENCH_COROUTINES,
+           kb, us, us ? kb * 1000000 / us : 0, failed ? ", with errors" : "");
+}
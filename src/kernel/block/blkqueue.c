@@ -0,0 +1,429 @@
+#include <block/blkqueue.h>
+#include <block/bcache.h>
+#include <ktime.h>
+#include <timer.h>
+#include <util.h>
+#include <stdio.h>
+
+// Everything here is touched with interrupts off. The transfer itself runs
+// with them restored, whoever is dispatching sleeps in the driver.
+
+static bool blkCanSleep(struct blk_queue *q, uint32_t flags)
+{
+    return !q->polled && schedulerEnabled && (flags & 0x200);
+}
+
+static void initQueue(struct blk_queue *q, const char *name, void *dev, uint32_t max_sectors, uint32_t depth)
+{
+    q->name = name;
+    q->transfer = NULL;
+    q->start = NULL;
+    q->poll = NULL;
+    q->commit = NULL;
+    q->polled = false;
+    q->dev = dev;
+    q->max_sectors = max_sectors;
+    q->depth = depth;
+    q->virt_boundary = 0;
+
+    q->free = NULL;
+    for (int i = BLK_QUEUE_DEPTH - 1; i >= 0; i--)
+    {
+        q->pool[i].next = q->free;
+        q->free = &q->pool[i];
+    }
+    q->sorted = NULL;
+    q->fifo_head = q->fifo_tail = NULL;
+    q->head_pos = 0;
+    q->plugged = 0;
+    q->running = false;
+    q->inflight = 0;
+    q->ordered = false;
+    wait_queue_init(&q->wq);
+    q->cache = NULL;
+
+    q->ios = q->requests = q->back_merges = q->front_merges = q->expired = q->barriers = 0;
+    q->peak_inflight = 0;
+    q->sectors = 0;
+}
+
+void blk_queue_init(struct blk_queue *q, const char *name, blk_transfer_t transfer, void *dev, uint32_t max_sectors)
+{
+    initQueue(q, name, dev, max_sectors, 1);
+    q->transfer = transfer;
+}
+
+void blk_queue_init_async(struct blk_queue *q, const char *name, blk_start_t start, blk_poll_t poll,
+                          blk_commit_t commit, void *dev, uint32_t max_sectors, uint32_t depth)
+{
+    // Every request out at once still has to leave some to merge into
+    if (depth > BLK_QUEUE_DEPTH / 2)
+        depth = BLK_QUEUE_DEPTH / 2;
+    initQueue(q, name, dev, max_sectors, depth ? depth : 1);
+    q->start = start;
+    q->poll = poll;
+    q->commit = commit;
+}
+
+bool blk_queue_enable_cache(struct blk_queue *q)
+{
+    if (q->cache == NULL)
+        q->cache = bcache_create();
+    return q->cache != NULL;
+}
+
+static void unlinkRequest(struct blk_queue *q, struct blk_request *rq)
+{
+    struct blk_request **link = &q->sorted;
+    while (*link != rq)
+        link = &(*link)->next;
+    *link = rq->next;
+
+    struct blk_request *prev = NULL;
+    link = &q->fifo_head;
+    while (*link != rq)
+    {
+        prev = *link;
+        link = &(*link)->fifo_next;
+    }
+    *link = rq->fifo_next;
+    if (q->fifo_tail == rq)
+        q->fifo_tail = prev;
+}
+
+// Oldest request if it's past its deadline, otherwise the next one up from
+// where the disk head is, wrapping to the lowest LBA at the end.
+static struct blk_request *pickRequest(struct blk_queue *q)
+{
+    if (q->sorted == NULL)
+        return NULL;
+
+    struct blk_request *rq = q->fifo_head;
+    if ((int64_t)(ktime_get_ns() - rq->deadline) >= 0)
+        q->expired++;
+    else
+    {
+        rq = q->sorted;
+        for (struct blk_request *r = q->sorted; r != NULL; r = r->next)
+        {
+            if (r->lba >= q->head_pos)
+            {
+                rq = r;
+                break;
+            }
+        }
+    }
+    unlinkRequest(q, rq);
+    return rq;
+}
+
+// Interrupts off
+static void endIo(struct blk_io *io, uint8_t err)
+{
+    io->error = err;
+    io->done = true;
+    if (io->end_io)
+        io->end_io(io);
+}
+
+// Interrupts off
+static void completeRequest(struct blk_queue *q, struct blk_request *rq, uint8_t err)
+{
+    struct blk_io *io = rq->head;
+    while (io != NULL)
+    {
+        struct blk_io *next = io->next;
+        // Reads see what's newer in the cache than on the disk
+        if (err == 0 && q->cache && io->direction == BLK_READ && !(io->flags & BLK_NOCACHE))
+            bcache_overlay(q->cache, io);
+        endIo(io, err);
+        io = next;
+    }
+    if (rq->flags & (BLK_PREFLUSH | BLK_FUA))
+        q->ordered = false;
+    q->inflight--;
+    rq->next = q->free;
+    q->free = rq;
+    wait_queue_wake_all(&q->wq);
+}
+
+void blk_complete(struct blk_queue *q, struct blk_request *rq, uint8_t error)
+{
+    completeRequest(q, rq, error);
+}
+
+// Hands one request to the driver. A synchronous driver has finished it
+// by the time this returns. Called and returns with interrupts off, flags
+// are the caller's.
+static void dispatch(struct blk_queue *q, struct blk_request *rq, uint32_t flags)
+{
+    struct blk_segment segs[BLK_MAX_SEGMENTS];
+    uint32_t nsegs = 0;
+    for (struct blk_io *io = rq->head; io != NULL; io = io->next)
+    {
+        if (io->count == 0)
+            continue;
+        segs[nsegs].buf = io->buf;
+        segs[nsegs].sectors = io->count;
+        nsegs++;
+    }
+    q->requests++;
+    q->sectors += rq->count;
+    if (rq->count)
+        q->head_pos = rq->lba + rq->count;
+    if (rq->flags & (BLK_PREFLUSH | BLK_FUA))
+        q->ordered = true;
+    if (++q->inflight > q->peak_inflight)
+        q->peak_inflight = q->inflight;
+
+    restoreInterrupts(flags);
+    uint8_t err;
+    if (q->start)
+        err = q->start(q->dev, rq, segs, nsegs);
+    else
+        err = q->transfer(q->dev, rq->direction, rq->flags, rq->lba, segs, nsegs);
+    saveInterrupts();
+
+    if (q->transfer || err)
+        completeRequest(q, rq, err);
+}
+
+// Lets the driver push out what the last starts queued up
+static void commitQueue(struct blk_queue *q, uint32_t flags)
+{
+    if (q->commit == NULL)
+        return;
+    restoreInterrupts(flags);
+    q->commit(q->dev);
+    saveInterrupts();
+}
+
+static bool canDispatch(struct blk_queue *q)
+{
+    return q->sorted != NULL && q->inflight < q->depth && !q->ordered;
+}
+
+// Dispatches until the queue is empty or the driver is full. Called and
+// returns with interrupts off, flags are the caller's.
+static void runQueue(struct blk_queue *q, uint32_t flags)
+{
+    bool started = false;
+    q->running = true;
+    while (canDispatch(q))
+    {
+        dispatch(q, pickRequest(q), flags);
+        started = true;
+    }
+    if (started)
+        commitQueue(q, flags);
+    q->running = false;
+}
+
+// Waits for something to happen on the queue, or makes it happen
+static void waitQueue(struct blk_queue *q, uint32_t flags)
+{
+    if (!q->running && canDispatch(q))
+        runQueue(q, flags);
+    else if (blkCanSleep(q, flags))
+        wait_queue_sleep(&q->wq);
+    else
+    {
+        if (q->poll && q->inflight)
+            q->poll(q->dev);
+        restoreInterrupts(flags);
+        asm volatile("pause");
+        saveInterrupts();
+    }
+}
+
+static void initRequest(struct blk_request *rq, struct blk_io *io)
+{
+    rq->direction = io->direction;
+    rq->flags = io->flags;
+    rq->lba = io->lba;
+    rq->count = io->count;
+    rq->deadline = ktime_get_ns() +
+                   (io->direction == BLK_READ ? BLK_READ_DEADLINE_MS : BLK_WRITE_DEADLINE_MS) * NSEC_PER_MSEC;
+    rq->head = rq->tail = io;
+    rq->nios = 1;
+}
+
+// Everything queued so far goes out first, then this on its own
+static void submitBarrier(struct blk_queue *q, struct blk_io *io, uint32_t flags)
+{
+    while (q->sorted != NULL || q->running || q->inflight)
+        waitQueue(q, flags);
+
+    struct blk_request *rq = q->free;
+    q->free = rq->next;
+    initRequest(rq, io);
+    q->barriers++;
+
+    q->running = true;
+    dispatch(q, rq, flags);
+    commitQueue(q, flags);
+    q->running = false;
+
+    // Whatever piled up behind it, once an async barrier has completed
+    if (!q->plugged)
+        runQueue(q, flags);
+}
+
+// Whether b's buffer can follow a's in one request
+static bool buffersJoin(struct blk_queue *q, struct blk_io *a, struct blk_io *b)
+{
+    uint32_t end = (uint32_t)a->buf + a->count * BLK_SECTOR_SIZE;
+    return ((end | (uint32_t)b->buf) & q->virt_boundary) == 0;
+}
+
+static bool tryMerge(struct blk_queue *q, struct blk_io *io)
+{
+    for (struct blk_request *rq = q->sorted; rq != NULL; rq = rq->next)
+    {
+        if (rq->direction != io->direction || rq->nios >= BLK_MAX_SEGMENTS || rq->count + io->count > q->max_sectors)
+            continue;
+
+        if (rq->lba + rq->count == io->lba && buffersJoin(q, rq->tail, io))
+        {
+            rq->tail->next = io;
+            rq->tail = io;
+            rq->count += io->count;
+            rq->nios++;
+            q->back_merges++;
+            return true;
+        }
+        if (io->lba + io->count == rq->lba && buffersJoin(q, io, rq->head))
+        {
+            io->next = rq->head;
+            rq->head = io;
+            rq->lba = io->lba;
+            rq->count += io->count;
+            rq->nios++;
+            q->front_merges++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void blk_submit(struct blk_queue *q, struct blk_io *io)
+{
+    blk_submit_end(q, io, NULL, NULL);
+}
+
+void blk_submit_end(struct blk_queue *q, struct blk_io *io, blk_end_io_t end_io, void *private)
+{
+    io->done = false;
+    io->error = 0;
+    io->next = NULL;
+    io->end_io = end_io;
+    io->private = private;
+
+    uint32_t flags;
+    if (q->cache && !(io->flags & BLK_NOCACHE))
+    {
+        if ((io->direction == BLK_READ && bcache_read(q->cache, io)) ||
+            (io->direction == BLK_WRITE && !(io->flags & (BLK_FUA | BLK_PREFLUSH)) && bcache_write(q, io)))
+        {
+            flags = saveInterrupts();
+            endIo(io, 0);
+            restoreInterrupts(flags);
+            return;
+        }
+        if (io->direction == BLK_WRITE)
+            bcache_update(q->cache, io);
+    }
+
+    flags = saveInterrupts();
+    q->ios++;
+
+    if (io->flags & (BLK_FUA | BLK_PREFLUSH))
+        submitBarrier(q, io, flags);
+    else if (!tryMerge(q, io))
+    {
+        while (q->free == NULL)
+            waitQueue(q, flags);
+
+        struct blk_request *rq = q->free;
+        q->free = rq->next;
+        initRequest(rq, io);
+
+        struct blk_request **link = &q->sorted;
+        while (*link != NULL && (*link)->lba <= rq->lba)
+            link = &(*link)->next;
+        rq->next = *link;
+        *link = rq;
+
+        rq->fifo_next = NULL;
+        if (q->fifo_tail)
+            q->fifo_tail->fifo_next = rq;
+        else
+            q->fifo_head = rq;
+        q->fifo_tail = rq;
+    }
+
+    if (!q->plugged && !q->running)
+        runQueue(q, flags);
+    restoreInterrupts(flags);
+}
+
+uint8_t blk_wait(struct blk_queue *q, struct blk_io *io)
+{
+    uint32_t flags = saveInterrupts();
+    while (!io->done)
+        waitQueue(q, flags);
+    restoreInterrupts(flags);
+    return io->error;
+}
+
+uint8_t blk_rw(struct blk_queue *q, uint8_t direction, uint64_t lba, uint32_t count, void *buf)
+{
+    struct blk_io io;
+    io.direction = direction;
+    io.flags = 0;
+    io.lba = lba;
+    io.count = count;
+    io.buf = buf;
+    blk_submit(q, &io);
+    return blk_wait(q, &io);
+}
+
+void blk_plug(struct blk_queue *q)
+{
+    uint32_t flags = saveInterrupts();
+    q->plugged++;
+    restoreInterrupts(flags);
+}
+
+void blk_unplug(struct blk_queue *q)
+{
+    uint32_t flags = saveInterrupts();
+    if (q->plugged > 0 && --q->plugged == 0 && !q->running)
+        runQueue(q, flags);
+    restoreInterrupts(flags);
+}
+
+uint8_t blk_sync(struct blk_queue *q)
+{
+    uint8_t err = q->cache ? bcache_writeback(q) : 0;
+
+    struct blk_io io;
+    io.direction = BLK_WRITE;
+    io.flags = BLK_PREFLUSH | BLK_NOCACHE;
+    io.lba = 0;
+    io.count = 0;
+    io.buf = NULL;
+    blk_submit(q, &io);
+    uint8_t flush_err = blk_wait(q, &io);
+    return err ? err : flush_err;
+}
+
+void blk_queue_report(struct blk_queue *q)
+{
+    printf("%s: %u ios in %u requests, %u back/%u front merges, %u expired, %u barriers, %llu sectors\n", q->name,
+           q->ios, q->requests, q->back_merges, q->front_merges, q->expired, q->barriers, q->sectors);
+    if (q->start)
+        printf("%s: up to %u of %u requests in flight\n", q->name, q->peak_inflight, q->depth);
+    if (q->cache)
+        bcache_report(q);
+}
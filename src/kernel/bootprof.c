@@ -0,0 +1,92 @@
+#include <bootprof.h>
+#include <ktime.h>
+#include <util.h>
+#include <stdio.h>
+
+struct boot_stage
+{
+    const char *name;
+    uint64_t start; // cycles since bootprof_init
+    uint64_t cycles;
+    uint8_t depth;
+};
+
+static struct boot_stage stages[BOOTPROF_MAX_STAGES];
+static int num_stages = 0;
+static int depth = 0;
+static uint64_t boot_tsc = 0;
+
+void bootprof_init()
+{
+    boot_tsc = rdtsc();
+}
+
+int bootprof_begin(const char *name)
+{
+    if (num_stages >= BOOTPROF_MAX_STAGES)
+        return -1;
+
+    struct boot_stage *stage = &stages[num_stages];
+    stage->name = name;
+    stage->depth = depth++;
+    stage->cycles = 0;
+    stage->start = rdtsc() - boot_tsc;
+    return num_stages++;
+}
+
+void bootprof_end(int stage)
+{
+    uint64_t now = rdtsc() - boot_tsc;
+    if (stage < 0)
+        return;
+    stages[stage].cycles = now - stages[stage].start;
+    depth--;
+}
+
+static void serialOut(char c, void *arg)
+{
+    (void)arg;
+    serial_putc(c);
+}
+
+static uint64_t cyclesToUs(uint64_t cycles)
+{
+    uint32_t khz = ktime_tsc_khz();
+    return khz ? cycles * 1000 / khz : 0;
+}
+
+void bootprof_report()
+{
+    uint64_t total = rdtsc() - boot_tsc;
+
+    // Sort slowest first, by index so the stage table keeps boot order.
+    int order[BOOTPROF_MAX_STAGES];
+    for (int i = 0; i < num_stages; i++)
+    {
+        int j = i;
+        while (j > 0 && stages[order[j - 1]].cycles < stages[i].cycles)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    printf("--- Boot profile: %llu us total ---\n", cyclesToUs(total));
+    for (int i = 0; i < num_stages; i++)
+    {
+        struct boot_stage *stage = &stages[order[i]];
+        uint32_t permille = total ? (uint32_t)(stage->cycles * 1000 / total) : 0;
+        printf("%8llu us %3u.%u%%  %s%s\n", cyclesToUs(stage->cycles), permille / 10, permille % 10,
+               stage->depth ? "  " : "", stage->name);
+    }
+
+    // name,depth,start_cycles,cycles,start_us,us
+    fctprintf(serialOut, 0, "bootprof,total,0,0,%llu,0,%llu\n", total, cyclesToUs(total));
+    for (int i = 0; i < num_stages; i++)
+    {
+        struct boot_stage *stage = &stages[i];
+        fctprintf(serialOut, 0, "bootprof,%s,%u,%llu,%llu,%llu,%llu\n", stage->name, stage->depth, stage->start,
+                  stage->cycles, cyclesToUs(stage->start), cyclesToUs(stage->cycles));
+    }
+}
@@ -0,0 +1,636 @@
+#include <drivers/ahci.h>
+#include <drivers/atadefs.h>
+#include <drivers/device.h>
+#include <memory.h>
+#include <liballoc.h>
+#include <idt.h>
+#include <ktime.h>
+#include <util.h>
+#include <string.h>
+#include <stdio.h>
+
+#define AHCI_MMIO_SIZE 0x1100 // generic registers plus 32 ports
+#define AHCI_FIS_OFFSET 1024  // received FIS area, after the command list
+#define AHCI_PORT_IRQS (AHCI_PxIS_DHRS | AHCI_PxIS_SDBS | AHCI_PxIS_ERRORS)
+
+static ahci_controller_t controller;
+static ahci_port_t *disks[AHCI_MAX_DISKS];
+static uint32_t numDisks = 0;
+static const char *diskNames[AHCI_MAX_DISKS] = {"sd0", "sd1", "sd2", "sd3"};
+
+static inline uint32_t regRead(volatile uint8_t *base, uint32_t reg)
+{
+    return *(volatile uint32_t *)(base + reg);
+}
+
+static inline void regWrite(volatile uint8_t *base, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(base + reg) = value;
+}
+
+static inline uint32_t portRead(ahci_port_t *p, uint32_t reg)
+{
+    return regRead(p->regs, reg);
+}
+
+static inline void portWrite(ahci_port_t *p, uint32_t reg, uint32_t value)
+{
+    regWrite(p->regs, reg, value);
+}
+
+// Spins until (reg & mask) == value, false if that takes over timeout_ms
+static bool waitReg(volatile uint8_t *base, uint32_t reg, uint32_t mask, uint32_t value, uint32_t timeout_ms)
+{
+    uint64_t deadline = ktime_get_ns() + (uint64_t)timeout_ms * NSEC_PER_MSEC;
+    while ((regRead(base, reg) & mask) != value)
+    {
+        if (ktime_get_ns() >= deadline)
+            return false;
+        asm volatile("pause");
+    }
+    return true;
+}
+
+static void delayMs(uint32_t ms)
+{
+    uint64_t until = ktime_get_ns() + (uint64_t)ms * NSEC_PER_MSEC;
+    while (ktime_get_ns() < until)
+        asm volatile("pause");
+}
+
+// Command list and FIS receive engines off, which also drops whatever was
+// in PxCI and PxSACT
+static bool portStop(ahci_port_t *p)
+{
+    portWrite(p, AHCI_PxCMD, portRead(p, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+    if (!waitReg(p->regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500))
+        return false;
+    portWrite(p, AHCI_PxCMD, portRead(p, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+    return waitReg(p->regs, AHCI_PxCMD, AHCI_PxCMD_FR, 0, 500);
+}
+
+// ST may only go on once the drive has settled
+static void portStart(ahci_port_t *p)
+{
+    portWrite(p, AHCI_PxCMD, portRead(p, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+    waitReg(p->regs, AHCI_PxTFD, ATA_SR_BSY | ATA_SR_DRQ, 0, 1000);
+    portWrite(p, AHCI_PxCMD, portRead(p, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+static void portComReset(ahci_port_t *p)
+{
+    portWrite(p, AHCI_PxSCTL, (portRead(p, AHCI_PxSCTL) & ~0xF) | 1);
+    delayMs(1);
+    portWrite(p, AHCI_PxSCTL, portRead(p, AHCI_PxSCTL) & ~0xF);
+    waitReg(p->regs, AHCI_PxSSTS, 0xF, AHCI_SSTS_DET_PRESENT, 1000);
+    portWrite(p, AHCI_PxSERR, 0xFFFFFFFF);
+}
+
+static inline ahci_cmd_table_t *slotTable(ahci_port_t *p, uint32_t slot)
+{
+    return (ahci_cmd_table_t *)(p->tables + slot * AHCI_CMD_TABLE_SIZE);
+}
+
+// Puts the slot's next stage on the wire. Interrupts off.
+static void issueStage(ahci_port_t *p, uint32_t slot)
+{
+    struct ahci_slot *s = &p->slots[slot];
+    struct blk_request *rq = s->rq;
+    ahci_cmd_header_t *header = &p->cmd_list[slot];
+    ahci_fis_h2d_t *fis = (ahci_fis_h2d_t *)slotTable(p, slot)->cfis;
+    uint8_t stage = s->stages & -s->stages;
+    bool queued = false;
+
+    memset(fis, 0, sizeof(ahci_fis_h2d_t));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->device = FIS_DEVICE_LBA;
+    header->flags = sizeof(ahci_fis_h2d_t) / 4;
+    header->prdtl = 0;
+    header->prdbc = 0;
+
+    if (stage == AHCI_STAGE_DATA)
+    {
+        fis->lba0 = (uint8_t)rq->lba;
+        fis->lba1 = (uint8_t)(rq->lba >> 8);
+        fis->lba2 = (uint8_t)(rq->lba >> 16);
+        fis->lba3 = (uint8_t)(rq->lba >> 24);
+        fis->lba4 = (uint8_t)(rq->lba >> 32);
+        fis->lba5 = (uint8_t)(rq->lba >> 40);
+        if (p->ncq)
+        {
+            // The count moves to the feature register, the tag takes its place
+            fis->command = rq->direction == BLK_WRITE ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+            fis->feature_low = (uint8_t)rq->count;
+            fis->feature_high = (uint8_t)(rq->count >> 8);
+            fis->count_low = (uint8_t)(slot << 3);
+            if (rq->direction == BLK_WRITE && (rq->flags & BLK_FUA))
+                fis->device |= FIS_DEVICE_FUA;
+            queued = true;
+        }
+        else
+        {
+            fis->command = rq->direction == BLK_WRITE ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+            fis->count_low = (uint8_t)rq->count;
+            fis->count_high = (uint8_t)(rq->count >> 8);
+        }
+        if (rq->direction == BLK_WRITE)
+            header->flags |= AHCI_CMD_WRITE;
+        header->prdtl = s->prdtl;
+    }
+    else
+        fis->command = ATA_CMD_CACHE_FLUSH_EXT;
+
+    // The HBA fetches the header and table once it sees the CI bit
+    asm volatile("" ::: "memory");
+    if (queued)
+        portWrite(p, AHCI_PxSACT, 1u << slot);
+    portWrite(p, AHCI_PxCI, 1u << slot);
+    p->commands++;
+}
+
+// Interrupts off. A slot's stages all go out back to back, the bit that
+// just finished is the lowest one left.
+static void finishSlot(ahci_port_t *p, uint32_t slot, uint8_t err)
+{
+    struct ahci_slot *s = &p->slots[slot];
+    s->stages &= s->stages - 1;
+    if (err == 0 && s->stages)
+    {
+        issueStage(p, slot);
+        return;
+    }
+
+    struct blk_request *rq = s->rq;
+    s->rq = NULL;
+    s->stages = 0;
+    p->active &= ~(1u << slot);
+    blk_complete(&p->queue, rq, err);
+}
+
+// The HBA stops the port on any error and the drive drops its whole NCQ
+// queue, so everything outstanding fails and the port starts over.
+// Interrupts off.
+static void portRecover(ahci_port_t *p, uint8_t err)
+{
+    printf("AHCI: port %u error %u, IS 0x%x TFD 0x%x SERR 0x%x, failing 0x%x\n", p->num, err, portRead(p, AHCI_PxIS),
+           portRead(p, AHCI_PxTFD), portRead(p, AHCI_PxSERR), p->active);
+
+    portStop(p);
+    portWrite(p, AHCI_PxSERR, 0xFFFFFFFF);
+    portWrite(p, AHCI_PxIS, 0xFFFFFFFF);
+    if (portRead(p, AHCI_PxTFD) & (ATA_SR_BSY | ATA_SR_DRQ))
+        portComReset(p);
+    portStart(p);
+
+    uint32_t failed = p->active;
+    while (failed)
+    {
+        uint32_t slot = __builtin_ctz(failed);
+        failed &= failed - 1;
+        p->errors++;
+        finishSlot(p, slot, err);
+    }
+}
+
+// Completes whatever the HBA and drive have let go of. Interrupts off.
+static void portService(ahci_port_t *p)
+{
+    uint32_t is = portRead(p, AHCI_PxIS);
+    portWrite(p, AHCI_PxIS, is);
+    if (is & AHCI_PxIS_ERRORS)
+    {
+        portRecover(p, (is & AHCI_PxIS_TFES) ? AHCI_ERR_DEVICE : AHCI_ERR_HOST);
+        return;
+    }
+
+    // A queued command is done once the drive clears its SACT bit, the
+    // others once the HBA clears CI
+    uint32_t done = p->active & ~(portRead(p, AHCI_PxSACT) | portRead(p, AHCI_PxCI));
+    if (done)
+        p->progress = ktime_get_ns();
+    while (done)
+    {
+        uint32_t slot = __builtin_ctz(done);
+        done &= done - 1;
+        finishSlot(p, slot, 0);
+    }
+}
+
+static void portCheckTimeout(ahci_port_t *p)
+{
+    if (p->active && ktime_get_ns() - p->progress >= (uint64_t)AHCI_TIMEOUT_MS * NSEC_PER_MSEC)
+        portRecover(p, AHCI_ERR_TIMEOUT);
+}
+
+// Runs in softirq context. Only fires if nothing completed for a whole
+// timeout, otherwise it rearms for the rest of it.
+static void ahciTimeout(struct hrtimer *timer)
+{
+    ahci_port_t *p = timer->data;
+    uint32_t flags = saveInterrupts();
+    portCheckTimeout(p);
+    if (p->active)
+        hrtimer_start(timer, p->progress + (uint64_t)AHCI_TIMEOUT_MS * NSEC_PER_MSEC - ktime_get_ns(), NULL);
+    restoreInterrupts(flags);
+}
+
+static irqreturn_t ahciIrq(int irq, void *dev_id)
+{
+    (void)irq;
+    ahci_controller_t *hba = dev_id;
+    uint32_t is = regRead(hba->abar, AHCI_REG_IS);
+    if (is == 0)
+        return IRQ_NONE;
+
+    // Port bits first, the global bit stays set while they are
+    for (uint32_t pending = is; pending; pending &= pending - 1)
+    {
+        ahci_port_t *p = hba->ports[__builtin_ctz(pending)];
+        if (p)
+            portService(p);
+    }
+    regWrite(hba->abar, AHCI_REG_IS, is);
+    return IRQ_HANDLED;
+}
+
+// For waiters with interrupts off
+static void ahciPoll(void *dev)
+{
+    ahci_port_t *p = dev;
+    portService(p);
+    regWrite(controller.abar, AHCI_REG_IS, 1u << p->num);
+    portCheckTimeout(p);
+}
+
+// Fills the slot's PRDT from the segments, merging physically adjacent
+// pages. -1 if a buffer isn't mapped or starts on an odd address.
+static int buildPrdt(ahci_cmd_table_t *table, const struct blk_segment *segs, uint32_t nsegs)
+{
+    int n = 0;
+    for (uint32_t i = 0; i < nsegs; i++)
+    {
+        uint32_t virt = (uint32_t)segs[i].buf;
+        uint32_t left = segs[i].sectors * 512;
+        while (left)
+        {
+            uint32_t phys = vmmVirtToPhys(virt);
+            uint32_t chunk = PAGE_SIZE - (virt & 0xFFF);
+            if (chunk > left)
+                chunk = left;
+            if (phys == 0 || (phys & 1))
+                return -1;
+
+            ahci_prd_t *last = n ? &table->prdt[n - 1] : NULL;
+            uint32_t lastBytes = last ? (last->dbc & 0x3FFFFF) + 1 : 0;
+            if (last && last->dba + lastBytes == phys && lastBytes + chunk <= AHCI_PRD_MAX_BYTES)
+                last->dbc = lastBytes + chunk - 1;
+            else
+            {
+                if (n == AHCI_PRDT_ENTRIES)
+                    return -1;
+                table->prdt[n].dba = phys;
+                table->prdt[n].dbau = 0;
+                table->prdt[n].reserved = 0;
+                table->prdt[n].dbc = chunk - 1;
+                n++;
+            }
+            virt += chunk;
+            left -= chunk;
+        }
+    }
+    return n;
+}
+
+// blk_start_t. Takes a free slot and sends the request's first command,
+// the irq handler takes it from there.
+static uint8_t ahciStart(void *dev, struct blk_request *rq, const struct blk_segment *segs, uint32_t nsegs)
+{
+    ahci_port_t *p = dev;
+    uint32_t mask = p->depth >= 32 ? 0xFFFFFFFF : (1u << p->depth) - 1;
+
+    uint32_t flags = saveInterrupts();
+    uint32_t free = ~p->active & mask;
+    if (free == 0)
+    {
+        // The queue never has more than depth out
+        restoreInterrupts(flags);
+        return AHCI_ERR_HOST;
+    }
+    uint32_t slot = __builtin_ctz(free);
+    struct ahci_slot *s = &p->slots[slot];
+
+    int prdtl = buildPrdt(slotTable(p, slot), segs, nsegs);
+    if (prdtl < 0)
+    {
+        restoreInterrupts(flags);
+        return AHCI_ERR_ALIGN;
+    }
+
+    s->rq = rq;
+    s->prdtl = (uint16_t)prdtl;
+    s->stages = 0;
+    if (rq->flags & BLK_PREFLUSH)
+        s->stages |= AHCI_STAGE_PREFLUSH;
+    if (rq->count)
+        s->stages |= AHCI_STAGE_DATA;
+    if (rq->count && rq->direction == BLK_WRITE && (rq->flags & BLK_FUA) && !p->ncq)
+        s->stages |= AHCI_STAGE_POSTFLUSH;
+
+    if (s->stages == 0)
+    {
+        s->rq = NULL;
+        blk_complete(&p->queue, rq, 0);
+        restoreInterrupts(flags);
+        return 0;
+    }
+
+    if (p->active == 0)
+    {
+        p->progress = ktime_get_ns();
+        hrtimer_start(&p->timeout, (uint64_t)AHCI_TIMEOUT_MS * NSEC_PER_MSEC, NULL);
+    }
+    p->active |= 1u << slot;
+    issueStage(p, slot);
+    restoreInterrupts(flags);
+    return 0;
+}
+
+// Slot 0, polled, before the port has interrupts or a queue
+static bool portIdentify(ahci_port_t *p, uint32_t phys)
+{
+    ahci_cmd_table_t *table = slotTable(p, 0);
+    ahci_fis_h2d_t *fis = (ahci_fis_h2d_t *)table->cfis;
+    memset(fis, 0, sizeof(ahci_fis_h2d_t));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->command = ATA_CMD_IDENTIFY;
+    table->prdt[0].dba = phys;
+    table->prdt[0].dbau = 0;
+    table->prdt[0].dbc = 511;
+
+    p->cmd_list[0].flags = sizeof(ahci_fis_h2d_t) / 4;
+    p->cmd_list[0].prdtl = 1;
+    p->cmd_list[0].prdbc = 0;
+
+    portWrite(p, AHCI_PxIS, 0xFFFFFFFF);
+    asm volatile("" ::: "memory");
+    portWrite(p, AHCI_PxCI, 1);
+    if (!waitReg(p->regs, AHCI_PxCI, 1, 0, AHCI_TIMEOUT_MS))
+        return false;
+    return !(portRead(p, AHCI_PxIS) & AHCI_PxIS_TFES) && !(portRead(p, AHCI_PxTFD) & ATA_SR_ERR);
+}
+
+static void portFree(ahci_port_t *p)
+{
+    if (p->cmd_list)
+        memFreeDma(p->cmd_list, PAGE_SIZE);
+    if (p->tables)
+        memFreeDma(p->tables, AHCI_SLOTS * AHCI_CMD_TABLE_SIZE);
+    kfree(p);
+}
+
+// Reads IDENTIFY into the port, false if it isn't a usable disk
+static bool portProbe(ahci_port_t *p)
+{
+    uint32_t phys;
+    uint8_t *id = memAllocDma(PAGE_SIZE, PAGE_SIZE, &phys);
+    if (id == NULL)
+        return false;
+    if (!portIdentify(p, phys) || !(*(uint32_t *)(id + ATA_IDENT_COMMANDSETS) & ATA_CMDSET_LBA48))
+    {
+        memFreeDma(id, PAGE_SIZE);
+        return false;
+    }
+
+    p->sectors = *(uint64_t *)(id + ATA_IDENT_MAX_LBA_EXT);
+    for (int i = 0; i < 40; i += 2)
+    {
+        p->model[i] = id[ATA_IDENT_MODEL + i + 1];
+        p->model[i + 1] = id[ATA_IDENT_MODEL + i];
+    }
+    p->model[40] = 0;
+    for (int i = 39; i >= 0 && p->model[i] == ' '; i--)
+        p->model[i] = 0;
+
+    // Tags have to stay below both the drive's depth and the HBA's slots
+    p->ncq = (controller.cap & AHCI_CAP_SNCQ) && (*(uint16_t *)(id + ATA_IDENT_SATA_CAPS) & ATA_SATA_CAP_NCQ);
+    p->depth = p->ncq ? (*(uint16_t *)(id + ATA_IDENT_QUEUE_DEPTH) & 0x1F) + 1 : 1;
+    if (p->depth > controller.nslots)
+        p->depth = controller.nslots;
+
+    memFreeDma(id, PAGE_SIZE);
+    return true;
+}
+
+static ahci_port_t *portInit(uint8_t num)
+{
+    volatile uint8_t *regs = controller.abar + AHCI_PORT(num);
+
+    // Spun down or no phy yet, give the link a moment
+    if (AHCI_SSTS_DET(regRead(regs, AHCI_PxSSTS)) != AHCI_SSTS_DET_PRESENT)
+    {
+        regWrite(regs, AHCI_PxCMD, regRead(regs, AHCI_PxCMD) | AHCI_PxCMD_SUD | AHCI_PxCMD_POD);
+        if (AHCI_SSTS_DET(regRead(regs, AHCI_PxSSTS)) == 0 ||
+            !waitReg(regs, AHCI_PxSSTS, 0xF, AHCI_SSTS_DET_PRESENT, 20))
+            return NULL;
+    }
+    if (AHCI_SSTS_IPM(regRead(regs, AHCI_PxSSTS)) != AHCI_SSTS_IPM_ACTIVE)
+        return NULL;
+
+    uint32_t sig = regRead(regs, AHCI_PxSIG);
+    if (sig != AHCI_SIG_ATA)
+    {
+        if (sig == AHCI_SIG_ATAPI)
+            printf("AHCI: port %u is ATAPI, skipped\n", num);
+        return NULL;
+    }
+
+    ahci_port_t *p = kmalloc(sizeof(ahci_port_t));
+    if (p == NULL)
+        return NULL;
+    memset(p, 0, sizeof(ahci_port_t));
+    p->hba = &controller;
+    p->num = num;
+    p->regs = regs;
+
+    if (!portStop(p))
+    {
+        printf("AHCI: port %u won't stop\n", num);
+        portFree(p);
+        return NULL;
+    }
+
+    // Command list and received FISes share a page
+    p->cmd_list = memAllocDma(PAGE_SIZE, PAGE_SIZE, &p->cmd_list_phys);
+    p->tables = memAllocDma(AHCI_SLOTS * AHCI_CMD_TABLE_SIZE, PAGE_SIZE, &p->tables_phys);
+    if (p->cmd_list == NULL || p->tables == NULL)
+    {
+        portFree(p);
+        return NULL;
+    }
+    p->fis = (uint8_t *)p->cmd_list + AHCI_FIS_OFFSET;
+    for (int i = 0; i < AHCI_SLOTS; i++)
+    {
+        p->cmd_list[i].ctba = p->tables_phys + i * AHCI_CMD_TABLE_SIZE;
+        p->cmd_list[i].ctbau = 0;
+    }
+
+    portWrite(p, AHCI_PxCLB, p->cmd_list_phys);
+    portWrite(p, AHCI_PxCLBU, 0);
+    portWrite(p, AHCI_PxFB, p->cmd_list_phys + AHCI_FIS_OFFSET);
+    portWrite(p, AHCI_PxFBU, 0);
+    portWrite(p, AHCI_PxIE, 0);
+    portWrite(p, AHCI_PxSERR, 0xFFFFFFFF);
+    portWrite(p, AHCI_PxIS, 0xFFFFFFFF);
+    portStart(p);
+
+    if (!portProbe(p))
+    {
+        printf("AHCI: port %u didn't identify\n", num);
+        portStop(p);
+        portFree(p);
+        return NULL;
+    }
+    hrtimer_init(&p->timeout, ahciTimeout, p);
+    return p;
+}
+
+// Takes the HBA from the firmware if it says it owns it
+static void biosHandoff()
+{
+    if (!(regRead(controller.abar, AHCI_REG_CAP2) & AHCI_CAP2_BOH))
+        return;
+    regWrite(controller.abar, AHCI_REG_BOHC, regRead(controller.abar, AHCI_REG_BOHC) | AHCI_BOHC_OOS);
+    if (!waitReg(controller.abar, AHCI_REG_BOHC, AHCI_BOHC_BOS, 0, 25))
+        printf("AHCI: firmware didn't let go, taking it anyway\n");
+}
+
+void ahci_init()
+{
+    pci_device_t *dev = pciFindDevice(PCI_ANY_VENDOR, 0x01, 0x06);
+    if (dev == NULL || dev->prog_if != 0x01 || (dev->bar5 & 1) || (dev->bar5 & ~0xF) == 0)
+    {
+        printf("AHCI: no controller\n");
+        return;
+    }
+
+    uint16_t command = pciConfigReadWord(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+    pciConfigWriteWord(dev->bus, dev->slot, dev->func, PCI_COMMAND,
+                       command | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    controller.pci = dev;
+    controller.abar = vmmMapMmio(dev->bar5 & ~0xF, AHCI_MMIO_SIZE, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+    if (controller.abar == NULL)
+        return;
+
+    // No HBA reset: every port would renegotiate its link, and the
+    // firmware already brought them up
+    biosHandoff();
+    regWrite(controller.abar, AHCI_REG_GHC, regRead(controller.abar, AHCI_REG_GHC) | AHCI_GHC_AE);
+    controller.cap = regRead(controller.abar, AHCI_REG_CAP);
+    controller.nslots = AHCI_CAP_NCS(controller.cap);
+
+    uint32_t implemented = regRead(controller.abar, AHCI_REG_PI);
+    for (uint32_t n = 0; n < AHCI_MAX_PORTS; n++)
+    {
+        if (!(implemented & (1u << n)))
+            continue;
+        ahci_port_t *p = portInit(n);
+        if (p == NULL)
+            continue;
+        controller.ports[n] = p;
+        if (numDisks < AHCI_MAX_DISKS)
+            disks[numDisks++] = p;
+    }
+    if (numDisks == 0)
+    {
+        printf("AHCI: no disks\n");
+        return;
+    }
+
+    // MSI where there's an IOAPIC to send it to, otherwise the INTx line
+    // the BIOS routed. Without either the queues poll.
+    int irq = -1;
+    if (pciFindCapability(dev, PCI_CAP_ID_MSI) && (irq = irq_alloc()) >= 0 && pciEnableMsi(dev, irq))
+        controller.msi = true;
+    else if (dev->irq_pin && dev->irq_line < NUM_ISA_IRQS)
+        irq = dev->irq_line;
+    else
+        irq = -1;
+    controller.irq = irq;
+    if (irq >= 0)
+        irq_request(irq, ahciIrq, &controller, "ahci");
+
+    for (uint32_t i = 0; i < numDisks; i++)
+    {
+        ahci_port_t *p = disks[i];
+        blk_queue_init_async(&p->queue, diskNames[i], ahciStart, ahciPoll, NULL, p, AHCI_MAX_SECTORS, p->depth);
+        p->queue.polled = irq < 0;
+        blk_queue_enable_cache(&p->queue);
+        bdev_register(diskNames[i], BLOCK_DISK, &p->queue, p->sectors, BLK_SECTOR_SIZE, false);
+        portWrite(p, AHCI_PxIS, 0xFFFFFFFF);
+        portWrite(p, AHCI_PxIE, AHCI_PORT_IRQS);
+        printf("AHCI: %s on port %u, %s, %llu MiB, %s, %u deep\n", diskNames[i], p->num, p->model, p->sectors / 2048,
+               p->ncq ? "NCQ" : "no NCQ", p->depth);
+    }
+    regWrite(controller.abar, AHCI_REG_IS, 0xFFFFFFFF);
+    regWrite(controller.abar, AHCI_REG_GHC, regRead(controller.abar, AHCI_REG_GHC) | AHCI_GHC_IE);
+
+    printf("AHCI: %u slots, irq %d%s\n", controller.nslots, irq, controller.msi ? " (MSI)" : "");
+}
+
+struct blk_queue *ahci_queue(uint32_t disk)
+{
+    return disk < numDisks ? &disks[disk]->queue : NULL;
+}
+
+void ahci_benchmark(uint32_t disk, uint32_t count)
+{
+    if (disk >= numDisks || count == 0)
+        return;
+    ahci_port_t *p = disks[disk];
+    struct blk_queue *q = &p->queue;
+    uint8_t *buf = kmalloc(AHCI_BENCH_DEPTH * PAGE_SIZE);
+    if (buf == NULL)
+        return;
+
+    struct blk_io ios[AHCI_BENCH_DEPTH];
+    uint64_t blocks = p->sectors / 8;
+    uint32_t depths[2] = {1, AHCI_BENCH_DEPTH};
+
+    for (int d = 0; d < 2; d++)
+    {
+        uint32_t depth = depths[d] < p->depth ? depths[d] : p->depth;
+        uint32_t seed = 0x2545F491, errors = 0;
+        uint64_t start = ktime_get_ns();
+        for (uint32_t done = 0; done < count; done += depth)
+        {
+            blk_plug(q);
+            for (uint32_t i = 0; i < depth; i++)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                ios[i].direction = BLK_READ;
+                ios[i].flags = BLK_NOCACHE;
+                ios[i].lba = (seed % blocks) * 8;
+                ios[i].count = 8;
+                ios[i].buf = buf + i * PAGE_SIZE;
+                blk_submit(q, &ios[i]);
+            }
+            blk_unplug(q);
+            for (uint32_t i = 0; i < depth; i++)
+            {
+                if (blk_wait(q, &ios[i]))
+                    errors++;
+            }
+        }
+        uint64_t us = (ktime_get_ns() - start) / 1000;
+        printf("AHCI: %u random 4K reads at depth %u in %llu us (%llu IOPS)%s\n", count, depth, us,
+               us ? (uint64_t)count * 1000000 / us : 0, errors ? ", with errors" : "");
+        if (depth == p->depth)
+            break;
+    }
+    kfree(buf);
+}
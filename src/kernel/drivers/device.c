@@ -0,0 +1,57 @@
+#include <drivers/device.h>
+#include <util.h>
+#include <string.h>
+#include <stdio.h>
+
+static block_device_t devices[BLOCK_DEVICE_MAX];
+static uint32_t numDevices = 0;
+
+block_device_t *bdev_register(const char *name, block_device_type_t type, struct blk_queue *queue, uint64_t sectors,
+                              uint32_t block_size, bool readonly)
+{
+    if (numDevices == BLOCK_DEVICE_MAX || strlen(name) >= BLOCK_DEVICE_NAME_LEN || bdev_find(name) != NULL)
+    {
+        printf("Block: can't register %s\n", name);
+        return NULL;
+    }
+
+    block_device_t *dev = &devices[numDevices];
+    memcpy(dev->name, name, strlen(name) + 1);
+    dev->type = type;
+    dev->queue = queue;
+    dev->sectors = sectors;
+    dev->block_size = block_size < BLK_SECTOR_SIZE ? BLK_SECTOR_SIZE : block_size;
+    dev->readonly = readonly;
+    numDevices++;
+    return dev;
+}
+
+block_device_t *bdev_find(const char *name)
+{
+    for (uint32_t i = 0; i < numDevices; i++)
+    {
+        if (strcmp(devices[i].name, (char *)name) == 0)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+block_device_t *bdev_get(uint32_t index)
+{
+    return index < numDevices ? &devices[index] : NULL;
+}
+
+uint32_t bdev_count()
+{
+    return numDevices;
+}
+
+void bdev_list()
+{
+    for (uint32_t i = 0; i < numDevices; i++)
+    {
+        block_device_t *dev = &devices[i];
+        printf("Block: %s, %s, %llu MiB, %u byte blocks%s\n", dev->name, dev->type == BLOCK_CDROM ? "cdrom" : "disk",
+               dev->sectors / 2048, dev->block_size, dev->readonly ? ", read-only" : "");
+    }
+}
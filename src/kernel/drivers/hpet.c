@@ -0,0 +1,248 @@
+#include <drivers/hpet.h>
+#include <memory.h>
+#include <idt.h>
+#include <timer.h>
+#include <ktime.h>
+#include <util.h>
+#include <stdio.h>
+
+#define FS_PER_NS 1000000ULL
+
+static volatile uint8_t *hpet_base = NULL;
+static uint32_t hpet_period_fs; // femtoseconds per counter tick
+static uint64_t hpet_freq;
+static bool hpet_64bit;
+static bool hpet_legacy;
+static int num_timers;
+
+// Per comparator: the PIC line it raises (-1 if none) and who to call.
+static int timer_irq[HPET_MAX_TIMERS];
+static hpet_handler_t timer_handlers[HPET_MAX_TIMERS];
+static bool timer_periodic[HPET_MAX_TIMERS];
+
+static inline uint32_t hpetRead(uint32_t reg)
+{
+    return *(volatile uint32_t *)(hpet_base + reg);
+}
+
+static inline void hpetWrite(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(hpet_base + reg) = value;
+}
+
+uint64_t hpet_read_counter()
+{
+    if (!hpet_64bit)
+        return hpetRead(HPET_REG_COUNTER);
+
+    // Two 32-bit reads, retry if the low half wrapped in between.
+    uint32_t hi, lo;
+    do
+    {
+        hi = hpetRead(HPET_REG_COUNTER + 4);
+        lo = hpetRead(HPET_REG_COUNTER);
+    } while (hi != hpetRead(HPET_REG_COUNTER + 4));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static struct clocksource hpet_clocksource = {"hpet", hpet_read_counter, ~0ULL, 0, 0, 0, CLOCKSOURCE_RATING_HPET, 0};
+
+bool hpet_present()
+{
+    return hpet_base != NULL;
+}
+
+uint64_t hpet_frequency()
+{
+    return hpet_freq;
+}
+
+int hpet_timer_count()
+{
+    return num_timers;
+}
+
+bool hpet_timer_usable(int timer)
+{
+    // Timer 0 is the system tick once legacy replacement is on.
+    if (timer < 0 || timer >= num_timers || (hpet_legacy && timer == 0))
+        return false;
+    return timer_irq[timer] >= 0;
+}
+
+static uint32_t nsToTicks(uint64_t ns)
+{
+    uint64_t ticks = ns * FS_PER_NS / hpet_period_fs;
+    if (ticks == 0)
+        ticks = 1;
+    if (ticks > 0xFFFFFFFF)
+        ticks = 0xFFFFFFFF;
+    return (uint32_t)ticks;
+}
+
+// One action per comparator, dev_id is the timer number.
+static irqreturn_t hpetIrq(int irq, void *dev_id)
+{
+    (void)irq;
+    int t = (int)(uintptr_t)dev_id;
+    hpet_handler_t handler = timer_handlers[t];
+    if (handler == NULL)
+        return IRQ_NONE;
+
+    if (!timer_periodic[t])
+    {
+        hpet_timer_stop(t);
+        timer_handlers[t] = NULL;
+    }
+    handler(t);
+    return IRQ_HANDLED;
+}
+
+// Comparators run in 32-bit mode, like the tick. Keeps the programming to
+// single register writes and any delay we hand out fits anyway.
+static void programTimer(int timer, uint32_t ticks, bool periodic)
+{
+    uint32_t config = hpetRead(HPET_REG_TIMER_CONFIG(timer));
+    config &= ~(HPET_TIMER_LEVEL | HPET_TIMER_PERIODIC | HPET_TIMER_ROUTE_MASK);
+    config |= HPET_TIMER_ENABLE | HPET_TIMER_32BIT_MODE;
+    if (!(hpet_legacy && timer < 2))
+        config |= (uint32_t)timer_irq[timer] << HPET_TIMER_ROUTE_SHIFT;
+    if (periodic)
+        config |= HPET_TIMER_PERIODIC | HPET_TIMER_VAL_SET;
+
+    uint32_t now = hpetRead(HPET_REG_COUNTER);
+    hpetWrite(HPET_REG_TIMER_CONFIG(timer), config);
+    hpetWrite(HPET_REG_TIMER_COMPARATOR(timer), now + ticks);
+    if (periodic)
+    {
+        // With VAL_SET the second write sets the period. Some chipsets need
+        // a moment between the two.
+        hpetRead(HPET_REG_COUNTER);
+        hpetWrite(HPET_REG_TIMER_COMPARATOR(timer), ticks);
+    }
+}
+
+bool hpet_timer_oneshot(int timer, uint64_t delay_ns, hpet_handler_t handler)
+{
+    if (!hpet_timer_usable(timer))
+        return false;
+
+    uint32_t flags = saveInterrupts();
+    timer_handlers[timer] = handler;
+    timer_periodic[timer] = false;
+    programTimer(timer, nsToTicks(delay_ns), false);
+    restoreInterrupts(flags);
+    return true;
+}
+
+bool hpet_timer_periodic(int timer, uint64_t period_ns, hpet_handler_t handler)
+{
+    if (!hpet_timer_usable(timer))
+        return false;
+    if (!(hpetRead(HPET_REG_TIMER_CONFIG(timer)) & HPET_TIMER_PERIODIC_CAP))
+        return false;
+
+    uint32_t flags = saveInterrupts();
+    timer_handlers[timer] = handler;
+    timer_periodic[timer] = true;
+    programTimer(timer, nsToTicks(period_ns), true);
+    restoreInterrupts(flags);
+    return true;
+}
+
+void hpet_timer_stop(int timer)
+{
+    if (timer < 0 || timer >= num_timers)
+        return;
+    uint32_t config = hpetRead(HPET_REG_TIMER_CONFIG(timer));
+    hpetWrite(HPET_REG_TIMER_CONFIG(timer), config & ~(HPET_TIMER_ENABLE | HPET_TIMER_PERIODIC));
+}
+
+// Picks a free PIC line out of the timer's routing capabilities, leaving
+// the ones legacy devices are known to use. Most chipsets only offer
+// IOAPIC inputs here, those timers stay unusable.
+static int pickTimerIrq(int timer)
+{
+    if (hpet_legacy && timer == 0)
+        return 0;
+    if (hpet_legacy && timer == 1)
+        return 8;
+
+    uint32_t route_cap = hpetRead(HPET_REG_TIMER_CONFIG(timer) + 4);
+    for (int irq = 3; irq < 16; irq++)
+    {
+        if ((HPET_ISA_RESERVED & (1 << irq)) || !(route_cap & (1 << irq)) || irq_line_in_use(irq))
+            continue;
+        return irq;
+    }
+    return -1;
+}
+
+bool hpet_init()
+{
+    HPETTable_t *table = (HPETTable_t *)acpi_find_table("HPET");
+    if (table == NULL)
+    {
+        printf("HPET: not found, staying on the PIT\n");
+        return false;
+    }
+    if (table->address_space_id != 0 || (table->address >> 32) != 0)
+    {
+        printf("HPET: registers not in 32-bit memory space\n");
+        return false;
+    }
+
+    hpet_base = vmmMapMmio((uint32_t)table->address, HPET_MMIO_SIZE, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+    if (hpet_base == NULL)
+        return false;
+
+    uint32_t caps = hpetRead(HPET_REG_CAPABILITIES);
+    hpet_period_fs = hpetRead(HPET_REG_CAPABILITIES + 4);
+    if (hpet_period_fs == 0 || hpet_period_fs > 100000000) // spec says <= 100ns
+    {
+        printf("HPET: bogus counter period %u fs\n", hpet_period_fs);
+        vmmUnmapMmio((void *)hpet_base, HPET_MMIO_SIZE);
+        hpet_base = NULL;
+        return false;
+    }
+
+    hpet_freq = 1000000000000000ULL / hpet_period_fs;
+    hpet_64bit = (caps & HPET_CAP_COUNT_SIZE) != 0;
+    num_timers = ((caps >> 8) & 0x1F) + 1;
+    // Legacy replacement cuts the PIT off IRQ0, so timer 0 has to be able to
+    // tick periodically to take over.
+    hpet_legacy = (caps & HPET_CAP_LEGACY) && (hpetRead(HPET_REG_TIMER_CONFIG(0)) & HPET_TIMER_PERIODIC_CAP);
+
+    uint32_t flags = saveInterrupts();
+
+    // Everything off while we set up, the counter keeps its value.
+    hpetWrite(HPET_REG_CONFIG, hpetRead(HPET_REG_CONFIG) & ~(HPET_CONFIG_ENABLE | HPET_CONFIG_LEGACY));
+    for (int t = 0; t < num_timers; t++)
+    {
+        hpet_timer_stop(t);
+        timer_handlers[t] = NULL;
+        timer_irq[t] = pickTimerIrq(t);
+        if (timer_irq[t] > 0)
+            irq_request(timer_irq[t], hpetIrq, (void *)(uintptr_t)t, "hpet");
+    }
+
+    // Timer 0 ticks at the PIT's rate before the switch, onIrq0 doesn't
+    // notice the difference.
+    if (hpet_legacy)
+    {
+        programTimer(0, (uint32_t)(hpet_freq / TIMER_FREQ), true);
+        hpetWrite(HPET_REG_CONFIG, HPET_CONFIG_ENABLE | HPET_CONFIG_LEGACY);
+    }
+    else
+        hpetWrite(HPET_REG_CONFIG, HPET_CONFIG_ENABLE);
+
+    restoreInterrupts(flags);
+
+    printf("HPET: %u timers, %u kHz, %s counter%s\n", num_timers, (uint32_t)(hpet_freq / 1000),
+           hpet_64bit ? "64-bit" : "32-bit", hpet_legacy ? ", driving the system tick" : "");
+
+    hpet_clocksource.freq = hpet_freq;
+    hpet_clocksource.mask = hpet_64bit ? ~0ULL : 0xFFFFFFFFULL;
+    clocksource_register(&hpet_clocksource);
+    return true;
+}
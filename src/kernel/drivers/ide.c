@@ -1,16 +1,32 @@
 #include <drivers/ide.h>
+#include <drivers/device.h>
 #include <stddef.h>
 #include <util.h>
 #include <timer.h>
 #include <idt.h>
 #include <liballoc.h>
+#include <memory.h>
+#include <ktime.h>
+#include <string.h>
 #include <stdio.h>
 
 ide_channel_register_t channels[2];
 ide_device_t ideDevices[4];
 uint8_t ideBuf[2048] = {0};
-volatile unsigned static char ideIrqInvoked = 0;
-unsigned static char atapiPacket[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+bool ide_use_dma = true;
+static struct blk_queue ideQueues[4];
+static ide_atapi_ra_t ideReadahead[4];
+
+static void ideSetupDma(uint8_t channel);
+static void ideSetupReadahead(uint8_t drive);
+static uint8_t ideAtapiRead(uint8_t drive, uint32_t lba, uint32_t count, uint8_t *buf);
+static void ideTimeout(struct hrtimer *timer);
+static void ideSetMultiple(uint8_t drive);
+static uint32_t ideMaxSectors(uint8_t drive, uint32_t selector);
+static uint8_t ideQueueTransfer(void *dev, uint8_t direction, uint8_t flags, uint64_t lba, const struct blk_segment *segs,
+                                uint32_t nsegs);
+static uint8_t ideAtapiTransfer(void *dev, uint8_t direction, uint8_t flags, uint64_t lba, const struct blk_segment *segs,
+                                uint32_t nsegs);
 
 void init_ide()
 {
@@ -25,15 +41,315 @@ void init_ide()
 
     // currently were just gonna support compatibility mode
     // to make this more robust check prog if for pci then pass the BARs from the device
-    init_controller(0x1F0, 0x3F6, 0x170, 0x376, 0x000);
-    irq_install_handler(14, &ide_irq_handle);
-    irq_install_handler(15, &ide_irq_handle);
+    unsigned int bar4 = 0;
+    if ((ide_controller->prog_if & 0x80) && (ide_controller->bar4 & 1))
+    {
+        bar4 = ide_controller->bar4;
+        pciEnableBusMastering(ide_controller);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        wait_queue_init(&channels[i].wq);
+        wait_queue_init(&channels[i].busy_wq);
+        hrtimer_init(&channels[i].timeout, ideTimeout, &channels[i]);
+    }
+    init_controller(0x1F0, 0x3F6, 0x170, 0x376, bar4);
+    irq_request(14, ide_irq_handle, &channels[ATA_PRIMARY], "ide0");
+    irq_request(15, ide_irq_handle, &channels[ATA_SECONDARY], "ide1");
+    if (bar4)
+    {
+        ideSetupDma(ATA_PRIMARY);
+        ideSetupDma(ATA_SECONDARY);
+    }
+
+    // Needs the irq, so not part of the probe
+    for (int i = 0; i < 4; i++)
+    {
+        if (ideDevices[i].Reserved == 1 && ideDevices[i].Type == IDE_ATA)
+        {
+            ideSetMultiple(i);
+            if (ideDevices[i].Multiple)
+                printf("IDE: drive %d moves %u sectors per interrupt\n", i, ideDevices[i].Multiple);
+            const char *name = (const char *[]){"hd0", "hd1", "hd2", "hd3"}[i];
+            blk_queue_init(&ideQueues[i], name, ideQueueTransfer, (void *)(uintptr_t)i, ideMaxSectors(i, 0x10));
+            blk_queue_enable_cache(&ideQueues[i]);
+            bdev_register(name, BLOCK_DISK, &ideQueues[i], ideDevices[i].Size, BLK_SECTOR_SIZE, false);
+        }
+        else if (ideDevices[i].Reserved == 1 && ideDevices[i].Type == IDE_ATAPI)
+        {
+            const char *name = (const char *[]){"cd0", "cd1", "cd2", "cd3"}[i];
+            ideSetupReadahead(i);
+            blk_queue_init(&ideQueues[i], name, ideAtapiTransfer, (void *)(uintptr_t)i, IDE_ATAPI_MAX_SECTORS);
+            bdev_register(name, BLOCK_CDROM, &ideQueues[i], 0, ATAPI_SECTOR_SIZE, true);
+        }
+    }
     return;
 }
 
-void ide_irq_handle(struct InterruptRegisters *r)
+// PRD table and bounce buffer for one channel. The buffer is 64K aligned so
+// each 64K half is exactly one PRD.
+static void ideSetupDma(uint8_t channel)
 {
-    ideIrqInvoked = 1;
+    ide_channel_register_t *ch = &channels[channel];
+    ch->prdt = memAllocDma(PAGE_SIZE, PAGE_SIZE, &ch->prdt_phys);
+    ch->dma_buf = memAllocDma(IDE_DMA_BUF_SIZE, 0x10000, &ch->dma_phys);
+    if (ch->prdt == NULL || ch->dma_buf == NULL)
+    {
+        printf("IDE: no memory for DMA on channel %d, using PIO\n", channel);
+        if (ch->prdt)
+            memFreeDma(ch->prdt, PAGE_SIZE);
+        if (ch->dma_buf)
+            memFreeDma(ch->dma_buf, IDE_DMA_BUF_SIZE);
+        ch->prdt = NULL;
+        ch->dma_buf = NULL;
+        return;
+    }
+    outb(ch->bmide + ATA_BMR_COMMAND, 0);
+    outb(ch->bmide + ATA_BMR_STATUS, ATA_BMR_SR_IRQ | ATA_BMR_SR_ERR);
+}
+
+// Writing the command register also drops whatever INTRQ the drive still
+// had up, from here on its interrupts are ours
+static void ideCommand(uint8_t channel, uint8_t cmd)
+{
+    channels[channel].irq_pending = 0;
+    channels[channel].cmd_pending = 1;
+    ideWrite(channel, ATA_REG_COMMAND, cmd);
+}
+
+// The line may be shared, only claim what this channel raised: with DMA
+// the bus master's interrupt bit, with PIO a command that's out and a
+// drive that isn't busy anymore
+irqreturn_t ide_irq_handle(int irq, void *dev_id)
+{
+    (void)irq;
+    ide_channel_register_t *ch = dev_id;
+    if (ch->dma_active)
+    {
+        uint8_t status = inb(ch->bmide + ATA_BMR_STATUS);
+        if (!(status & ATA_BMR_SR_IRQ))
+            return IRQ_NONE;
+
+        // Stop the engine and clear the bits
+        outb(ch->bmide + ATA_BMR_COMMAND, 0);
+        outb(ch->bmide + ATA_BMR_STATUS, ATA_BMR_SR_IRQ | ATA_BMR_SR_ERR);
+        ch->bm_status = status;
+    }
+    else if (!ch->cmd_pending || (inb(ch->ctrl + 2) & ATA_SR_BSY)) // alternate status
+        return IRQ_NONE;
+
+    // Reading status lets the drive drop INTRQ
+    inb(ch->base + ATA_REG_STATUS);
+    ch->irq_pending = 1;
+    wait_queue_wake_all(&ch->wq);
+    return IRQ_HANDLED;
+}
+
+// Runs in softirq context
+static void ideTimeout(struct hrtimer *timer)
+{
+    ide_channel_register_t *ch = timer->data;
+    ch->timed_out = 1;
+    wait_queue_wake_all(&ch->wq);
+}
+
+// Sleeping needs a task to block and interrupts to wake it. Early boot and
+// callers with interrupts off watch the drive instead.
+static bool ideCanSleep(uint32_t flags)
+{
+    return schedulerEnabled && (flags & 0x200);
+}
+
+// What the irq would have seen, for when it can't come
+static bool ideIrqAsserted(ide_channel_register_t *ch)
+{
+    if (ch->dma_active)
+        return inb(ch->bmide + ATA_BMR_STATUS) & ATA_BMR_SR_IRQ;
+    return !(inb(ch->ctrl + 2) & ATA_SR_BSY); // alternate status, no side effects
+}
+
+uint8_t ideWaitIrq(uint8_t channel, uint32_t timeout_ms)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    uint32_t flags = saveInterrupts();
+
+    if (ideCanSleep(flags))
+    {
+        ch->timed_out = 0;
+        hrtimer_start(&ch->timeout, (uint64_t)timeout_ms * NSEC_PER_MSEC, NULL);
+        while (!ch->irq_pending && !ch->timed_out)
+            wait_queue_sleep(&ch->wq);
+        hrtimer_cancel(&ch->timeout);
+    }
+    else
+    {
+        uint64_t deadline = ktime_get_ns() + (uint64_t)timeout_ms * NSEC_PER_MSEC;
+        for (int i = 0; i < 4; i++) // 400ns for BSY to show up
+            inb(ch->ctrl + 2);
+        while (!ch->irq_pending && ktime_get_ns() < deadline)
+        {
+            if (ideIrqAsserted(ch))
+            {
+                ide_irq_handle(0, ch);
+                break;
+            }
+            asm volatile("pause");
+        }
+    }
+
+    uint8_t err = ch->irq_pending ? 0 : IDE_ERR_TIMEOUT;
+    ch->irq_pending = 0;
+    restoreInterrupts(flags);
+    return err;
+}
+
+static void ideLock(uint8_t channel)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    uint32_t flags = saveInterrupts();
+    while (ch->busy)
+    {
+        if (ideCanSleep(flags))
+        {
+            wait_queue_sleep(&ch->busy_wq);
+            continue;
+        }
+        // Nobody can wake us, so spin. The holder only gets to finish in
+        // the window where interrupts are back on.
+        restoreInterrupts(flags);
+        asm volatile("pause");
+        flags = saveInterrupts();
+    }
+    ch->busy = true;
+    restoreInterrupts(flags);
+}
+
+static void ideUnlock(uint8_t channel)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    uint32_t flags = saveInterrupts();
+    ch->cmd_pending = 0;
+    ch->busy = false;
+    wait_queue_wake_one(&ch->busy_wq);
+    restoreInterrupts(flags);
+}
+
+// Points the bus master at the bounce buffer. Has to happen before the
+// command goes out, the engine is started right after it.
+// Walks a segment list a sector at a time, so a command can move data
+// for several callers' buffers
+typedef struct ide_sg_cursor
+{
+    const struct blk_segment *seg;
+    uint32_t sector; // within seg
+} ide_sg_cursor_t;
+
+static uint8_t *ideSgNext(ide_sg_cursor_t *cur)
+{
+    while (cur->sector >= cur->seg->sectors)
+    {
+        cur->seg++;
+        cur->sector = 0;
+    }
+    return cur->seg->buf + (cur->sector++) * 512;
+}
+
+// Copies sectors between the bounce buffer and the segments
+static void ideSgCopy(ide_sg_cursor_t *cur, uint8_t *bounce, uint32_t sectors, bool to_bounce)
+{
+    while (sectors > 0)
+    {
+        while (cur->sector >= cur->seg->sectors)
+        {
+            cur->seg++;
+            cur->sector = 0;
+        }
+        uint32_t n = cur->seg->sectors - cur->sector < sectors ? cur->seg->sectors - cur->sector : sectors;
+        uint8_t *buf = cur->seg->buf + cur->sector * 512;
+        if (to_bounce)
+            memcpy(bounce, buf, n * 512);
+        else
+            memcpy(buf, bounce, n * 512);
+        bounce += n * 512;
+        cur->sector += n;
+        sectors -= n;
+    }
+}
+
+// Programs the bus master for bytes at phys, which must not cross a 64K
+// boundary other than on a PRD split (64K aligned memory is fine)
+static void ideDmaProgram(uint8_t channel, uint8_t direction, uint32_t phys, uint32_t bytes)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    int entries = 0;
+    for (uint32_t offset = 0; offset < bytes; offset += 0x10000)
+    {
+        uint32_t chunk = bytes - offset < 0x10000 ? bytes - offset : 0x10000;
+        ch->prdt[entries].phys = phys + offset;
+        ch->prdt[entries].byte_count = (uint16_t)chunk; // 64K wraps to 0
+        ch->prdt[entries].flags = 0;
+        entries++;
+    }
+    ch->prdt[entries - 1].flags = IDE_PRD_EOT;
+
+    outb(ch->bmide + ATA_BMR_COMMAND, 0);
+    outl(ch->bmide + ATA_BMR_PRDT, ch->prdt_phys);
+    outb(ch->bmide + ATA_BMR_STATUS, ATA_BMR_SR_IRQ | ATA_BMR_SR_ERR);
+    outb(ch->bmide + ATA_BMR_COMMAND, direction == ATA_READ ? ATA_BMR_CMD_READ : 0);
+    ch->dma_active = 1;
+}
+
+static void ideDmaPrepare(uint8_t channel, uint8_t direction, uint32_t bytes, ide_sg_cursor_t *cur)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    if (direction == ATA_WRITE)
+        ideSgCopy(cur, ch->dma_buf, bytes / 512, true);
+    ideDmaProgram(channel, direction, ch->dma_phys, bytes);
+}
+
+static void ideDmaStart(uint8_t channel)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    outb(ch->bmide + ATA_BMR_COMMAND, inb(ch->bmide + ATA_BMR_COMMAND) | ATA_BMR_CMD_START);
+}
+
+// Stops the engine, for the end of a command or when it never got going.
+// Returns the bus master status.
+static uint8_t ideDmaStop(uint8_t channel, bool irq_seen)
+{
+    ide_channel_register_t *ch = &channels[channel];
+    uint32_t flags = saveInterrupts();
+    uint8_t bm_status = irq_seen ? ch->bm_status : inb(ch->bmide + ATA_BMR_STATUS);
+    outb(ch->bmide + ATA_BMR_COMMAND, 0);
+    outb(ch->bmide + ATA_BMR_STATUS, ATA_BMR_SR_IRQ | ATA_BMR_SR_ERR);
+    ch->dma_active = 0;
+    restoreInterrupts(flags);
+    return bm_status;
+}
+
+// Sleeps until the completion interrupt, the irq handler has already
+// stopped the engine by then.
+static uint8_t ideDmaWait(uint8_t channel)
+{
+    uint8_t err = ideWaitIrq(channel, IDE_TIMEOUT_MS);
+    uint8_t bm_status = ideDmaStop(channel, err == 0);
+
+    uint8_t status = ideRead(channel, ATA_REG_STATUS);
+    if (err == 0 && (status & ATA_SR_ERR))
+        err = 2;
+    else if (err == 0 && (status & ATA_SR_DF))
+        err = 1;
+    else if (err == 0 && (bm_status & ATA_BMR_SR_ERR))
+        err = 2;
+    return err;
+}
+
+static uint8_t ideDmaFinish(uint8_t channel, uint8_t direction, uint32_t bytes, ide_sg_cursor_t *cur)
+{
+    uint8_t err = ideDmaWait(channel);
+    if (err == 0 && direction == ATA_READ)
+        ideSgCopy(cur, channels[channel].dma_buf, bytes / 512, false);
+    return err;
 }
 
 void init_controller(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, unsigned int BAR3, unsigned int BAR4)
@@ -73,8 +389,15 @@ void init_controller(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, un
             if (ideRead(i, ATA_REG_STATUS) == 0)
                 continue; // If Status = 0, No Device.
 
+            // A half-present drive can sit in BSY forever, give up on it
+            uint64_t deadline = ktime_get_ns() + (uint64_t)IDE_TIMEOUT_MS * NSEC_PER_MSEC;
             while (1)
             {
+                if (ktime_get_ns() > deadline)
+                {
+                    err = IDE_ERR_TIMEOUT;
+                    break;
+                }
                 status = ideRead(i, ATA_REG_STATUS);
                 if ((status & ATA_SR_ERR))
                 {
@@ -114,9 +437,11 @@ void init_controller(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, un
             ideDevices[count].Signature = *((uint16_t *)(ideBuf + ATA_IDENT_DEVICETYPE));
             ideDevices[count].Capabilities = *((uint16_t *)(ideBuf + ATA_IDENT_CAPABILITIES));
             ideDevices[count].CommandSets = *((unsigned int *)(ideBuf + ATA_IDENT_COMMANDSETS));
+            ideDevices[count].Fua = (*((uint16_t *)(ideBuf + ATA_IDENT_CMDSET_DEFAULT)) & ATA_CMDSET_FUA) != 0;
+            ideDevices[count].Multiple = type == IDE_ATA ? ideBuf[ATA_IDENT_MAX_MULTIPLE] : 0; // max for now, see ideSetMultiple
 
             // (VII) Get Size:
-            if (ideDevices[count].CommandSets & (1 << 26))
+            if (ideDevices[count].CommandSets & ATA_CMDSET_LBA48)
                 ideDevices[count].Size = *((unsigned int *)(ideBuf + ATA_IDENT_MAX_LBA_EXT)); // Device uses 48-Bit Addressing:
             else
                 ideDevices[count].Size = *((unsigned int *)(ideBuf + ATA_IDENT_MAX_LBA)); // Device uses CHS or 28-bit Addressing:
@@ -146,6 +471,34 @@ void init_controller(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, un
     }
 }
 
+// SET MULTIPLE MODE with the largest power of two up to what IDENTIFY
+// reported in Multiple. Drops back to 0 (single sector PIO) if the drive
+// doesn't take it.
+static void ideSetMultiple(uint8_t drive)
+{
+    uint8_t channel = ideDevices[drive].Channel;
+    uint16_t max = ideDevices[drive].Multiple;
+    uint16_t sectors = 1;
+    ideDevices[drive].Multiple = 0;
+
+    while (sectors * 2 <= max)
+        sectors *= 2;
+    if (sectors < 2)
+        return;
+
+    ideLock(channel);
+    ideWrite(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0);
+    ideWrite(channel, ATA_REG_HDDEVSEL, 0xA0 | (ideDevices[drive].Drive << 4));
+    if (idePolling(channel, 0) == 0)
+    {
+        ideWrite(channel, ATA_REG_SECCOUNT0, sectors);
+        ideCommand(channel, ATA_CMD_SET_MULTIPLE);
+        if (ideWaitIrq(channel, IDE_TIMEOUT_MS) == 0 && !(ideRead(channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)))
+            ideDevices[drive].Multiple = sectors;
+    }
+    ideUnlock(channel);
+}
+
 uint8_t ideRead(uint8_t channel, uint8_t reg)
 {
     uint8_t result;
@@ -246,6 +599,11 @@ uint8_t idePrintError(unsigned int drive, uint8_t err)
         printf("- Write Protected\n     ");
         err = 8;
     }
+    else if (err == IDE_ERR_TIMEOUT)
+    {
+        printf("- Timed Out\n     ");
+        err = 24;
+    }
     printf("- [%s %s] %s\n",
            (const char *[]){"Primary", "Secondary"}[ideDevices[drive].Channel], // Use the channel as an index into the array
            (const char *[]){"Master", "Slave"}[ideDevices[drive].Drive],        // Same as above, using the drive
@@ -281,9 +639,13 @@ uint8_t idePolling(uint8_t channel, unsigned int advanced_check)
     {
         ideRead(channel, ATA_REG_ALTSTATUS);
     }
-    while (ideRead(channel, ATA_REG_STATUS) & ATA_SR_BSY)
+    // Only used where BSY is about to clear (command setup, right after an
+    // irq), long waits sleep in ideWaitIrq.
+    uint64_t deadline = ktime_get_ns() + (uint64_t)IDE_TIMEOUT_MS * NSEC_PER_MSEC;
+    while (ideRead(channel, ATA_REG_ALTSTATUS) & ATA_SR_BSY)
     {
-        ;
+        if (ktime_get_ns() > deadline)
+            return IDE_ERR_TIMEOUT;
     }
     if (advanced_check)
     {
@@ -308,18 +670,6 @@ uint8_t idePolling(uint8_t channel, unsigned int advanced_check)
     return 0; // No Error.
 }
 
-void ideWaitIrq()
-{
-    while (!ideIrqInvoked)
-        ;
-    ideIrqInvoked = 0;
-}
-
-void ideIrq()
-{
-    ideIrqInvoked = 1;
-}
-
 // TODO: fix determineAdressing
 /*
 void determineAddressing(unsigned int lba, uint16_t capabilities, uint8_t *lba_mode, uint8_t *lba_io[6], uint8_t *head, uint8_t *sect, uint32_t *cyl)
@@ -366,7 +716,46 @@ void determineAddressing(unsigned int lba, uint16_t capabilities, uint8_t *lba_m
 }
 */
 
-uint8_t ide_ata_rw(uint8_t direction, uint8_t drive, unsigned int lba, uint8_t numsects, uint32_t selector, unsigned int edi)
+// The bounce buffer is copied with a flat pointer, other selectors stay on PIO.
+static bool ideUseDma(uint8_t drive, uint32_t selector)
+{
+    return ide_use_dma && channels[ideDevices[drive].Channel].prdt != NULL &&
+           (ideDevices[drive].Capabilities & ATA_CAP_DMA) && selector == 0x10;
+}
+
+static bool ideLba48(uint8_t drive)
+{
+    return ideDevices[drive].CommandSets & ATA_CMDSET_LBA48;
+}
+
+// Drains the drive's write cache and sleeps until it's done. Channel lock
+// held.
+static uint8_t ideFlush(uint8_t drive)
+{
+    uint8_t channel = ideDevices[drive].Channel;
+    uint8_t err;
+
+    ideWrite(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0);
+    ideWrite(channel, ATA_REG_HDDEVSEL, 0xE0 | (ideDevices[drive].Drive << 4));
+    if ((err = idePolling(channel, 0)))
+        return err;
+
+    ideCommand(channel, ideLba48(drive) ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+    if ((err = ideWaitIrq(channel, IDE_TIMEOUT_MS)))
+        return err;
+    return (ideRead(channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)) ? 1 : 0;
+}
+
+// FUA writes only exist as LBA48 DMA or MULTIPLE commands
+static bool ideNativeFua(uint8_t drive, uint32_t selector)
+{
+    return ideDevices[drive].Fua && ideLba48(drive) && (ideUseDma(drive, selector) || ideDevices[drive].Multiple > 1);
+}
+
+// One command. numsects goes up to 256, or 65536 with LBA48, which is also
+// used for anything past the 28-bit range and for FUA writes.
+static uint8_t ideAtaCommand(uint8_t direction, uint8_t drive, uint64_t lba, uint32_t numsects, uint32_t selector, bool fua,
+                             ide_sg_cursor_t *cur)
 {
     uint8_t lba_mode; /* 0: CHS, 1:LBA28, 2: LBA48 */
     uint8_t dma;      /* 0: No DMA, 1: DMA */
@@ -376,25 +765,26 @@ uint8_t ide_ata_rw(uint8_t direction, uint8_t drive, unsigned int lba, uint8_t n
     unsigned int slavebit = ideDevices[drive].Drive;  // Read the Drive [Master/Slave]
     unsigned int bus = channels[channel].base;        // Bus Base, like 0x1F0 which is also data port.
     unsigned int words = 256;                         // Almost every ATA drive has a sector-size of 512-byte.
-    uint32_t cyl, i;
+    uint32_t cyl, i, j, n;
     uint8_t head, sect, err;
 
-    ideWrite(channel, ATA_REG_CONTROL, channels[channel].nIEN = (ideIrqInvoked = 0x0) + 0x02);
+    // Both DMA and PIO complete on the interrupt.
+    dma = ideUseDma(drive, selector);
+    ideWrite(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0);
 
-    if (lba >= 0x10000000)
-    { // Sure Drive should support LBA in this case, or you are
-      // giving a wrong LBA.
+    if (fua || lba + numsects > 0x10000000 || numsects > 256)
+    {
         // LBA48:
         lba_mode = 2;
-        lba_io[0] = (lba & 0x000000FF) >> 0;
-        lba_io[1] = (lba & 0x0000FF00) >> 8;
-        lba_io[2] = (lba & 0x00FF0000) >> 16;
-        lba_io[3] = (lba & 0xFF000000) >> 24;
-        lba_io[4] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
-        lba_io[5] = 0; // LBA28 is integer, so 32-bits are enough to access 2TB.
-        head = 0;      // Lower 4-bits of HDDEVSEL are not used here.
-    }
-    else if (ideDevices[drive].Capabilities & 0x200)
+        lba_io[0] = (lba >> 0) & 0xFF;
+        lba_io[1] = (lba >> 8) & 0xFF;
+        lba_io[2] = (lba >> 16) & 0xFF;
+        lba_io[3] = (lba >> 24) & 0xFF;
+        lba_io[4] = (lba >> 32) & 0xFF;
+        lba_io[5] = (lba >> 40) & 0xFF;
+        head = 0; // Lower 4-bits of HDDEVSEL are not used here.
+    }
+    else if (ideDevices[drive].Capabilities & ATA_CAP_LBA)
     { // Drive supports LBA?
         // LBA28:
         lba_mode = 1;
@@ -421,167 +811,503 @@ uint8_t ide_ata_rw(uint8_t direction, uint8_t drive, unsigned int lba, uint8_t n
         head = (lba + 1 - sect) % (16 * 63) / (63); // Head number is written to HDDEVSEL lower 4-bits.
     }
 
-    dma = 0; // We don't support DMA.. yet
-
-    while (ideRead(channel, ATA_REG_STATUS) & ATA_SR_BSY)
-    {
-        ;
-    }
+    if ((err = idePolling(channel, 0)))
+        return err;
 
     if (lba_mode == 0)
         ideWrite(channel, ATA_REG_HDDEVSEL, 0xA0 | (slavebit << 4) | head); // Drive & CHS.
     else
         ideWrite(channel, ATA_REG_HDDEVSEL, 0xE0 | (slavebit << 4) | head); // Drive & LBA
 
+    // A count of 0 means 256, or 65536 with LBA48
     if (lba_mode == 2)
     {
-        ideWrite(channel, ATA_REG_SECCOUNT1, 0);
+        ideWrite(channel, ATA_REG_SECCOUNT1, (numsects >> 8) & 0xFF);
         ideWrite(channel, ATA_REG_LBA3, lba_io[3]);
         ideWrite(channel, ATA_REG_LBA4, lba_io[4]);
         ideWrite(channel, ATA_REG_LBA5, lba_io[5]);
     }
 
-    ideWrite(channel, ATA_REG_SECCOUNT0, numsects);
+    ideWrite(channel, ATA_REG_SECCOUNT0, numsects & 0xFF);
     ideWrite(channel, ATA_REG_LBA0, lba_io[0]);
     ideWrite(channel, ATA_REG_LBA1, lba_io[1]);
     ideWrite(channel, ATA_REG_LBA2, lba_io[2]);
 
-    if (lba_mode == 0 && dma == 0 && direction == 0)
-        cmd = ATA_CMD_READ_PIO;
-    if (lba_mode == 1 && dma == 0 && direction == 0)
-        cmd = ATA_CMD_READ_PIO;
-    if (lba_mode == 2 && dma == 0 && direction == 0)
-        cmd = ATA_CMD_READ_PIO_EXT;
-    if (lba_mode == 0 && dma == 1 && direction == 0)
-        cmd = ATA_CMD_READ_DMA;
-    if (lba_mode == 1 && dma == 1 && direction == 0)
-        cmd = ATA_CMD_READ_DMA;
-    if (lba_mode == 2 && dma == 1 && direction == 0)
-        cmd = ATA_CMD_READ_DMA_EXT;
-    if (lba_mode == 0 && dma == 0 && direction == 1)
-        cmd = ATA_CMD_WRITE_PIO;
-    if (lba_mode == 1 && dma == 0 && direction == 1)
-        cmd = ATA_CMD_WRITE_PIO;
-    if (lba_mode == 2 && dma == 0 && direction == 1)
-        cmd = ATA_CMD_WRITE_PIO_EXT;
-    if (lba_mode == 0 && dma == 1 && direction == 1)
-        cmd = ATA_CMD_WRITE_DMA;
-    if (lba_mode == 1 && dma == 1 && direction == 1)
-        cmd = ATA_CMD_WRITE_DMA;
-    if (lba_mode == 2 && dma == 1 && direction == 1)
-        cmd = ATA_CMD_WRITE_DMA_EXT;
-    ideWrite(channel, ATA_REG_COMMAND, cmd);
+    // PIO moves a block of sectors per DRQ interrupt with the MULTIPLE
+    // commands, a single sector without.
+    uint32_t block = ideDevices[drive].Multiple ? ideDevices[drive].Multiple : 1;
+    bool ext = lba_mode == 2;
+    if (dma && fua)
+        cmd = ATA_CMD_WRITE_DMA_FUA_EXT;
+    else if (dma)
+        cmd = direction == ATA_READ ? (ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA)
+                                    : (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
+    else if (block > 1 && fua)
+        cmd = ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+    else if (block > 1)
+        cmd = direction == ATA_READ ? (ext ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE)
+                                    : (ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE);
+    else
+        cmd = direction == ATA_READ ? (ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO)
+                                    : (ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO);
 
-    // implement dma smh
+    uint32_t bytes = numsects * 512;
     if (dma)
-        if (direction == 0)
-            ;
-        // DMA Read.
-        else
-            ;
-    // DMA Write.
+        ideDmaPrepare(channel, direction, bytes, cur);
+    ideCommand(channel, cmd);
+
+    if (dma)
+    {
+        ideDmaStart(channel);
+        if ((err = ideDmaFinish(channel, direction, bytes, cur)))
+            return err;
+    }
     else if (direction == 0)
-        // PIO Read.
-        for (i = 0; i < numsects; i++)
+        // PIO Read: one interrupt per block once its data is ready
+        for (i = 0; i < numsects; i += n)
         {
-            if (err = idePolling(channel, 1))
+            n = numsects - i < block ? numsects - i : block;
+            if ((err = ideWaitIrq(channel, IDE_TIMEOUT_MS)))
+                return err;
+            if ((err = idePolling(channel, 1)))
                 return err;
 
-            ataReadSector(selector, (void *)edi, bus, words);
-            edi += (words * 2);
+            for (j = 0; j < n; j++)
+                ataReadSector(selector, ideSgNext(cur), bus, words);
         }
     else
     {
-
-        for (i = 0; i < numsects; i++)
+        // PIO Write: the first block goes as soon as DRQ is up, after that
+        // every block (and the end of the command) is an interrupt.
+        for (i = 0; i < numsects; i += n)
         {
-            idePolling(channel, 0); // Polling.
-            asm volatile(
-                "pushl %%ds\n\t"
-                "movw %w[sel], %%ds\n\t" // %w for 16-bit selector
-                "rep outsw\n\t"
-                "popl %%ds\n\t"
-                : "+S"(edi), "+c"(words)
-                : "d"(bus), [sel] "r"(selector)
-                : "memory");
-            edi += (words * 2);
+            n = numsects - i < block ? numsects - i : block;
+            if (i == 0)
+                err = idePolling(channel, 1);
+            else
+                err = ideWaitIrq(channel, IDE_TIMEOUT_MS);
+            if (err)
+                return err;
+
+            for (j = 0; j < n; j++)
+            {
+                uint8_t *sector = ideSgNext(cur);
+                unsigned int count = words;
+                asm volatile(
+                    "pushl %%ds\n\t"
+                    "movw %w[sel], %%ds\n\t" // %w for 16-bit selector
+                    "rep outsw\n\t"
+                    "popl %%ds\n\t"
+                    : "+S"(sector), "+c"(count)
+                    : "d"(bus), [sel] "r"(selector)
+                    : "memory");
+            }
         }
-        ideWrite(channel, ATA_REG_COMMAND, (char[]){ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
-        idePolling(channel, 0); // Polling.
+        if ((err = ideWaitIrq(channel, IDE_TIMEOUT_MS)))
+            return err;
     }
-    ideWrite(channel, ATA_REG_COMMAND, (char[]){ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
-    idePolling(channel, 0);
-
     return 0;
 }
 
-uint8_t ide_atapi_read(uint8_t drive, unsigned int lba, uint8_t numsects, unsigned short selector, unsigned int edi)
+// Biggest command the drive takes. DMA is bounded by the bounce buffer.
+static uint32_t ideMaxSectors(uint8_t drive, uint32_t selector)
+{
+    uint32_t max = ideLba48(drive) ? 65536 : 256;
+    if (ideUseDma(drive, selector) && max > IDE_DMA_MAX_SECTORS)
+        max = IDE_DMA_MAX_SECTORS;
+    return max;
+}
+
+// The drive's write cache is left alone unless flags ask for a flush
+// before (BLK_PREFLUSH) or durability of this write (BLK_FUA).
+static uint8_t ideAtaTransfer(uint8_t direction, uint8_t drive, uint64_t lba, uint32_t numsects, uint32_t selector,
+                              uint8_t flags, ide_sg_cursor_t *cur)
+{
+    uint8_t channel = ideDevices[drive].Channel;
+    uint32_t max = ideMaxSectors(drive, selector);
+    bool fua = (flags & BLK_FUA) && direction == ATA_WRITE && numsects > 0;
+    bool native_fua = fua && ideNativeFua(drive, selector);
+    uint8_t err = 0;
+
+    ideLock(channel);
+    if (flags & BLK_PREFLUSH)
+        err = ideFlush(drive);
+    while (numsects > 0 && err == 0)
+    {
+        uint32_t n = numsects < max ? numsects : max;
+        err = ideAtaCommand(direction, drive, lba, n, selector, native_fua, cur);
+        lba += n;
+        numsects -= n;
+    }
+    if (err == 0 && fua && !native_fua)
+        err = ideFlush(drive);
+    ideUnlock(channel);
+    return err;
+}
+
+uint8_t ide_ata_rw(uint8_t direction, uint8_t drive, uint64_t lba, uint32_t numsects, uint32_t selector, unsigned int edi)
+{
+    struct blk_segment seg = {(uint8_t *)edi, numsects};
+    ide_sg_cursor_t cur = {&seg, 0};
+    return ideAtaTransfer(direction, drive, lba, numsects, selector, 0, &cur);
+}
+
+uint8_t ide_ata_rw_sg(uint8_t direction, uint8_t drive, uint64_t lba, uint8_t flags, const struct blk_segment *segs,
+                      uint32_t nsegs)
+{
+    uint32_t numsects = 0;
+    for (uint32_t i = 0; i < nsegs; i++)
+        numsects += segs[i].sectors;
+
+    ide_sg_cursor_t cur = {segs, 0};
+    return ideAtaTransfer(direction, drive, lba, numsects, 0x10, flags, &cur);
+}
+
+uint8_t ide_flush(uint8_t drive)
+{
+    uint8_t channel = ideDevices[drive].Channel;
+    ideLock(channel);
+    uint8_t err = ideFlush(drive);
+    ideUnlock(channel);
+    return err;
+}
+
+static uint8_t ideQueueTransfer(void *dev, uint8_t direction, uint8_t flags, uint64_t lba, const struct blk_segment *segs,
+                                uint32_t nsegs)
+{
+    return ide_ata_rw_sg(direction, (uint8_t)(uintptr_t)dev, lba, flags, segs, nsegs);
+}
+
+// The queue counts 512 byte sectors, bio_submit already made sure they
+// come in whole 2048 byte blocks
+static uint8_t ideAtapiTransfer(void *dev, uint8_t direction, uint8_t flags, uint64_t lba, const struct blk_segment *segs,
+                                uint32_t nsegs)
+{
+    uint8_t drive = (uint8_t)(uintptr_t)dev;
+    uint32_t per = ATAPI_SECTOR_SIZE / BLK_SECTOR_SIZE;
+    // Nothing is ever written, so there's no write cache to drain. A bare
+    // flush succeeds, writes (FUA or not) are refused, and BLK_PREFLUSH on
+    // a read is ignored.
+    if (direction != BLK_READ)
+        return nsegs ? IDE_ERR_READONLY : 0;
+    (void)flags;
+    for (uint32_t i = 0; i < nsegs; i++)
+    {
+        if (segs[i].sectors % per)
+            return IDE_ERR_ALIGN;
+    }
+    if (lba % per)
+        return IDE_ERR_ALIGN;
+
+    uint8_t channel = ideDevices[drive].Channel;
+    uint8_t err = 0;
+    ideLock(channel);
+    for (uint32_t i = 0; i < nsegs && err == 0; i++)
+    {
+        err = ideAtapiRead(drive, (uint32_t)(lba / per), segs[i].sectors / per, segs[i].buf);
+        lba += segs[i].sectors;
+    }
+    ideUnlock(channel);
+    return err;
+}
+
+struct blk_queue *ide_queue(uint8_t drive)
+{
+    if (drive >= 4 || !ideDevices[drive].Reserved)
+        return NULL;
+    return &ideQueues[drive];
+}
+
+// One packet command reading bytes (0 for none). With DMA the bus master
+// fills phys and the drive interrupts once at the end. PIO takes whatever
+// the drive offers per DRQ, up to IDE_ATAPI_PIO_BYTES, and one interrupt
+// for each of those. phys 0 is PIO. Channel lock held.
+static uint8_t ideAtapiPacket(uint8_t drive, const uint8_t *packet, uint32_t bytes, uint16_t selector, uint8_t *buf,
+                              uint32_t phys)
 {
     unsigned int channel = ideDevices[drive].Channel;
     unsigned int slavebit = ideDevices[drive].Drive;
     unsigned int bus = channels[channel].base;
-    unsigned int words = 1024; // Sector Size. ATAPI drives have a sector size of 2048 bytes.
+    bool dma = phys != 0 && bytes != 0 && ideUseDma(drive, selector);
+    uint32_t left = bytes;
     uint8_t err;
-    int i;
-
-    ideWrite(channel, ATA_REG_CONTROL, channels[channel].nIEN = ideIrqInvoked = 0x0);
-
-    atapiPacket[0] = ATAPI_CMD_READ;
-    atapiPacket[1] = 0x0;
-    atapiPacket[2] = (lba >> 24) & 0xFF;
-    atapiPacket[3] = (lba >> 16) & 0xFF;
-    atapiPacket[4] = (lba >> 8) & 0xFF;
-    atapiPacket[5] = (lba >> 0) & 0xFF;
-    atapiPacket[6] = 0x0;
-    atapiPacket[7] = 0x0;
-    atapiPacket[8] = 0x0;
-    atapiPacket[9] = numsects;
-    atapiPacket[10] = 0x0;
-    atapiPacket[11] = 0x0;
 
+    ideWrite(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0x0);
     ideWrite(channel, ATA_REG_HDDEVSEL, slavebit << 4);
 
     // 400 nanosecond delay for drive select to finish
     for (int i = 0; i < 4; i++)
         ideRead(channel, ATA_REG_ALTSTATUS);
 
-    ideWrite(channel, ATA_REG_FEATURES, 0);
+    ideWrite(channel, ATA_REG_FEATURES, dma ? ATAPI_FEAT_DMA : 0);
+    // Ignored with DMA
+    ideWrite(channel, ATA_REG_LBA1, IDE_ATAPI_PIO_BYTES & 0xFF);
+    ideWrite(channel, ATA_REG_LBA2, IDE_ATAPI_PIO_BYTES >> 8);
 
-    ideWrite(channel, ATA_REG_LBA1, (words * 2) & 0xFF); // Lower Byte of Sector Size.
-    ideWrite(channel, ATA_REG_LBA2, (words * 2) >> 8);   // Upper Byte of Sector Size.
+    if (dma)
+        ideDmaProgram(channel, ATA_READ, phys, left);
+    ideCommand(channel, ATA_CMD_PACKET);
 
-    // (VI): Send the Packet Command:
-    // ------------------------------------------------------------------
-    ideWrite(channel, ATA_REG_COMMAND, ATA_CMD_PACKET); // Send the Command.
+    // DRQ up means it wants the packet
+    if ((err = idePolling(channel, 1)))
+    {
+        if (dma)
+            ideDmaStop(channel, false);
+        return err;
+    }
 
-    // (VII): Waiting for the driver to finish or return an error code:
-    // ------------------------------------------------------------------
-    if (err = idePolling(channel, 1))
-        return err; // Polling and return if error.
+    const uint8_t *p = packet;
+    unsigned int words = 6;
+    asm volatile("rep outsw" : "+S"(p), "+c"(words) : "d"(bus) : "memory");
 
-    // (VIII): Sending the packet data:
-    // ------------------------------------------------------------------
-    asm volatile("rep   outsw" : : "c"(6), "d"(bus), "S"(atapiPacket)); // Send Packet Data
-    for (i = 0; i < numsects; i++)
+    if (dma)
     {
-        ideWaitIrq(); // Wait for an IRQ.
-        if ((err = idePolling(channel, 1)))
+        ideDmaStart(channel);
+        return ideDmaWait(channel);
+    }
+
+    // An interrupt per DRQ block, the byte count registers say how big it
+    // is. The last interrupt comes with DRQ down.
+    for (;;)
+    {
+        if ((err = ideWaitIrq(channel, IDE_TIMEOUT_MS)))
+            return err;
+        if ((err = idePolling(channel, 0)))
+            return err;
+        uint8_t status = ideRead(channel, ATA_REG_STATUS);
+        if (status & ATA_SR_ERR)
+            return 2;
+        if (status & ATA_SR_DF)
+            return 1;
+        if (!(status & ATA_SR_DRQ))
+            break;
+
+        uint32_t bytes = ideRead(channel, ATA_REG_LBA1) | (ideRead(channel, ATA_REG_LBA2) << 8);
+        if (bytes == 0 || bytes > left || bytes % 2)
         {
-            printf("ATAPI: Error polling after IRQ for sector %d\n", i);
-            return err; // Polling failed, abort.
+            printf("ATAPI: drive %d offered %u bytes with %u left\n", drive, bytes, left);
+            return 2;
         }
-        ataReadSector(selector, (void *)edi, bus, words);
-        edi += (words * 2);
+        ataReadSector(selector, buf, bus, bytes / 2);
+        buf += bytes;
+        left -= bytes;
     }
+    return left ? 2 : 0;
+}
 
-    ideWaitIrq();
+// Whatever the buffer holds may be from another disc or half written
+static void ideAtapiDropReadahead(uint8_t drive)
+{
+    ideReadahead[drive].count = 0;
+    ideReadahead[drive].window = IDE_ATAPI_RA_MIN;
+}
 
-    // (XI): Waiting for BSY & DRQ to clear:
-    // ------------------------------------------------------------------
-    while (ideRead(channel, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ))
-        ;
+// READ(12) of count blocks. A failure drops the readahead, the drive
+// reports a disc change as a unit attention on the next command.
+static uint8_t ideAtapiCommand(uint8_t drive, uint32_t lba, uint32_t count, uint16_t selector, uint8_t *buf, uint32_t phys)
+{
+    uint8_t packet[12] = {ATAPI_CMD_READ, 0, (lba >> 24) & 0xFF, (lba >> 16) & 0xFF, (lba >> 8) & 0xFF, lba & 0xFF,
+                          (count >> 24) & 0xFF, (count >> 16) & 0xFF, (count >> 8) & 0xFF, count & 0xFF, 0, 0};
+    uint8_t err = ideAtapiPacket(drive, packet, count * ATAPI_SECTOR_SIZE, selector, buf, phys);
+    if (err)
+    {
+        ideAtapiDropReadahead(drive);
+        if (err == 2 && (ideRead(ideDevices[drive].Channel, ATA_REG_ERROR) >> 4) == ATAPI_SENSE_UNIT_ATTENTION)
+            printf("IDE cd%d: medium changed\n", drive);
+    }
+    return err;
+}
+
+// DMA memory, so the bus master fills it directly. 64K aligned like the
+// bounce buffers, each 64K half is one PRD.
+static void ideSetupReadahead(uint8_t drive)
+{
+    ide_atapi_ra_t *ra = &ideReadahead[drive];
+    ra->buf = memAllocDma(IDE_ATAPI_RA_MAX * ATAPI_SECTOR_SIZE, 0x10000, &ra->phys);
+    if (ra->buf == NULL)
+        printf("IDE: no memory for readahead on drive %d\n", drive);
+    ra->window = IDE_ATAPI_RA_MIN;
+}
+
+// Flat buffer, channel lock held. What's in the readahead buffer is copied
+// out, a miss refills it starting at the missing block.
+static uint8_t ideAtapiRead(uint8_t drive, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    ide_atapi_ra_t *ra = &ideReadahead[drive];
+    ra->blocks += count;
+    if (ra->count && ktime_get_ns() - ra->filled_ns > (uint64_t)IDE_ATAPI_RA_TTL_MS * NSEC_PER_MSEC)
+        ra->count = 0;
+    if (ra->buf == NULL)
+    {
+        ra->commands++;
+        return ideAtapiCommand(drive, lba, count, 0x10, buf, 0);
+    }
+
+    bool refilled = false;
+    while (count > 0)
+    {
+        if (ra->count && lba >= ra->lba && lba < ra->lba + ra->count)
+        {
+            uint32_t n = ra->lba + ra->count - lba < count ? ra->lba + ra->count - lba : count;
+            memcpy(buf, ra->buf + (lba - ra->lba) * ATAPI_SECTOR_SIZE, n * ATAPI_SECTOR_SIZE);
+            if (!refilled)
+                ra->hits += n;
+            refilled = false;
+            buf += n * ATAPI_SECTOR_SIZE;
+            lba += n;
+            count -= n;
+            continue;
+        }
+
+        // Carrying on right behind the buffer is a sequential stream
+        if (lba == ra->lba + ra->count)
+            ra->window = ra->window * 2 < IDE_ATAPI_RA_MAX ? ra->window * 2 : IDE_ATAPI_RA_MAX;
+        else
+            ra->window = IDE_ATAPI_RA_MIN;
+
+        uint32_t want = count < IDE_ATAPI_RA_MAX ? count : IDE_ATAPI_RA_MAX;
+        uint32_t n = want > ra->window ? want : ra->window;
+        ra->count = 0;
+        ra->commands++;
+        uint8_t err = ideAtapiCommand(drive, lba, n, 0x10, ra->buf, ra->phys);
+        if (err && n > want)
+        {
+            // Probably ran past the end of the disc, try without readahead
+            n = want;
+            ra->commands++;
+            err = ideAtapiCommand(drive, lba, n, 0x10, ra->buf, ra->phys);
+        }
+        if (err)
+            return err;
+        ra->lba = lba;
+        ra->count = n;
+        ra->filled_ns = ktime_get_ns();
+        refilled = true;
+    }
+    return 0;
+}
+
+uint8_t ide_atapi_read(uint8_t drive, unsigned int lba, uint8_t numsects, unsigned short selector, unsigned int edi)
+{
+    uint8_t channel = ideDevices[drive].Channel;
+    uint8_t err;
+    ideLock(channel);
+    if (selector == 0x10)
+        err = ideAtapiRead(drive, lba, numsects, (uint8_t *)edi);
+    else
+        err = ideAtapiCommand(drive, lba, numsects, selector, (uint8_t *)edi, 0);
+    ideUnlock(channel);
+    return err;
+}
+
+uint8_t ide_atapi_eject(uint8_t drive)
+{
+    if (drive >= 4 || !ideDevices[drive].Reserved || ideDevices[drive].Type != IDE_ATAPI)
+        return IDE_ERR_NODEV;
+    uint8_t packet[12] = {ATAPI_CMD_EJECT, 0, 0, 0, 0x02, 0, 0, 0, 0, 0, 0, 0}; // LoEj
+    uint8_t channel = ideDevices[drive].Channel;
+    ideLock(channel);
+    ideAtapiDropReadahead(drive);
+    uint8_t err = ideAtapiPacket(drive, packet, 0, 0x10, NULL, 0);
+    ideUnlock(channel);
+    return err;
+}
+
+void ide_atapi_report()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        ide_atapi_ra_t *ra = &ideReadahead[i];
+        if (!ideDevices[i].Reserved || ideDevices[i].Type != IDE_ATAPI)
+            continue;
+        printf("IDE cd%d: %u blocks in %u commands (%s), %u from readahead, window %u\n", i, ra->blocks, ra->commands,
+               ideUseDma(i, 0x10) && ra->buf ? "DMA" : "PIO", ra->hits, ra->window);
+    }
+}
+
+void ide_benchmark(uint8_t drive, uint32_t count)
+{
+    if (drive >= 4 || !ideDevices[drive].Reserved || ideDevices[drive].Type != IDE_ATA)
+        return;
+    if (count > ideDevices[drive].Size)
+        count = ideDevices[drive].Size;
+
+    uint8_t *buffer = kmalloc(IDE_DMA_MAX_SECTORS * 512);
+    if (buffer == NULL)
+        return;
+
+    bool was_dma = ide_use_dma;
+    uint64_t cycles[2];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        ide_use_dma = pass == 1;
+        uint64_t start = rdtsc();
+        for (uint32_t lba = 0; lba < count; lba += IDE_DMA_MAX_SECTORS)
+        {
+            uint32_t n = count - lba < IDE_DMA_MAX_SECTORS ? count - lba : IDE_DMA_MAX_SECTORS;
+            if (ide_ata_rw(ATA_READ, drive, lba, n, 0x10, (unsigned int)buffer))
+                break;
+        }
+        cycles[pass] = rdtsc() - start;
+    }
+    ide_use_dma = was_dma;
+
+    uint32_t khz = ktime_tsc_khz();
+    uint64_t kb = (uint64_t)count / 2;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t us = khz ? cycles[pass] * 1000 / khz : 0;
+        printf("IDE %s: %llu KB in %llu us, %llu KB/s\n", pass ? "DMA" : "PIO", kb, us, us ? kb * 1000000 / us : 0);
+    }
+
+    kfree(buffer);
+}
 
-    return 0; // Easy, ... Isn't it?
+void ide_benchmark_writes(uint8_t drive, uint64_t scratch_lba)
+{
+    struct blk_queue *q = ide_queue(drive);
+    if (q == NULL || ideDevices[drive].Type != IDE_ATA || scratch_lba + IDE_BENCH_WRITES > ideDevices[drive].Size)
+    {
+        printf("IDE: no scratch range at %llu on drive %d, skipping write benchmark\n", scratch_lba, drive);
+        return;
+    }
+
+    uint8_t *buffer = kmalloc(IDE_BENCH_WRITES * 512);
+    if (buffer == NULL)
+        return;
+
+    // Single sector writes of what's already there, each one durable on
+    // its own against cached with one sync at the end
+    if (blk_rw(q, BLK_READ, scratch_lba, IDE_BENCH_WRITES, buffer))
+    {
+        kfree(buffer);
+        return;
+    }
+    uint64_t cycles[2];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < IDE_BENCH_WRITES; i++)
+        {
+            struct blk_io io = {
+                BLK_WRITE, pass ? 0 : BLK_FUA, scratch_lba + i, 1, buffer + i * 512, false, 0, NULL, NULL, NULL};
+            blk_submit(q, &io);
+            if (blk_wait(q, &io))
+                break;
+        }
+        if (pass)
+            blk_sync(q);
+        cycles[pass] = rdtsc() - start;
+    }
+    kfree(buffer);
+
+    uint32_t khz = ktime_tsc_khz();
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t us = khz ? cycles[pass] * 1000 / khz : 0;
+        printf("IDE %s writes: %u sectors in %llu us, %llu writes/s\n", pass ? "cached" : "FUA", IDE_BENCH_WRITES, us,
+               us ? (uint64_t)IDE_BENCH_WRITES * 1000000 / us : 0);
+    }
 }
 
 void idePrintProg(pci_device_t *device)
@@ -0,0 +1,212 @@
+#include <drivers/ioapic.h>
+#include <drivers/lapic.h>
+#include <memory.h>
+#include <idt.h>
+#include <util.h>
+#include <stdio.h>
+
+#define IOAPIC_MMIO_SIZE 0x20
+
+struct ioapic
+{
+    volatile uint8_t *base;
+    uint8_t id;
+    uint32_t gsi_base;
+    uint32_t num_pins;
+};
+
+static struct ioapic ioapics[IOAPIC_MAX];
+static int num_ioapics = 0;
+
+// Where each IRQ comes in, -1 if nowhere, and how the pin is wired.
+static int32_t irq_gsi[IRQ_MSI_FIRST];
+static uint32_t irq_flags[IRQ_MSI_FIRST]; // IOAPIC_POLARITY_LOW | IOAPIC_TRIGGER_LEVEL
+
+static uint32_t ioapicRead(struct ioapic *io, uint8_t reg)
+{
+    *(volatile uint32_t *)(io->base + IOAPIC_REGSEL) = reg;
+    return *(volatile uint32_t *)(io->base + IOAPIC_WINDOW);
+}
+
+static void ioapicWrite(struct ioapic *io, uint8_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(io->base + IOAPIC_REGSEL) = reg;
+    *(volatile uint32_t *)(io->base + IOAPIC_WINDOW) = value;
+}
+
+static struct ioapic *ioapicForGsi(uint32_t gsi, uint32_t *pin)
+{
+    for (int i = 0; i < num_ioapics; i++)
+    {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].num_pins)
+        {
+            *pin = gsi - ioapics[i].gsi_base;
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t ioapic_isa_to_gsi(uint8_t irq)
+{
+    return irq < NUM_ISA_IRQS && irq_gsi[irq] >= 0 ? (uint32_t)irq_gsi[irq] : irq;
+}
+
+static void routeIrq(int irq, bool masked)
+{
+    uint32_t pin;
+    struct ioapic *io = ioapicForGsi(irq_gsi[irq], &pin);
+    if (io == NULL)
+        return;
+
+    uint32_t low = (IRQ_VECTOR_BASE + irq) | irq_flags[irq];
+    if (masked)
+        low |= IOAPIC_MASKED;
+
+    // Fixed delivery, physical destination: this cpu. High half first so
+    // the entry never points somewhere else while unmasked.
+    ioapicWrite(io, IOAPIC_REG_REDIRECT(pin) + 1, lapic_id() << 24);
+    ioapicWrite(io, IOAPIC_REG_REDIRECT(pin), low);
+}
+
+void ioapic_set_irq_mask(int irq, bool masked)
+{
+    if (irq < 0 || irq >= IRQ_MSI_FIRST || irq_gsi[irq] < 0)
+        return;
+
+    uint32_t pin;
+    struct ioapic *io = ioapicForGsi(irq_gsi[irq], &pin);
+    if (io == NULL)
+        return;
+
+    uint32_t low = ioapicRead(io, IOAPIC_REG_REDIRECT(pin));
+    if (masked)
+        low |= IOAPIC_MASKED;
+    else
+        low &= ~IOAPIC_MASKED;
+    ioapicWrite(io, IOAPIC_REG_REDIRECT(pin), low);
+}
+
+bool ioapic_msi_message(int irq, uint32_t *address, uint32_t *data)
+{
+    if (!irq_apic_mode() || irq < 0 || irq >= NUM_IRQS)
+        return false;
+
+    // Physical destination this cpu, fixed delivery, edge triggered
+    *address = MSI_ADDRESS_BASE | (lapic_id() << 12);
+    *data = IRQ_VECTOR_BASE + irq;
+    return true;
+}
+
+static void parseMadt(MADT_t *madt)
+{
+    uint8_t *entry = (uint8_t *)madt + sizeof(MADT_t);
+    uint8_t *end = (uint8_t *)madt + madt->header.Length;
+
+    while (entry + sizeof(MADTEntryHeader_t) <= end)
+    {
+        MADTEntryHeader_t *header = (MADTEntryHeader_t *)entry;
+        if (header->length < sizeof(MADTEntryHeader_t))
+            break;
+
+        if (header->type == MADT_ENTRY_IOAPIC && num_ioapics < IOAPIC_MAX)
+        {
+            MADTIOApic_t *info = (MADTIOApic_t *)entry;
+            struct ioapic *io = &ioapics[num_ioapics];
+            io->base = vmmMapMmio(info->address, IOAPIC_MMIO_SIZE, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+            if (io->base != NULL)
+            {
+                io->id = info->id;
+                io->gsi_base = info->gsi_base;
+                io->num_pins = ((ioapicRead(io, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+                num_ioapics++;
+            }
+        }
+        else if (header->type == MADT_ENTRY_OVERRIDE)
+        {
+            MADTOverride_t *override = (MADTOverride_t *)entry;
+            if (override->bus == 0 && override->source < NUM_ISA_IRQS)
+            {
+                uint32_t flags = 0;
+                if ((override->flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW)
+                    flags |= IOAPIC_POLARITY_LOW;
+                if ((override->flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL)
+                    flags |= IOAPIC_TRIGGER_LEVEL;
+                irq_gsi[override->source] = override->gsi;
+                irq_flags[override->source] = flags;
+            }
+        }
+        entry += header->length;
+    }
+}
+
+bool ioapic_init()
+{
+    if (!lapic_present())
+        return false;
+
+    MADT_t *madt = (MADT_t *)acpi_find_table("APIC");
+    if (madt == NULL)
+    {
+        printf("IOAPIC: no MADT, staying on the PIC\n");
+        return false;
+    }
+
+    for (int irq = 0; irq < IRQ_MSI_FIRST; irq++)
+    {
+        irq_gsi[irq] = -1;
+        irq_flags[irq] = 0;
+    }
+    parseMadt(madt);
+    if (num_ioapics == 0)
+    {
+        printf("IOAPIC: none in the MADT, staying on the PIC\n");
+        return false;
+    }
+
+    // ISA IRQs without an override sit on the pin of the same number unless
+    // an override already took it (IRQ0 usually lives on GSI 2). Above the
+    // ISA range IRQ n is GSI n, PCI style active low and level triggered.
+    for (int irq = 0; irq < IRQ_MSI_FIRST; irq++)
+    {
+        if (irq_gsi[irq] >= 0)
+            continue;
+
+        bool taken = false;
+        for (int other = 0; other < NUM_ISA_IRQS; other++)
+        {
+            if (irq_gsi[other] == irq)
+                taken = true;
+        }
+        if (taken)
+            continue;
+
+        irq_gsi[irq] = irq;
+        if (irq >= NUM_ISA_IRQS)
+            irq_flags[irq] = IOAPIC_POLARITY_LOW | IOAPIC_TRIGGER_LEVEL;
+    }
+
+    uint32_t flags = saveInterrupts();
+
+    // Everything starts masked, irq_set_apic_mode unmasks the lines that
+    // have handlers and weren't masked on the PIC.
+    for (int i = 0; i < num_ioapics; i++)
+    {
+        for (uint32_t pin = 0; pin < ioapics[i].num_pins; pin++)
+            ioapicWrite(&ioapics[i], IOAPIC_REG_REDIRECT(pin), IOAPIC_MASKED);
+    }
+    for (int irq = 0; irq < IRQ_MSI_FIRST; irq++)
+    {
+        if (irq_gsi[irq] >= 0)
+            routeIrq(irq, true);
+    }
+
+    disable_pic();
+    irq_set_apic_mode();
+    restoreInterrupts(flags);
+
+    for (int i = 0; i < num_ioapics; i++)
+        printf("IOAPIC: id %u, GSI %u-%u\n", ioapics[i].id, ioapics[i].gsi_base,
+               ioapics[i].gsi_base + ioapics[i].num_pins - 1);
+    return true;
+}
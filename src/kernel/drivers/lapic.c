@@ -0,0 +1,246 @@
+#include <drivers/lapic.h>
+#include <memory.h>
+#include <idt.h>
+#include <timer.h>
+#include <ktime.h>
+#include <irqstat.h>
+#include <util.h>
+#include <stdio.h>
+
+#define LAPIC_MMIO_SIZE 0x1000
+#define LAPIC_CALIBRATE_MS 10
+
+static volatile uint8_t *lapic_base = NULL;
+static uint32_t timer_freq; // after LAPIC_DIVIDE_16
+static bool tsc_deadline;
+static lapic_timer_mode_t timer_mode = LAPIC_TIMER_OFF;
+
+// Tick state. In TSC-deadline mode every tick arms the next one.
+static bool driving_tick;
+static uint64_t tsc_per_tick;
+static uint64_t next_deadline;
+
+static void (*timer_handler)() = NULL;
+
+static inline uint32_t lapicRead(uint32_t reg)
+{
+    return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+static inline void lapicWrite(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+bool lapic_present()
+{
+    return lapic_base != NULL;
+}
+
+void lapic_eoi()
+{
+    lapicWrite(LAPIC_REG_EOI, 0);
+}
+
+uint32_t lapic_id()
+{
+    return lapic_base ? lapicRead(LAPIC_REG_ID) >> 24 : 0;
+}
+
+uint32_t lapic_timer_frequency()
+{
+    return timer_freq;
+}
+
+lapic_timer_mode_t lapic_timer_mode()
+{
+    return timer_mode;
+}
+
+bool lapic_tsc_deadline_supported()
+{
+    return tsc_deadline;
+}
+
+static void armNextDeadline()
+{
+    uint64_t now = rdtsc();
+    next_deadline += tsc_per_tick;
+    // Fell behind (long cli section, debugger), don't fire a burst.
+    if ((int64_t)(next_deadline - now) <= 0)
+        next_deadline = now + tsc_per_tick;
+    wrmsr(IA32_TSC_DEADLINE, next_deadline);
+}
+
+static void lapicTimerIrq(uint32_t vector)
+{
+    uint64_t start = rdtsc();
+    if (driving_tick)
+    {
+        if (timer_mode == LAPIC_TIMER_TSC_DEADLINE)
+            armNextDeadline();
+        lapic_eoi();
+        timer_tick();
+    }
+    else
+    {
+        if (timer_mode == LAPIC_TIMER_ONESHOT || timer_mode == LAPIC_TIMER_TSC_DEADLINE)
+            timer_mode = LAPIC_TIMER_OFF;
+        lapic_eoi();
+        if (timer_handler)
+            timer_handler();
+    }
+    irqstat_record(vector, (uint32_t)(rdtsc() - start));
+}
+
+// Spurious interrupts don't get an EOI.
+static void lapicSpuriousIrq(uint32_t vector)
+{
+    irqstat_spurious(vector);
+}
+
+// Counts down from the top for LAPIC_CALIBRATE_MS worth of TSC cycles.
+static uint32_t calibrateTimer()
+{
+    uint64_t wait = (uint64_t)ktime_tsc_khz() * LAPIC_CALIBRATE_MS;
+
+    lapicWrite(LAPIC_REG_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_LVT_ONESHOT | LAPIC_TIMER_VECTOR);
+
+    uint64_t start = rdtsc();
+    lapicWrite(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+    while (rdtsc() - start < wait)
+        ;
+    uint32_t elapsed = 0xFFFFFFFF - lapicRead(LAPIC_REG_TIMER_CURRENT);
+    lapicWrite(LAPIC_REG_TIMER_INITIAL, 0);
+
+    return elapsed * (1000 / LAPIC_CALIBRATE_MS);
+}
+
+void lapic_timer_stop()
+{
+    if (!lapic_base)
+        return;
+    lapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapicWrite(LAPIC_REG_TIMER_INITIAL, 0);
+    if (tsc_deadline)
+        wrmsr(IA32_TSC_DEADLINE, 0);
+    timer_mode = LAPIC_TIMER_OFF;
+    driving_tick = false;
+}
+
+void lapic_timer_set_handler(void (*handler)())
+{
+    timer_handler = handler;
+}
+
+void lapic_timer_oneshot(uint64_t delay_ns)
+{
+    uint64_t count = delay_ns * timer_freq / NSEC_PER_SEC;
+    if (count == 0)
+        count = 1;
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+
+    uint32_t flags = saveInterrupts();
+    lapic_timer_stop();
+    lapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapicWrite(LAPIC_REG_TIMER_INITIAL, (uint32_t)count);
+    timer_mode = LAPIC_TIMER_ONESHOT;
+    restoreInterrupts(flags);
+}
+
+void lapic_timer_periodic(uint32_t hz)
+{
+    uint32_t flags = saveInterrupts();
+    lapic_timer_stop();
+    lapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapicWrite(LAPIC_REG_TIMER_INITIAL, timer_freq / hz);
+    timer_mode = LAPIC_TIMER_PERIODIC;
+    restoreInterrupts(flags);
+}
+
+// Fires once rdtsc reaches tsc. Reprogramming is a single wrmsr, no MMIO.
+bool lapic_timer_deadline(uint64_t tsc)
+{
+    if (!tsc_deadline)
+        return false;
+
+    uint32_t flags = saveInterrupts();
+    if (timer_mode != LAPIC_TIMER_TSC_DEADLINE || driving_tick)
+    {
+        lapic_timer_stop();
+        lapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+        // The LVT write has to land before the MSR write arms the timer.
+        asm volatile("mfence" ::: "memory");
+        timer_mode = LAPIC_TIMER_TSC_DEADLINE;
+    }
+    wrmsr(IA32_TSC_DEADLINE, tsc);
+    restoreInterrupts(flags);
+    return true;
+}
+
+void lapic_timer_start_tick()
+{
+    uint32_t flags = saveInterrupts();
+    if (tsc_deadline)
+    {
+        tsc_per_tick = (uint64_t)ktime_tsc_khz() * 1000 / TIMER_FREQ;
+        next_deadline = rdtsc();
+        lapic_timer_deadline(next_deadline + tsc_per_tick);
+        next_deadline += tsc_per_tick;
+    }
+    else
+        lapic_timer_periodic(TIMER_FREQ);
+    driving_tick = true;
+    restoreInterrupts(flags);
+}
+
+bool lapic_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9)))
+    {
+        printf("LAPIC: not present, tick stays on IRQ0\n");
+        return false;
+    }
+    if (ktime_tsc_khz() == 0)
+    {
+        printf("LAPIC: no calibrated TSC, tick stays on IRQ0\n");
+        return false;
+    }
+    tsc_deadline = (ecx & (1 << 24)) != 0;
+
+    uint64_t base = rdmsr(IA32_APIC_BASE);
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+    lapic_base = vmmMapMmio((uint32_t)base & ~0xFFF, LAPIC_MMIO_SIZE, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+    if (lapic_base == NULL)
+        return false;
+
+    vector_install_handler(LAPIC_TIMER_VECTOR, lapicTimerIrq);
+    vector_install_handler(LAPIC_SPURIOUS_VECTOR, lapicSpuriousIrq);
+
+    uint32_t flags = saveInterrupts();
+
+    // Software enable. LINT0 stays in whatever virtual wire setup the BIOS
+    // left, so the PIC keeps delivering everything else.
+    lapicWrite(LAPIC_REG_TPR, 0);
+    lapicWrite(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    timer_freq = calibrateTimer();
+    if (timer_freq == 0)
+    {
+        restoreInterrupts(flags);
+        printf("LAPIC: timer didn't count, tick stays on IRQ0\n");
+        return false;
+    }
+
+    lapic_timer_start_tick();
+    irq_mask(0);
+    restoreInterrupts(flags);
+
+    printf("LAPIC: id %u, timer %u kHz, tick in %s mode\n", lapic_id(), timer_freq / 1000,
+           tsc_deadline ? "TSC-deadline" : "periodic");
+    return true;
+}
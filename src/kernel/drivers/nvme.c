@@ -0,0 +1,771 @@
+#include <drivers/nvme.h>
+#include <drivers/device.h>
+#include <drivers/lapic.h>
+#include <memory.h>
+#include <liballoc.h>
+#include <idt.h>
+#include <ktime.h>
+#include <util.h>
+#include <string.h>
+#include <stdio.h>
+
+static nvme_controller_t controller;
+static nvme_namespace_t *disks[NVME_MAX_DISKS];
+static uint32_t numDisks = 0;
+static const char *diskNames[NVME_MAX_DISKS] = {"nvme0n1", "nvme0n2", "nvme0n3", "nvme0n4"};
+
+static inline uint32_t regRead(volatile uint8_t *base, uint32_t reg)
+{
+    return *(volatile uint32_t *)(base + reg);
+}
+
+static inline void regWrite(volatile uint8_t *base, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(base + reg) = value;
+}
+
+static inline uint64_t regRead64(volatile uint8_t *base, uint32_t reg)
+{
+    return regRead(base, reg) | (uint64_t)regRead(base, reg + 4) << 32;
+}
+
+static inline void regWrite64(volatile uint8_t *base, uint32_t reg, uint64_t value)
+{
+    regWrite(base, reg, (uint32_t)value);
+    regWrite(base, reg + 4, (uint32_t)(value >> 32));
+}
+
+// Spins until (reg & mask) == value, false if that takes over timeout_ms
+static bool waitReg(volatile uint8_t *base, uint32_t reg, uint32_t mask, uint32_t value, uint32_t timeout_ms)
+{
+    uint64_t deadline = ktime_get_ns() + (uint64_t)timeout_ms * NSEC_PER_MSEC;
+    while ((regRead(base, reg) & mask) != value)
+    {
+        if (ktime_get_ns() >= deadline)
+            return false;
+        asm volatile("pause");
+    }
+    return true;
+}
+
+// CAP.TO is how long the controller may take to come up or go down
+static bool waitReady(nvme_controller_t *c, bool ready)
+{
+    uint32_t timeout = NVME_CAP_TO(c->cap) * 500;
+    return waitReg(c->regs, NVME_REG_CSTS, NVME_CSTS_RDY, ready ? NVME_CSTS_RDY : 0, timeout ? timeout : 500);
+}
+
+// Only the boot CPU is brought up, so that's one I/O queue pair. With
+// the APs running each would land on its own pair by APIC id.
+static uint32_t onlineCpus()
+{
+    return 1;
+}
+
+static nvme_queue_pair_t *cpuQueue(nvme_controller_t *c)
+{
+    return c->io[c->nio > 1 && lapic_present() ? lapic_id() % c->nio : 0];
+}
+
+static bool queueAlloc(nvme_controller_t *c, nvme_queue_pair_t *qp, uint16_t qid, uint16_t size)
+{
+    qp->ctrl = c;
+    qp->qid = qid;
+    qp->size = size;
+    qp->irq = -1;
+    qp->vector = 0;
+    qp->sq = memAllocDma(size * sizeof(nvme_sqe_t), PAGE_SIZE, &qp->sq_phys);
+    qp->cq = memAllocDma(size * sizeof(nvme_cqe_t), PAGE_SIZE, &qp->cq_phys);
+    if (qp->sq == NULL || qp->cq == NULL)
+        return false;
+
+    qp->sq_doorbell = (volatile uint32_t *)(c->regs + NVME_REG_DOORBELLS + (2 * qid) * c->doorbell_stride);
+    qp->cq_doorbell = (volatile uint32_t *)(c->regs + NVME_REG_DOORBELLS + (2 * qid + 1) * c->doorbell_stride);
+    qp->sq_tail = qp->sq_rung = qp->cq_head = 0;
+    qp->phase = 1; // the ring is zeroed, the controller's first pass writes ones
+    return true;
+}
+
+// Tells the controller about everything queued since the last time.
+// Interrupts off.
+static void ringDoorbell(nvme_queue_pair_t *qp)
+{
+    if (qp->sq_tail == qp->sq_rung)
+        return;
+    *qp->sq_doorbell = qp->sq_tail;
+    qp->sq_rung = qp->sq_tail;
+    qp->doorbells++;
+}
+
+// Polled, before there are I/O queues. Returns the status field, 0 is
+// success and 0xFFFF a timeout.
+static uint16_t adminCommand(nvme_controller_t *c, nvme_sqe_t *cmd, uint32_t *result)
+{
+    nvme_queue_pair_t *qp = &c->admin;
+    cmd->cdw0 |= (uint32_t)qp->sq_tail << 16;
+    qp->sq[qp->sq_tail] = *cmd;
+    qp->sq_tail = (qp->sq_tail + 1) % qp->size;
+    ringDoorbell(qp);
+
+    uint64_t deadline = ktime_get_ns() + (uint64_t)NVME_TIMEOUT_MS * NSEC_PER_MSEC;
+    while ((qp->cq[qp->cq_head].status & 1) != qp->phase)
+    {
+        if (ktime_get_ns() >= deadline)
+            return 0xFFFF;
+        asm volatile("pause");
+    }
+    uint16_t status = qp->cq[qp->cq_head].status >> 1;
+    if (result)
+        *result = qp->cq[qp->cq_head].result;
+    if (++qp->cq_head == qp->size)
+    {
+        qp->cq_head = 0;
+        qp->phase ^= 1;
+    }
+    *qp->cq_doorbell = qp->cq_head;
+    return status;
+}
+
+static uint16_t identify(nvme_controller_t *c, uint32_t cns, uint32_t nsid, uint32_t phys)
+{
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = phys;
+    cmd.cdw10 = cns;
+    return adminCommand(c, &cmd, NULL);
+}
+
+// Completion queue first, the submission queue names it
+static bool createQueuePair(nvme_controller_t *c, nvme_queue_pair_t *qp)
+{
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = qp->cq_phys;
+    cmd.cdw10 = (uint32_t)(qp->size - 1) << 16 | qp->qid;
+    cmd.cdw11 = (uint32_t)qp->vector << 16 | NVME_QUEUE_CONTIGUOUS | (qp->irq >= 0 ? NVME_CQ_IRQ_ENABLED : 0);
+    if (adminCommand(c, &cmd, NULL) != 0)
+        return false;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = qp->sq_phys;
+    cmd.cdw10 = (uint32_t)(qp->size - 1) << 16 | qp->qid;
+    cmd.cdw11 = (uint32_t)qp->qid << 16 | NVME_QUEUE_CONTIGUOUS;
+    return adminCommand(c, &cmd, NULL) == 0;
+}
+
+// Puts the slot's next stage on the submission queue, the doorbell is
+// rung by whoever called. Interrupts off.
+static void issueStage(nvme_queue_pair_t *qp, uint32_t slot)
+{
+    struct nvme_slot *s = &qp->slots[slot];
+    struct blk_request *rq = s->rq;
+    nvme_sqe_t *cmd = &qp->sq[qp->sq_tail];
+    memset(cmd, 0, sizeof(nvme_sqe_t));
+    cmd->nsid = s->ns->nsid;
+
+    if ((s->stages & -s->stages) == NVME_STAGE_PREFLUSH)
+        cmd->cdw0 = NVME_CMD_FLUSH;
+    else
+    {
+        cmd->cdw0 = rq->direction == BLK_WRITE ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd->prp1 = s->prp1;
+        cmd->prp2 = s->prp2;
+        cmd->cdw10 = (uint32_t)rq->lba;
+        cmd->cdw11 = (uint32_t)(rq->lba >> 32);
+        cmd->cdw12 = rq->count - 1;
+        if (rq->direction == BLK_WRITE && (rq->flags & BLK_FUA))
+            cmd->cdw12 |= NVME_RW_FUA;
+    }
+    cmd->cdw0 |= slot << 16;
+    qp->sq_tail = (qp->sq_tail + 1) % qp->size;
+    qp->commands++;
+}
+
+// Interrupts off. A slot's stages all go out back to back, the bit that
+// just finished is the lowest one left.
+static void finishSlot(nvme_queue_pair_t *qp, uint32_t slot, uint8_t err)
+{
+    struct nvme_slot *s = &qp->slots[slot];
+    s->stages &= s->stages - 1;
+    if (err == 0 && s->stages)
+    {
+        issueStage(qp, slot);
+        return;
+    }
+
+    nvme_namespace_t *ns = s->ns;
+    struct blk_request *rq = s->rq;
+    if (err)
+        ns->errors++;
+    s->ns = NULL;
+    s->rq = NULL;
+    s->stages = 0;
+    qp->active &= ~(1ull << slot);
+    blk_complete(&ns->queue, rq, err);
+}
+
+// Completes everything the controller has posted, returns how much that
+// was. Interrupts off.
+static uint32_t queueService(nvme_queue_pair_t *qp)
+{
+    uint32_t n = 0;
+    while ((qp->cq[qp->cq_head].status & 1) == qp->phase)
+    {
+        uint16_t cid = qp->cq[qp->cq_head].cid;
+        uint16_t status = qp->cq[qp->cq_head].status >> 1;
+        if (++qp->cq_head == qp->size)
+        {
+            qp->cq_head = 0;
+            qp->phase ^= 1;
+        }
+        n++;
+        if (cid < qp->nslots && (qp->active & (1ull << cid)))
+            finishSlot(qp, cid, status ? NVME_ERR_DEVICE : 0);
+    }
+    if (n)
+    {
+        qp->progress = ktime_get_ns();
+        *qp->cq_doorbell = qp->cq_head;
+        // Follow-up stages finishSlot queued
+        ringDoorbell(qp);
+    }
+    return n;
+}
+
+// Submission queue first, deleting it makes the controller drop whatever
+// is still on it
+static bool deleteQueuePair(nvme_controller_t *c, nvme_queue_pair_t *qp)
+{
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_DELETE_SQ;
+    cmd.cdw10 = qp->qid;
+    if (adminCommand(c, &cmd, NULL) != 0)
+        return false;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_DELETE_CQ;
+    cmd.cdw10 = qp->qid;
+    return adminCommand(c, &cmd, NULL) == 0;
+}
+
+// A command went missing. The pair is torn down and set up again, so the
+// controller no longer owns any of the buffers and no stale completion
+// can land on a reused slot, then everything outstanding fails. If the
+// controller doesn't take the admin commands the pair stays dead.
+// Interrupts off.
+static void queueRecover(nvme_queue_pair_t *qp, uint8_t err)
+{
+    nvme_controller_t *c = qp->ctrl;
+    uint32_t csts = regRead(c->regs, NVME_REG_CSTS);
+    printf("NVMe: queue %u error %u, CSTS 0x%x, failing 0x%llx\n", qp->qid, err, csts, qp->active);
+    qp->timeouts++;
+
+    if (!(csts & NVME_CSTS_CFS) && deleteQueuePair(c, qp))
+    {
+        memset((void *)qp->cq, 0, qp->size * sizeof(nvme_cqe_t));
+        qp->sq_tail = qp->sq_rung = qp->cq_head = 0;
+        qp->phase = 1;
+        qp->dead = !createQueuePair(c, qp);
+    }
+    else
+        qp->dead = true;
+    if (qp->dead)
+        printf("NVMe: queue %u is gone\n", qp->qid);
+
+    qp->progress = ktime_get_ns();
+    uint64_t failed = qp->active;
+    while (failed)
+    {
+        uint32_t slot = __builtin_ctzll(failed);
+        failed &= failed - 1;
+        finishSlot(qp, slot, err);
+    }
+}
+
+// Runs in softirq context. Only fires if nothing completed for a whole
+// timeout, otherwise it rearms for the rest of it.
+static void nvmeTimeout(struct hrtimer *timer)
+{
+    nvme_queue_pair_t *qp = timer->data;
+    uint32_t flags = saveInterrupts();
+    // A lost interrupt isn't a lost command
+    queueService(qp);
+    if (qp->active && ktime_get_ns() - qp->progress >= (uint64_t)NVME_IO_TIMEOUT_MS * NSEC_PER_MSEC)
+        queueRecover(qp, NVME_ERR_TIMEOUT);
+    if (qp->active)
+        hrtimer_start_abs(timer, qp->progress + (uint64_t)NVME_IO_TIMEOUT_MS * NSEC_PER_MSEC);
+    restoreInterrupts(flags);
+}
+
+// Every pair on this line. There's no interrupt status register, a
+// shared INTx line is ours if a completion queue moved.
+static irqreturn_t nvmeIrq(int irq, void *dev_id)
+{
+    nvme_controller_t *c = dev_id;
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < c->nio; i++)
+    {
+        nvme_queue_pair_t *qp = c->io[i];
+        if (qp->irq != irq)
+            continue;
+        qp->interrupts++;
+        done += queueService(qp);
+    }
+    return (done || c->msix || c->msi) ? IRQ_HANDLED : IRQ_NONE;
+}
+
+// For waiters with interrupts off
+static void nvmePoll(void *dev)
+{
+    nvme_namespace_t *ns = dev;
+    for (uint32_t i = 0; i < ns->ctrl->nio; i++)
+        queueService(ns->ctrl->io[i]);
+}
+
+// One doorbell write for everything the queue just started
+static void nvmeCommit(void *dev)
+{
+    nvme_namespace_t *ns = dev;
+    uint32_t flags = saveInterrupts();
+    ringDoorbell(cpuQueue(ns->ctrl));
+    restoreInterrupts(flags);
+}
+
+// PRP1 may start anywhere (dword aligned) in a page, every entry after it
+// starts a page and all but the last run to its end. More than two
+// entries go in the slot's list page and PRP2 points there.
+static bool buildPrps(nvme_queue_pair_t *qp, uint32_t slot, const struct blk_segment *segs, uint32_t nsegs)
+{
+    struct nvme_slot *s = &qp->slots[slot];
+    uint64_t *list = qp->prp_lists + slot * (PAGE_SIZE / sizeof(uint64_t));
+    uint32_t n = 0, end = 0;
+    for (uint32_t i = 0; i < nsegs; i++)
+    {
+        uint32_t virt = (uint32_t)segs[i].buf;
+        uint32_t left = segs[i].sectors * 512;
+        while (left)
+        {
+            uint32_t phys = vmmVirtToPhys(virt);
+            uint32_t chunk = PAGE_SIZE - (virt & 0xFFF);
+            if (chunk > left)
+                chunk = left;
+            if (phys == 0 || (phys & 3))
+                return false;
+
+            if (n == 0)
+                s->prp1 = phys;
+            else if ((phys & 0xFFF) || (end & 0xFFF) || n == NVME_PRP_ENTRIES)
+                return false;
+            else
+                list[n - 1] = phys;
+            n++;
+            end = phys + chunk;
+            virt += chunk;
+            left -= chunk;
+        }
+    }
+    if (n <= 1)
+        s->prp2 = 0;
+    else if (n == 2)
+        s->prp2 = list[0];
+    else
+        s->prp2 = qp->prp_lists_phys + slot * PAGE_SIZE;
+    return true;
+}
+
+// blk_start_t. Takes a free slot on this CPU's queue pair and queues the
+// request's first command, nvmeCommit rings the doorbell.
+static uint8_t nvmeStart(void *dev, struct blk_request *rq, const struct blk_segment *segs, uint32_t nsegs)
+{
+    nvme_namespace_t *ns = dev;
+    uint8_t stages = 0;
+    // Without a volatile write cache everything written is already durable
+    if ((rq->flags & BLK_PREFLUSH) && ns->ctrl->write_cache)
+        stages |= NVME_STAGE_PREFLUSH;
+    if (rq->count)
+        stages |= NVME_STAGE_DATA;
+
+    uint32_t flags = saveInterrupts();
+    if (stages == 0)
+    {
+        blk_complete(&ns->queue, rq, 0);
+        restoreInterrupts(flags);
+        return 0;
+    }
+
+    nvme_queue_pair_t *qp = cpuQueue(ns->ctrl);
+    if (qp->dead)
+    {
+        restoreInterrupts(flags);
+        return NVME_ERR_DEAD;
+    }
+    uint64_t free = ~qp->active & (qp->nslots >= 64 ? ~0ull : (1ull << qp->nslots) - 1);
+    if (free == 0)
+    {
+        // Namespace depths add up to the slots, so this doesn't happen
+        restoreInterrupts(flags);
+        return NVME_ERR_BUSY;
+    }
+    uint32_t slot = __builtin_ctzll(free);
+    if (rq->count && !buildPrps(qp, slot, segs, nsegs))
+    {
+        restoreInterrupts(flags);
+        return NVME_ERR_ALIGN;
+    }
+
+    struct nvme_slot *s = &qp->slots[slot];
+    s->ns = ns;
+    s->rq = rq;
+    s->stages = stages;
+    if (qp->active == 0)
+    {
+        qp->progress = ktime_get_ns();
+        hrtimer_start(&qp->timeout, (uint64_t)NVME_IO_TIMEOUT_MS * NSEC_PER_MSEC, NULL);
+    }
+    qp->active |= 1ull << slot;
+    issueStage(qp, slot);
+    restoreInterrupts(flags);
+    return 0;
+}
+
+// MSI-X gives each pair its own vector (entry 0 stays with the admin
+// queue, which is only ever polled). Otherwise they all share MSI or the
+// INTx line the BIOS routed, and without either the queues poll.
+static void setupInterrupts(nvme_controller_t *c)
+{
+    pci_device_t *dev = c->pci;
+    if (pciFindCapability(dev, PCI_CAP_ID_MSIX))
+    {
+        for (uint32_t i = 0; i < c->nio; i++)
+        {
+            nvme_queue_pair_t *qp = c->io[i];
+            int irq = irq_alloc();
+            if (irq >= 0 && pciEnableMsix(dev, i + 1, irq))
+            {
+                qp->irq = irq;
+                qp->vector = i + 1;
+                c->msix = true;
+            }
+            else if (i > 0)
+            {
+                // Out of lines or table entries, double up
+                qp->irq = c->io[i - 1]->irq;
+                qp->vector = c->io[i - 1]->vector;
+            }
+            else
+                break;
+        }
+        if (c->msix)
+            return;
+    }
+
+    int irq = -1;
+    if (pciFindCapability(dev, PCI_CAP_ID_MSI) && (irq = irq_alloc()) >= 0 && pciEnableMsi(dev, irq))
+        c->msi = true;
+    else if (dev->irq_pin && dev->irq_line < NUM_ISA_IRQS)
+        irq = dev->irq_line;
+    else
+        irq = -1;
+    for (uint32_t i = 0; i < c->nio; i++)
+    {
+        c->io[i]->irq = irq;
+        c->io[i]->vector = 0;
+    }
+}
+
+static nvme_queue_pair_t *ioQueueInit(nvme_controller_t *c, uint16_t qid, uint16_t size)
+{
+    nvme_queue_pair_t *qp = kmalloc(sizeof(nvme_queue_pair_t));
+    if (qp == NULL)
+        return NULL;
+    memset(qp, 0, sizeof(nvme_queue_pair_t));
+    // A full ring looks empty, so one entry always stays unused
+    qp->nslots = size - 1 < NVME_IO_SLOTS ? size - 1 : NVME_IO_SLOTS;
+    qp->prp_lists = memAllocDma(qp->nslots * PAGE_SIZE, PAGE_SIZE, &qp->prp_lists_phys);
+    if (qp->prp_lists == NULL || !queueAlloc(c, qp, qid, size))
+    {
+        if (qp->prp_lists)
+            memFreeDma(qp->prp_lists, qp->nslots * PAGE_SIZE);
+        if (qp->sq)
+            memFreeDma(qp->sq, size * sizeof(nvme_sqe_t));
+        if (qp->cq)
+            memFreeDma((void *)qp->cq, size * sizeof(nvme_cqe_t));
+        kfree(qp);
+        return NULL;
+    }
+    hrtimer_init(&qp->timeout, nvmeTimeout, qp);
+    return qp;
+}
+
+// Reset, admin queue, enable. false if the controller didn't come up.
+static bool controllerEnable(nvme_controller_t *c)
+{
+    regWrite(c->regs, NVME_REG_CC, regRead(c->regs, NVME_REG_CC) & ~NVME_CC_EN);
+    if (!waitReady(c, false))
+        return false;
+
+    if (!queueAlloc(c, &c->admin, 0, NVME_ADMIN_QUEUE_SIZE))
+        return false;
+    regWrite(c->regs, NVME_REG_AQA, (NVME_ADMIN_QUEUE_SIZE - 1) << 16 | (NVME_ADMIN_QUEUE_SIZE - 1));
+    regWrite64(c->regs, NVME_REG_ASQ, c->admin.sq_phys);
+    regWrite64(c->regs, NVME_REG_ACQ, c->admin.cq_phys);
+
+    // NVM command set, 4K pages, 64 byte submission and 16 byte completion
+    // entries
+    regWrite(c->regs, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4));
+    return waitReady(c, true) && !(regRead(c->regs, NVME_REG_CSTS) & NVME_CSTS_CFS);
+}
+
+// Reads model, transfer limit and cache out of IDENTIFY CONTROLLER and
+// returns the namespace count, 0 if it failed
+static uint32_t identifyController(nvme_controller_t *c, uint8_t *page, uint32_t phys)
+{
+    if (identify(c, NVME_CNS_CONTROLLER, 0, phys) != 0)
+        return 0;
+
+    memcpy(c->model, page + NVME_ID_CTRL_MODEL, 40);
+    c->model[40] = '\0';
+    for (int i = 39; i >= 0 && c->model[i] == ' '; i--)
+        c->model[i] = '\0';
+
+    c->write_cache = page[NVME_ID_CTRL_VWC] & 1;
+    c->max_sectors = NVME_MAX_SECTORS;
+    uint8_t mdts = page[NVME_ID_CTRL_MDTS];
+    if (mdts && mdts < 6 && (8u << mdts) < c->max_sectors)
+        c->max_sectors = 8u << mdts;
+    return *(uint32_t *)(page + NVME_ID_CTRL_NN);
+}
+
+// A namespace if nsid is active and has 512 byte blocks
+static nvme_namespace_t *namespaceProbe(nvme_controller_t *c, uint32_t nsid, uint8_t *page, uint32_t phys)
+{
+    if (identify(c, NVME_CNS_NAMESPACE, nsid, phys) != 0)
+        return NULL;
+    uint64_t blocks = *(uint64_t *)(page + NVME_ID_NS_NSZE);
+    if (blocks == 0)
+        return NULL;
+    uint8_t format = page[NVME_ID_NS_FLBAS] & 0xF;
+    uint8_t lbads = page[NVME_ID_NS_LBAF + format * 4 + 2];
+    if (lbads != 9)
+    {
+        printf("NVMe: namespace %u has %u byte blocks, skipped\n", nsid, 1u << lbads);
+        return NULL;
+    }
+
+    nvme_namespace_t *ns = kmalloc(sizeof(nvme_namespace_t));
+    if (ns == NULL)
+        return NULL;
+    memset(ns, 0, sizeof(nvme_namespace_t));
+    ns->ctrl = c;
+    ns->nsid = nsid;
+    ns->sectors = blocks;
+    return ns;
+}
+
+void nvme_init()
+{
+    nvme_controller_t *c = &controller;
+    pci_device_t *dev = pciFindDevice(PCI_ANY_VENDOR, 0x01, 0x08);
+    if (dev == NULL || dev->prog_if != 0x02 || (dev->bar0 & 1))
+    {
+        printf("NVMe: no controller\n");
+        return;
+    }
+    uint32_t base = pciBarAddress(dev, 0);
+    if (base == 0)
+    {
+        printf("NVMe: BAR0 is out of reach\n");
+        return;
+    }
+
+    uint16_t command = pciConfigReadWord(dev->bus, dev->slot, dev->func, PCI_COMMAND);
+    pciConfigWriteWord(dev->bus, dev->slot, dev->func, PCI_COMMAND,
+                       command | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+    c->pci = dev;
+
+    // The doorbell stride decides how much of the BAR we need
+    volatile uint8_t *regs = vmmMapMmio(base, PAGE_SIZE, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+    if (regs == NULL)
+        return;
+    c->cap = regRead64(regs, NVME_REG_CAP);
+    vmmUnmapMmio((void *)regs, PAGE_SIZE);
+    if (NVME_CAP_MPSMIN(c->cap) != 0)
+    {
+        printf("NVMe: controller doesn't do 4K pages\n");
+        return;
+    }
+    c->doorbell_stride = 4u << NVME_CAP_DSTRD(c->cap);
+    c->regs_size = NVME_REG_DOORBELLS + 2 * (NVME_MAX_IO_QUEUES + 1) * c->doorbell_stride;
+    c->regs = vmmMapMmio(base, c->regs_size, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+    if (c->regs == NULL)
+        return;
+
+    if (!controllerEnable(c))
+    {
+        printf("NVMe: controller didn't come up, CSTS 0x%x\n", regRead(c->regs, NVME_REG_CSTS));
+        return;
+    }
+
+    uint32_t phys;
+    uint8_t *page = memAllocDma(PAGE_SIZE, PAGE_SIZE, &phys);
+    if (page == NULL)
+        return;
+    uint32_t namespaces = identifyController(c, page, phys);
+    if (namespaces == 0)
+    {
+        printf("NVMe: IDENTIFY failed or no namespaces\n");
+        memFreeDma(page, PAGE_SIZE);
+        return;
+    }
+
+    // Ask for a pair per CPU, take what's granted (zero based counts)
+    uint32_t want = onlineCpus() < NVME_MAX_IO_QUEUES ? onlineCpus() : NVME_MAX_IO_QUEUES;
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = (want - 1) << 16 | (want - 1);
+    uint32_t granted;
+    if (adminCommand(c, &cmd, &granted) != 0)
+    {
+        printf("NVMe: no I/O queues\n");
+        memFreeDma(page, PAGE_SIZE);
+        return;
+    }
+    if ((granted & 0xFFFF) + 1 < want)
+        want = (granted & 0xFFFF) + 1;
+    if ((granted >> 16) + 1 < want)
+        want = (granted >> 16) + 1;
+
+    uint16_t size = NVME_CAP_MQES(c->cap) < NVME_IO_QUEUE_SIZE ? NVME_CAP_MQES(c->cap) : NVME_IO_QUEUE_SIZE;
+    for (c->nio = 0; c->nio < want; c->nio++)
+    {
+        c->io[c->nio] = ioQueueInit(c, c->nio + 1, size);
+        if (c->io[c->nio] == NULL)
+            break;
+    }
+    setupInterrupts(c);
+    uint32_t created = 0;
+    while (created < c->nio && createQueuePair(c, c->io[created]))
+        created++;
+    c->nio = created;
+    if (c->nio == 0)
+    {
+        printf("NVMe: couldn't create an I/O queue pair\n");
+        memFreeDma(page, PAGE_SIZE);
+        return;
+    }
+
+    for (uint32_t nsid = 1; nsid <= namespaces && numDisks < NVME_MAX_DISKS; nsid++)
+    {
+        nvme_namespace_t *ns = namespaceProbe(c, nsid, page, phys);
+        if (ns)
+            disks[numDisks++] = ns;
+    }
+    memFreeDma(page, PAGE_SIZE);
+    if (numDisks == 0)
+    {
+        printf("NVMe: no usable namespaces\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < c->nio; i++)
+    {
+        int irq = c->io[i]->irq;
+        bool registered = false;
+        for (uint32_t j = 0; j < i; j++)
+            registered |= c->io[j]->irq == irq;
+        if (irq >= 0 && !registered)
+            irq_request(irq, nvmeIrq, c, "nvme");
+    }
+
+    // Namespaces split a pair's slots between them
+    uint32_t depth = c->io[0]->nslots / numDisks;
+    for (uint32_t i = 0; i < numDisks; i++)
+    {
+        nvme_namespace_t *ns = disks[i];
+        blk_queue_init_async(&ns->queue, diskNames[i], nvmeStart, nvmePoll, nvmeCommit, ns, c->max_sectors, depth);
+        ns->queue.virt_boundary = PAGE_SIZE - 1;
+        ns->queue.polled = c->io[0]->irq < 0;
+        blk_queue_enable_cache(&ns->queue);
+        bdev_register(diskNames[i], BLOCK_DISK, &ns->queue, ns->sectors, BLK_SECTOR_SIZE, false);
+        printf("NVMe: %s, namespace %u, %llu MiB, %u deep\n", diskNames[i], ns->nsid, ns->sectors / 2048,
+               ns->queue.depth);
+    }
+    printf("NVMe: %s, %u I/O queue pair(s) of %u, irq %d%s%s\n", c->model, c->nio, size, c->io[0]->irq,
+           c->msix ? " (MSI-X)" : c->msi ? " (MSI)" : "", c->write_cache ? ", write cache" : "");
+}
+
+struct blk_queue *nvme_queue(uint32_t disk)
+{
+    return disk < numDisks ? &disks[disk]->queue : NULL;
+}
+
+void nvme_benchmark(uint32_t disk, uint32_t count)
+{
+    if (disk >= numDisks || count == 0)
+        return;
+    nvme_namespace_t *ns = disks[disk];
+    struct blk_queue *q = &ns->queue;
+    uint8_t *buf = kmalloc(NVME_BENCH_DEPTH * PAGE_SIZE);
+    if (buf == NULL)
+        return;
+
+    struct blk_io ios[NVME_BENCH_DEPTH];
+    uint64_t blocks = ns->sectors / 8;
+    uint32_t depths[2] = {1, NVME_BENCH_DEPTH};
+
+    for (int d = 0; d < 2; d++)
+    {
+        uint32_t depth = depths[d] < q->depth ? depths[d] : q->depth;
+        uint32_t seed = 0x2545F491, errors = 0;
+        uint32_t doorbells = 0, interrupts = 0;
+        for (uint32_t i = 0; i < controller.nio; i++)
+        {
+            doorbells -= controller.io[i]->doorbells;
+            interrupts -= controller.io[i]->interrupts;
+        }
+
+        uint64_t start = ktime_get_ns();
+        for (uint32_t done = 0; done < count; done += depth)
+        {
+            blk_plug(q);
+            for (uint32_t i = 0; i < depth; i++)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                ios[i].direction = BLK_READ;
+                ios[i].flags = BLK_NOCACHE;
+                ios[i].lba = (seed % blocks) * 8;
+                ios[i].count = 8;
+                ios[i].buf = buf + i * PAGE_SIZE;
+                blk_submit(q, &ios[i]);
+            }
+            blk_unplug(q);
+            for (uint32_t i = 0; i < depth; i++)
+            {
+                if (blk_wait(q, &ios[i]))
+                    errors++;
+            }
+        }
+        uint64_t us = (ktime_get_ns() - start) / 1000;
+
+        for (uint32_t i = 0; i < controller.nio; i++)
+        {
+            doorbells += controller.io[i]->doorbells;
+            interrupts += controller.io[i]->interrupts;
+        }
+        printf("NVMe: %u random 4K reads at depth %u in %llu us (%llu IOPS), %u doorbells, %u interrupts%s\n", count,
+               depth, us, us ? (uint64_t)count * 1000000 / us : 0, doorbells, interrupts,
+               errors ? ", with errors" : "");
+        if (depth == q->depth)
+            break;
+    }
+    kfree(buf);
+}
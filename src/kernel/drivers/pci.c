@@ -1,4 +1,6 @@
 #include <drivers/pci.h>
+#include <drivers/ioapic.h>
+#include <memory.h>
 #include <util.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -33,6 +35,126 @@ uint32_t pciConfigReadDWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off
     return inl(0xCFC);
 }
 
+void pciConfigWriteDWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value)
+{
+    uint32_t address = ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC) | 0x80000000;
+    outl(0xCF8, address);
+    outl(0xCFC, value);
+}
+
+void pciConfigWriteWord(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t value)
+{
+    // Read-modify-write the dword, config space only takes dword accesses here
+    uint32_t dWord = pciConfigReadDWord(bus, slot, func, offset);
+    uint32_t shift = (offset & 2) * 8;
+    dWord = (dWord & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pciConfigWriteDWord(bus, slot, func, offset, dWord);
+}
+
+void pciEnableBusMastering(pci_device_t *device)
+{
+    uint16_t command = pciConfigReadWord(device->bus, device->slot, device->func, PCI_COMMAND);
+    if (!(command & PCI_COMMAND_BUS_MASTER))
+        pciConfigWriteWord(device->bus, device->slot, device->func, PCI_COMMAND, command | PCI_COMMAND_BUS_MASTER);
+}
+
+uint32_t pciBarAddress(pci_device_t *device, uint8_t bar)
+{
+    if (bar > 5)
+        return 0;
+    uint32_t *bars = &device->bar0;
+    uint32_t value = bars[bar];
+    if (value & 1)
+        return value & ~3;
+    // 64-bit memory BAR, the next one holds the top half
+    if ((value & 6) == 4 && bar < 5 && bars[bar + 1] != 0)
+        return 0;
+    return value & ~0xF;
+}
+
+uint8_t pciNextCapability(pci_device_t *device, uint8_t offset, uint8_t id)
+{
+    if (!(pciConfigReadWord(device->bus, device->slot, device->func, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+        return 0;
+
+    if (offset == 0)
+        offset = pciConfigReadDWord(device->bus, device->slot, device->func, PCI_CAP_PTR) & 0xFC;
+    else
+        offset = (pciConfigReadWord(device->bus, device->slot, device->func, offset) >> 8) & 0xFC;
+    // 48 is as many as fit in config space, a looping list stops there
+    for (int i = 0; offset && i < 48; i++)
+    {
+        uint16_t header = pciConfigReadWord(device->bus, device->slot, device->func, offset);
+        if ((header & 0xFF) == id)
+            return offset;
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+uint8_t pciFindCapability(pci_device_t *device, uint8_t id)
+{
+    return pciNextCapability(device, 0, id);
+}
+
+bool pciEnableMsi(pci_device_t *device, int irq)
+{
+    uint8_t cap = pciFindCapability(device, PCI_CAP_ID_MSI);
+    uint32_t address, data;
+    if (cap == 0 || !ioapic_msi_message(irq, &address, &data))
+        return false;
+
+    uint16_t control = pciConfigReadWord(device->bus, device->slot, device->func, cap + 2);
+    pciConfigWriteDWord(device->bus, device->slot, device->func, cap + 4, address);
+    if (control & PCI_MSI_64BIT)
+    {
+        pciConfigWriteDWord(device->bus, device->slot, device->func, cap + 8, 0);
+        pciConfigWriteWord(device->bus, device->slot, device->func, cap + 12, (uint16_t)data);
+    }
+    else
+        pciConfigWriteWord(device->bus, device->slot, device->func, cap + 8, (uint16_t)data);
+
+    // One vector (multiple message enable 0)
+    control = (control & ~(7 << 4)) | PCI_MSI_ENABLE;
+    pciConfigWriteWord(device->bus, device->slot, device->func, cap + 2, control);
+
+    uint16_t command = pciConfigReadWord(device->bus, device->slot, device->func, PCI_COMMAND);
+    pciConfigWriteWord(device->bus, device->slot, device->func, PCI_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+    return true;
+}
+
+bool pciEnableMsix(pci_device_t *device, uint16_t entry, int irq)
+{
+    uint8_t cap = pciFindCapability(device, PCI_CAP_ID_MSIX);
+    uint32_t address, data;
+    if (cap == 0 || !ioapic_msi_message(irq, &address, &data))
+        return false;
+
+    uint16_t control = pciConfigReadWord(device->bus, device->slot, device->func, cap + 2);
+    if (entry > (control & 0x7FF)) // table size - 1
+        return false;
+    uint32_t table = pciConfigReadDWord(device->bus, device->slot, device->func, cap + 4);
+    uint32_t base = pciBarAddress(device, table & 7);
+    if (base == 0)
+        return false;
+    volatile uint32_t *e = vmmMapMmio(base + (table & ~7) + entry * 16, 16, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+    if (e == NULL)
+        return false;
+
+    // Whole function masked while the entry is half written
+    pciConfigWriteWord(device->bus, device->slot, device->func, cap + 2, control | PCI_MSIX_ENABLE | PCI_MSIX_MASKALL);
+    e[0] = address;
+    e[1] = 0;
+    e[2] = data;
+    e[3] = 0; // unmasked
+    vmmUnmapMmio((void *)e, 16);
+    pciConfigWriteWord(device->bus, device->slot, device->func, cap + 2, (control | PCI_MSIX_ENABLE) & ~PCI_MSIX_MASKALL);
+
+    uint16_t command = pciConfigReadWord(device->bus, device->slot, device->func, PCI_COMMAND);
+    pciConfigWriteWord(device->bus, device->slot, device->func, PCI_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+    return true;
+}
+
 uint8_t pciGetSecondaryBus(uint8_t bus, uint8_t slot, uint8_t func)
 {
     uint32_t reg = pciConfigReadDWord(bus, slot, func, 0x18);
@@ -53,7 +175,8 @@ pci_device_t *pciFindDevice(uint16_t vendorId, uint8_t classId, uint8_t subclass
 {
     for (int i = 0; i < MAX_PCI_DEVICES; i++)
     {
-        if (pciDevices[i].vendor_id == vendorId &&
+        if (pciDevices[i].vendor_id != 0 &&
+            (vendorId == PCI_ANY_VENDOR || pciDevices[i].vendor_id == vendorId) &&
             pciDevices[i].class_code == classId &&
             pciDevices[i].subclass == subclass)
         {
@@ -64,6 +187,16 @@ pci_device_t *pciFindDevice(uint16_t vendorId, uint8_t classId, uint8_t subclass
     return NULL;
 }
 
+pci_device_t *pciFindDeviceId(uint16_t vendorId, uint16_t deviceId, int index)
+{
+    for (int i = 0; i < pciDeviceCount; i++)
+    {
+        if (pciDevices[i].vendor_id == vendorId && pciDevices[i].device_id == deviceId && index-- == 0)
+            return &pciDevices[i];
+    }
+    return NULL;
+}
+
 uint16_t pciGetVendorID(uint8_t bus, uint8_t device, uint8_t func)
 {
     return pciConfigReadWord(bus, device, func, 0);
@@ -182,6 +315,21 @@ void checkFunction(uint8_t bus, uint8_t slot, uint8_t func)
     device->subclass = subclass;
     device->header_type = header_type;
     device->prog_if = pciGetProgIF(bus, slot, func);
+
+    // Only general devices (header type 0) have six BARs
+    if ((header_type & 0x7F) == 0)
+    {
+        device->bar0 = pciConfigReadDWord(bus, slot, func, PCI_BAR0 + 0x00);
+        device->bar1 = pciConfigReadDWord(bus, slot, func, PCI_BAR0 + 0x04);
+        device->bar2 = pciConfigReadDWord(bus, slot, func, PCI_BAR0 + 0x08);
+        device->bar3 = pciConfigReadDWord(bus, slot, func, PCI_BAR0 + 0x0C);
+        device->bar4 = pciConfigReadDWord(bus, slot, func, PCI_BAR0 + 0x10);
+        device->bar5 = pciConfigReadDWord(bus, slot, func, PCI_BAR0 + 0x14);
+
+        uint32_t interrupt = pciConfigReadDWord(bus, slot, func, PCI_INTERRUPT_LINE);
+        device->irq_line = interrupt & 0xFF;
+        device->irq_pin = (interrupt >> 8) & 0xFF;
+    }
     pciDeviceCount++;
 
     if (class_code == 0x06 && subclass == 0x04)
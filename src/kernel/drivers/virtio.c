@@ -0,0 +1,357 @@
+#include <drivers/virtio.h>
+#include <memory.h>
+#include <idt.h>
+#include <ktime.h>
+#include <util.h>
+#include <string.h>
+#include <stdio.h>
+
+#define VIRTIO_RESET_TIMEOUT_MS 100
+
+static inline uint8_t mmioRead8(volatile uint8_t *base, uint32_t reg)
+{
+    return base[reg];
+}
+
+static inline uint16_t mmioRead16(volatile uint8_t *base, uint32_t reg)
+{
+    return *(volatile uint16_t *)(base + reg);
+}
+
+static inline uint32_t mmioRead32(volatile uint8_t *base, uint32_t reg)
+{
+    return *(volatile uint32_t *)(base + reg);
+}
+
+static inline void mmioWrite8(volatile uint8_t *base, uint32_t reg, uint8_t value)
+{
+    base[reg] = value;
+}
+
+static inline void mmioWrite16(volatile uint8_t *base, uint32_t reg, uint16_t value)
+{
+    *(volatile uint16_t *)(base + reg) = value;
+}
+
+static inline void mmioWrite32(volatile uint8_t *base, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(base + reg) = value;
+}
+
+// 64-bit registers take two dword writes, low half first
+static inline void mmioWrite64(volatile uint8_t *base, uint32_t reg, uint64_t value)
+{
+    mmioWrite32(base, reg, (uint32_t)value);
+    mmioWrite32(base, reg + 4, (uint32_t)(value >> 32));
+}
+
+static uint8_t getStatus(struct virtio_device *vdev)
+{
+    return vdev->modern ? mmioRead8(vdev->common, VIRTIO_COMMON_STATUS) : inb(vdev->iobase + VIRTIO_LEGACY_STATUS);
+}
+
+static void setStatus(struct virtio_device *vdev, uint8_t status)
+{
+    if (vdev->modern)
+        mmioWrite8(vdev->common, VIRTIO_COMMON_STATUS, status);
+    else
+        outb(vdev->iobase + VIRTIO_LEGACY_STATUS, status);
+}
+
+// Maps the window a virtio vendor capability describes
+static volatile uint8_t *mapCap(pci_device_t *pci, uint8_t cap)
+{
+    uint8_t bar = pciConfigReadDWord(pci->bus, pci->slot, pci->func, cap + 4) & 0xFF;
+    uint32_t offset = pciConfigReadDWord(pci->bus, pci->slot, pci->func, cap + 8);
+    uint32_t length = pciConfigReadDWord(pci->bus, pci->slot, pci->func, cap + 12);
+    uint32_t base = pciBarAddress(pci, bar);
+    if (base == 0 || bar > 5 || ((&pci->bar0)[bar] & 1) || length == 0)
+        return NULL;
+    return vmmMapMmio(base + offset, length, PAGE_FLAG_CACHE_DISABLE | PAGE_FLAG_WRITE_THROUGH);
+}
+
+// The 1.0 layout, if the device has all of it in BARs we can reach
+static bool findModern(struct virtio_device *vdev)
+{
+    pci_device_t *pci = vdev->pci;
+    uint8_t caps[VIRTIO_PCI_CAP_DEVICE + 1] = {0};
+
+    for (uint8_t cap = pciFindCapability(pci, PCI_CAP_ID_VENDOR); cap; cap = pciNextCapability(pci, cap, PCI_CAP_ID_VENDOR))
+    {
+        uint8_t type = pciConfigReadDWord(pci->bus, pci->slot, pci->func, cap) >> 24;
+        if (type <= VIRTIO_PCI_CAP_DEVICE && caps[type] == 0)
+            caps[type] = cap;
+    }
+    for (int type = VIRTIO_PCI_CAP_COMMON; type <= VIRTIO_PCI_CAP_DEVICE; type++)
+    {
+        if (caps[type] == 0)
+            return false;
+    }
+
+    vdev->common = mapCap(pci, caps[VIRTIO_PCI_CAP_COMMON]);
+    vdev->notify_base = mapCap(pci, caps[VIRTIO_PCI_CAP_NOTIFY]);
+    vdev->isr = mapCap(pci, caps[VIRTIO_PCI_CAP_ISR]);
+    vdev->config = mapCap(pci, caps[VIRTIO_PCI_CAP_DEVICE]);
+    vdev->notify_multiplier = pciConfigReadDWord(pci->bus, pci->slot, pci->func, caps[VIRTIO_PCI_CAP_NOTIFY] + 16);
+    return vdev->common && vdev->notify_base && vdev->isr && vdev->config;
+}
+
+bool virtio_pci_init(struct virtio_device *vdev, pci_device_t *pci)
+{
+    memset(vdev, 0, sizeof(struct virtio_device));
+    vdev->pci = pci;
+    vdev->irq = -1;
+
+    uint16_t command = pciConfigReadWord(pci->bus, pci->slot, pci->func, PCI_COMMAND);
+    pciConfigWriteWord(pci->bus, pci->slot, pci->func, PCI_COMMAND,
+                       command | PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    vdev->modern = findModern(vdev);
+    if (!vdev->modern)
+    {
+        // Transitional devices still have the legacy registers in BAR0
+        if (pci->device_id >= VIRTIO_PCI_MODERN_BASE || !(pci->bar0 & 1))
+        {
+            printf("virtio: %x:%x has no registers we can use\n", pci->vendor_id, pci->device_id);
+            return false;
+        }
+        vdev->iobase = pci->bar0 & ~3;
+    }
+
+    setStatus(vdev, 0);
+    if (vdev->modern)
+    {
+        uint64_t deadline = ktime_get_ns() + VIRTIO_RESET_TIMEOUT_MS * NSEC_PER_MSEC;
+        while (getStatus(vdev) != 0 && ktime_get_ns() < deadline)
+            asm volatile("pause");
+    }
+    setStatus(vdev, VIRTIO_STATUS_ACKNOWLEDGE);
+    setStatus(vdev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    // Every queue shares MSI-X entry 0, config changes get no interrupt
+    int irq;
+    if (pciFindCapability(pci, PCI_CAP_ID_MSIX) && (irq = irq_alloc()) >= 0 && pciEnableMsix(pci, 0, irq))
+    {
+        vdev->irq = irq;
+        vdev->msix = true;
+        if (vdev->modern)
+            mmioWrite16(vdev->common, VIRTIO_COMMON_MSIX, VIRTIO_MSI_NO_VECTOR);
+        else
+            outw(vdev->iobase + VIRTIO_LEGACY_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+    }
+    else if (pci->irq_pin && pci->irq_line < NUM_ISA_IRQS)
+        vdev->irq = pci->irq_line;
+    return true;
+}
+
+bool virtio_negotiate(struct virtio_device *vdev, uint64_t wanted)
+{
+    if (!vdev->modern)
+    {
+        uint32_t offered = inl(vdev->iobase + VIRTIO_LEGACY_DEVICE_FEATURES);
+        vdev->features = offered & (uint32_t)wanted;
+        outl(vdev->iobase + VIRTIO_LEGACY_GUEST_FEATURES, (uint32_t)vdev->features);
+        return true;
+    }
+
+    mmioWrite32(vdev->common, VIRTIO_COMMON_DFSELECT, 0);
+    uint64_t offered = mmioRead32(vdev->common, VIRTIO_COMMON_DF);
+    mmioWrite32(vdev->common, VIRTIO_COMMON_DFSELECT, 1);
+    offered |= (uint64_t)mmioRead32(vdev->common, VIRTIO_COMMON_DF) << 32;
+
+    vdev->features = offered & (wanted | VIRTIO_F_VERSION_1);
+    if (!(vdev->features & VIRTIO_F_VERSION_1))
+        return false;
+    mmioWrite32(vdev->common, VIRTIO_COMMON_GFSELECT, 0);
+    mmioWrite32(vdev->common, VIRTIO_COMMON_GF, (uint32_t)vdev->features);
+    mmioWrite32(vdev->common, VIRTIO_COMMON_GFSELECT, 1);
+    mmioWrite32(vdev->common, VIRTIO_COMMON_GF, (uint32_t)(vdev->features >> 32));
+
+    setStatus(vdev, getStatus(vdev) | VIRTIO_STATUS_FEATURES_OK);
+    return (getStatus(vdev) & VIRTIO_STATUS_FEATURES_OK) != 0;
+}
+
+uint32_t virtio_config_read32(struct virtio_device *vdev, uint32_t offset)
+{
+    if (vdev->modern)
+        return mmioRead32(vdev->config, offset);
+    return inl(vdev->iobase + VIRTIO_LEGACY_CONFIG(vdev->msix) + offset);
+}
+
+uint64_t virtio_config_read64(struct virtio_device *vdev, uint32_t offset)
+{
+    // The device may change it between the two halves, the generation
+    // counter says when to try again
+    uint8_t generation;
+    uint64_t value;
+    do
+    {
+        generation = vdev->modern ? mmioRead8(vdev->common, VIRTIO_COMMON_CFGGEN) : 0;
+        value = virtio_config_read32(vdev, offset) | (uint64_t)virtio_config_read32(vdev, offset + 4) << 32;
+    } while (vdev->modern && generation != mmioRead8(vdev->common, VIRTIO_COMMON_CFGGEN));
+    return value;
+}
+
+void virtio_driver_ok(struct virtio_device *vdev)
+{
+    setStatus(vdev, getStatus(vdev) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+void virtio_fail(struct virtio_device *vdev)
+{
+    setStatus(vdev, getStatus(vdev) | VIRTIO_STATUS_FAILED);
+}
+
+uint8_t virtio_read_isr(struct virtio_device *vdev)
+{
+    return vdev->modern ? mmioRead8(vdev->isr, 0) : inb(vdev->iobase + VIRTIO_LEGACY_ISR);
+}
+
+#define RING_ALIGN(x) (((x) + VIRTIO_LEGACY_ALIGN - 1) & ~(VIRTIO_LEGACY_ALIGN - 1))
+
+// Descriptors, then the avail ring, then the used ring on the next page
+// boundary. That's what legacy devices expect, modern ones take the three
+// addresses separately but are happy with it too.
+static uint32_t usedOffset(uint16_t size)
+{
+    return RING_ALIGN(sizeof(vring_desc_t) * size + sizeof(vring_avail_t) + sizeof(uint16_t) * (size + 1));
+}
+
+static uint32_t ringBytes(uint16_t size)
+{
+    return usedOffset(size) + RING_ALIGN(sizeof(vring_used_t) + sizeof(vring_used_elem_t) * size + sizeof(uint16_t));
+}
+
+bool virtqueue_setup(struct virtio_device *vdev, struct virtqueue *vq, uint16_t index, uint16_t max_size)
+{
+    memset(vq, 0, sizeof(struct virtqueue));
+    vq->vdev = vdev;
+    vq->index = index;
+
+    uint16_t size;
+    if (vdev->modern)
+    {
+        mmioWrite16(vdev->common, VIRTIO_COMMON_Q_SELECT, index);
+        size = mmioRead16(vdev->common, VIRTIO_COMMON_Q_SIZE);
+        if (max_size > VIRTQUEUE_MAX_SIZE)
+            max_size = VIRTQUEUE_MAX_SIZE;
+        // Split rings want a power of two
+        while (size > max_size)
+            size >>= 1;
+    }
+    else
+    {
+        // Legacy devices don't let us pick
+        outw(vdev->iobase + VIRTIO_LEGACY_QUEUE_SELECT, index);
+        size = inw(vdev->iobase + VIRTIO_LEGACY_QUEUE_SIZE);
+    }
+    if (size == 0)
+        return false;
+
+    vq->size = size;
+    vq->ring_bytes = ringBytes(size);
+    vq->ring = memAllocDma(vq->ring_bytes, PAGE_SIZE, &vq->ring_phys);
+    if (vq->ring == NULL)
+        return false;
+    vq->desc = vq->ring;
+    vq->avail = (vring_avail_t *)((uint8_t *)vq->ring + sizeof(vring_desc_t) * size);
+    uint32_t used_offset = usedOffset(size);
+    vq->used = (vring_used_t *)((uint8_t *)vq->ring + used_offset);
+
+    if (vdev->modern)
+    {
+        mmioWrite16(vdev->common, VIRTIO_COMMON_Q_SIZE, size);
+        if (vdev->msix)
+        {
+            mmioWrite16(vdev->common, VIRTIO_COMMON_Q_MSIX, 0);
+            if (mmioRead16(vdev->common, VIRTIO_COMMON_Q_MSIX) != 0)
+                vdev->irq = -1;
+        }
+        mmioWrite64(vdev->common, VIRTIO_COMMON_Q_DESC, vq->ring_phys);
+        mmioWrite64(vdev->common, VIRTIO_COMMON_Q_AVAIL, vq->ring_phys + sizeof(vring_desc_t) * size);
+        mmioWrite64(vdev->common, VIRTIO_COMMON_Q_USED, vq->ring_phys + used_offset);
+        uint16_t notify_off = mmioRead16(vdev->common, VIRTIO_COMMON_Q_NOFF);
+        vq->notify = (volatile uint16_t *)(vdev->notify_base + notify_off * vdev->notify_multiplier);
+        mmioWrite16(vdev->common, VIRTIO_COMMON_Q_ENABLE, 1);
+    }
+    else
+    {
+        if (vdev->msix)
+        {
+            outw(vdev->iobase + VIRTIO_LEGACY_QUEUE_VECTOR, 0);
+            if (inw(vdev->iobase + VIRTIO_LEGACY_QUEUE_VECTOR) != 0)
+                vdev->irq = -1;
+        }
+        outl(vdev->iobase + VIRTIO_LEGACY_QUEUE_PFN, vq->ring_phys / VIRTIO_LEGACY_ALIGN);
+    }
+    return true;
+}
+
+void virtqueue_add(struct virtqueue *vq, uint16_t head)
+{
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+}
+
+static bool eventIdx(struct virtqueue *vq)
+{
+    return virtio_has(vq->vdev, VIRTIO_F_EVENT_IDX);
+}
+
+void virtqueue_kick(struct virtqueue *vq)
+{
+    uint16_t old = vq->kicked_idx;
+    uint16_t new = vq->avail_idx;
+    if (old == new)
+        return;
+
+    // Ring entries before the index that publishes them
+    asm volatile("" ::: "memory");
+    vq->avail->idx = new;
+    vq->kicked_idx = new;
+    // and the index before we read what the device asked for
+    asm volatile("mfence" ::: "memory");
+
+    bool notify;
+    if (eventIdx(vq))
+    {
+        // Notify only if this batch carried avail past avail_event
+        uint16_t event = *(volatile uint16_t *)&vq->used->ring[vq->size];
+        notify = (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+    }
+    else
+        notify = !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+
+    if (!notify)
+    {
+        vq->kicks_suppressed++;
+        return;
+    }
+    vq->kicks++;
+    if (vq->vdev->modern)
+        *vq->notify = vq->index;
+    else
+        outw(vq->vdev->iobase + VIRTIO_LEGACY_QUEUE_NOTIFY, vq->index);
+}
+
+bool virtqueue_next_used(struct virtqueue *vq, uint32_t *head, uint32_t *len)
+{
+    if (vq->last_used == vq->used->idx)
+        return false;
+    asm volatile("" ::: "memory");
+    volatile vring_used_elem_t *e = &vq->used->ring[vq->last_used % vq->size];
+    *head = e->id;
+    *len = e->len;
+    vq->last_used++;
+    return true;
+}
+
+bool virtqueue_arm(struct virtqueue *vq)
+{
+    if (eventIdx(vq))
+        *(volatile uint16_t *)&vq->avail->ring[vq->size] = vq->last_used;
+    else
+        vq->avail->flags = 0;
+    asm volatile("mfence" ::: "memory");
+    return vq->last_used == vq->used->idx;
+}
@@ -0,0 +1,386 @@
+#include <drivers/virtio_blk.h>
+#include <drivers/device.h>
+#include <memory.h>
+#include <liballoc.h>
+#include <idt.h>
+#include <ktime.h>
+#include <util.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+
+static virtio_blk_t *disks[VIRTIO_BLK_MAX_DISKS];
+static uint32_t numDisks = 0;
+static const char *diskNames[VIRTIO_BLK_MAX_DISKS] = {"vd0", "vd1", "vd2", "vd3"};
+
+static inline uint32_t slotPhys(virtio_blk_t *b, uint32_t slot)
+{
+    return b->slots_phys + slot * sizeof(struct virtio_blk_slot);
+}
+
+// Header, the data a page at a time (physically adjacent pages merged)
+// and the status byte, linked with next indexes counted from base.
+// 0 if it won't fit in chain_max or seg_max.
+static uint32_t buildChain(virtio_blk_t *b, uint32_t slot, vring_desc_t *d, uint16_t base)
+{
+    struct virtio_blk_slot *s = &b->slots[slot];
+    struct blk_request *rq = b->requests[slot];
+    uint8_t stage = b->stages[slot] & -b->stages[slot];
+    uint32_t n = 0;
+
+    s->hdr.reserved = 0;
+    if (stage == VIRTIO_BLK_STAGE_DATA)
+    {
+        s->hdr.type = rq->direction == BLK_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        s->hdr.sector = rq->lba;
+    }
+    else
+    {
+        s->hdr.type = VIRTIO_BLK_T_FLUSH;
+        s->hdr.sector = 0;
+    }
+    s->status = 0xFF;
+
+    d[n].addr = slotPhys(b, slot) + offsetof(struct virtio_blk_slot, hdr);
+    d[n].len = sizeof(virtio_blk_req_hdr_t);
+    d[n].flags = 0;
+    n++;
+
+    for (uint32_t i = 0; stage == VIRTIO_BLK_STAGE_DATA && i < b->nsegs[slot]; i++)
+    {
+        uint32_t virt = (uint32_t)b->data[slot][i].buf;
+        uint32_t left = b->data[slot][i].sectors * 512;
+        while (left)
+        {
+            uint32_t phys = vmmVirtToPhys(virt);
+            uint32_t chunk = PAGE_SIZE - (virt & 0xFFF);
+            if (chunk > left)
+                chunk = left;
+            if (phys == 0)
+                return 0;
+
+            if (n > 1 && d[n - 1].addr + d[n - 1].len == phys)
+                d[n - 1].len += chunk;
+            else
+            {
+                // One more for the status
+                if (n + 1 >= b->chain_max || n - 1 >= b->seg_max)
+                    return 0;
+                d[n].addr = phys;
+                d[n].len = chunk;
+                d[n].flags = rq->direction == BLK_READ ? VRING_DESC_F_WRITE : 0;
+                n++;
+            }
+            virt += chunk;
+            left -= chunk;
+        }
+    }
+
+    d[n].addr = slotPhys(b, slot) + offsetof(struct virtio_blk_slot, status);
+    d[n].len = 1;
+    d[n].flags = VRING_DESC_F_WRITE;
+    d[n].next = 0;
+    n++;
+
+    for (uint32_t i = 0; i + 1 < n; i++)
+    {
+        d[i].flags |= VRING_DESC_F_NEXT;
+        d[i].next = base + i + 1;
+    }
+    return n;
+}
+
+// Adds the slot's next stage to the avail ring, the commit or the irq
+// handler kicks it out. Interrupts off.
+static bool issueStage(virtio_blk_t *b, uint32_t slot)
+{
+    uint16_t head;
+    if (b->indirect)
+    {
+        uint32_t n = buildChain(b, slot, b->slots[slot].table, 0);
+        if (n == 0)
+            return false;
+        head = slot;
+        vring_desc_t *d = &b->vq.desc[head];
+        d->addr = slotPhys(b, slot) + offsetof(struct virtio_blk_slot, table);
+        d->len = n * sizeof(vring_desc_t);
+        d->flags = VRING_DESC_F_INDIRECT;
+        d->next = 0;
+    }
+    else
+    {
+        head = slot * b->ring_descs;
+        if (buildChain(b, slot, &b->vq.desc[head], head) == 0)
+            return false;
+    }
+    virtqueue_add(&b->vq, head);
+    return true;
+}
+
+// Interrupts off
+static void finishSlot(virtio_blk_t *b, uint32_t slot, uint8_t err)
+{
+    b->stages[slot] &= b->stages[slot] - 1;
+    if (err == 0 && b->stages[slot])
+    {
+        if (issueStage(b, slot))
+            return;
+        err = VIRTIO_BLK_ERR_ALIGN;
+    }
+
+    struct blk_request *rq = b->requests[slot];
+    b->requests[slot] = NULL;
+    b->stages[slot] = 0;
+    b->active &= ~(1u << slot);
+    blk_complete(&b->queue, rq, err);
+}
+
+// Drains the used ring, then asks for an interrupt on the next entry.
+// Interrupts off.
+static void service(virtio_blk_t *b)
+{
+    uint32_t head, len;
+    do
+    {
+        while (virtqueue_next_used(&b->vq, &head, &len))
+        {
+            uint32_t slot = b->indirect ? head : head / b->ring_descs;
+            if (slot >= b->depth || !(b->active & (1u << slot)))
+                continue;
+
+            uint8_t status = b->slots[slot].status;
+            uint8_t err = 0;
+            if (status == VIRTIO_BLK_S_UNSUPP)
+                err = VIRTIO_BLK_ERR_UNSUPPORTED;
+            else if (status != VIRTIO_BLK_S_OK)
+                err = VIRTIO_BLK_ERR_IO;
+            finishSlot(b, slot, err);
+        }
+    } while (!virtqueue_arm(&b->vq));
+
+    // Follow-up stages finishSlot queued
+    virtqueue_kick(&b->vq);
+}
+
+static irqreturn_t virtioBlkIrq(int irq, void *dev_id)
+{
+    (void)irq;
+    virtio_blk_t *b = dev_id;
+    // INTx is shared and has to be acknowledged, MSI-X is ours alone
+    if (!b->vdev.msix && !(virtio_read_isr(&b->vdev) & 1))
+        return IRQ_NONE;
+    b->interrupts++;
+    service(b);
+    return IRQ_HANDLED;
+}
+
+static void virtioBlkPoll(void *dev)
+{
+    service(dev);
+}
+
+// One kick for everything the queue just started
+static void virtioBlkCommit(void *dev)
+{
+    virtio_blk_t *b = dev;
+    uint32_t flags = saveInterrupts();
+    virtqueue_kick(&b->vq);
+    restoreInterrupts(flags);
+}
+
+// blk_start_t. Without VIRTIO_BLK_F_FLUSH the device has no volatile
+// cache, so flushes have nothing to do.
+static uint8_t virtioBlkStart(void *dev, struct blk_request *rq, const struct blk_segment *segs, uint32_t nsegs)
+{
+    virtio_blk_t *b = dev;
+    if (rq->count && rq->direction == BLK_WRITE && b->readonly)
+        return VIRTIO_BLK_ERR_READONLY;
+
+    bool flush = virtio_has(&b->vdev, VIRTIO_BLK_F_FLUSH);
+    uint8_t stages = 0;
+    if ((rq->flags & BLK_PREFLUSH) && flush)
+        stages |= VIRTIO_BLK_STAGE_PREFLUSH;
+    if (rq->count)
+        stages |= VIRTIO_BLK_STAGE_DATA;
+    if (rq->count && rq->direction == BLK_WRITE && (rq->flags & BLK_FUA) && flush)
+        stages |= VIRTIO_BLK_STAGE_POSTFLUSH;
+
+    uint32_t flags = saveInterrupts();
+    if (stages == 0)
+    {
+        blk_complete(&b->queue, rq, 0);
+        restoreInterrupts(flags);
+        return 0;
+    }
+
+    uint32_t free = ~b->active & (b->depth >= 32 ? 0xFFFFFFFF : (1u << b->depth) - 1);
+    if (free == 0)
+    {
+        // The queue never has more than depth out
+        restoreInterrupts(flags);
+        return VIRTIO_BLK_ERR_IO;
+    }
+    uint32_t slot = __builtin_ctz(free);
+    b->requests[slot] = rq;
+    b->stages[slot] = stages;
+    b->nsegs[slot] = nsegs;
+    memcpy(b->data[slot], segs, nsegs * sizeof(struct blk_segment));
+    if (!issueStage(b, slot))
+    {
+        b->requests[slot] = NULL;
+        b->stages[slot] = 0;
+        restoreInterrupts(flags);
+        return VIRTIO_BLK_ERR_ALIGN;
+    }
+    b->active |= 1u << slot;
+    restoreInterrupts(flags);
+    return 0;
+}
+
+static virtio_blk_t *probe(pci_device_t *pci)
+{
+    virtio_blk_t *b = kmalloc(sizeof(virtio_blk_t));
+    if (b == NULL)
+        return NULL;
+    memset(b, 0, sizeof(virtio_blk_t));
+
+    if (!virtio_pci_init(&b->vdev, pci))
+    {
+        kfree(b);
+        return NULL;
+    }
+    if (!virtio_negotiate(&b->vdev, VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX | VIRTIO_BLK_F_SEG_MAX |
+                                        VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH) ||
+        !virtqueue_setup(&b->vdev, &b->vq, 0, VIRTQUEUE_MAX_SIZE))
+    {
+        printf("virtio-blk: %x:%x refused setup\n", pci->vendor_id, pci->device_id);
+        virtio_fail(&b->vdev);
+        kfree(b);
+        return NULL;
+    }
+
+    b->sectors = virtio_config_read64(&b->vdev, VIRTIO_BLK_CFG_CAPACITY);
+    b->readonly = virtio_has(&b->vdev, VIRTIO_BLK_F_RO);
+    b->seg_max = VIRTIO_BLK_MAX_DESCS - 2;
+    if (virtio_has(&b->vdev, VIRTIO_BLK_F_SEG_MAX))
+    {
+        uint32_t seg_max = virtio_config_read32(&b->vdev, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < b->seg_max)
+            b->seg_max = seg_max;
+    }
+
+    // No chain may be longer than the ring, indirect or not
+    b->indirect = virtio_has(&b->vdev, VIRTIO_F_INDIRECT_DESC);
+    b->chain_max = b->vq.size < VIRTIO_BLK_MAX_DESCS ? b->vq.size : VIRTIO_BLK_MAX_DESCS;
+    if (b->indirect)
+    {
+        b->ring_descs = 1;
+        b->depth = b->vq.size < VIRTIO_BLK_DEPTH ? b->vq.size : VIRTIO_BLK_DEPTH;
+    }
+    else
+    {
+        b->ring_descs = b->chain_max;
+        b->depth = b->vq.size / b->ring_descs;
+        if (b->depth > VIRTIO_BLK_DEPTH)
+            b->depth = VIRTIO_BLK_DEPTH;
+    }
+
+    b->slots = memAllocDma(b->depth * sizeof(struct virtio_blk_slot), PAGE_SIZE, &b->slots_phys);
+    if (b->slots == NULL)
+    {
+        virtio_fail(&b->vdev);
+        kfree(b);
+        return NULL;
+    }
+    return b;
+}
+
+void virtio_blk_init()
+{
+    static const uint16_t ids[] = {VIRTIO_PCI_LEGACY_BASE + 1, VIRTIO_PCI_MODERN_BASE + VIRTIO_ID_BLOCK};
+
+    for (int id = 0; id < 2; id++)
+    {
+        pci_device_t *pci;
+        for (int i = 0; numDisks < VIRTIO_BLK_MAX_DISKS && (pci = pciFindDeviceId(VIRTIO_PCI_VENDOR, ids[id], i)); i++)
+        {
+            virtio_blk_t *b = probe(pci);
+            if (b == NULL)
+                continue;
+
+            const char *name = diskNames[numDisks];
+            blk_queue_init_async(&b->queue, name, virtioBlkStart, virtioBlkPoll, virtioBlkCommit, b,
+                                 VIRTIO_BLK_MAX_SECTORS, b->depth);
+            blk_queue_enable_cache(&b->queue);
+            bdev_register(name, BLOCK_DISK, &b->queue, b->sectors, BLK_SECTOR_SIZE, b->readonly);
+            if (b->vdev.irq >= 0)
+                irq_request(b->vdev.irq, virtioBlkIrq, b, name);
+            else
+                b->queue.polled = true;
+            virtio_driver_ok(&b->vdev);
+            disks[numDisks++] = b;
+
+            printf("virtio-blk: %s %s, %llu MiB%s, irq %d%s, ring %u, %u deep%s%s\n", name,
+                   b->vdev.modern ? "modern" : "legacy", b->sectors / 2048, b->readonly ? " read-only" : "", b->vdev.irq,
+                   b->vdev.msix ? " (MSI-X)" : "", b->vq.size, b->depth, b->indirect ? ", indirect" : "",
+                   virtio_has(&b->vdev, VIRTIO_F_EVENT_IDX) ? ", event idx" : "");
+        }
+    }
+    if (numDisks == 0)
+        printf("virtio-blk: no devices\n");
+}
+
+struct blk_queue *virtio_blk_queue(uint32_t disk)
+{
+    return disk < numDisks ? &disks[disk]->queue : NULL;
+}
+
+void virtio_blk_benchmark(uint32_t disk, uint32_t count)
+{
+    if (disk >= numDisks)
+        return;
+    virtio_blk_t *b = disks[disk];
+    struct blk_queue *q = &b->queue;
+    if (count > b->sectors)
+        count = (uint32_t)b->sectors;
+
+    uint8_t *buffer = kmalloc(VIRTIO_BLK_BENCH_BATCH * VIRTIO_BLK_BENCH_SECTORS * 512);
+    if (buffer == NULL)
+        return;
+
+    struct blk_io ios[VIRTIO_BLK_BENCH_BATCH];
+    uint32_t requests = q->requests, kicks = b->vq.kicks, suppressed = b->vq.kicks_suppressed;
+    uint32_t interrupts = b->interrupts;
+    bool failed = false;
+
+    uint64_t start = rdtsc();
+    for (uint32_t lba = 0; lba < count && !failed;)
+    {
+        uint32_t n = 0;
+        blk_plug(q);
+        for (; n < VIRTIO_BLK_BENCH_BATCH && lba < count; n++)
+        {
+            uint32_t sectors = count - lba < VIRTIO_BLK_BENCH_SECTORS ? count - lba : VIRTIO_BLK_BENCH_SECTORS;
+            ios[n].direction = BLK_READ;
+            ios[n].flags = BLK_NOCACHE;
+            ios[n].lba = lba;
+            ios[n].count = sectors;
+            ios[n].buf = buffer + n * VIRTIO_BLK_BENCH_SECTORS * 512;
+            blk_submit(q, &ios[n]);
+            lba += sectors;
+        }
+        blk_unplug(q);
+        for (uint32_t i = 0; i < n; i++)
+            failed |= blk_wait(q, &ios[i]) != 0;
+    }
+    uint64_t cycles = rdtsc() - start;
+    kfree(buffer);
+
+    uint32_t khz = ktime_tsc_khz();
+    uint64_t kb = (uint64_t)count / 2;
+    uint64_t us = khz ? cycles * 1000 / khz : 0;
+    printf("virtio-blk %s: %llu KB in %llu us, %llu KB/s%s\n", q->name, kb, us, us ? kb * 1000000 / us : 0,
+           failed ? ", with errors" : "");
+    printf("virtio-blk %s: %u requests, %u kicks (%u suppressed), %u interrupts\n", q->name, q->requests - requests,
+           b->vq.kicks - kicks, b->vq.kicks_suppressed - suppressed, b->interrupts - interrupts);
+}
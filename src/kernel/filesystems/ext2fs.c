@@ -2,9 +2,38 @@
 #include <string.h>
 #include <util.h>
 
-ext2_superblock_ext_t *ext2_get_superblock(uint8_t drive)
+// Everything goes through the block device, whatever controller is behind it
+static uint8_t ext2_read_sectors(block_device_t *drive, uint64_t lba, uint32_t count, void *buffer)
 {
-    printf("Attempting to read ext2 Superblock from drive %d...\n", drive);
+    return bdev_rw(drive, BLK_READ, lba, count, buffer);
+}
+
+block_device_t *ext2_find_root()
+{
+    ext2_superblock_ext_t *superblock = kmalloc(SUPERBLOCK_SIZE);
+    if (!superblock)
+        return NULL;
+
+    block_device_t *root = NULL;
+    for (uint32_t i = 0; i < bdev_count() && root == NULL; i++)
+    {
+        block_device_t *dev = bdev_get(i);
+        if (dev->type == BLOCK_DISK && ext2_read_sectors(dev, 2, 2, superblock) == 0 &&
+            superblock->signature == EXT2_SIGNATURE)
+            root = dev;
+    }
+    kfree(superblock);
+    return root;
+}
+
+ext2_superblock_ext_t *ext2_get_superblock(block_device_t *drive)
+{
+    if (drive == NULL)
+    {
+        printf("Superblock Read Error: no drive.\n");
+        return NULL;
+    }
+    printf("Attempting to read ext2 Superblock from %s...\n", drive->name);
 
     unsigned int *superBlockBuffer = kmalloc(SUPERBLOCK_SIZE);
     if (!superBlockBuffer)
@@ -13,17 +42,23 @@ ext2_superblock_ext_t *ext2_get_superblock(uint8_t drive)
         return NULL;
     }
 
-    uint8_t error = ide_ata_rw(0, drive, 2, 2, 0x10, (unsigned int)superBlockBuffer);
+    uint8_t error = ext2_read_sectors(drive, 2, 2, superBlockBuffer);
 
     if (error != 0)
     {
-        printf("Superblock Read Error: ideAtaRead failed with code %d.\n", error);
+        printf("Superblock Read Error: read failed with code %d.\n", error);
         kfree(superBlockBuffer);
         return NULL;
     }
 
     ext2_superblock_ext_t *superblock = (ext2_superblock_ext_t *)superBlockBuffer;
     printf("ext2 signature: 0x%x\n", superblock->signature);
+    if (superblock->signature != EXT2_SIGNATURE)
+    {
+        printf("Superblock Read Error: %s is not ext2.\n", drive->name);
+        kfree(superBlockBuffer);
+        return NULL;
+    }
     printf("%i.%i\n", superblock->majorPortionVersion, superblock->minorPortionVersion);
     printf("iNode Size: %i\n", superblock->iNodeSize);
 
@@ -31,17 +66,16 @@ ext2_superblock_ext_t *ext2_get_superblock(uint8_t drive)
 }
 
 /**
- * Reads a specific data block from an inode, handling direct and indirect blocks.
+ * Finds where a logical block of an inode lives on disk, handling direct and indirect blocks.
  *
  * @param drive The drive number.
  * @param superblock The ext2 superblock.
- * @param bgdt The block group descriptor table.
- * @param inode The inode to read from.
+ * @param inode The inode to look in.
  * @param blockNum The logical block number within the file/directory.
- * @param buffer A pointer to a buffer where the block data will be stored.
+ * @param address Set to the block's address on disk, 0 for a hole.
  * @return 0 on success, a non-zero error code on failure.
  */
-int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode, uint32_t blockNum, uint8_t *buffer)
+static int ext2_map_inode_block(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode, uint32_t blockNum, uint32_t *address)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
     uint32_t pointersPerBlock = blockSize / sizeof(uint32_t);
@@ -61,7 +95,7 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
 
         uint32_t lba = (inode->singleIndirectBlckPtr * blockSize) / 512;
         uint32_t secsRead = blockSize / 512;
-        if (ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)singlyIndirectBlock) != 0)
+        if (ext2_read_sectors(drive, lba, secsRead, singlyIndirectBlock) != 0)
         {
             kfree(singlyIndirectBlock);
             return -1;
@@ -79,7 +113,7 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
 
         uint32_t lba = (inode->doubleIndirectBlckPtr * blockSize) / 512;
         uint32_t secsRead = blockSize / 512;
-        if (ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)doublyIndirectBlock) != 0)
+        if (ext2_read_sectors(drive, lba, secsRead, doublyIndirectBlock) != 0)
         {
             kfree(doublyIndirectBlock);
             return -1;
@@ -94,7 +128,7 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
             return -1;
 
         lba = (singlyBlockAddress * blockSize) / 512;
-        if (ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)singlyIndirectBlock) != 0)
+        if (ext2_read_sectors(drive, lba, secsRead, singlyIndirectBlock) != 0)
         {
             kfree(singlyIndirectBlock);
             return -1;
@@ -113,7 +147,7 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
 
         uint32_t lba = (inode->tripleIndirectBlckPtr * blockSize) / 512;
         uint32_t secsRead = blockSize / 512;
-        if (ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)triplyIndirectBlock) != 0)
+        if (ext2_read_sectors(drive, lba, secsRead, triplyIndirectBlock) != 0)
         {
             kfree(triplyIndirectBlock);
             return -1;
@@ -128,7 +162,7 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
             return -1;
 
         lba = (doublyBlockAddress * blockSize) / 512;
-        if (ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)doublyIndirectBlock) != 0)
+        if (ext2_read_sectors(drive, lba, secsRead, doublyIndirectBlock) != 0)
         {
             kfree(doublyIndirectBlock);
             return -1;
@@ -143,7 +177,7 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
             return -1;
 
         lba = (singlyBlockAddress * blockSize) / 512;
-        if (ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)singlyIndirectBlock) != 0)
+        if (ext2_read_sectors(drive, lba, secsRead, singlyIndirectBlock) != 0)
         {
             kfree(singlyIndirectBlock);
             return -1;
@@ -154,6 +188,28 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
         kfree(singlyIndirectBlock);
     }
 
+    *address = blockAddress;
+    return 0;
+}
+
+/**
+ * Reads a specific data block from an inode, handling direct and indirect blocks.
+ *
+ * @param drive The drive number.
+ * @param superblock The ext2 superblock.
+ * @param inode The inode to read from.
+ * @param blockNum The logical block number within the file/directory.
+ * @param buffer A pointer to a buffer where the block data will be stored.
+ * @return 0 on success, a non-zero error code on failure.
+ */
+int ext2_read_inode_block(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode, uint32_t blockNum, uint8_t *buffer)
+{
+    uint32_t blockSize = 1024 << superblock->logBlockSize;
+    uint32_t blockAddress;
+
+    if (ext2_map_inode_block(drive, superblock, inode, blockNum, &blockAddress) != 0)
+        return -1;
+
     if (blockAddress == 0)
     {
 
@@ -163,10 +219,10 @@ int ext2_read_inode_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2
 
     uint32_t lba = (blockAddress * blockSize) / 512;
     uint32_t secsRead = blockSize / 512;
-    return ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)buffer);
+    return ext2_read_sectors(drive, lba, secsRead, buffer);
 }
 
-ext2_blockgroupdescriptor_t *ext2_get_bgdt(uint8_t drive, ext2_superblock_ext_t *superblock)
+ext2_blockgroupdescriptor_t *ext2_get_bgdt(block_device_t *drive, ext2_superblock_ext_t *superblock)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
     unsigned int *bgdtBuffer = kmalloc(blockSize);
@@ -185,10 +241,10 @@ ext2_blockgroupdescriptor_t *ext2_get_bgdt(uint8_t drive, ext2_superblock_ext_t
 
     uint32_t secsRead = blockSize / 512;
     uint32_t lba = (bgdtBlock * blockSize) / 512;
-    uint8_t error = ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)bgdtBuffer);
+    uint8_t error = ext2_read_sectors(drive, lba, secsRead, bgdtBuffer);
     if (error != 0)
     {
-        printf("Block Group Descriptor Table Read Error: ideAtaRead failed with code %d.\n", error);
+        printf("Block Group Descriptor Table Read Error: read failed with code %d.\n", error);
         kfree(bgdtBuffer);
         return NULL;
     }
@@ -196,7 +252,7 @@ ext2_blockgroupdescriptor_t *ext2_get_bgdt(uint8_t drive, ext2_superblock_ext_t
     return (ext2_blockgroupdescriptor_t *)bgdtBuffer;
 }
 
-ext2_inode_t *ext2_get_inode(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt, unsigned int inodeNum)
+ext2_inode_t *ext2_get_inode(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt, unsigned int inodeNum)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
     uint32_t blockGroup = (inodeNum - 1) / superblock->iNodesPerGroup;
@@ -214,10 +270,10 @@ ext2_inode_t *ext2_get_inode(uint8_t drive, ext2_superblock_ext_t *superblock, e
         printf("inode Read Error: Failed to allocate memory.\n");
         return NULL;
     }
-    uint8_t error = ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)nodeBuffer);
+    uint8_t error = ext2_read_sectors(drive, lba, secsRead, nodeBuffer);
     if (error != 0)
     {
-        printf("inode Read Error: ideAtaRead failed with code %d.\n", error);
+        printf("inode Read Error: read failed with code %d.\n", error);
         kfree(nodeBuffer);
         return NULL;
     }
@@ -232,7 +288,7 @@ ext2_inode_t *ext2_get_inode(uint8_t drive, ext2_superblock_ext_t *superblock, e
     return inodeR;
 }
 
-void ext2_iterate_directory(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode, bool dirEntryHasType)
+void ext2_iterate_directory(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode, bool dirEntryHasType)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
 
@@ -264,10 +320,10 @@ void ext2_iterate_directory(uint8_t drive, ext2_superblock_ext_t *superblock, ex
         uint32_t secsRead = blockSize / 512;
         uint32_t lba = (blockAddr * blockSize) / 512;
 
-        uint8_t error = ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)blockBuffer);
+        uint8_t error = ext2_read_sectors(drive, lba, secsRead, blockBuffer);
         if (error != 0)
         {
-            printf("Directory Read Error: ideAtaRead failed with code %d.\n", error);
+            printf("Directory Read Error: read failed with code %d.\n", error);
             kfree(blockBuffer);
             return;
         }
@@ -328,7 +384,7 @@ void ext2_iterate_directory(uint8_t drive, ext2_superblock_ext_t *superblock, ex
  * @return A pointer to a buffer containing the file data, or NULL on failure.
  *         The caller is responsible for freeing this buffer with kfree().
  */
-uint8_t *ext2_read_file(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode)
+uint8_t *ext2_read_file(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_inode_t *inode)
 {
 
     uint16_t typePerm = inode->typePerm;
@@ -366,9 +422,78 @@ uint8_t *ext2_read_file(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_i
     }
 
     uint32_t total_blocks = (fileSize + blockSize - 1) / blockSize;
-    uint32_t bytesRemaining = fileSize;
+    uint32_t full_blocks = fileSize / blockSize;
+    uint32_t i = 0;
+
+    // Whole blocks are read straight into the file buffer. Blocks that sit
+    // next to each other on disk share a bio, up to EXT2_FILE_BIOS of them
+    // are out at once and the queue merges whatever it can. Mapping comes
+    // first since indirect block reads would have to wait behind them.
+    uint32_t *addresses = full_blocks ? kmalloc(full_blocks * sizeof(uint32_t)) : NULL;
+    struct bio *bios = addresses ? kmalloc(EXT2_FILE_BIOS * sizeof(struct bio)) : NULL;
+    if (bios)
+    {
+        uint32_t mapped;
+        for (mapped = 0; mapped < full_blocks; mapped++)
+        {
+            if (ext2_map_inode_block(drive, superblock, inode, mapped, &addresses[mapped]) != 0)
+                break;
+        }
 
-    for (uint32_t i = 0; i < total_blocks; i++)
+        uint32_t firsts[EXT2_FILE_BIOS]; // file block each bio starts at
+        uint32_t submitted = 0, waited = 0, failed = mapped;
+        struct bio *bio = NULL;
+        for (uint32_t j = 0; j <= mapped; j++)
+        {
+            // Sparse blocks read as zeroes
+            if (j < mapped && addresses[j] == 0)
+            {
+                memset(fileBuffer + (j * blockSize), 0, blockSize);
+                continue;
+            }
+
+            uint64_t lba = j < mapped ? (uint64_t)addresses[j] * (blockSize / 512) : 0;
+            if (bio && j < mapped && bio->sector + bio->sectors == lba &&
+                bio_add(bio, fileBuffer + (j * blockSize), blockSize / 512))
+                continue;
+
+            if (bio)
+            {
+                bio_submit(bio);
+                submitted++;
+                bio = NULL;
+            }
+            if (j == mapped)
+                break;
+
+            // Every bio is out, the oldest one makes room
+            if (submitted - waited == EXT2_FILE_BIOS)
+            {
+                uint32_t k = waited++ % EXT2_FILE_BIOS;
+                if (bio_wait(&bios[k]) != 0 && firsts[k] < failed)
+                    failed = firsts[k];
+            }
+            uint32_t k = submitted % EXT2_FILE_BIOS;
+            bio = &bios[k];
+            firsts[k] = j;
+            bio_init(bio, drive, BLK_READ, lba);
+            bio_add(bio, fileBuffer + (j * blockSize), blockSize / 512);
+        }
+        while (waited < submitted)
+        {
+            uint32_t k = waited++ % EXT2_FILE_BIOS;
+            if (bio_wait(&bios[k]) != 0 && firsts[k] < failed)
+                failed = firsts[k];
+        }
+        i = failed; // redo from here below, which reports it
+    }
+    if (bios)
+        kfree(bios);
+    if (addresses)
+        kfree(addresses);
+
+    // Whatever's left, including the partial last block, one block at a time
+    for (; i < total_blocks; i++)
     {
 
         if (ext2_read_inode_block(drive, superblock, inode, i, blockBuffer) != 0)
@@ -379,11 +504,9 @@ uint8_t *ext2_read_file(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_i
             return NULL;
         }
 
-        uint32_t bytesToCopy = (bytesRemaining > blockSize) ? blockSize : bytesRemaining;
+        uint32_t bytesToCopy = (fileSize - (i * blockSize) > blockSize) ? blockSize : fileSize - (i * blockSize);
 
         memcpy(fileBuffer + (i * blockSize), blockBuffer, bytesToCopy);
-
-        bytesRemaining -= bytesToCopy;
     }
 
     fileBuffer[fileSize] = '\0';
@@ -402,7 +525,7 @@ uint8_t *ext2_read_file(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_i
  * @param filename The name of the file to find.
  * @return The inode number of the file if found, otherwise 0.
  */
-uint32_t ext2_find_entry(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_inode_t *dir_inode, const char *filename)
+uint32_t ext2_find_entry(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_inode_t *dir_inode, const char *filename)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
 
@@ -466,7 +589,7 @@ uint32_t ext2_find_entry(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_
 /**
  * Finds a file or directory by its full path starting from root
  */
-ext2_inode_t *ext2_find_by_path(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt, const char *path)
+ext2_inode_t *ext2_find_by_path(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt, const char *path)
 {
     char *path_copy = strdup(path);
     if (!path_copy)
@@ -539,7 +662,7 @@ ext2_inode_t *ext2_find_by_path(uint8_t drive, ext2_superblock_ext_t *superblock
     return ext2_get_inode(drive, superblock, bgdt, cur_inode_num);
 }
 
-int ext2_allocate_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt)
+int ext2_allocate_block(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt)
 {
     uint32_t blockSize = 1024 << superblock->logBlockSize;
     uint8_t *bitmap = kmalloc(blockSize);
@@ -551,11 +674,11 @@ int ext2_allocate_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_b
 
     uint32_t secsRead = blockSize / 512;
     uint32_t lba = (bgdt->blockUsageBitmapAddr * blockSize) / 512;
-    uint8_t error = ide_ata_rw(0, drive, lba, secsRead, 0x10, (unsigned int)bitmap);
+    uint8_t error = ext2_read_sectors(drive, lba, secsRead, bitmap);
 
     if (error != 0)
     {
-        printf("Block bitmap Read Error: ideAtaRead failed with code %d.\n", error);
+        printf("Block bitmap Read Error: read failed with code %d.\n", error);
         kfree(bitmap);
         return -1;
     }
@@ -591,7 +714,7 @@ int ext2_allocate_block(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_b
     return allocated_index;
 }
 
-int ext2_create_entry(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt, uint32_t new_inode_num, ext2_inode_t *parent, uint32_t parent_num, char *name, ext2_dirtype_t type)
+int ext2_create_entry(block_device_t *drive, ext2_superblock_ext_t *superblock, ext2_blockgroupdescriptor_t *bgdt, uint32_t new_inode_num, ext2_inode_t *parent, uint32_t parent_num, char *name, ext2_dirtype_t type)
 {
     uint16_t required_size = 8 + strlen(name);
 
@@ -665,9 +788,11 @@ int ext2_create_entry(uint8_t drive, ext2_superblock_ext_t *superblock, ext2_blo
         // uint32_t newBlockAddr = ext2_allocate_block(drive, superblock, bgdt);
     }
 }
-void ext2_read_drive(uint8_t drive)
+void ext2_read_drive(block_device_t *drive)
 {
     ext2_superblock_ext_t *superblock = ext2_get_superblock(drive);
+    if (superblock == NULL)
+        return;
     ext2_blockgroupdescriptor_t *bgdt = ext2_get_bgdt(drive, superblock);
     bool dirEntryHasType;
 
@@ -1,5 +1,45 @@
 #include <filesystems.h>
 
+// ISO blocks are 2048 bytes, the device counts 512 byte sectors
+static uint8_t isoReadBlocks(block_device_t *drive, uint32_t lba, uint32_t count, void *buffer)
+{
+    uint32_t per = ISO_BLOCKSIZE / BLK_SECTOR_SIZE;
+    return bdev_rw(drive, BLK_READ, (uint64_t)lba * per, count * per, buffer);
+}
+
+// The whole extent of a directory, kmalloc'd. Its size is in the "."
+// entry of the first block, so that one goes first and only the rest is
+// read after it, which the drive's readahead usually already has.
+static uint8_t *isoReadDirectory(block_device_t *drive, uint32_t dirLBA, uint32_t *dirSize)
+{
+    uint8_t *first = (uint8_t *)kmalloc(ISO_BLOCKSIZE);
+    if (!first)
+        return NULL;
+    if (isoReadBlocks(drive, dirLBA, 1, first))
+    {
+        kfree(first);
+        return NULL;
+    }
+
+    *dirSize = ((iso9660_dir_t *)first)->size;
+    uint32_t numSectors = (*dirSize + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+    if (numSectors <= 1)
+        return first;
+
+    uint8_t *buf = (uint8_t *)kmalloc(numSectors * ISO_BLOCKSIZE);
+    if (buf)
+    {
+        memcpy(buf, first, ISO_BLOCKSIZE);
+        if (isoReadBlocks(drive, dirLBA + 1, numSectors - 1, buf + ISO_BLOCKSIZE))
+        {
+            kfree(buf);
+            buf = NULL;
+        }
+    }
+    kfree(first);
+    return buf;
+}
+
 int isoFilenameCompare(const char *isoName, int isoLen, const char *cName)
 {
     int c_len = strlen(cName);
@@ -37,43 +77,12 @@ int isoFilenameCompare(const char *isoName, int isoLen, const char *cName)
  * @param name The name of the file or subdirectory to find.
  * @return A pointer to a kmalloc'd directory entry struct on success, NULL on failure.
  */
-iso9660_dir_t *isoResolveEntry(uint8_t drive, uint32_t dirLBA, const char *name)
+iso9660_dir_t *isoResolveEntry(block_device_t *drive, uint32_t dirLBA, const char *name)
 {
-    uint8_t *dirContentBuf = NULL;
     uint32_t dirSize = 0;
-
-    {
-        uint8_t *sectorBuffer = (uint8_t *)kmalloc(ISO_BLOCKSIZE);
-        if (!sectorBuffer)
-            return NULL;
-
-        if (ide_atapi_read(drive, dirLBA, 1, 0x10, (unsigned int)sectorBuffer))
-        {
-            kfree(sectorBuffer);
-            return NULL;
-        }
-
-        iso9660_dir_t *self_entry = (iso9660_dir_t *)sectorBuffer;
-        dirSize = self_entry->size;
-        uint32_t numSectors = (dirSize + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
-
-        if (numSectors <= 1)
-        {
-            dirContentBuf = sectorBuffer;
-        }
-        else
-        {
-            kfree(sectorBuffer);
-            dirContentBuf = (uint8_t *)kmalloc(numSectors * ISO_BLOCKSIZE);
-            if (!dirContentBuf)
-                return NULL;
-            if (ide_atapi_read(drive, dirLBA, numSectors, 0x10, (unsigned int)dirContentBuf))
-            {
-                kfree(dirContentBuf);
-                return NULL;
-            }
-        }
-    }
+    uint8_t *dirContentBuf = isoReadDirectory(drive, dirLBA, &dirSize);
+    if (!dirContentBuf)
+        return NULL;
 
     uint32_t offset = 0;
     while (offset < dirSize)
@@ -100,12 +109,12 @@ iso9660_dir_t *isoResolveEntry(uint8_t drive, uint32_t dirLBA, const char *name)
     return NULL;
 }
 
-iso9660_pvd_t *isoGetPVDStruct(uint8_t driveIndex)
+iso9660_pvd_t *isoGetPVDStruct(block_device_t *drive)
 {
     uint32_t pvdLBA = ISO_PVD_SECTOR;
     uint32_t sectorSize = ISO_BLOCKSIZE;
 
-    printf("Attempting to read PVD from drive %d...\n", driveIndex);
+    printf("Attempting to read PVD from %s...\n", drive->name);
 
     uint8_t *buffer = (uint8_t *)kmalloc(sectorSize);
     if (!buffer)
@@ -114,11 +123,11 @@ iso9660_pvd_t *isoGetPVDStruct(uint8_t driveIndex)
         return NULL;
     }
 
-    uint8_t error = ide_atapi_read(driveIndex, pvdLBA, 1, 0x10, (unsigned int)buffer);
+    uint8_t error = isoReadBlocks(drive, pvdLBA, 1, buffer);
 
     if (error != 0)
     {
-        printf("PVD Read Error: ideAtapiRead failed with code %d.\n", error);
+        printf("PVD Read Error: read failed with code %d.\n", error);
         kfree(buffer);
         return NULL;
     }
@@ -137,7 +146,7 @@ iso9660_pvd_t *isoGetPVDStruct(uint8_t driveIndex)
     return pvd;
 }
 
-uint8_t *isoLoadPathTable(uint8_t drive, iso9660_pvd_t *pvd)
+uint8_t *isoLoadPathTable(block_device_t *drive, iso9660_pvd_t *pvd)
 {
     uint32_t pathTableLBA = pvd->type_l_path_table;
     uint32_t pathTableSize = pvd->pathTableSize;
@@ -159,7 +168,7 @@ uint8_t *isoLoadPathTable(uint8_t drive, iso9660_pvd_t *pvd)
         return NULL;
     }
 
-    uint8_t error = ide_atapi_read(drive, pathTableLBA, numSectors, 0x10, (unsigned int)tableBuffer);
+    uint8_t error = isoReadBlocks(drive, pathTableLBA, numSectors, tableBuffer);
     if (error)
     {
         printf("Error: Failed to read path table from disc. Code: %d\n", error);
@@ -170,7 +179,7 @@ uint8_t *isoLoadPathTable(uint8_t drive, iso9660_pvd_t *pvd)
     return tableBuffer;
 }
 
-void isoPrintDirectoryRecursive(uint8_t drive, uint8_t *pathTableBuf, uint32_t table_size, uint16_t parent_index, int depth)
+void isoPrintDirectoryRecursive(block_device_t *drive, uint8_t *pathTableBuf, uint32_t table_size, uint16_t parent_index, int depth)
 {
     uint32_t table_offset = 0;
     uint16_t current_entry_index = 0;
@@ -207,9 +216,9 @@ void isoPrintDirectoryRecursive(uint8_t drive, uint8_t *pathTableBuf, uint32_t t
     }
 }
 
-void isoPrintfileSystemTree(uint8_t drive)
+void isoPrintfileSystemTree(block_device_t *drive)
 {
-    printf("Attempting to print filesystem tree for drive %d:\n", drive);
+    printf("Attempting to print filesystem tree for %s:\n", drive->name);
 
     iso9660_pvd_t *pvd = isoGetPVDStruct(drive);
     if (!pvd)
@@ -238,47 +247,17 @@ void isoPrintfileSystemTree(uint8_t drive)
     printf("\nFilesystem tree printed.\n");
 }
 
-void isoPrintFilesInDirectory(uint8_t drive, uint32_t dirLBA, int depth)
+void isoPrintFilesInDirectory(block_device_t *drive, uint32_t dirLBA, int depth)
 {
 
-    uint8_t *sectorBuffer = (uint8_t *)kmalloc(ISO_BLOCKSIZE);
-    if (!sectorBuffer)
-        return;
-
-    if (ide_atapi_read(drive, dirLBA, 1, 0x10, (unsigned int)sectorBuffer))
+    uint32_t dirSize = 0;
+    uint8_t *dirContentBuf = isoReadDirectory(drive, dirLBA, &dirSize);
+    if (!dirContentBuf)
     {
         printf("Read error in printfilesInDirectory\n");
-        kfree(sectorBuffer);
         return;
     }
 
-    iso9660_dir_t *self_entry = (iso9660_dir_t *)sectorBuffer;
-    uint32_t dirSize = self_entry->size;
-
-    uint8_t *dirContentBuf = NULL;
-    uint32_t num_sectors = (dirSize + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
-
-    if (num_sectors <= 1)
-    {
-
-        dirContentBuf = sectorBuffer;
-    }
-    else
-    {
-
-        kfree(sectorBuffer);
-        dirContentBuf = (uint8_t *)kmalloc(num_sectors * ISO_BLOCKSIZE);
-        if (!dirContentBuf)
-            return;
-
-        if (ide_atapi_read(drive, dirLBA, num_sectors, 0x10, (unsigned int)dirContentBuf))
-        {
-            printf("Read error for multi-sector directory\n");
-            kfree(dirContentBuf);
-            return;
-        }
-    }
-
     uint32_t offset = 0;
     while (offset < dirSize)
     {
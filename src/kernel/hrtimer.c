@@ -0,0 +1,195 @@
+#include <hrtimer.h>
+#include <ktime.h>
+#include <softirq.h>
+#include <drivers/hpet.h>
+#include <util.h>
+#include <stdio.h>
+
+#define HRTIMER_HPET_TIMER 1
+
+// Min-heap on expires. Only touched with interrupts off.
+static struct hrtimer *heap[HRTIMER_MAX];
+static int heap_size = 0;
+
+// One-shot event source, NULL means we only look at the heap every tick.
+static bool (*program_event)(uint64_t delay_ns) = NULL;
+static const char *event_source = "tick";
+static uint64_t programmed_expiry = 0; // what the event source is armed for, 0 = nothing
+
+static void heapSwap(int a, int b)
+{
+    struct hrtimer *t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    heap[a]->index = a;
+    heap[b]->index = b;
+}
+
+static void siftUp(int i)
+{
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (heap[parent]->expires <= heap[i]->expires)
+            break;
+        heapSwap(i, parent);
+        i = parent;
+    }
+}
+
+static void siftDown(int i)
+{
+    for (;;)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap_size && heap[left]->expires < heap[smallest]->expires)
+            smallest = left;
+        if (right < heap_size && heap[right]->expires < heap[smallest]->expires)
+            smallest = right;
+        if (smallest == i)
+            break;
+        heapSwap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heapRemove(struct hrtimer *timer)
+{
+    int i = timer->index;
+    heap_size--;
+    if (i != heap_size)
+    {
+        heap[i] = heap[heap_size];
+        heap[i]->index = i;
+        siftDown(i);
+        siftUp(i);
+    }
+    timer->index = -1;
+}
+
+// Arms the event source for the earliest timer if it isn't already.
+static void reprogram()
+{
+    if (program_event == NULL || heap_size == 0)
+        return;
+
+    uint64_t expires = heap[0]->expires;
+    if (expires == programmed_expiry)
+        return;
+
+    uint64_t now = ktime_get_ns();
+    programmed_expiry = expires;
+    program_event(expires > now ? expires - now : 0);
+}
+
+// Runs in softirq context with interrupts on.
+static void hrtimerSoftirq()
+{
+    lockInterrupts();
+    programmed_expiry = 0;
+    uint64_t now = ktime_get_ns();
+    while (heap_size > 0 && heap[0]->expires <= now)
+    {
+        struct hrtimer *timer = heap[0];
+        heapRemove(timer);
+
+        unlockInterrupts();
+        timer->callback(timer);
+        lockInterrupts();
+    }
+    reprogram();
+    unlockInterrupts();
+}
+
+static void hrtimerExpired()
+{
+    if (heap_size > 0 && heap[0]->expires <= ktime_get_ns())
+        softirq_raise(SOFTIRQ_HRTIMER);
+}
+
+static void hpetEventFired(int timer)
+{
+    (void)timer;
+    programmed_expiry = 0;
+    // Early by a fraction of a tick is still early, the softirq rearms.
+    softirq_raise(SOFTIRQ_HRTIMER);
+}
+
+static bool hpetProgramEvent(uint64_t delay_ns)
+{
+    return hpet_timer_oneshot(HRTIMER_HPET_TIMER, delay_ns, hpetEventFired);
+}
+
+void init_hrtimer()
+{
+    softirq_register(SOFTIRQ_HRTIMER, hrtimerSoftirq);
+
+    // The local APIC timer is busy being the tick, so a spare HPET
+    // comparator is the only one-shot source for now.
+    if (hpet_timer_usable(HRTIMER_HPET_TIMER))
+    {
+        program_event = hpetProgramEvent;
+        event_source = "hpet";
+    }
+    printf("hrtimer: event source %s\n", event_source);
+}
+
+void hrtimer_init(struct hrtimer *timer, hrtimer_callback_t callback, void *data)
+{
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->index = -1;
+}
+
+bool hrtimer_start_abs(struct hrtimer *timer, uint64_t expires_ns)
+{
+    uint32_t flags = saveInterrupts();
+    if (timer->index >= 0)
+        heapRemove(timer);
+
+    if (heap_size >= HRTIMER_MAX)
+    {
+        restoreInterrupts(flags);
+        return false;
+    }
+
+    timer->expires = expires_ns;
+    timer->index = heap_size;
+    heap[heap_size++] = timer;
+    siftUp(timer->index);
+
+    if (heap[0] == timer)
+        reprogram();
+    restoreInterrupts(flags);
+    return true;
+}
+
+bool hrtimer_start(struct hrtimer *timer, uint64_t delay_ns, hrtimer_callback_t callback)
+{
+    if (callback)
+        timer->callback = callback;
+    return hrtimer_start_abs(timer, ktime_get_ns() + delay_ns);
+}
+
+bool hrtimer_cancel(struct hrtimer *timer)
+{
+    uint32_t flags = saveInterrupts();
+    bool was_active = timer->index >= 0;
+    if (was_active)
+        heapRemove(timer);
+    restoreInterrupts(flags);
+    return was_active;
+}
+
+bool hrtimer_active(struct hrtimer *timer)
+{
+    return timer->index >= 0;
+}
+
+void hrtimer_tick()
+{
+    hrtimerExpired();
+}
@@ -1,9 +1,23 @@
 #include <idt.h>
 #include <vga.h>
 #include <stdio.h>
+#include <scheduler/scheduler.h>
+#include <memory.h>
+#include <syscall.h>
+#include <softirq.h>
+#include <irqstat.h>
+#include <drivers/lapic.h>
+#include <drivers/ioapic.h>
 
 struct idt_entry_struct idt_entries[256];
 struct idt_ptr_struct idt_ptr;
+vector_handler_t vector_table[256];
+
+static void nullVector(uint32_t vector)
+{
+    (void)vector;
+}
+
 void disable_pic()
 {
     outb(0x21, 0xFF);
@@ -101,9 +115,36 @@ void init_idt()
     setIDTGate(45, (uint32_t)irq13, 0x08, 0x8E);
     setIDTGate(46, (uint32_t)irq14, 0x08, 0x8E);
     setIDTGate(47, (uint32_t)irq15, 0x08, 0x8E);
-
-    setIDTGate(128, (uint32_t)isr128, 0x08, 0x8E); // sys calls
-    setIDTGate(177, (uint32_t)isr177, 0x08, 0x8E); // sys calls
+    setIDTGate(48, (uint32_t)irq16, 0x08, 0x8E);
+    setIDTGate(49, (uint32_t)irq17, 0x08, 0x8E);
+    setIDTGate(50, (uint32_t)irq18, 0x08, 0x8E);
+    setIDTGate(51, (uint32_t)irq19, 0x08, 0x8E);
+    setIDTGate(52, (uint32_t)irq20, 0x08, 0x8E);
+    setIDTGate(53, (uint32_t)irq21, 0x08, 0x8E);
+    setIDTGate(54, (uint32_t)irq22, 0x08, 0x8E);
+    setIDTGate(55, (uint32_t)irq23, 0x08, 0x8E);
+    setIDTGate(56, (uint32_t)irq24, 0x08, 0x8E);
+    setIDTGate(57, (uint32_t)irq25, 0x08, 0x8E);
+    setIDTGate(58, (uint32_t)irq26, 0x08, 0x8E);
+    setIDTGate(59, (uint32_t)irq27, 0x08, 0x8E);
+    setIDTGate(60, (uint32_t)irq28, 0x08, 0x8E);
+    setIDTGate(61, (uint32_t)irq29, 0x08, 0x8E);
+    setIDTGate(62, (uint32_t)irq30, 0x08, 0x8E);
+    setIDTGate(63, (uint32_t)irq31, 0x08, 0x8E);
+
+    setIDTGate(239, (uint32_t)vector239, 0x08, 0x8E); // local APIC timer
+    setIDTGate(IRQ_BENCH_VECTOR, (uint32_t)vector240, 0x08, 0x8E);
+    setIDTGate(255, (uint32_t)vector255, 0x08, 0x8E); // local APIC spurious
+
+    setIDTGate(128, (uint32_t)isr128, 0x08, 0xEE); // sys calls, the only gate ring 3 may int to
+    setIDTGate(177, (uint32_t)isr177, 0x08, 0x8E); // irq_benchmark's full frame path
+
+    // Every vector with a lean stub needs an entry, the stub doesn't check
+    for (int irq = 0; irq < NUM_IRQS; irq++)
+        vector_table[IRQ_VECTOR_BASE + irq] = irq_handler;
+    vector_table[239] = nullVector;
+    vector_table[IRQ_BENCH_VECTOR] = nullVector;
+    vector_table[255] = nullVector;
 
     idt_flush((uint32_t)&idt_ptr);
     serial_putsf("IDT Initialized.\n");
@@ -115,7 +156,7 @@ void setIDTGate(uint8_t num, uint32_t base, uint16_t selector, uint8_t flags)
     idt_entries[num].base_high = (base >> 16) & 0xFFFF;
     idt_entries[num].selector = selector;
     idt_entries[num].always0 = 0;
-    idt_entries[num].flags = flags | 0x60;
+    idt_entries[num].flags = flags;
 }
 
 const char *exceptionMessages[] = {
@@ -158,6 +199,14 @@ void handle_page_fault(struct InterruptRegisters *regs)
     // Get the faulting address from CR2 register
     asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
 
+    // Write to a present page: copy-on-write after fork?
+    if ((error_code & 0x3) == 0x3 && memHandleCowFault(faulting_address))
+    {
+        irqstat_page_fault(error_code, true);
+        return;
+    }
+    irqstat_page_fault(error_code, false);
+
     // Parse the error code bits
     uint8_t present = error_code & 0x1;
     uint8_t write = (error_code >> 1) & 0x1;
@@ -257,10 +306,19 @@ void isr_handler(struct InterruptRegisters *registers)
 {
     if (registers->int_no == 14)
     {
+        uint64_t start = rdtsc();
         handle_page_fault(registers);
+        irqstat_record(14, (uint32_t)(rdtsc() - start));
+    }
+    else if (registers->int_no == 128)
+    {
+        // Syscalls can sleep, the time would be meaningless
+        irqstat_count(128);
+        syscall_int80_handler(registers);
     }
     else if (registers->int_no < 32)
     {
+        irqstat_count(registers->int_no);
         serial_putsf(exceptionMessages[registers->int_no]);
         serial_putsf("\n");
         serial_putsf("Exception Reached.\nSystem Haulted\n");
@@ -269,35 +327,245 @@ void isr_handler(struct InterruptRegisters *registers)
     }
 }
 
-void *irq_routines[16] =
+static struct irq_action irq_action_pool[IRQ_MAX_ACTIONS];
+static struct irq_action *irq_actions[NUM_IRQS];
+static uint32_t irq_unhandled[NUM_IRQS]; // nobody on the chain claimed it
+
+static bool apic_irqs = false;
+static uint32_t irq_masked = 0;      // lines masked on purpose, carried over to the IOAPIC
+static uint32_t irq_allocated = 0;   // MSI lines handed out by irq_alloc
+
+static void irqApplyMask(int irq)
+{
+    // On the IOAPIC a line without a handler stays masked, a level
+    // triggered PCI line would storm otherwise.
+    bool masked = (irq_masked & (1u << irq)) || irq_actions[irq] == 0;
+    if (apic_irqs)
+    {
+        if (irq < IRQ_MSI_FIRST)
+            ioapic_set_irq_mask(irq, masked);
+    }
+    else if (irq < NUM_ISA_IRQS)
+    {
+        if (irq_masked & (1u << irq))
+            pic_mask_irq(irq);
+        else
+            pic_unmask_irq(irq);
+    }
+}
+
+// The pool keeps this usable before the heap exists (the timer is set up
+// before init_memory).
+int irq_request(int irq, irq_handler_t handler, void *dev_id, const char *name)
+{
+    if (irq < 0 || irq >= NUM_IRQS || handler == 0)
+        return -1;
+
+    uint32_t flags = saveInterrupts();
+    struct irq_action *action = 0;
+    for (int i = 0; i < IRQ_MAX_ACTIONS; i++)
+    {
+        if (irq_action_pool[i].handler == 0)
+        {
+            action = &irq_action_pool[i];
+            break;
+        }
+    }
+    if (action == 0)
+    {
+        restoreInterrupts(flags);
+        return -1;
+    }
+
+    action->handler = handler;
+    action->dev_id = dev_id;
+    action->name = name;
+    action->next = 0;
+
+    // Append, so handlers run in the order they were registered.
+    struct irq_action **link = &irq_actions[irq];
+    while (*link)
+        link = &(*link)->next;
+    *link = action;
+
+    irqApplyMask(irq);
+    restoreInterrupts(flags);
+    return 0;
+}
+
+void irq_free(int irq, void *dev_id)
+{
+    if (irq < 0 || irq >= NUM_IRQS)
+        return;
+
+    uint32_t flags = saveInterrupts();
+    for (struct irq_action **link = &irq_actions[irq]; *link; link = &(*link)->next)
     {
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0};
+        struct irq_action *action = *link;
+        if (action->dev_id == dev_id)
+        {
+            *link = action->next;
+            action->handler = 0;
+            break;
+        }
+    }
+    if (irq_actions[irq] == 0)
+        irq_allocated &= ~(1u << irq);
+    irqApplyMask(irq);
+    restoreInterrupts(flags);
+}
+
+uint32_t irq_unhandled_count(int irq)
+{
+    return irq >= 0 && irq < NUM_IRQS ? irq_unhandled[irq] : 0;
+}
 
-void irq_install_handler(int irq, void (*handler)(struct InterruptRegisters *r))
+const char *irq_name(int irq)
 {
-    irq_routines[irq] = handler;
+    if (irq < 0 || irq >= NUM_IRQS || irq_actions[irq] == 0)
+        return 0;
+    return irq_actions[irq]->name;
 }
 
-void irq_uninstall_handler(int irq)
+bool irq_line_in_use(int irq)
 {
-    irq_routines[irq] = 0;
+    return irq_actions[irq] != 0;
 }
 
-void irq_handler(struct InterruptRegisters *registers)
+void irq_mask(int irq)
 {
-    void (*handler)(struct InterruptRegisters *registers);
-    handler = irq_routines[registers->int_no - 32];
+    irq_masked |= 1u << irq;
+    irqApplyMask(irq);
+}
 
-    if (handler)
+void irq_unmask(int irq)
+{
+    irq_masked &= ~(1u << irq);
+    irqApplyMask(irq);
+}
+
+void irq_eoi(int irq)
+{
+    if (apic_irqs)
     {
-        handler(registers);
+        lapic_eoi();
+        return;
     }
 
-    if (registers->int_no >= 40)
+    if (irq >= 8)
     {
         outb(0xA0, 0x20);
     }
-
     outb(0x20, 0x20);
-}
\ No newline at end of file
+}
+
+void irq_set_apic_mode()
+{
+    apic_irqs = true;
+    for (int irq = 0; irq < NUM_IRQS; irq++)
+        irqApplyMask(irq);
+}
+
+bool irq_apic_mode()
+{
+    return apic_irqs;
+}
+
+int irq_alloc()
+{
+    if (!apic_irqs)
+        return -1;
+
+    for (int irq = IRQ_MSI_FIRST; irq < NUM_IRQS; irq++)
+    {
+        if (!(irq_allocated & (1u << irq)) && irq_actions[irq] == 0)
+        {
+            irq_allocated |= 1u << irq;
+            return irq;
+        }
+    }
+    return -1;
+}
+
+// A line that drops before the PIC gets the INTA shows up as the lowest
+// priority line (7 or 15) without its in-service bit set. It must not get an
+// EOI, that would end some other line's interrupt.
+static bool picSpurious(int irq)
+{
+    uint16_t port = irq == 7 ? 0x20 : 0xA0;
+    outb(port, 0x0B); // OCW3: read ISR
+    return !(inb(port) & 0x80);
+}
+
+void irq_handler(uint32_t vector)
+{
+    uint64_t start = rdtsc();
+    int irq = vector - IRQ_VECTOR_BASE;
+    irqreturn_t handled = IRQ_NONE;
+
+    if (!apic_irqs && (irq == 7 || irq == 15) && picSpurious(irq))
+    {
+        irqstat_spurious(vector);
+        // The slave did raise its cascade line on the master
+        if (irq == 15)
+            outb(0x20, 0x20);
+        return;
+    }
+
+    for (struct irq_action *action = irq_actions[irq]; action; action = action->next)
+    {
+        handled |= action->handler(irq, action->dev_id);
+    }
+    if (handled == IRQ_NONE)
+        irq_unhandled[irq]++;
+
+    irq_eoi(irq);
+    irqstat_record(vector, (uint32_t)(rdtsc() - start));
+}
+
+// Task switches wait until the interrupt has been acknowledged, otherwise
+// the next task would run with this IRQ line still in service.
+void interrupt_exit()
+{
+    softirq_irq_exit();
+    scheduler_irq_exit();
+}
+
+void pic_mask_irq(uint8_t irq)
+{
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void pic_unmask_irq(uint8_t irq)
+{
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void vector_install_handler(uint8_t vector, vector_handler_t handler)
+{
+    vector_table[vector] = handler ? handler : nullVector;
+}
+
+void irq_benchmark(uint32_t iterations)
+{
+    if (iterations == 0)
+        return;
+
+    uint32_t flags = saveInterrupts();
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < iterations; i++)
+        asm volatile("int %0" ::"i"(IRQ_BENCH_VECTOR) : "memory");
+    uint64_t lean = rdtsc() - start;
+
+    // isr177 goes through isr_common_stub, the way every IRQ used to
+    start = rdtsc();
+    for (uint32_t i = 0; i < iterations; i++)
+        asm volatile("int $177" ::: "memory");
+    uint64_t full = rdtsc() - start;
+    restoreInterrupts(flags);
+
+    printf("IRQ entry: %llu cycles lean, %llu cycles full frame (%u rounds)\n", lean / iterations,
+           full / iterations, iterations);
+}
@@ -22,13 +22,24 @@ idt_flush:
         JMP isr_common_stub
 %endmacro
 
+; Hardware interrupts and local APIC vectors take the lean path: only what
+; a C call can clobber gets saved and the vector goes straight through
+; vector_table. Interrupt gates already cleared IF.
 %macro IRQ 2
     global irq%1
     irq%1:
-        CLI
-        PUSH LONG 0
-        PUSH LONG %2
-        JMP irq_common_stub
+        PUSH eax
+        MOV eax, %2
+        JMP irq_fast_stub
+%endmacro
+
+; Vectors outside the IRQ range, their handlers send their own EOI.
+%macro VECTOR 1
+    global vector%1
+    vector%1:
+        PUSH eax
+        MOV eax, %1
+        JMP irq_fast_stub
 %endmacro
 
 ISR_NOERRCODE 0
@@ -84,8 +95,31 @@ IRQ 13, 45
 IRQ 14, 46
 IRQ 15, 47
 
+; IOAPIC inputs above the ISA range and MSI
+IRQ 16, 48
+IRQ 17, 49
+IRQ 18, 50
+IRQ 19, 51
+IRQ 20, 52
+IRQ 21, 53
+IRQ 22, 54
+IRQ 23, 55
+IRQ 24, 56
+IRQ 25, 57
+IRQ 26, 58
+IRQ 27, 59
+IRQ 28, 60
+IRQ 29, 61
+IRQ 30, 62
+IRQ 31, 63
+
+VECTOR 239 ; local APIC timer
+VECTOR 240 ; irq_benchmark
+VECTOR 255 ; local APIC spurious
+
 extern isr_handler
 isr_common_stub:
+    CLD ; int 0x80 comes straight from ring 3, DF could be anything
     pusha
     mov eax, ds
     PUSH eax
@@ -113,31 +147,40 @@ isr_common_stub:
     STI
     IRET
 
-extern irq_handler
-irq_common_stub:
-    pusha
-    mov eax, ds
-    PUSH eax
-    MOV eax, cr2
-    PUSH eax
-
-    MOV ax, 0x10
-    MOV ds, ax
-    MOV es, ax
-    MOV fs, ax
-    MOV gs, ax
+extern vector_table
+extern interrupt_exit
+irq_fast_stub:
+    PUSH ecx
+    PUSH edx
+    ; From ring 0 the data segments are already ours, only user mode needs
+    ; them swapped. fs/gs aren't touched by the kernel.
+    TEST BYTE [esp + 16], 3 ; interrupted cs
+    JNZ .from_user
 
-    PUSH esp
-    CALL irq_handler
+    PUSH eax
+    CALL DWORD [vector_table + eax * 4]
+    CALL interrupt_exit
+    ADD esp, 4
+    POP edx
+    POP ecx
+    POP eax
+    IRET
 
-    ADD esp, 8
-    POP ebx
-    MOV ds, bx
-    MOV es, bx
-    MOV fs, bx
-    MOV gs, bx
+.from_user:
+    CLD ; user DF, iret puts it back
+    PUSH ds
+    PUSH es
+    MOV cx, 0x10
+    MOV ds, cx
+    MOV es, cx
 
-    POPA
-    ADD esp, 8
-    STI
-    IRET
\ No newline at end of file
+    PUSH eax
+    CALL DWORD [vector_table + eax * 4]
+    CALL interrupt_exit
+    ADD esp, 4
+    POP es
+    POP ds
+    POP edx
+    POP ecx
+    POP eax
+    IRET
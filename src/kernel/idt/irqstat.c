@@ -0,0 +1,155 @@
+#include <irqstat.h>
+#include <idt.h>
+#include <ktime.h>
+#include <util.h>
+#include <stdio.h>
+#include <string.h>
+#include <drivers/lapic.h>
+
+extern const char *exceptionMessages[];
+
+static struct irq_stat stats[256];
+static struct irq_stat softirq_stat;
+static uint32_t pf_counts[NR_PF_STATS];
+
+static const char *pf_names[NR_PF_STATS] = {"not present", "protection", "write", "user", "ifetch", "reserved bit", "cow"};
+
+static inline int log2Bucket(uint32_t cycles)
+{
+    return cycles ? 31 - __builtin_clz(cycles) : 0;
+}
+
+static void record(struct irq_stat *stat, uint32_t cycles)
+{
+    stat->count++;
+    stat->cycles += cycles;
+    if (cycles > stat->max_cycles)
+        stat->max_cycles = cycles;
+    stat->hist[log2Bucket(cycles)]++;
+}
+
+void irqstat_record(uint8_t vector, uint32_t cycles)
+{
+    record(&stats[vector], cycles);
+}
+
+void irqstat_count(uint8_t vector)
+{
+    stats[vector].count++;
+}
+
+void irqstat_spurious(uint8_t vector)
+{
+    stats[vector].spurious++;
+}
+
+void irqstat_softirq(uint32_t cycles)
+{
+    record(&softirq_stat, cycles);
+}
+
+void irqstat_page_fault(uint32_t error_code, bool cow)
+{
+    pf_counts[(error_code & 0x1) ? PF_STAT_PROTECTION : PF_STAT_NOT_PRESENT]++;
+    if (error_code & 0x2)
+        pf_counts[PF_STAT_WRITE]++;
+    if (error_code & 0x4)
+        pf_counts[PF_STAT_USER]++;
+    if (error_code & 0x8)
+        pf_counts[PF_STAT_RESERVED]++;
+    if (error_code & 0x10)
+        pf_counts[PF_STAT_IFETCH]++;
+    if (cow)
+        pf_counts[PF_STAT_COW]++;
+}
+
+const struct irq_stat *irqstat_get(uint8_t vector)
+{
+    return &stats[vector];
+}
+
+uint32_t irqstat_page_faults(int type)
+{
+    return type >= 0 && type < NR_PF_STATS ? pf_counts[type] : 0;
+}
+
+void irqstat_reset()
+{
+    uint32_t flags = saveInterrupts();
+    memset(stats, 0, sizeof(stats));
+    memset(&softirq_stat, 0, sizeof(softirq_stat));
+    memset(pf_counts, 0, sizeof(pf_counts));
+    restoreInterrupts(flags);
+}
+
+static void serialOut(char c, void *arg)
+{
+    (void)arg;
+    serial_putc(c);
+}
+
+static const char *vectorName(int vector)
+{
+    if (vector < 32)
+        return exceptionMessages[vector];
+    if (vector >= IRQ_VECTOR_BASE && vector < IRQ_VECTOR_BASE + NUM_IRQS)
+    {
+        const char *name = irq_name(vector - IRQ_VECTOR_BASE);
+        return name ? name : "irq";
+    }
+    if (vector == 0x80)
+        return "syscall";
+    if (vector == LAPIC_TIMER_VECTOR)
+        return "lapic timer";
+    if (vector == LAPIC_SPURIOUS_VECTOR)
+        return "lapic spurious";
+    return "?";
+}
+
+// Only the buckets that were hit, as "2^n:count".
+static void printRow(const char *label, int vector, const struct irq_stat *stat)
+{
+    uint32_t khz = ktime_tsc_khz();
+    uint64_t avg = stat->count ? stat->cycles / stat->count : 0;
+
+    fctprintf(serialOut, 0, "%4d %-20.20s %10u %6u %14llu %8llu %8u %8llu ", vector, label, stat->count,
+              stat->spurious, stat->cycles, avg, stat->max_cycles,
+              khz ? (uint64_t)stat->max_cycles * 1000000 / khz : 0ULL);
+    for (int b = 0; b < IRQSTAT_BUCKETS; b++)
+    {
+        if (stat->hist[b])
+            fctprintf(serialOut, 0, " %d:%u", b, stat->hist[b]);
+    }
+    fctprintf(serialOut, 0, "\n");
+}
+
+void irqstat_report()
+{
+    // Copy first so the table is one consistent snapshot
+    static struct irq_stat snapshot[256];
+    static struct irq_stat softirq_snapshot;
+    uint32_t pf[NR_PF_STATS];
+
+    uint32_t flags = saveInterrupts();
+    memcpy(snapshot, stats, sizeof(stats));
+    softirq_snapshot = softirq_stat;
+    memcpy(pf, pf_counts, sizeof(pf));
+    restoreInterrupts(flags);
+
+    fctprintf(serialOut, 0, "--- Interrupt statistics (cycles, max in ns, histogram log2 cycles) ---\n");
+    fctprintf(serialOut, 0, "%4s %-20s %10s %6s %14s %8s %8s %8s  %s\n", "vec", "name", "count", "spur", "cycles",
+              "avg", "max", "max ns", "hist");
+    for (int vector = 0; vector < 256; vector++)
+    {
+        struct irq_stat *stat = &snapshot[vector];
+        if (stat->count == 0 && stat->spurious == 0)
+            continue;
+        printRow(vectorName(vector), vector, stat);
+    }
+    if (softirq_snapshot.count)
+        printRow("softirq", -1, &softirq_snapshot);
+
+    fctprintf(serialOut, 0, "page faults:");
+    for (int i = 0; i < NR_PF_STATS; i++)
+        fctprintf(serialOut, 0, " %s %u%s", pf_names[i], pf[i], i + 1 < NR_PF_STATS ? "," : "\n");
+}
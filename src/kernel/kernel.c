@@ -4,25 +4,43 @@
 #include <gdt.h>
 #include <idt.h>
 #include <timer.h>
+#include <ktime.h>
+#include <hrtimer.h>
 #include <multiboot.h>
 #include <memory.h>
 #include <keyboard.h>
 #include <drivers/pci.h>
 #include <drivers/ide.h>
+#include <drivers/ahci.h>
+#include <drivers/virtio_blk.h>
+#include <drivers/nvme.h>
+#include <drivers/device.h>
+#include <drivers/hpet.h>
+#include <drivers/lapic.h>
+#include <drivers/ioapic.h>
 #include <filesystems.h>
 #include <vbe.h>
 #include <console.h>
 #include <rsdp.h>
 #include <scheduler/scheduler.h>
+#include <scheduler/coroutine.h>
 #include <ebda.h>
+#include <syscall.h>
+#include <bootprof.h>
+#include <softirq.h>
+#include <irqstat.h>
 
 void kernel_main(uint32_t magic, multiboot_info_t *bootInfo)
 {
     // basics
+    bootprof_init();
     serial_init();
-    init_gdt();
-    init_idt();
+    BOOT_STAGE("init_gdt", init_gdt());
+    BOOT_STAGE("init_idt", init_idt());
+    softirq_init();
+    syscall_init();
     init_timer();
+    BOOT_STAGE("ktime_init", ktime_init());
 
     // ebda
     uint32_t g_ebda_addr = getEBDA(bootInfo);
@@ -30,24 +48,63 @@ void kernel_main(uint32_t magic, multiboot_info_t *bootInfo)
     // memory
     uint32_t mod1 = *(uint32_t *)(bootInfo->mods_addr);
     uint32_t physicalAllocStart = (mod1 + 0xFFF) & ~0XFFF;
-    init_memory((uint32_t)bootInfo->mem_upper * 1024, physicalAllocStart);
+    BOOT_STAGE("init_memory", init_memory((uint32_t)bootInfo->mem_upper * 1024, physicalAllocStart));
     multiboot_info_t *vbi = (multiboot_info_t *)((uint32_t)bootInfo + KERNEL_START);
 
     // video
-    vbe_init(bootInfo);
-    console_init();
+    BOOT_STAGE("vbe_init", vbe_init(bootInfo));
+    BOOT_STAGE("console_init", console_init());
 
     // devices
-    acpi_init(g_ebda_addr);
-    pci_init(false);
-    rsdt_parse();
-    scheduler_init();
-    ide_device_t *ideDevices = init_ide();
+    BOOT_STAGE("acpi_init", acpi_init(g_ebda_addr));
+    BOOT_STAGE("pci_init", pci_init(false));
+    BOOT_STAGE("rsdt_parse", rsdt_parse());
+    BOOT_STAGE("hpet_init", hpet_init());
+    BOOT_STAGE("lapic_init", lapic_init());
+    BOOT_STAGE("ioapic_init", ioapic_init());
+    init_hrtimer();
+    BOOT_STAGE("scheduler_init", scheduler_init());
+    coroutine_init();
+    BOOT_STAGE("init_ide", init_ide());
+    BOOT_STAGE("ahci_init", ahci_init());
+    BOOT_STAGE("virtio_blk_init", virtio_blk_init());
+    BOOT_STAGE("nvme_init", nvme_init());
+#ifdef BOOT_BENCHMARKS
+    BOOT_STAGE("syscall_benchmark", syscall_benchmark(10000));
+    BOOT_STAGE("irq_benchmark", irq_benchmark(10000));
+    BOOT_STAGE("ide_benchmark", ide_benchmark(0, 2048));
+#ifdef IDE_BENCH_SCRATCH_LBA
+    BOOT_STAGE("ide_benchmark_writes", ide_benchmark_writes(0, IDE_BENCH_SCRATCH_LBA));
+#endif
+    BOOT_STAGE("ahci_benchmark", ahci_benchmark(0, 1024));
+    BOOT_STAGE("virtio_blk_benchmark", virtio_blk_benchmark(0, 2048));
+    BOOT_STAGE("nvme_benchmark", nvme_benchmark(0, 4096));
+    if (bdev_count())
+        BOOT_STAGE("bio_coroutine_benchmark", bio_coroutine_benchmark(bdev_get(0), 4096));
+#endif
+    bdev_list();
 
     init_keyboard();
 
-    printf("Kernel Booted in %ims\n", ticks);
-    ext2_read_drive(0);
+    printf("Kernel Booted in %ims\n", (uint32_t)(ktime_get_ns() / NSEC_PER_MSEC));
+    block_device_t *root = ext2_find_root();
+    if (root)
+        BOOT_STAGE("ext2_read_drive", ext2_read_drive(root));
+    else
+        printf("No ext2 disk found\n");
+    bootprof_report();
+#ifdef BOOT_BENCHMARKS
+    irqstat_report();
+    if (ide_queue(0))
+        blk_queue_report(ide_queue(0));
+    ide_atapi_report();
+    if (ahci_queue(0))
+        blk_queue_report(ahci_queue(0));
+    if (virtio_blk_queue(0))
+        blk_queue_report(virtio_blk_queue(0));
+    if (nvme_queue(0))
+        blk_queue_report(nvme_queue(0));
+#endif
     consoleMarkInputStart();
 
     asm volatile("sti");
@@ -2,8 +2,20 @@
 #include <timer.h>
 #include <stdio.h>
 #include <idt.h>
+#include <softirq.h>
 #include <stdbool.h>
-#include <stdio.h>
+
+// Scancodes waiting for the tasklet. Power of two so the indices can just
+// keep counting up.
+#define KEYBOARD_BUFFER_SIZE 64
+
+static volatile uint8_t scancodes[KEYBOARD_BUFFER_SIZE];
+static volatile uint32_t scancode_head = 0; // written by the irq
+static volatile uint32_t scancode_tail = 0; // written by the tasklet
+static struct tasklet keyboard_tasklet;
+
+static irqreturn_t keyboardIrq(int irq, void *dev_id);
+static void keyboardTasklet(void *data);
 
 bool capsOn;
 bool capsLock;
@@ -67,13 +79,30 @@ void init_keyboard()
 {
     capsOn = false;
     capsLock = false;
-    irq_install_handler(1, &keyboardHandler);
+    tasklet_init(&keyboard_tasklet, keyboardTasklet, 0);
+    irq_request(1, keyboardIrq, &keyboard_tasklet, "keyboard");
 }
 
-void keyboardHandler(struct InterruptRegisters *reg)
+// Top half: grab the byte so the controller can take the next one, the rest
+// happens in the tasklet with interrupts on.
+static irqreturn_t keyboardIrq(int irq, void *dev_id)
 {
-    char scanCode = inb(0x60) & 0x7f; // KeyCode
-    char press = inb(0x60) & 0x80;    // Pressed 0 is down -128 is up
+    (void)irq;
+    (void)dev_id;
+    uint8_t code = inb(0x60);
+    if (scancode_head - scancode_tail < KEYBOARD_BUFFER_SIZE)
+    {
+        scancodes[scancode_head % KEYBOARD_BUFFER_SIZE] = code;
+        scancode_head++;
+    }
+    tasklet_schedule(&keyboard_tasklet);
+    return IRQ_HANDLED;
+}
+
+static void handleScancode(uint8_t code)
+{
+    char scanCode = code & 0x7f; // KeyCode
+    char press = code & 0x80;    // Pressed 0 is down -128 is up
 
     switch (scanCode)
     {
@@ -122,4 +151,15 @@ void keyboardHandler(struct InterruptRegisters *reg)
             }
         }
     }
-}
\ No newline at end of file
+}
+
+static void keyboardTasklet(void *data)
+{
+    (void)data;
+    while (scancode_tail != scancode_head)
+    {
+        uint8_t code = scancodes[scancode_tail % KEYBOARD_BUFFER_SIZE];
+        scancode_tail++;
+        handleScancode(code);
+    }
+}
@@ -0,0 +1,207 @@
+#include <ktime.h>
+#include <timer.h>
+#include <seqlock.h>
+#include <util.h>
+
+#define PIT_HZ 1193182
+#define PIT_CALIBRATE_MS 10
+#define PIT_CALIBRATE_RUNS 3
+#define PIT_CALIBRATE_TIMEOUT 100000000 // polls, in case channel 2 never fires
+
+static struct clocksource *clocksources = 0;
+static struct clocksource *current_cs = 0;
+
+// Readers take a snapshot of these under the seqlock, ktime_tick and
+// clocksource switches write them with interrupts off.
+static seqlock_t ktime_lock = SEQLOCK_INIT;
+static uint64_t base_cycles; // clocksource value at base_ns
+static uint64_t base_ns;
+static uint64_t base_frac; // sub-ns remainder, << shift
+
+static uint32_t tsc_khz = 0;
+static bool tsc_invariant = false;
+
+static uint64_t readTsc()
+{
+    return rdtsc();
+}
+
+static uint64_t readPitTicks()
+{
+    return timer_get_ticks();
+}
+
+static struct clocksource tsc_clocksource = {"tsc", readTsc, ~0ULL, 0, 0, 0, CLOCKSOURCE_RATING_TSC, 0};
+static struct clocksource pit_clocksource = {"pit", readPitTicks, ~0ULL, TIMER_FREQ, 0, 0, CLOCKSOURCE_RATING_PIT, 0};
+
+// Largest shift whose mult still fits 32 bits while a 10 second delta times
+// mult still fits 64 bits, ticks refold the base far more often than that.
+static void calcMultShift(struct clocksource *cs)
+{
+    for (uint32_t shift = 32; shift > 0; shift--)
+    {
+        uint64_t mult = (NSEC_PER_SEC << shift) / cs->freq;
+        if (mult == 0 || mult > 0xFFFFFFFFULL)
+            continue;
+        if (cs->freq * 10 > ~0ULL / mult)
+            continue;
+        cs->mult = (uint32_t)mult;
+        cs->shift = shift;
+        return;
+    }
+    cs->mult = 1;
+    cs->shift = 0;
+}
+
+// One run of PIT channel 2 in mode 0 (interrupt on terminal count), timed
+// with rdtsc. The output bit shows up in port 0x61 bit 5.
+static uint64_t calibrateTscOnce()
+{
+    uint32_t count = PIT_HZ / 1000 * PIT_CALIBRATE_MS;
+
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01); // gate on, speaker off
+    outb(0x43, 0xB0);                       // channel 2, lo/hi, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+
+    uint64_t start = rdtsc();
+    uint32_t polls = 0;
+    while (!(inb(0x61) & 0x20))
+    {
+        if (++polls > PIT_CALIBRATE_TIMEOUT)
+            return 0;
+    }
+    uint64_t end = rdtsc();
+
+    return (end - start) * PIT_HZ / count;
+}
+
+static void calibrateTsc()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 4)))
+        return;
+
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007)
+    {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = (edx & (1 << 8)) != 0;
+    }
+
+    // The shortest run is the one least disturbed by SMIs and the like.
+    uint64_t best = 0;
+    for (int i = 0; i < PIT_CALIBRATE_RUNS; i++)
+    {
+        uint64_t hz = calibrateTscOnce();
+        if (hz != 0 && (best == 0 || hz < best))
+            best = hz;
+    }
+    tsc_khz = (uint32_t)(best / 1000);
+}
+
+// Caller holds the seqlock for writing.
+static void foldCycles(uint64_t now)
+{
+    uint64_t delta = (now - base_cycles) & current_cs->mask;
+    base_frac += delta * current_cs->mult;
+    base_ns += base_frac >> current_cs->shift;
+    base_frac &= (1ULL << current_cs->shift) - 1;
+    base_cycles = now;
+}
+
+void clocksource_register(struct clocksource *cs)
+{
+    if (cs->mult == 0)
+        calcMultShift(cs);
+
+    uint32_t flags = saveInterrupts();
+    cs->next = clocksources;
+    clocksources = cs;
+
+    if (current_cs == 0 || cs->rating > current_cs->rating)
+    {
+        // Carry the current time over so the switch doesn't jump.
+        seqlock_write_begin(&ktime_lock);
+        if (current_cs)
+            foldCycles(current_cs->read());
+        current_cs = cs;
+        base_cycles = cs->read();
+        base_frac = 0;
+        seqlock_write_end(&ktime_lock);
+        serial_putsf("ktime: clocksource %s, %u Hz\n", cs->name, (uint32_t)cs->freq);
+    }
+    restoreInterrupts(flags);
+}
+
+const struct clocksource *clocksource_current()
+{
+    return current_cs;
+}
+
+void ktime_init()
+{
+    calibrateTsc();
+    serial_putsf("ktime: tsc %u kHz%s\n", tsc_khz, tsc_invariant ? " invariant" : "");
+
+    clocksource_register(&pit_clocksource);
+    if (tsc_khz != 0 && tsc_invariant)
+    {
+        tsc_clocksource.freq = (uint64_t)tsc_khz * 1000;
+        clocksource_register(&tsc_clocksource);
+    }
+}
+
+void ktime_tick()
+{
+    if (current_cs == 0)
+        return;
+
+    seqlock_write_begin(&ktime_lock);
+    foldCycles(current_cs->read());
+    seqlock_write_end(&ktime_lock);
+}
+
+uint64_t ktime_get_ns()
+{
+    uint64_t ns;
+    uint32_t seq;
+    do
+    {
+        seq = seqlock_read_begin(&ktime_lock);
+        const struct clocksource *cs = current_cs;
+        if (cs == 0)
+            return 0;
+        uint64_t delta = (cs->read() - base_cycles) & cs->mask;
+        ns = base_ns + ((base_frac + delta * cs->mult) >> cs->shift);
+    } while (seqlock_read_retry(&ktime_lock, seq));
+    return ns;
+}
+
+uint64_t ktime_get_cycles()
+{
+    const struct clocksource *cs = current_cs;
+    return cs ? cs->read() : 0;
+}
+
+uint64_t ktime_cycles_to_ns(uint64_t cycles)
+{
+    const struct clocksource *cs = current_cs;
+    if (cs == 0)
+        return 0;
+    // Split so long intervals don't overflow the multiply.
+    uint64_t secs = cycles / cs->freq;
+    uint64_t rest = cycles % cs->freq;
+    return secs * NSEC_PER_SEC + ((rest * cs->mult) >> cs->shift);
+}
+
+uint32_t ktime_tsc_khz()
+{
+    return tsc_khz;
+}
+
+bool ktime_tsc_invariant()
+{
+    return tsc_invariant;
+}
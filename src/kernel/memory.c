@@ -14,16 +14,23 @@ int mem_num_vpages;
 #define BYTE 8
 #define NUM_PAGES_DIRS 256
 #define NUM_PAGE_FRAMES (0x10000000 / 0x1000 / BYTE)
+#define MAX_PAGE_FRAMES (NUM_PAGE_FRAMES * BYTE) // frames covered by the bitmap (256MB)
 static uint32_t next_free_vaddr = HEAP_START;
 
-uint8_t physicalMemoryBitmap[NUM_PAGE_FRAMES / BYTE];
+uint8_t physicalMemoryBitmap[NUM_PAGE_FRAMES];
 static uint32_t pageDirs[NUM_PAGES_DIRS][1024] __attribute__((aligned(PAGE_SIZE)));
 static uint8_t pageDirUsed[NUM_PAGES_DIRS];
 
+// Extra references to a frame beyond its first owner, i.e. how many more
+// address spaces map it copy-on-write. 0 means the frame is private.
+static uint8_t frameShares[MAX_PAGE_FRAMES];
+
 void pmmInit(uint32_t memLow, uint32_t memHigh)
 {
     pageFrameMin = CEIL_DIV(memLow, 0x1000);
     pageFrameMax = memHigh / 0x1000;
+    if (pageFrameMax > MAX_PAGE_FRAMES)
+        pageFrameMax = MAX_PAGE_FRAMES;
     totalAlloc = 0;
     serial_putsf("--- PMM Initialization ---\n");
     serial_putsf("memLow (physicalAllocStart): 0x%x\n", memLow);
@@ -34,6 +41,7 @@ void pmmInit(uint32_t memLow, uint32_t memHigh)
     serial_putsf("Search will end before byte_index: %d\n", pageFrameMax / 8);
     serial_putsf("--------------------------\n");
     memset(physicalMemoryBitmap, 0, sizeof(physicalMemoryBitmap));
+    memset(frameShares, 0, sizeof(frameShares));
 }
 
 uint32_t vmmFindFreePages(size_t numPages)
@@ -87,6 +95,16 @@ void init_memory(uint32_t memHigh, uint32_t physicalAllocStart)
     pmmInit(physicalAllocStart, memHigh);
     memset(pageDirs, 0, 0x1000 * NUM_PAGES_DIRS);
     memset(pageDirUsed, 0, NUM_PAGES_DIRS);
+
+    // Build the scratch page table now so later temp maps are one PTE write.
+    memTempMap(0);
+    memTempUnmap();
+
+    // Write protect in ring 0 too, so kernel writes to COW pages fault.
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= 1 << 16;
+    asm volatile("mov %0, %%cr0" ::"r"(cr0));
 }
 
 void invalid(uint32_t virtualAddr)
@@ -124,6 +142,29 @@ uint32_t pmmAllocPageFrame()
     return 0;
 }
 
+uint32_t pmmAllocContiguous(size_t numPages, uint32_t align)
+{
+    uint32_t step = align > PAGE_SIZE ? align / PAGE_SIZE : 1;
+    uint32_t first = CEIL_DIV(pageFrameMin, step) * step;
+
+    for (uint32_t start = first; start + numPages <= pageFrameMax; start += step)
+    {
+        uint32_t run = 0;
+        while (run < numPages && !(physicalMemoryBitmap[(start + run) / 8] & (1 << ((start + run) % 8))))
+            run++;
+        if (run < numPages)
+            continue;
+
+        for (uint32_t i = 0; i < numPages; i++)
+            physicalMemoryBitmap[(start + i) / 8] |= 1 << ((start + i) % 8);
+        totalAlloc += numPages;
+        return start * PAGE_SIZE;
+    }
+
+    serial_putsf("PMM: no %d contiguous frames\n", numPages);
+    return 0;
+}
+
 void pmmFreePageFrame(uint32_t paddr)
 {
     uint32_t frameNum = paddr / PAGE_SIZE;
@@ -173,7 +214,7 @@ void vmmUnmapPage(uint32_t virtualAddr)
 
             if (paddr != 0)
             {
-                pmmFreePageFrame(paddr);
+                pmmPutFrame(paddr);
             }
 
             //
@@ -253,6 +294,61 @@ bool memIsPagePresent(uint32_t virtualAddr)
     return true;
 }
 
+// Only pages the user could touch themselves, so a bad pointer from ring 3
+// is an error code instead of a kernel page fault.
+static bool memIsUserPage(uint32_t virtualAddr)
+{
+    if (virtualAddr >= KERNEL_START)
+        return false;
+
+    uint32_t pde = REC_PAGEDIR[virtualAddr >> 22];
+    if ((pde & (PAGE_FLAG_PRESENT | PAGE_FLAG_USER)) != (PAGE_FLAG_PRESENT | PAGE_FLAG_USER))
+        return false;
+    if (pde & PAGE_FLAG_4MB)
+        return true;
+
+    uint32_t pte = REC_PAGETABLE(virtualAddr >> 22)[(virtualAddr >> 12) & 0x3FF];
+    return (pte & (PAGE_FLAG_PRESENT | PAGE_FLAG_USER)) == (PAGE_FLAG_PRESENT | PAGE_FLAG_USER);
+}
+
+bool memCopyFromUser(void *dst, uint32_t userAddr, size_t len)
+{
+    uint8_t *out = (uint8_t *)dst;
+
+    if (len > KERNEL_START - userAddr)
+        return false;
+
+    // Check a page, then copy what lies in it
+    while (len > 0)
+    {
+        if (userAddr >= KERNEL_START || !memIsUserPage(userAddr))
+            return false;
+
+        size_t chunk = PAGE_SIZE - (userAddr & (PAGE_SIZE - 1));
+        if (chunk > len)
+            chunk = len;
+        memcpy(out, (const void *)userAddr, chunk);
+        out += chunk;
+        userAddr += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+uint32_t vmmVirtToPhys(uint32_t virtualAddr)
+{
+    uint32_t pde = REC_PAGEDIR[virtualAddr >> 22];
+    if (!(pde & PAGE_FLAG_PRESENT))
+        return 0;
+    if (pde & PAGE_FLAG_4MB)
+        return (pde & 0xFFC00000) | (virtualAddr & 0x3FFFFF);
+
+    uint32_t pte = REC_PAGETABLE(virtualAddr >> 22)[(virtualAddr >> 12) & 0x3FF];
+    if (!(pte & PAGE_FLAG_PRESENT))
+        return 0;
+    return (pte & ~0xFFF) | (virtualAddr & 0xFFF);
+}
+
 void vmmMapPage(uint32_t virutalAddr, uint32_t physAddr, uint32_t flags)
 {
     uint32_t *prevPageDir = 0;
@@ -331,4 +427,307 @@ void *vmmAlloc(uint32_t phys_addr, size_t num_pages, uint32_t flags)
     vmmMapRegion(virt_addr, phys_addr, num_pages, flags);
 
     return (void *)virt_addr;
-}
\ No newline at end of file
+}
+
+void *memAllocDma(size_t size, uint32_t align, uint32_t *phys)
+{
+    size_t numPages = CEIL_DIV(size, PAGE_SIZE);
+    uint32_t paddr = pmmAllocContiguous(numPages, align);
+    if (paddr == 0)
+        return NULL;
+
+    void *virt = vmmAlloc(paddr, numPages, PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
+    if (virt == NULL)
+    {
+        for (size_t i = 0; i < numPages; i++)
+            pmmFreePageFrame(paddr + i * PAGE_SIZE);
+        return NULL;
+    }
+    memset(virt, 0, numPages * PAGE_SIZE);
+    *phys = paddr;
+    return virt;
+}
+
+// The frames are ours, so unmapping frees them.
+void memFreeDma(void *virtualAddr, size_t size)
+{
+    vmmUnmapRegion((uint32_t)virtualAddr, CEIL_DIV(size, PAGE_SIZE));
+}
+
+void *vmmMapMmio(uint32_t physAddr, size_t size, uint32_t flags)
+{
+    uint32_t offset = physAddr & 0xFFF;
+    size_t numPages = CEIL_DIV(offset + size, PAGE_SIZE);
+
+    uint8_t *base = vmmAlloc(physAddr & ~0xFFF, numPages, PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | flags);
+    if (base == NULL)
+        return NULL;
+    return base + offset;
+}
+
+void vmmUnmapMmio(void *virtualAddr, size_t size)
+{
+    uint32_t start = (uint32_t)virtualAddr & ~0xFFF;
+    size_t numPages = CEIL_DIV(((uint32_t)virtualAddr & 0xFFF) + size, PAGE_SIZE);
+
+    // Kernel page tables are shared by every directory, clearing the PTE
+    // through the current one is enough.
+    for (size_t i = 0; i < numPages; i++)
+    {
+        uint32_t v = start + i * PAGE_SIZE;
+        if (!(REC_PAGEDIR[v >> 22] & PAGE_FLAG_PRESENT))
+            continue;
+
+        uint32_t *pt = REC_PAGETABLE(v >> 22);
+        if (pt[(v >> 12) & 0x3FF] & PAGE_FLAG_PRESENT)
+        {
+            pt[(v >> 12) & 0x3FF] = 0;
+            mem_num_vpages--;
+            invalid(v);
+        }
+    }
+
+    // vmmFindFreePages only searches forward from the cursor, so move it
+    // back or the range is never handed out again
+    if (start >= HEAP_START && start < next_free_vaddr)
+        next_free_vaddr = start;
+}
+
+void pmmGetFrame(uint32_t paddr)
+{
+    uint32_t frameNum = paddr / PAGE_SIZE;
+    if (frameNum < MAX_PAGE_FRAMES)
+        frameShares[frameNum]++;
+}
+
+// Drop one reference, the frame is only freed once nobody maps it anymore.
+void pmmPutFrame(uint32_t paddr)
+{
+    uint32_t frameNum = paddr / PAGE_SIZE;
+    if (frameNum < MAX_PAGE_FRAMES && frameShares[frameNum] > 0)
+    {
+        frameShares[frameNum]--;
+        return;
+    }
+    pmmFreePageFrame(paddr);
+}
+
+void *memTempMap(uint32_t physAddr)
+{
+    uint32_t pdIndex = TEMP_MAP_VADDR >> 22;
+    uint32_t ptIndex = (TEMP_MAP_VADDR >> 12) & 0x3FF;
+
+    // First use creates the page table in the kernel half and syncs it to
+    // every directory, after that it's a single PTE write.
+    if (!(REC_PAGEDIR[pdIndex] & PAGE_FLAG_PRESENT))
+    {
+        vmmMapPage(TEMP_MAP_VADDR, physAddr, PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
+        return (void *)TEMP_MAP_VADDR;
+    }
+
+    REC_PAGETABLE(pdIndex)[ptIndex] = physAddr | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+    invalid(TEMP_MAP_VADDR);
+    return (void *)TEMP_MAP_VADDR;
+}
+
+void memTempUnmap()
+{
+    uint32_t pdIndex = TEMP_MAP_VADDR >> 22;
+    uint32_t ptIndex = (TEMP_MAP_VADDR >> 12) & 0x3FF;
+
+    REC_PAGETABLE(pdIndex)[ptIndex] = 0;
+    invalid(TEMP_MAP_VADDR);
+}
+
+uint32_t memPageDirPhys(uint32_t *pd)
+{
+    return (uint32_t)pd - KERNEL_START;
+}
+
+uint32_t *memAllocPageDir()
+{
+    for (int i = 0; i < NUM_PAGES_DIRS; i++)
+    {
+        if (pageDirUsed[i])
+            continue;
+
+        uint32_t *pd = pageDirs[i];
+        pageDirUsed[i] = 1;
+
+        memset(pd, 0, 768 * sizeof(uint32_t));
+        for (int j = 768; j < 1023; j++)
+        {
+            pd[j] = initial_page_dir[j] & ~PAGE_FLAG_OWNER;
+        }
+        pd[1023] = memPageDirPhys(pd) | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+
+        return pd;
+    }
+
+    serial_putsf("memAllocPageDir: out of page directories!\n");
+    return NULL;
+}
+
+// Releases the user half of an address space that isn't loaded.
+void memFreePageDir(uint32_t *pd)
+{
+    uint32_t flags = saveInterrupts();
+    for (int i = 0; i < 768; i++)
+    {
+        uint32_t pde = pd[i];
+        if (!(pde & PAGE_FLAG_PRESENT) || (pde & PAGE_FLAG_4MB))
+            continue;
+
+        uint32_t ptPhys = pde & ~0xFFF;
+        uint32_t *pt = memTempMap(ptPhys);
+        for (int j = 0; j < 1024; j++)
+        {
+            if (pt[j] & PAGE_FLAG_PRESENT)
+                pmmPutFrame(pt[j] & ~0xFFF);
+        }
+        memTempUnmap();
+
+        if (pde & PAGE_FLAG_OWNER)
+            pmmFreePageFrame(ptPhys);
+        pd[i] = 0;
+    }
+    restoreInterrupts(flags);
+
+    int index = (pd - &pageDirs[0][0]) / 1024;
+    if (index >= 0 && index < NUM_PAGES_DIRS)
+        pageDirUsed[index] = 0;
+}
+
+bool vmmMapPageInDir(uint32_t *pd, uint32_t virtualAddr, uint32_t physAddr, uint32_t flags)
+{
+    uint32_t pdIndex = virtualAddr >> 22;
+    uint32_t ptIndex = (virtualAddr >> 12) & 0x3FF;
+
+    if (pdIndex >= 768)
+    {
+        // The kernel half is shared, go through the normal path.
+        vmmMapPage(virtualAddr, physAddr, flags);
+        return true;
+    }
+
+    uint32_t irqFlags = saveInterrupts();
+    if (!(pd[pdIndex] & PAGE_FLAG_PRESENT))
+    {
+        uint32_t ptPhys = pmmAllocPageFrame();
+        if (ptPhys == 0)
+        {
+            restoreInterrupts(irqFlags);
+            return false;
+        }
+        memset(memTempMap(ptPhys), 0, PAGE_SIZE);
+        memTempUnmap();
+        pd[pdIndex] = ptPhys | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_OWNER | (flags & PAGE_FLAG_USER);
+    }
+
+    uint32_t *pt = memTempMap(pd[pdIndex] & ~0xFFF);
+    pt[ptIndex] = physAddr | PAGE_FLAG_PRESENT | flags;
+    memTempUnmap();
+    restoreInterrupts(irqFlags);
+
+    if (pd == memGetCurrentPageDir())
+        invalid(virtualAddr);
+    return true;
+}
+
+// Duplicates the user half of the current address space. Only the page
+// tables are copied: every writable page becomes read-only + COW in both
+// parent and child and is copied on the first write.
+uint32_t *memForkPageDir()
+{
+    uint32_t *child = memAllocPageDir();
+    if (child == NULL)
+        return NULL;
+
+    uint32_t flags = saveInterrupts();
+    uint32_t *parentDir = REC_PAGEDIR;
+    for (uint32_t i = 0; i < 768; i++)
+    {
+        uint32_t pde = parentDir[i];
+        if (!(pde & PAGE_FLAG_PRESENT))
+            continue;
+
+        if (pde & PAGE_FLAG_4MB)
+        {
+            child[i] = pde & ~PAGE_FLAG_OWNER;
+            continue;
+        }
+
+        uint32_t ptPhys = pmmAllocPageFrame();
+        if (ptPhys == 0)
+        {
+            restoreInterrupts(flags);
+            memFreePageDir(child);
+            return NULL;
+        }
+
+        uint32_t *parentPt = REC_PAGETABLE(i);
+        uint32_t *childPt = memTempMap(ptPhys);
+        for (int j = 0; j < 1024; j++)
+        {
+            uint32_t pte = parentPt[j];
+            if (pte & PAGE_FLAG_PRESENT)
+            {
+                if (pte & (PAGE_FLAG_WRITE | PAGE_FLAG_COW))
+                {
+                    pte = (pte & ~PAGE_FLAG_WRITE) | PAGE_FLAG_COW;
+                    parentPt[j] = pte;
+                }
+                pmmGetFrame(pte & ~0xFFF);
+            }
+            childPt[j] = pte;
+        }
+        memTempUnmap();
+
+        child[i] = ptPhys | (pde & 0xFFF) | PAGE_FLAG_OWNER;
+    }
+
+    // Parent mappings just lost their write bit.
+    memChangePageDir(memGetCurrentPageDir());
+    restoreInterrupts(flags);
+    return child;
+}
+
+// Called from the #PF handler for write faults on present pages. Returns
+// false if the fault wasn't a COW page.
+bool memHandleCowFault(uint32_t faultAddr)
+{
+    uint32_t pdIndex = faultAddr >> 22;
+    uint32_t ptIndex = (faultAddr >> 12) & 0x3FF;
+    uint32_t pageAddr = faultAddr & ~0xFFF;
+
+    if (!(REC_PAGEDIR[pdIndex] & PAGE_FLAG_PRESENT) || (REC_PAGEDIR[pdIndex] & PAGE_FLAG_4MB))
+        return false;
+
+    uint32_t *pt = REC_PAGETABLE(pdIndex);
+    uint32_t pte = pt[ptIndex];
+    if (!(pte & PAGE_FLAG_PRESENT) || !(pte & PAGE_FLAG_COW))
+        return false;
+
+    uint32_t frame = pte & ~0xFFF;
+    uint32_t frameNum = frame / PAGE_SIZE;
+
+    if (frameNum < MAX_PAGE_FRAMES && frameShares[frameNum] == 0)
+    {
+        // Last one holding it, just take it back.
+        pt[ptIndex] = (pte | PAGE_FLAG_WRITE) & ~PAGE_FLAG_COW;
+        invalid(pageAddr);
+        return true;
+    }
+
+    uint32_t copy = pmmAllocPageFrame();
+    if (copy == 0)
+        return false;
+
+    memcpy(memTempMap(copy), (void *)pageAddr, PAGE_SIZE);
+    memTempUnmap();
+    pmmPutFrame(frame);
+
+    pt[ptIndex] = copy | ((pte & 0xFFF) & ~PAGE_FLAG_COW) | PAGE_FLAG_WRITE;
+    invalid(pageAddr);
+    return true;
+}
@@ -6,6 +6,7 @@
 
 XSDP_t *g_xsdp = NULL;
 RSDP_t *g_rsdp = NULL;
+static ACPISDTHeader_t *g_rsdt = NULL; // mapped once rsdt_parse accepted it
 
 int do_checksum(uint8_t *start_addr, int len)
 {
@@ -128,90 +129,83 @@ bool rsdt_validate(ACPISDTHeader_t *tableHeader)
     return sum == 0;
 }
 
-void rsdt_parse()
+// Maps a whole ACPI table and leaves it mapped. Returns NULL if it doesn't
+// look like a table.
+static ACPISDTHeader_t *acpi_map_table(uint32_t phys_addr)
 {
-    if (g_rsdp == NULL)
-    {
-        printf("RSDP not found or is ACPI 2.0+, cannot parse RSDT.\n");
-        return;
-    }
-
-    uint32_t rsdt_phys_addr = g_rsdp->RsdtAddress;
-    printf("Attempting to parse RSDT at physical address: 0x%x\n", rsdt_phys_addr);
-
-    uint32_t phys_page_base = rsdt_phys_addr & ~0xFFF; // Address of the page the RSDT starts in
-    uint32_t page_offset = rsdt_phys_addr & 0xFFF;     // Offset of the RSDT within that page
+    ACPISDTHeader_t *header = vmmMapMmio(phys_addr, sizeof(ACPISDTHeader_t), 0);
+    if (header == NULL)
+        return NULL;
 
-    // Map just the first page to read the header and get the full length.
-    void *mapped_page = vmmAlloc(phys_page_base, 1, PAGE_FLAG_PRESENT);
+    uint32_t length = header->Length;
+    vmmUnmapMmio(header, sizeof(ACPISDTHeader_t));
 
-    if (mapped_page == NULL)
-    {
-        printf("FATAL: Failed to temporarily map RSDT header.\n");
-        return;
-    }
-
-    // The header's virtual address is the base of the mapped page + the offset.
-    ACPISDTHeader_t *header = (ACPISDTHeader_t *)((uintptr_t)mapped_page + page_offset);
+    if (length < sizeof(ACPISDTHeader_t) || length > ACPI_MAX_TABLE_LENGTH)
+        return NULL;
 
-    printf("DEBUG: Physical page 0x%x was mapped to virtual address 0x%x\n", phys_page_base, (uint32_t)mapped_page);
-    printf("DEBUG: RSDT header is at virtual address 0x%x\n", (uint32_t)header);
+    return vmmMapMmio(phys_addr, length, 0);
+}
 
-    // --- STAGE 3: SANITY CHECKS ---
-    if (memcmp(header->Signature, "RSDT", 4) != 0)
+void rsdt_parse()
+{
+    // ACPI 2.0+ still carries the 32-bit RSDT pointer, and every table we
+    // care about is below 4GB anyway.
+    uint32_t rsdt_phys_addr;
+    if (g_rsdp != NULL)
+        rsdt_phys_addr = g_rsdp->RsdtAddress;
+    else if (g_xsdp != NULL)
+        rsdt_phys_addr = g_xsdp->RsdtAddress;
+    else
     {
-        printf("FATAL: Mapped memory does NOT have a valid 'RSDT' signature.\n");
-        vmmUnmapPage((uint32_t)mapped_page); // Clean up the bad mapping
+        printf("RSDP not found, cannot parse RSDT.\n");
         return;
     }
 
-    uint32_t real_length = header->Length;
-    printf("RSDT header reports length: %u\n", real_length);
+    printf("Attempting to parse RSDT at physical address: 0x%x\n", rsdt_phys_addr);
 
-    if (real_length < sizeof(ACPISDTHeader_t) || real_length > 16384) // 16KB sanity limit
+    ACPISDTHeader_t *rsdt = acpi_map_table(rsdt_phys_addr);
+    if (rsdt == NULL)
     {
         printf("FATAL: RSDT has a corrupt or unreasonable length.\n");
-        vmmUnmapPage((uint32_t)mapped_page); // Clean up
         return;
     }
 
-    // We are done with the temporary one-page mapping.
-    vmmUnmapPage((uint32_t)mapped_page);
-
-    // Now, calculate the total number of pages needed for the *entire* table.
-    // This correctly handles tables that cross page boundaries.
-    size_t num_pages = (page_offset + real_length + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    // Map the full region
-    void *full_mapped_base = vmmAlloc(phys_page_base, num_pages, PAGE_FLAG_PRESENT);
-    if (full_mapped_base == NULL)
+    if (memcmp(rsdt->Signature, "RSDT", 4) != 0)
     {
-        printf("FATAL: Failed to map the full RSDT.\n");
+        printf("FATAL: Mapped memory does NOT have a valid 'RSDT' signature.\n");
+        vmmUnmapMmio(rsdt, rsdt->Length);
         return;
     }
 
-    // The pointer to the full RSDT is again at the offset from the base.
-    ACPISDTHeader_t *full_rsdt = (ACPISDTHeader_t *)((uintptr_t)full_mapped_base + page_offset);
-
-    if (!rsdt_validate(full_rsdt))
+    if (!rsdt_validate(rsdt))
     {
         printf("FATAL: Full RSDT checksum is invalid!\n");
-        vmmUnmapRegion((uint32_t)full_mapped_base, num_pages);
+        vmmUnmapMmio(rsdt, rsdt->Length);
         return;
     }
 
-    printf("RSDT is valid. Parsing other tables...\n");
+    g_rsdt = rsdt;
+    printf("RSDT is valid, %d tables.\n", (rsdt->Length - sizeof(ACPISDTHeader_t)) / 4);
+}
+
+ACPISDTHeader_t *acpi_find_table(const char *signature)
+{
+    if (g_rsdt == NULL)
+        return NULL;
 
-    int num_pointers = (full_rsdt->Length - sizeof(ACPISDTHeader_t)) / 4;
-    uint32_t *pointer_array = (uint32_t *)((void *)full_rsdt + sizeof(ACPISDTHeader_t));
+    int num_pointers = (g_rsdt->Length - sizeof(ACPISDTHeader_t)) / 4;
+    uint32_t *pointer_array = (uint32_t *)((uint8_t *)g_rsdt + sizeof(ACPISDTHeader_t));
 
     for (int i = 0; i < num_pointers; i++)
     {
-        uint32_t other_table_phys_addr = pointer_array[i];
-        // printf("Found table at physical address: 0x%x\n", other_table_phys_addr);
-        //  Now you would repeat this whole map/validate/parse process for this new table...
-    }
+        ACPISDTHeader_t *table = acpi_map_table(pointer_array[i]);
+        if (table == NULL)
+            continue;
 
-    // Remember to unmap the full region when you are done with it!
-    // vmmUnmapRegion((uint32_t)full_mapped_base, num_pages);
+        if (memcmp(table->Signature, signature, 4) == 0 && rsdt_validate(table))
+            return table;
+
+        vmmUnmapMmio(table, table->Length);
+    }
+    return NULL;
 }
@@ -53,4 +53,20 @@ newTaskSetup:
 	xor edi, edi
 	xor ebp, ebp
 
-    iret            ; Start the task
\ No newline at end of file
+    iret            ; Start the task
+
+global forkReturn
+forkReturn:
+    ; Where a forked child's first contextSwitch returns to. ESP points to a
+    ; copy of the parent's struct InterruptRegisters, unwind it like
+    ; isr_common_stub does and iret back to where the parent trapped.
+    add esp, 4      ; cr2
+    pop ebx         ; ds
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+
+    popa            ; eax was zeroed for the child
+    add esp, 8      ; int_no, err_code
+    iret
@@ -0,0 +1,124 @@
+#include <scheduler/coroutine.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/waitqueue.h>
+#include <util.h>
+
+enum CoState : uint8_t
+{
+    CO_STATE_IDLE,    // set up or finished, not known to the workers
+    CO_STATE_READY,   // on the ready queue
+    CO_STATE_RUNNING, // a worker is inside the body
+    CO_STATE_PARKED   // returned CO_WAITING
+};
+
+// Ready coroutines, FIFO. Only touched with interrupts off.
+static struct coroutine *ready_head = nullptr;
+static struct coroutine *ready_tail = nullptr;
+static struct wait_queue idle_workers = WAIT_QUEUE_INIT;
+static uint32_t active_count = 0;
+
+static void pushReady(struct coroutine *co)
+{
+    co->state = CO_STATE_READY;
+    co->next = nullptr;
+    if (ready_tail)
+        ready_tail->next = co;
+    else
+        ready_head = co;
+    ready_tail = co;
+    wait_queue_wake_one(&idle_workers);
+}
+
+static struct coroutine *popReady()
+{
+    struct coroutine *co = ready_head;
+    if (co)
+    {
+        ready_head = co->next;
+        if (ready_head == nullptr)
+            ready_tail = nullptr;
+        co->next = nullptr;
+    }
+    return co;
+}
+
+static void workerLoop()
+{
+    lockInterrupts();
+    for (;;)
+    {
+        struct coroutine *co = popReady();
+        if (co == nullptr)
+        {
+            wait_queue_sleep(&idle_workers);
+            continue;
+        }
+
+        co->state = CO_STATE_RUNNING;
+        co->wake_pending = 0;
+        unlockInterrupts();
+
+        int result = co->fn(co);
+
+        lockInterrupts();
+        if (result == CO_DONE)
+        {
+            co->state = CO_STATE_IDLE;
+            active_count--;
+            // The done callback owns the coroutine from here on.
+            if (co->done)
+            {
+                unlockInterrupts();
+                co->done(co);
+                lockInterrupts();
+            }
+        }
+        else if (result == CO_YIELDED || co->wake_pending)
+            pushReady(co);
+        else
+            co->state = CO_STATE_PARKED;
+    }
+}
+
+extern "C" void coroutine_init()
+{
+    for (int i = 0; i < COROUTINE_WORKERS; i++)
+        scheduler_create_task((uint32_t)workerLoop, true);
+}
+
+extern "C" void coroutine_setup(struct coroutine *co, coroutine_fn fn, coroutine_done_fn done)
+{
+    co->fn = fn;
+    co->done = done;
+    co->next = nullptr;
+    co->resume_at = 0;
+    co->state = CO_STATE_IDLE;
+    co->wake_pending = 0;
+}
+
+extern "C" void coroutine_start(struct coroutine *co)
+{
+    uint32_t flags = saveInterrupts();
+    if (co->state == CO_STATE_IDLE)
+    {
+        co->resume_at = 0;
+        active_count++;
+        pushReady(co);
+    }
+    restoreInterrupts(flags);
+}
+
+extern "C" void coroutine_wake(struct coroutine *co)
+{
+    uint32_t flags = saveInterrupts();
+    if (co->state == CO_STATE_PARKED)
+        pushReady(co);
+    else if (co->state == CO_STATE_RUNNING)
+        co->wake_pending = 1; // the worker requeues it once the body returns
+    restoreInterrupts(flags);
+}
+
+extern "C" uint32_t coroutine_count_active()
+{
+    return active_count;
+}
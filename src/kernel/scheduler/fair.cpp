@@ -0,0 +1,96 @@
+#include <scheduler/fair.hpp>
+
+// nice -20 .. 19, each step is roughly a 10% change in cpu share.
+static const uint32_t niceWeights[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15};
+
+uint32_t niceToWeight(int nice)
+{
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    return niceWeights[nice - NICE_MIN];
+}
+
+FairRunQueue::FairRunQueue() : head(nullptr), min_vruntime(0), total_weight(0), nr_running(0) {}
+
+void FairRunQueue::enqueue(Task *task)
+{
+    if (task->on_rq)
+        return;
+
+    // Equal keys go after the existing ones so equal tasks round robin.
+    Task **link = &head;
+    while (*link && (int64_t)((*link)->vruntime - task->vruntime) <= 0)
+        link = &(*link)->rq_next;
+
+    task->rq_next = *link;
+    *link = task;
+    task->on_rq = true;
+    total_weight += task->weight;
+    nr_running++;
+}
+
+void FairRunQueue::dequeue(Task *task)
+{
+    if (!task->on_rq)
+        return;
+
+    Task **link = &head;
+    while (*link && *link != task)
+        link = &(*link)->rq_next;
+
+    if (*link)
+        *link = task->rq_next;
+
+    task->rq_next = nullptr;
+    task->on_rq = false;
+    total_weight -= task->weight;
+    nr_running--;
+}
+
+void FairRunQueue::updateMinVruntime(Task *curr)
+{
+    uint64_t vruntime = min_vruntime;
+
+    if (curr)
+        vruntime = curr->vruntime;
+    if (head && (!curr || (int64_t)(head->vruntime - vruntime) < 0))
+        vruntime = head->vruntime;
+
+    // min_vruntime only ever moves forward
+    if ((int64_t)(vruntime - min_vruntime) > 0)
+        min_vruntime = vruntime;
+}
+
+void FairRunQueue::placeWakingTask(Task *task, uint64_t sleeper_credit)
+{
+    // Give the sleeper a bounded head start over the queue, but never let it
+    // go back in time relative to what it has already consumed.
+    uint64_t vruntime = min_vruntime - sleeper_credit;
+    if (min_vruntime < sleeper_credit)
+        vruntime = 0;
+
+    if ((int64_t)(vruntime - task->vruntime) > 0)
+        task->vruntime = vruntime;
+}
+
+uint64_t FairRunQueue::idealSlice(Task *task, uint64_t latency, uint64_t min_granularity)
+{
+    uint32_t weight = total_weight;
+    if (!task->on_rq)
+        weight += task->weight;
+    if (weight == 0)
+        return latency;
+
+    uint64_t slice = latency * task->weight / weight;
+    return slice < min_granularity ? min_granularity : slice;
+}
@@ -0,0 +1,82 @@
+#include <scheduler/rt.hpp>
+
+RtRunQueue::RtRunQueue() : nr_running(0)
+{
+    for (int i = 0; i < RT_NUM_PRIOS; i++)
+        heads[i] = tails[i] = nullptr;
+    for (int i = 0; i < RT_BITMAP_WORDS; i++)
+        bitmap[i] = 0;
+}
+
+void RtRunQueue::enqueue(Task *task, bool at_head)
+{
+    if (task->on_rq)
+        return;
+
+    int prio = task->rt_priority;
+    if (at_head)
+    {
+        task->rq_next = heads[prio];
+        heads[prio] = task;
+        if (tails[prio] == nullptr)
+            tails[prio] = task;
+    }
+    else
+    {
+        task->rq_next = nullptr;
+        if (tails[prio])
+            tails[prio]->rq_next = task;
+        else
+            heads[prio] = task;
+        tails[prio] = task;
+    }
+
+    bitmap[prio / 32] |= 1u << (prio % 32);
+    task->on_rq = true;
+    nr_running++;
+}
+
+void RtRunQueue::dequeue(Task *task)
+{
+    if (!task->on_rq)
+        return;
+
+    int prio = task->rt_priority;
+    Task *prev = nullptr;
+    Task *cur = heads[prio];
+    while (cur && cur != task)
+    {
+        prev = cur;
+        cur = cur->rq_next;
+    }
+
+    if (cur)
+    {
+        if (prev)
+            prev->rq_next = task->rq_next;
+        else
+            heads[prio] = task->rq_next;
+        if (tails[prio] == task)
+            tails[prio] = prev;
+    }
+
+    if (heads[prio] == nullptr)
+        bitmap[prio / 32] &= ~(1u << (prio % 32));
+
+    task->rq_next = nullptr;
+    task->on_rq = false;
+    nr_running--;
+}
+
+Task *RtRunQueue::pickFirst()
+{
+    for (int word = RT_BITMAP_WORDS - 1; word >= 0; word--)
+    {
+        if (bitmap[word])
+        {
+            int bit = 31 - __builtin_clz(bitmap[word]);
+            return heads[word * 32 + bit];
+        }
+    }
+    return nullptr;
+}
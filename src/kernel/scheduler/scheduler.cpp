@@ -1,59 +1,279 @@
 #include <scheduler/scheduler.hpp>
 #include <scheduler/scheduler.h>
+#include <scheduler/waitqueue.h>
+#include <scheduler/trace.hpp>
 #include <stdio.h>
 #include <new.h>
 #include <liballoc.h>
 #include <timer.h>
-#include <stdio.h>
+#include <util.h>
+#include <memory.h>
+#include <softirq.h>
+
+// Runs whenever nothing else is runnable. Never sits on a run queue.
+static void idleLoop()
+{
+    for (;;)
+        asm volatile("sti; hlt");
+}
 
-Scheduler::Scheduler() : num_tasks(0), current_task_index(-1) {}
+Scheduler::Scheduler() : num_tasks(0), current(nullptr), idle_task(nullptr), rt_period_elapsed(0), rt_time(0), rt_throttled(false),
+                         need_resched(false), last_tick_tsc(0), cycles_per_tick(0) {}
 
 void Scheduler::init()
 {
+    // Task 0 is whoever called us (kernel_main), it is already running.
     tasks[0] = new Task(0, true);
     num_tasks = 1;
-    current_task_index = 0;
+    current = tasks[0];
+    current->exec_start = rdtsc();
+    current->refillSlice();
+
+    idle_task = allocateTask(MAX_TASKS, (uint32_t)idleLoop, true);
+    last_tick_tsc = rdtsc();
 }
 
 Task *Scheduler::getCurrentTask()
 {
-    if (current_task_index < 0)
-        return nullptr;
-    return tasks[current_task_index];
+    return current;
 }
 
-void Scheduler::createTask(uint32_t entry_point, bool is_kernel_task)
+Task *Scheduler::allocateTask(uint32_t id, uint32_t entry_point, bool is_kernel_task)
 {
-    if (num_tasks >= MAX_TASKS)
+    if (entry_point == 0)
     {
-        printf("PANIC: Exceeded MAX_TASKS!\n");
+        printf("PANIC: scheduler_create_task called with a NULL entry point!\n");
         for (;;)
             asm("cli; hlt");
     }
 
-    if (entry_point == 0)
+    void *stack_memory = kmalloc(TASK_STACK_SIZE);
+    uint32_t stack_top = (uint32_t)stack_memory + TASK_STACK_SIZE;
+
+    Task *task = new Task(id, entry_point, stack_top, is_kernel_task);
+    if (task == nullptr)
     {
-        printf("PANIC: scheduler_create_task called with a NULL entry point!\n");
+        printf("PANIC: Failed to allocate memory for new task T%d!\n", id);
+        // We could also free the stack_memory here.
         for (;;)
             asm("cli; hlt");
     }
+    return task;
+}
 
+// Registers a fully built task and makes it runnable.
+void Scheduler::addTask(Task *task)
+{
+    uint32_t flags = saveInterrupts();
+    tasks[num_tasks] = task;
+    num_tasks++;
+    // New tasks start level with the queue instead of with a zero vruntime,
+    // otherwise they would run until they caught up with everybody else.
+    task->vruntime = fair.minVruntime();
+    fair.enqueue(task);
+    restoreInterrupts(flags);
+}
+
+void Scheduler::createTask(uint32_t entry_point, bool is_kernel_task)
+{
     if (num_tasks >= MAX_TASKS)
+    {
+        printf("PANIC: Exceeded MAX_TASKS!\n");
+        for (;;)
+            asm("cli; hlt");
+    }
+
+    addTask(allocateTask(num_tasks, entry_point, is_kernel_task));
+}
+
+// Like createTask, but the task gets its own address space. User tasks also
+// get a stack page just below the kernel half.
+int Scheduler::createProcess(uint32_t entry_point, bool is_kernel_task, uint32_t *dir)
+{
+    if (num_tasks >= MAX_TASKS)
+        return -1;
+
+    // Callers that need code in place before the task can run build the
+    // directory themselves, otherwise start from an empty address space.
+    if (dir == nullptr)
+        dir = memAllocPageDir();
+    if (dir == nullptr)
+        return -1;
+
+    Task *task = allocateTask(num_tasks, entry_point, is_kernel_task);
+    task->setAddressSpace(dir);
+
+    if (!is_kernel_task)
+    {
+        uint32_t stack_frame = pmmAllocPageFrame();
+        if (stack_frame == 0 || !vmmMapPageInDir(dir, USER_STACK_TOP - PAGE_SIZE, stack_frame, PAGE_FLAG_WRITE | PAGE_FLAG_USER))
+        {
+            memFreePageDir(dir);
+            return -1;
+        }
+        task->setUserStack(USER_STACK_TOP);
+    }
+
+    int id = task->id;
+    addTask(task);
+    return id;
+}
+
+// Forks the running task. regs is the frame the task trapped into the kernel
+// with (a syscall), the child resumes from the same frame with eax = 0.
+// Only the page tables are copied, pages are shared copy-on-write.
+int Scheduler::fork(const struct InterruptRegisters *regs)
+{
+    if (num_tasks >= MAX_TASKS || current == nullptr)
+        return -1;
+
+    // The child gets a fresh kernel stack, so it can only return to a frame
+    // that carries its own stack pointer, i.e. one that came from ring 3.
+    if ((regs->csm & 3) == 0)
+        return -1;
+
+    uint32_t *dir = memForkPageDir();
+    if (dir == nullptr)
+        return -1;
+
+    void *stack_memory = kmalloc(TASK_STACK_SIZE);
+    if (stack_memory == nullptr)
+    {
+        memFreePageDir(dir);
+        return -1;
+    }
+    uint32_t stack_top = (uint32_t)stack_memory + TASK_STACK_SIZE;
+
+    Task *child = new Task(num_tasks, stack_top, regs);
+    child->setAddressSpace(dir);
+    child->nice = current->nice;
+    child->weight = current->weight;
+    child->policy = current->policy;
+    child->rt_priority = current->rt_priority;
+
+    int id = child->id;
+    addTask(child);
+    return id;
+}
+
+// Charge the running task for the cycles it used since exec_start.
+void Scheduler::updateCurrent()
+{
+    uint64_t now = rdtsc();
+    uint64_t delta = now - current->exec_start;
+    current->exec_start = now;
+
+    if (current == idle_task)
         return;
 
-    const uint32_t stack_size = 16384;
-    void *stack_memory = kmalloc(stack_size);
-    uint32_t stack_top = (uint32_t)stack_memory + stack_size;
+    current->sum_exec += delta;
+    current->slice_exec += delta;
+    if (current->isRealtime())
+        return;
+
+    if (current->weight == NICE_0_WEIGHT)
+        current->vruntime += delta;
+    else
+        current->vruntime += delta * NICE_0_WEIGHT / current->weight;
+
+    fair.updateMinVruntime(current);
+}
+
+void Scheduler::enqueueTask(Task *task, bool at_head)
+{
+    if (task->isRealtime())
+        rt.enqueue(task, at_head);
+    else
+        fair.enqueue(task);
+}
+
+void Scheduler::dequeueTask(Task *task)
+{
+    if (task->isRealtime())
+        rt.dequeue(task);
+    else
+        fair.dequeue(task);
+}
+
+// RT first unless throttled, then fair, then idle.
+Task *Scheduler::pickNextTask()
+{
+    Task *next = nullptr;
+    if (!rt_throttled)
+        next = rt.pickFirst();
+    if (next == nullptr)
+        next = fair.pickFirst();
+    return next;
+}
 
-    tasks[num_tasks] = new Task(num_tasks, entry_point, stack_top, is_kernel_task);
-    if (tasks[num_tasks] == nullptr)
+void Scheduler::checkPreemptWakeup(Task *task)
+{
+    if (current == idle_task)
     {
-        printf("PANIC: Failed to allocate memory for new task T%d!\n", num_tasks);
-        // We could also free the stack_memory here.
-        for (;;)
-            asm("cli; hlt");
+        need_resched = true;
+        return;
     }
-    num_tasks++;
+
+    if (task->isRealtime())
+    {
+        // RT wakeups preempt immediately unless the class is throttled.
+        if (rt_throttled)
+            return;
+        if (!current->isRealtime() || task->rt_priority > current->rt_priority)
+            need_resched = true;
+        return;
+    }
+
+    if (current->isRealtime())
+        return;
+
+    uint64_t granularity = cycles_per_tick * SCHED_WAKEUP_GRANULARITY_TICKS;
+    if ((int64_t)(current->vruntime - task->vruntime) > (int64_t)granularity)
+        need_resched = true;
+}
+
+void Scheduler::wakeUp(Task *task)
+{
+    if (task->on_rq || task == current)
+    {
+        task->setState(TaskState::RUNNING);
+        return;
+    }
+
+    task->setState(TaskState::RUNNING);
+    traceSchedWakeup(task);
+    if (!task->isRealtime())
+        fair.placeWakingTask(task, cycles_per_tick * SCHED_SLEEPER_CREDIT_TICKS);
+    enqueueTask(task, false);
+    checkPreemptWakeup(task);
+}
+
+bool Scheduler::setPolicy(Task *task, int policy, int rt_priority)
+{
+    if (policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR)
+        return false;
+    if (policy != SCHED_NORMAL && (rt_priority < RT_PRIO_MIN || rt_priority > RT_PRIO_MAX))
+        return false;
+
+    bool queued = task->on_rq;
+    if (queued)
+        dequeueTask(task);
+
+    // Coming back to the fair class starts level with the queue.
+    if (policy == SCHED_NORMAL && task->isRealtime())
+        task->vruntime = fair.minVruntime();
+
+    task->policy = policy;
+    task->rt_priority = policy == SCHED_NORMAL ? 0 : rt_priority;
+    task->refillSlice();
+
+    if (queued)
+        enqueueTask(task, false);
+
+    // We may have just demoted ourselves below somebody else.
+    if (task == current)
+        need_resched = true;
+    return true;
 }
 
 void Scheduler::wakeSleepingTasks(uint64_t current_ticks)
@@ -62,45 +282,163 @@ void Scheduler::wakeSleepingTasks(uint64_t current_ticks)
     {
         if (tasks[i]->state == TaskState::SLEEPING && current_ticks >= tasks[i]->wake_at_tick)
         {
-            tasks[i]->setState(TaskState::RUNNING);
+            wakeUp(tasks[i]);
         }
     }
 }
 
-void Scheduler::schedule()
+// RT bandwidth: count RT ticks per period and throttle the class once it
+// used up its runtime, so fair tasks get at least the rest of the period.
+void Scheduler::tickRt()
 {
-    if (num_tasks <= 1)
+    if (current->isRealtime())
+        rt_time++;
+
+    if (!rt_throttled && rt_time >= RT_RUNTIME_TICKS)
+    {
+        rt_throttled = true;
+        traceSchedThrottle(true);
+        if (current->isRealtime() && fair.pickFirst())
+            need_resched = true;
+    }
+
+    if (++rt_period_elapsed >= RT_PERIOD_TICKS)
+    {
+        rt_period_elapsed = 0;
+        rt_time = 0;
+        if (rt_throttled)
+        {
+            rt_throttled = false;
+            traceSchedThrottle(false);
+            if (rt.pickFirst() && !current->isRealtime())
+                need_resched = true;
+        }
+    }
+}
+
+// Count down the slice. The tick only asks for a switch once the slice is
+// used up, so a cpu bound task keeps its cache warm for a whole quantum
+// instead of a single tick.
+void Scheduler::tickFair()
+{
+    if (current->slice_left > 1)
+    {
+        current->slice_left--;
+
+        // Don't let the leftmost task fall too far behind either. The
+        // quantum is the floor, so only a light (high nice) task gets
+        // cut short.
+        Task *first = fair.pickFirst();
+        if (first == nullptr)
+            return;
+        uint64_t quantum = cycles_per_tick * (current->quantum ? current->quantum : (uint32_t)g_Quantum);
+        uint64_t slice = fair.idealSlice(current, cycles_per_tick * SCHED_LATENCY_TICKS, quantum);
+        if ((int64_t)(current->vruntime - first->vruntime) <= (int64_t)slice)
+            return;
+    }
+
+    // Slice is over or too far ahead, but if nobody is waiting just start a
+    // new one.
+    Task *next = pickNextTask();
+    if (next == nullptr)
+    {
+        current->refillSlice();
+        return;
+    }
+
+    current->slice_left = 0;
+    need_resched = true;
+}
+
+// Timer interrupt: account the running task and decide whether it has to
+// give up the cpu. The switch itself happens in scheduler_irq_exit once the
+// EOI is out.
+void Scheduler::tick()
+{
+    uint64_t now = rdtsc();
+    if (last_tick_tsc != 0)
+        cycles_per_tick = now - last_tick_tsc;
+    last_tick_tsc = now;
+
+    if (current == nullptr)
         return;
 
-    Task *old_task = tasks[current_task_index];
-    // <<<<<<<<<<<< THIS IS THE NEW, SMARTER LOGIC >>>>>>>>>>>>>
-    // Find the NEXT runnable task
-    int next_task_index = current_task_index;
-    do
+    updateCurrent();
+    tickRt();
+
+    if (current == idle_task)
     {
-        next_task_index = (next_task_index + 1) % num_tasks;
-    } while (tasks[next_task_index]->state != TaskState::RUNNING);
+        if (pickNextTask())
+            need_resched = true;
+        return;
+    }
 
-    // If we looped all the way around and only found ourselves,
-    // and we aren't runnable, then halt (nothing to do).
-    // This is a basic idle check.
-    if (next_task_index == current_task_index && old_task->state != TaskState::RUNNING)
+    if (current->policy == SCHED_FIFO)
+        return;
+
+    if (current->policy == SCHED_RR)
     {
-        // In a real OS, you'd find a dedicated idle task. For now, we just halt.
-        asm volatile("hlt");
+        // Round robin only among tasks of the same priority.
+        if (current->slice_left > 1)
+        {
+            current->slice_left--;
+            return;
+        }
+        current->slice_left = 0;
+        if (rt.hasOtherAt(current->rt_priority))
+            need_resched = true;
+        else
+            current->refillSlice();
+        return;
+    }
+
+    tickFair();
+}
+
+// Must be called with interrupts disabled.
+void Scheduler::schedule()
+{
+    if (current == nullptr)
         return;
+
+    need_resched = false;
+    Task *old_task = current;
+    updateCurrent();
+
+    if (old_task != idle_task && old_task->state == TaskState::RUNNING)
+    {
+        // A preempted task keeps its place at the head of its RT priority,
+        // one that used up its slice or yielded goes to the back.
+        bool at_head = old_task->slice_left != 0 && !old_task->yielding;
+        enqueueTask(old_task, at_head);
     }
+    old_task->yielding = false;
 
-    current_task_index = (current_task_index + 1) % num_tasks;
+    Task *new_task = pickNextTask();
+    if (new_task)
+        dequeueTask(new_task);
+    else
+        new_task = idle_task;
 
-    Task *new_task = tasks[current_task_index];
-    if (new_task == nullptr)
+    if (new_task == old_task)
     {
-        printf("PANIC: Scheduler selected a NULL task to run (T%d)!\n", current_task_index);
-        for (;;)
-            asm("cli; hlt");
+        if (old_task->slice_left == 0)
+            old_task->refillSlice();
+        return;
     }
 
+    traceSchedSwitch(old_task, new_task);
+    new_task->exec_start = rdtsc();
+    new_task->refillSlice();
+    current = new_task;
+
+    // Kernel tasks all share initial_page_dir, only reload CR3 (and flush
+    // the TLB) when we actually cross into another address space.
+    if (new_task->cr3 != old_task->cr3)
+        asm volatile("mov %0, %%cr3" ::"r"(new_task->cr3) : "memory");
+    if (new_task->kesp_bottom)
+        new_task->set_tss_stack(new_task->kesp_bottom);
+
     contextSwitch(old_task, new_task);
 }
 
@@ -111,8 +449,8 @@ extern "C" bool schedulerEnabled;
 
 extern "C" void scheduler_init()
 {
-    schedulerEnabled = true;
     scheduler_instance.init();
+    schedulerEnabled = true;
 }
 
 extern "C" void scheduler_create_task(uint32_t entry_point, bool is_kernel_task)
@@ -120,9 +458,96 @@ extern "C" void scheduler_create_task(uint32_t entry_point, bool is_kernel_task)
     scheduler_instance.createTask(entry_point, is_kernel_task);
 }
 
+extern "C" int scheduler_create_process(uint32_t entry_point, bool is_kernel_task, uint32_t *page_dir)
+{
+    return scheduler_instance.createProcess(entry_point, is_kernel_task, page_dir);
+}
+
+extern "C" int scheduler_fork(struct InterruptRegisters *regs)
+{
+    uint32_t flags = saveInterrupts();
+    int id = scheduler_instance.fork(regs);
+    restoreInterrupts(flags);
+    return id;
+}
+
+extern "C" void scheduler_set_nice(int nice)
+{
+    Task *current_task = scheduler_instance.getCurrentTask();
+    if (!current_task)
+        return;
+
+    uint32_t flags = saveInterrupts();
+    current_task->setNice(nice);
+    restoreInterrupts(flags);
+}
+
+extern "C" void scheduler_set_quantum(uint32_t ticks)
+{
+    Task *current_task = scheduler_instance.getCurrentTask();
+    if (!current_task)
+        return;
+
+    uint32_t flags = saveInterrupts();
+    current_task->setQuantum(ticks);
+    current_task->refillSlice();
+    restoreInterrupts(flags);
+}
+
+extern "C" bool scheduler_set_policy(int policy, int rt_priority)
+{
+    Task *current_task = scheduler_instance.getCurrentTask();
+    if (!current_task)
+        return false;
+
+    uint32_t flags = saveInterrupts();
+    bool ok = scheduler_instance.setPolicy(current_task, policy, rt_priority);
+    if (ok && scheduler_instance.needResched())
+        scheduler_instance.schedule();
+    restoreInterrupts(flags);
+    return ok;
+}
+
 extern "C" void scheduler_tick()
 {
+    scheduler_instance.tick();
+}
+
+// An irq nested in a softirq run leaves need_resched set, the outer irq
+// exit switches once the softirqs are done.
+extern "C" void scheduler_irq_exit()
+{
+    if (schedulerEnabled && !in_softirq_context() && scheduler_instance.needResched())
+        scheduler_instance.schedule();
+}
+
+extern "C" void scheduler_yield()
+{
+    uint32_t flags = saveInterrupts();
+    Task *current_task = scheduler_instance.getCurrentTask();
+    if (current_task)
+        current_task->yielding = true;
+    scheduler_instance.schedule();
+    restoreInterrupts(flags);
+}
+
+extern "C" uint32_t scheduler_current_id()
+{
+    Task *current_task = scheduler_instance.getCurrentTask();
+    return current_task ? current_task->id : 0;
+}
+
+// The task is never picked again. Its stack and address space are left
+// alone for now, we're still running on them.
+extern "C" void scheduler_exit()
+{
+    lockInterrupts();
+    Task *current_task = scheduler_instance.getCurrentTask();
+    if (current_task)
+        current_task->setState(TaskState::DEAD);
     scheduler_instance.schedule();
+    for (;;)
+        ;
 }
 
 extern "C" void task_sleep(uint32_t milliseconds)
@@ -130,12 +555,16 @@ extern "C" void task_sleep(uint32_t milliseconds)
     Task *current_task = scheduler_instance.getCurrentTask();
     if (!current_task)
         return;
-    // Call C++ methods on the C++ object
-    current_task->setWakeTime(ticks + milliseconds); // We need to add setWakeTime
-    current_task->setState(TaskState::SLEEPING);     // We need to add setState
+
+    // No interrupts between picking the wake time and leaving the cpu,
+    // otherwise the tick could wake us before we actually went to sleep.
+    uint32_t flags = saveInterrupts();
+    current_task->setWakeTime(ticks + milliseconds);
+    current_task->setState(TaskState::SLEEPING);
 
     // Immediately trigger a context switch
-    scheduler_tick();
+    scheduler_instance.schedule();
+    restoreInterrupts(flags);
 }
 
 extern "C" void scheduler_wake_sleeping_tasks(uint64_t current_ticks)
@@ -143,3 +572,55 @@ extern "C" void scheduler_wake_sleeping_tasks(uint64_t current_ticks)
     // Call a C++ method on the scheduler instance to do the work
     scheduler_instance.wakeSleepingTasks(current_ticks);
 }
+
+extern "C" void wait_queue_init(struct wait_queue *wq)
+{
+    wq->head = nullptr;
+    wq->tail = nullptr;
+}
+
+extern "C" void wait_queue_sleep(struct wait_queue *wq)
+{
+    Task *current_task = scheduler_instance.getCurrentTask();
+    if (!current_task)
+        return;
+
+    current_task->wq_next = nullptr;
+    if (wq->tail)
+        ((Task *)wq->tail)->wq_next = current_task;
+    else
+        wq->head = current_task;
+    wq->tail = current_task;
+
+    current_task->setState(TaskState::BLOCKED);
+    scheduler_instance.schedule();
+}
+
+extern "C" bool wait_queue_wake_one(struct wait_queue *wq)
+{
+    uint32_t flags = saveInterrupts();
+    Task *task = (Task *)wq->head;
+    if (task)
+    {
+        wq->head = task->wq_next;
+        if (wq->head == nullptr)
+            wq->tail = nullptr;
+        task->wq_next = nullptr;
+        scheduler_instance.wakeUp(task);
+    }
+    restoreInterrupts(flags);
+    return task != nullptr;
+}
+
+extern "C" bool wait_queue_wake_all(struct wait_queue *wq)
+{
+    bool woke = false;
+    while (wait_queue_wake_one(wq))
+        woke = true;
+    return woke;
+}
+
+extern "C" bool wait_queue_empty(struct wait_queue *wq)
+{
+    return wq->head == nullptr;
+}
@@ -1,9 +1,14 @@
 #include <scheduler/task.hpp>
+#include <scheduler/fair.hpp>
+#include <scheduler/rt.hpp>
 #include <gdt.h>
+#include <timer.h>
+#include <memory.h>
 #include <stdio.h>
 
 /// @brief Defined in scheduler.s
 extern "C" void newTaskSetup();
+extern "C" void forkReturn();
 
 extern tss_entry_t tss_entry;
 
@@ -19,6 +24,8 @@ Task::Task(uint32_t id, uint32_t entry_point, uint32_t kernel_stack_top, bool is
     this->id = id;
     this->kesp_bottom = kernel_stack_top;
     this->state = TaskState::RUNNING;
+    initSchedFields();
+    setAddressSpace(initial_page_dir);
     uint32_t code_selector = is_kernel ? GDT_KERNEL_CODE : (GDT_USER_CODE | 3);
     uint32_t data_selector = is_kernel ? GDT_KERNEL_DATA : (GDT_USER_DATA | 3);
 
@@ -44,6 +51,84 @@ Task::Task(uint32_t id, bool is_kernel)
     this->id = id;
     this->kesp = 0;
     this->kesp_bottom = 0;
+    this->state = TaskState::RUNNING;
+    initSchedFields();
+    setAddressSpace(memGetCurrentPageDir());
+}
+
+Task::Task(uint32_t id, uint32_t kernel_stack_top, const struct InterruptRegisters *parent_regs)
+{
+    this->id = id;
+    this->kesp_bottom = kernel_stack_top;
+    this->state = TaskState::RUNNING;
+    initSchedFields();
+    setAddressSpace(initial_page_dir);
+
+    uint8_t *kesp_ptr = (uint8_t *)kernel_stack_top;
+    kesp_ptr -= sizeof(ForkKernelStack);
+    ForkKernelStack *stack = (ForkKernelStack *)kesp_ptr;
+
+    stack->ebp = stack->edi = stack->esi = stack->ebx = 0;
+    stack->switch_context_return_addr = (uint32_t)forkReturn;
+    stack->regs = *parent_regs;
+    stack->regs.eax = 0; // fork() returns 0 in the child
+
+    this->kesp = (uint32_t)kesp_ptr;
+}
+
+void Task::setAddressSpace(uint32_t *dir)
+{
+    this->page_dir = dir;
+    this->cr3 = memPageDirPhys(dir);
+}
+
+// Only valid before the task first runs, patches the initial iret frame.
+void Task::setUserStack(uint32_t esp)
+{
+    NewTaskKernelStack *stack = (NewTaskKernelStack *)this->kesp;
+    stack->usermode_esp = esp;
+    stack->usermode_ss = GDT_USER_DATA | 3;
+}
+
+void Task::initSchedFields()
+{
+    this->wake_at_tick = 0;
+    this->policy = SCHED_NORMAL;
+    this->rt_priority = 0;
+    this->wake_tsc = 0;
+    this->yielding = false;
+    this->nice = 0;
+    this->weight = NICE_0_WEIGHT;
+    this->vruntime = 0;
+    this->exec_start = 0;
+    this->sum_exec = 0;
+    this->slice_exec = 0;
+    this->quantum = 0;
+    this->slice_left = 0;
+    this->rq_next = nullptr;
+    this->on_rq = false;
+    this->wq_next = nullptr;
+}
+
+// Only valid while the task is off the run queue (i.e. the running task),
+// the queue caches the sum of its weights.
+void Task::setNice(int new_nice)
+{
+    if (new_nice < NICE_MIN)
+        new_nice = NICE_MIN;
+    if (new_nice > NICE_MAX)
+        new_nice = NICE_MAX;
+    this->nice = new_nice;
+    this->weight = niceToWeight(new_nice);
+}
+
+void Task::refillSlice()
+{
+    uint32_t ticks = quantum ? quantum : (uint32_t)g_Quantum;
+    if (policy == SCHED_RR && !quantum)
+        ticks = RT_RR_QUANTUM_TICKS;
+    slice_left = ticks ? ticks : 1;
+    slice_exec = 0;
 }
 
 void Task::set_tss_stack(uint32_t stack)
@@ -0,0 +1,100 @@
+#include <scheduler/trace.hpp>
+#include <scheduler/scheduler.h>
+#include <util.h>
+
+static SchedTraceEntry traceRing[SCHED_TRACE_EVENTS];
+static uint32_t traceHead;
+static SchedLatencyStats latencyStats[3]; // indexed by policy
+
+static SchedTraceEntry *traceNext(TraceEvent event)
+{
+    SchedTraceEntry *entry = &traceRing[traceHead % SCHED_TRACE_EVENTS];
+    traceHead++;
+    entry->tsc = rdtsc();
+    entry->event = event;
+    entry->prev_id = entry->next_id = 0;
+    entry->latency = 0;
+    return entry;
+}
+
+void traceSchedWakeup(Task *task)
+{
+    SchedTraceEntry *entry = traceNext(TraceEvent::WAKEUP);
+    entry->next_id = task->id;
+    task->wake_tsc = entry->tsc;
+}
+
+void traceSchedSwitch(Task *prev, Task *next)
+{
+    SchedTraceEntry *entry = traceNext(TraceEvent::SWITCH);
+    entry->prev_id = prev->id;
+    entry->next_id = next->id;
+
+    if (next->wake_tsc == 0)
+        return;
+
+    uint64_t latency = entry->tsc - next->wake_tsc;
+    next->wake_tsc = 0;
+    entry->latency = latency > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)latency;
+
+    SchedLatencyStats *stats = &latencyStats[next->policy];
+    stats->count++;
+    stats->total += latency;
+    if (latency > stats->max)
+        stats->max = latency;
+
+    int bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+    if (bucket >= SCHED_TRACE_HIST_BUCKETS)
+        bucket = SCHED_TRACE_HIST_BUCKETS - 1;
+    stats->hist[bucket]++;
+}
+
+void traceSchedThrottle(bool throttled)
+{
+    traceNext(throttled ? TraceEvent::THROTTLE : TraceEvent::UNTHROTTLE);
+}
+
+extern "C" void scheduler_dump_trace()
+{
+    static const char *policyNames[3] = {"NORMAL", "FIFO", "RR"};
+
+    uint32_t flags = saveInterrupts();
+    serial_putsf("--- Scheduler dispatch latency (cycles) ---\n");
+    for (int p = 0; p < 3; p++)
+    {
+        SchedLatencyStats *stats = &latencyStats[p];
+        if (stats->count == 0)
+            continue;
+
+        uint32_t avg = (uint32_t)(stats->total / stats->count);
+        serial_putsf("%s: count=%u avg=%u max=%u\n", policyNames[p], stats->count, avg, (uint32_t)stats->max);
+        for (int b = 0; b < SCHED_TRACE_HIST_BUCKETS; b++)
+        {
+            if (stats->hist[b])
+                serial_putsf("  [2^%d, 2^%d): %u\n", b, b + 1, stats->hist[b]);
+        }
+    }
+
+    serial_putsf("--- Last %d scheduler events ---\n", SCHED_TRACE_EVENTS);
+    uint32_t start = traceHead > SCHED_TRACE_EVENTS ? traceHead - SCHED_TRACE_EVENTS : 0;
+    for (uint32_t i = start; i < traceHead; i++)
+    {
+        SchedTraceEntry *entry = &traceRing[i % SCHED_TRACE_EVENTS];
+        switch (entry->event)
+        {
+        case TraceEvent::WAKEUP:
+            serial_putsf("%x wakeup T%d\n", (uint32_t)entry->tsc, entry->next_id);
+            break;
+        case TraceEvent::SWITCH:
+            serial_putsf("%x switch T%d -> T%d latency=%u\n", (uint32_t)entry->tsc, entry->prev_id, entry->next_id, entry->latency);
+            break;
+        case TraceEvent::THROTTLE:
+            serial_putsf("%x rt throttled\n", (uint32_t)entry->tsc);
+            break;
+        case TraceEvent::UNTHROTTLE:
+            serial_putsf("%x rt unthrottled\n", (uint32_t)entry->tsc);
+            break;
+        }
+    }
+    restoreInterrupts(flags);
+}
@@ -0,0 +1,111 @@
+#include <softirq.h>
+#include <util.h>
+#include <irqstat.h>
+
+// Gives up after this many rounds so a softirq that keeps raising itself
+// can't starve tasks, the rest waits for the next interrupt.
+#define SOFTIRQ_MAX_RESTART 10
+
+static softirq_handler_t softirq_handlers[NR_SOFTIRQS];
+static volatile uint32_t pending = 0;
+static bool in_softirq = false;
+
+static struct tasklet *tasklet_head = 0;
+static struct tasklet **tasklet_tail = &tasklet_head;
+
+void softirq_register(int nr, softirq_handler_t handler)
+{
+    softirq_handlers[nr] = handler;
+}
+
+void softirq_raise(int nr)
+{
+    uint32_t flags = saveInterrupts();
+    pending |= 1 << nr;
+    restoreInterrupts(flags);
+}
+
+bool softirq_pending()
+{
+    return pending != 0;
+}
+
+bool in_softirq_context()
+{
+    return in_softirq;
+}
+
+// Entered with interrupts off, leaves them off.
+void softirq_irq_exit()
+{
+    if (in_softirq || pending == 0)
+        return;
+
+    in_softirq = true;
+    uint64_t start = rdtsc();
+    for (int round = 0; round < SOFTIRQ_MAX_RESTART && pending; round++)
+    {
+        uint32_t work = pending;
+        pending = 0;
+
+        unlockInterrupts();
+        for (int nr = 0; nr < NR_SOFTIRQS; nr++)
+        {
+            if ((work & (1 << nr)) && softirq_handlers[nr])
+                softirq_handlers[nr]();
+        }
+        lockInterrupts();
+    }
+    irqstat_softirq((uint32_t)(rdtsc() - start));
+    in_softirq = false;
+}
+
+void tasklet_init(struct tasklet *t, void (*func)(void *data), void *data)
+{
+    t->next = 0;
+    t->func = func;
+    t->data = data;
+    t->scheduled = false;
+}
+
+void tasklet_schedule(struct tasklet *t)
+{
+    uint32_t flags = saveInterrupts();
+    if (!t->scheduled)
+    {
+        t->scheduled = true;
+        t->next = 0;
+        *tasklet_tail = t;
+        tasklet_tail = &t->next;
+        pending |= 1 << SOFTIRQ_TASKLET;
+    }
+    restoreInterrupts(flags);
+}
+
+// Takes the whole list at once, anything scheduled while these run goes on
+// a fresh list and raises the softirq again.
+static void taskletSoftirq()
+{
+    lockInterrupts();
+    struct tasklet *list = tasklet_head;
+    tasklet_head = 0;
+    tasklet_tail = &tasklet_head;
+    unlockInterrupts();
+
+    while (list)
+    {
+        struct tasklet *t = list;
+        list = t->next;
+
+        // Cleared first so the handler's own interrupt can schedule it again
+        lockInterrupts();
+        t->scheduled = false;
+        unlockInterrupts();
+        t->func(t->data);
+    }
+}
+
+void softirq_init()
+{
+    softirq_register(SOFTIRQ_TASKLET, taskletSoftirq);
+}
@@ -0,0 +1,221 @@
+#include <syscall.h>
+#include <gdt.h>
+#include <idt.h>
+#include <timer.h>
+#include <memory.h>
+#include <console.h>
+#include <string.h>
+#include <scheduler/scheduler.h>
+
+extern void sysenterEntry();
+extern uint8_t userBenchStart[];
+extern uint8_t userBenchEnd[];
+
+#define USER_BENCH_VADDR 0x00400000
+
+bool sysenterSupported = false;
+
+static int32_t sys_null(struct syscall_frame *frame)
+{
+    (void)frame;
+    return 0;
+}
+
+static int32_t sys_yield(struct syscall_frame *frame)
+{
+    (void)frame;
+    scheduler_yield();
+    return 0;
+}
+
+// ebx = milliseconds
+static int32_t sys_sleep(struct syscall_frame *frame)
+{
+    task_sleep(frame->ebx);
+    return 0;
+}
+
+static int32_t sys_getpid(struct syscall_frame *frame)
+{
+    (void)frame;
+    return (int32_t)scheduler_current_id();
+}
+
+static int32_t sys_fork(struct syscall_frame *frame)
+{
+    if (frame->trap)
+        return scheduler_fork(frame->trap);
+
+    // sysenter doesn't leave a trap frame, so make the one the child will
+    // iret through. It comes back as if from int 0x80 at the sysenter's
+    // return address.
+    struct InterruptRegisters regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.ds = GDT_USER_DATA | RPL_USER;
+    regs.ebx = frame->ebx;
+    regs.esi = frame->esi;
+    regs.edi = frame->edi;
+    regs.ebp = frame->ebp;
+    regs.int_no = 128;
+    regs.eip = frame->user_eip;
+    regs.csm = GDT_USER_CODE | RPL_USER;
+    regs.eflags = 0x202;
+    regs.useresp = frame->user_esp;
+    regs.ss = GDT_USER_DATA | RPL_USER;
+    return scheduler_fork(&regs);
+}
+
+// ebx = fd (only the console for now), esi = buffer, edi = length
+static int32_t sys_write(struct syscall_frame *frame)
+{
+    uint32_t src = frame->esi;
+    uint32_t len = frame->edi;
+    char buf[128];
+
+    if (frame->ebx != 1 && frame->ebx != 2)
+        return -1;
+    if (src >= KERNEL_START || len > KERNEL_START - src || len > INT32_MAX)
+        return -1;
+
+    // Bounce through the kernel stack, the user pointer is only touched
+    // by memCopyFromUser
+    for (uint32_t done = 0; done < len;)
+    {
+        uint32_t chunk = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        if (!memCopyFromUser(buf, src + done, chunk))
+            return -1;
+        for (uint32_t i = 0; i < chunk; i++)
+            consolePutC(buf[i]);
+        done += chunk;
+    }
+    return (int32_t)len;
+}
+
+static int32_t sys_exit(struct syscall_frame *frame)
+{
+    (void)frame;
+    scheduler_exit();
+    return 0;
+}
+
+// ebx = sysenter cycles, esi = int 0x80 cycles, edi = iterations
+static int32_t sys_bench_report(struct syscall_frame *frame)
+{
+    uint32_t iterations = frame->edi ? frame->edi : 1;
+    serial_putsf("syscall bench (ring 3, %u calls): sysenter %u cycles/call, int 0x80 %u cycles/call\n",
+                 frame->edi, frame->ebx / iterations, frame->esi / iterations);
+    return 0;
+}
+
+static syscall_handler_t syscall_table[NUM_SYSCALLS] = {
+    [SYS_NULL] = sys_null,
+    [SYS_YIELD] = sys_yield,
+    [SYS_SLEEP] = sys_sleep,
+    [SYS_GETPID] = sys_getpid,
+    [SYS_FORK] = sys_fork,
+    [SYS_WRITE] = sys_write,
+    [SYS_EXIT] = sys_exit,
+    [SYS_BENCH_REPORT] = sys_bench_report,
+};
+
+void syscall_dispatch(struct syscall_frame *frame)
+{
+    uint32_t nr = frame->eax;
+    if (nr >= NUM_SYSCALLS || syscall_table[nr] == 0)
+    {
+        frame->eax = (uint32_t)-1;
+        return;
+    }
+    frame->eax = (uint32_t)syscall_table[nr](frame);
+}
+
+// int 0x80 comes through the common isr stub, so it pays for the full frame.
+void syscall_int80_handler(struct InterruptRegisters *regs)
+{
+    struct syscall_frame frame;
+    frame.eax = regs->eax;
+    frame.ebx = regs->ebx;
+    frame.esi = regs->esi;
+    frame.edi = regs->edi;
+    frame.ebp = regs->ebp;
+    frame.user_eip = regs->eip;
+    frame.user_esp = regs->useresp;
+    frame.trap = regs;
+
+    // Run the call with interrupts as the caller had them
+    if (regs->eflags & 0x200)
+        unlockInterrupts();
+    syscall_dispatch(&frame);
+    lockInterrupts();
+
+    regs->eax = frame.eax;
+}
+
+void syscall_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    // SEP is bit 11, but family 6 model < 3 stepping < 3 (early Pentium Pro)
+    // reports it without actually having it
+    uint32_t family = (eax >> 8) & 0xF;
+    uint32_t model = (eax >> 4) & 0xF;
+    uint32_t stepping = eax & 0xF;
+    sysenterSupported = (edx & (1 << 11)) && !(family == 6 && model < 3 && stepping < 3);
+    if (!sysenterSupported)
+    {
+        serial_putsf("syscall: no sysenter, int 0x80 only\n");
+        return;
+    }
+
+    // The stub loads its stack from tss_entry.esp0, which schedule() keeps
+    // pointing at the running task's kernel stack.
+    wrmsr(IA32_SYSENTER_CS, GDT_KERNEL_CODE);
+    wrmsr(IA32_SYSENTER_ESP, (uint32_t)&tss_entry.esp0 + sizeof(uint32_t));
+    wrmsr(IA32_SYSENTER_EIP, (uint32_t)sysenterEntry);
+}
+
+// Cycles per null syscall. The table dispatch and int 0x80 can be timed
+// from here, sysenter only works from ring 3 so that part runs as a small
+// user process that reports back through SYS_BENCH_REPORT.
+void syscall_benchmark(uint32_t iterations)
+{
+    if (iterations == 0)
+        return;
+
+    struct syscall_frame frame;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        frame.eax = SYS_NULL;
+        syscall_dispatch(&frame);
+    }
+    uint32_t dispatch_cycles = (uint32_t)((rdtsc() - start) / iterations);
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        uint32_t result;
+        asm volatile("int $0x80" : "=a"(result) : "a"(SYS_NULL) : "memory");
+    }
+    uint32_t int80_cycles = (uint32_t)((rdtsc() - start) / iterations);
+
+    serial_putsf("syscall bench (ring 0, %u calls): dispatch %u cycles/call, int 0x80 %u cycles/call\n",
+                 iterations, dispatch_cycles, int80_cycles);
+
+    if (!sysenterSupported)
+        return;
+
+    uint32_t size = (uint32_t)(userBenchEnd - userBenchStart);
+    uint32_t *dir = memAllocPageDir();
+    uint32_t code = pmmAllocPageFrame();
+    if (dir == 0 || code == 0 || size > PAGE_SIZE)
+        return;
+
+    memcpy(memTempMap(code), userBenchStart, size);
+    memTempUnmap();
+
+    if (!vmmMapPageInDir(dir, USER_BENCH_VADDR, code, PAGE_FLAG_USER) ||
+        scheduler_create_process(USER_BENCH_VADDR, false, dir) < 0)
+        serial_putsf("syscall bench: couldn't start the user task\n");
+}
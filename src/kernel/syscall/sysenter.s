@@ -0,0 +1,92 @@
+section .text
+
+extern syscall_dispatch
+
+; Fast syscall entry. SYSENTER_ESP points just past tss_entry.esp0, so the
+; first thing we do is hop onto the running task's kernel stack. Only the
+; registers that carry the call are saved, the C side preserves the rest,
+; and the user data segments are flat so there is no segment reload.
+global sysenterEntry
+sysenterEntry:
+    mov esp, [esp - 4]  ; esp = tss_entry.esp0
+    cld                 ; DF is whatever ring 3 left it, the C side wants it clear
+
+    ; struct syscall_frame, last member first
+    push dword 0        ; trap
+    push ecx            ; user_esp
+    push edx            ; user_eip
+    push ebp
+    push edi
+    push esi
+    push ebx
+    push eax
+    sti
+
+    push esp
+    call syscall_dispatch
+    add esp, 4
+
+    cli
+    pop eax             ; result
+    pop ebx
+    pop esi
+    pop edi
+    pop ebp
+    pop edx             ; sysexit: eip = edx
+    pop ecx             ; sysexit: esp = ecx
+    add esp, 4
+    sti                 ; takes effect after sysexit
+    sysexit
+
+; Ring 3 benchmark, copied into a user page by syscall_benchmark so it has
+; to be position independent. Times USER_BENCH_ITERATIONS null syscalls
+; through sysenter and through int 0x80 and reports both cycle counts.
+%define SYS_NULL 0
+%define SYS_EXIT 6
+%define SYS_BENCH_REPORT 7
+%define USER_BENCH_ITERATIONS 100000
+
+global userBenchStart
+global userBenchEnd
+userBenchStart:
+    call .base
+.base:
+    pop ebp             ; ebp = where we actually run
+
+    mov edi, USER_BENCH_ITERATIONS
+    rdtsc
+    mov esi, eax
+.sysenterLoop:
+    mov eax, SYS_NULL
+    mov ecx, esp
+    lea edx, [ebp + (.sysenterRet - .base)]
+    sysenter
+.sysenterRet:
+    dec edi
+    jnz .sysenterLoop
+    rdtsc
+    sub eax, esi
+    push eax            ; sysenter cycles
+
+    mov edi, USER_BENCH_ITERATIONS
+    rdtsc
+    mov esi, eax
+.intLoop:
+    mov eax, SYS_NULL
+    int 0x80
+    dec edi
+    jnz .intLoop
+    rdtsc
+    sub eax, esi
+
+    mov esi, eax        ; int 0x80 cycles
+    pop ebx             ; sysenter cycles
+    mov edi, USER_BENCH_ITERATIONS
+    mov eax, SYS_BENCH_REPORT
+    int 0x80
+
+    mov eax, SYS_EXIT
+    int 0x80
+.hang:
+    jmp .hang
+userBenchEnd:
@@ -1,14 +1,27 @@
 #include <timer.h>
 #include <idt.h>
 #include <scheduler/scheduler.h>
+#include <seqlock.h>
+#include <ktime.h>
+#include <hrtimer.h>
 
 uint64_t ticks = 0;
-static const uint32_t freq = 1000; // 1 ms
+uint64_t g_Quantum = DEFAULT_QUANTUM_TICKS;
+static const uint32_t freq = TIMER_FREQ; // 1 ms
+static seqlock_t ticks_lock = SEQLOCK_INIT;
 bool schedulerEnabled;
 
+static irqreturn_t onIrq0(int irq, void *dev_id)
+{
+    (void)irq;
+    (void)dev_id;
+    timer_tick();
+    return IRQ_HANDLED;
+}
+
 void init_timer()
 {
-    irq_install_handler(0, onIrq0);
+    irq_request(0, onIrq0, 0, "timer");
 
     // 1.1931816666 MHz -> 119318.16666 Hz
     uint32_t divisor = 1193180 / freq;
@@ -20,9 +33,14 @@ void init_timer()
     outb(0x40, (uint8_t)((divisor >> 8) & 0xFF)); // second chunk
 }
 
-void onIrq0(struct InterruptRegisters *reg)
+void timer_tick()
 {
+    seqlock_write_begin(&ticks_lock);
     ticks++;
+    seqlock_write_end(&ticks_lock);
+    ktime_tick();
+    hrtimer_tick();
+
     if (schedulerEnabled)
     {
         scheduler_wake_sleeping_tasks(ticks);
@@ -31,6 +49,18 @@ void onIrq0(struct InterruptRegisters *reg)
     }
 }
 
+uint64_t timer_get_ticks()
+{
+    uint64_t value;
+    uint32_t seq;
+    do
+    {
+        seq = seqlock_read_begin(&ticks_lock);
+        value = ticks;
+    } while (seqlock_read_retry(&ticks_lock, seq));
+    return value;
+}
+
 void sleep(uint32_t millis)
 {
     task_sleep(millis);